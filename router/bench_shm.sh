@@ -0,0 +1,29 @@
+#!/bin/sh
+
+#compares the VNS session over TCP with the shared memory rings on the
+#local VNS stand-in (vnsd), at each offered rate.
+#  ./bench_shm.sh [rate ...]          default 50000 150000 300000
+#COUNT sets the packets per run, FRAME the frame size.
+
+COUNT=${COUNT:-300000}
+FRAME=${FRAME:-64}
+RATES=${*:-"50000 150000 300000"}
+PORT=${PORT:-8889}
+SOCK=${SOCK:-/tmp/vnsd.$$.sock}
+
+run() {
+    ./vnsd $1 -g eth1:eth2 -r $rate -c $COUNT -s $FRAME > /tmp/vnsd.$$.out &
+    VNSD=$!
+    sleep 0.5
+    ./sr $2 > /dev/null
+    wait $VNSD
+    grep -E "forwarded|loss|latency" /tmp/vnsd.$$.out
+}
+
+for rate in $RATES; do
+    echo "== tcp @ $rate pps"
+    run "-p $PORT" "-i vns -p $PORT"
+    echo "== shm @ $rate pps"
+    run "-U $SOCK" "-i vns-shm -s $SOCK"
+done
+rm -f /tmp/vnsd.$$.out
@@ -0,0 +1,21 @@
+#!/bin/sh
+
+#compares the plain socket VNS transport with the io_uring one on the
+#local VNS stand-in (vnsd).  For each offered rate both backends are run
+#through loadtest.sh and the forwarded rate, loss and latency reported.
+#  ./bench_uring.sh [rate ...]        default 50000 150000 300000
+#COUNT sets the packets per run, FRAME the frame size.
+
+COUNT=${COUNT:-300000}
+FRAME=${FRAME:-64}
+RATES=${*:-"50000 150000 300000"}
+PORT=${PORT:-8889}
+export PORT
+
+for rate in $RATES; do
+    for io in vns vns-uring; do
+        echo "== $io @ $rate pps"
+        SR_ARGS="-i $io" ./loadtest.sh -r $rate -c $COUNT -s $FRAME 2>&1 |
+            grep -E "forwarded|loss|latency|io_uring"
+    done
+done
@@ -0,0 +1,14 @@
+#!/bin/sh
+
+#runs the router against the local VNS stand-in (vnsd) and prints the
+#throughput / loss / latency report. Arguments are passed on to vnsd, e.g.
+#  ./loadtest.sh -r 50000 -c 500000 -s 64
+#Extra router arguments can be given in SR_ARGS.
+
+PORT=${PORT:-8889}
+
+./vnsd -p $PORT -g eth1:eth2 "$@" &
+VNSD=$!
+sleep 0.5
+./sr -p $PORT $SR_ARGS > /dev/null
+wait $VNSD
@@ -0,0 +1,488 @@
+/*-----------------------------------------------------------------------------
+ * File: natbench.c
+ *
+ * Description:
+ *
+ * NAT churn benchmark.  Drives the NAT table (sr_nat.h) directly, with
+ * no router or network in the way, on a simulated clock, so a run with
+ * millions of sessions and minutes of timeouts takes seconds:
+ *
+ *   - flows arrive at a set rate per simulated second until the session
+ *     count is reached, each from a random port on one of the internal
+ *     hosts, and live an exponentially distributed time
+ *   - a new flow looks its mapping up (a miss) and inserts it; while it
+ *     lives it sends a packet every few seconds, each looked up (a hit)
+ *   - TCP flows, if asked for, also go through the connection tracker:
+ *     a handshake when they open, an ACK per packet, FINs when they end
+ *   - after each simulated second the NAT's expiry pass runs, as its
+ *     timeout thread would; once the last flow ends it carries on until
+ *     the table has drained
+ *
+ * Reports lookup and insert latency percentiles, expiry cost per tick,
+ * NAT memory per session at the peak and shard lock hold times.  The NAT
+ * is built with SR_NAT_LOCK_STATS for this, so every hold is timed.
+ * Latencies go into histograms with 16 buckets per power of two, so
+ * percentiles are good to about 6%; each one includes the ~20ns it takes
+ * to read the clock.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_nat.h"
+#include "sr_mem.h"
+
+#define NATBENCH_HIST      640 /* covers up to 2^40 ns */
+#define NATBENCH_DRAIN_MAX 100000 /* simulated seconds to wait for a drain */
+
+struct natbench_hist
+{
+    unsigned long n[NATBENCH_HIST];
+    unsigned long count;
+    uint64_t      sum;
+    uint64_t      max;
+};
+
+struct natbench_flow
+{
+    uint32_t ip_int;
+    uint16_t port_int;
+    uint8_t  tcp;
+    time_t   next;                      /* its next packet */
+    time_t   end;
+};
+
+struct natbench
+{
+    /* -- workload -- */
+    unsigned long sessions;
+    double   rate;                      /* new flows per simulated second */
+    double   lifetime;                  /* mean, seconds */
+    int      interval;                  /* seconds between a flow's packets */
+    int      timeout;                   /* UDP and TCP transitory idle */
+    int      tcp_pct;
+    unsigned int hosts;
+    unsigned int naddrs;
+    unsigned int port_block;
+    unsigned int expected;              /* sessions the tables are sized for */
+    uint64_t rng;
+
+    /* -- state -- */
+    struct sr_nat nat;
+    struct sr_epoch_reader *reader;
+    struct natbench_flow *flows;        /* live, any order */
+    unsigned long nflows, cap;
+
+    /* -- measurement -- */
+    struct natbench_hist miss, insert, hit, expire;
+    unsigned long reopened;             /* arrivals on a live mapping */
+    unsigned long failed;               /* inserts the NAT refused */
+    unsigned long lost;                 /* live flows whose mapping was gone */
+    unsigned long expired_max;          /* most expired in one tick */
+    unsigned long peak_live;
+    size_t   base_bytes, peak_bytes;
+};
+
+static time_t natbench_now;
+
+static time_t natbench_clock(time_t *t)
+{
+    if (t) { *t = natbench_now; }
+    return natbench_now;
+}
+
+static void usage(char* argv0)
+{
+    printf("NAT churn benchmark\n");
+    printf("Format: %s [-h] [-n sessions] [-r new per second] [-l mean lifetime]\n", argv0);
+    printf("           [-i seconds between packets] [-u idle timeout] [-t percent TCP]\n");
+    printf("           [-H internal hosts] [-a external addresses] [-B port block]\n");
+    printf("           [-S expected sessions, sizes the NAT tables] [-s seed]\n");
+    printf("   defaults -n 1000000 -r 10000 -l 20 -i 5 -u 30 -t 0 -H 4096 -a 16\n");
+    printf("   and -S twice the sessions live at once in the steady state\n");
+} /* -- usage -- */
+
+static uint64_t natbench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t natbench_rand(struct natbench *b)
+{
+    b->rng ^= b->rng << 13;
+    b->rng ^= b->rng >> 7;
+    b->rng ^= b->rng << 17;
+    return b->rng;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: natbench_record(..)
+ *
+ * Count 'ns' into a histogram: values under 16 exactly, the rest in 16
+ * buckets per power of two.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void natbench_record(struct natbench_hist *h, uint64_t ns)
+{
+    int msb, i;
+
+    if (ns < 16) {
+        i = (int)ns;
+    }
+    else {
+        msb = 63 - __builtin_clzll(ns);
+        i = (msb - 3) * 16 + (int)((ns >> (msb - 4)) & 15);
+        if (i >= NATBENCH_HIST) { i = NATBENCH_HIST - 1; }
+    }
+    h->n[i]++;
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max) { h->max = ns; }
+}
+
+/* -- the least value bucket 'i' holds -- */
+static uint64_t natbench_bucket_min(int i)
+{
+    if (i < 16) { return (uint64_t)i; }
+    return (uint64_t)(16 + i % 16) << (i / 16 - 1);
+}
+
+static uint64_t natbench_pct(const struct natbench_hist *h, double pct)
+{
+    unsigned long want = (unsigned long)ceil(h->count * pct / 100.0), seen = 0;
+    int i;
+
+    if (want == 0) { want = 1; }
+    for (i = 0; i < NATBENCH_HIST; i++) {
+        if ((seen += h->n[i]) >= want) { return natbench_bucket_min(i); }
+    }
+    return h->max;
+}
+
+static void natbench_print(const char *name, const struct natbench_hist *h)
+{
+    if (h->count == 0) {
+        printf("%-10s none\n", name);
+        return;
+    }
+    printf("%-10s %10lu  avg %7.0f  p50 %7llu  p90 %7llu  p99 %7llu"
+           "  p99.9 %8llu  max %9llu ns\n", name, h->count,
+           (double)h->sum / h->count,
+           (unsigned long long)natbench_pct(h, 50),
+           (unsigned long long)natbench_pct(h, 90),
+           (unsigned long long)natbench_pct(h, 99),
+           (unsigned long long)natbench_pct(h, 99.9),
+           (unsigned long long)h->max);
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: natbench_segment(..)
+ *
+ * One TCP segment of a flow through the connection tracker.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void natbench_segment(struct natbench *b, struct sr_nat_mapping *mapping,
+                             uint8_t flags, int outbound)
+{
+    sr_nat_track_tcp(&b->nat, mapping, htonl(0xc6336401), 443, flags, outbound);
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: natbench_open(..)
+ *
+ * A new flow: look its mapping up, insert it when that misses, and for
+ * TCP go through the handshake.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void natbench_open(struct natbench *b)
+{
+    struct natbench_flow *flow;
+    struct sr_nat_mapping *mapping;
+    sr_nat_mapping_type type;
+    uint64_t t0, t1;
+    double u;
+
+    if (b->nflows == b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 65536;
+        if ((b->flows = realloc(b->flows, b->cap * sizeof(*b->flows))) == NULL) {
+            fprintf(stderr, "Error: out of memory for flows\n");
+            exit(1);
+        }
+    }
+    flow = &b->flows[b->nflows];
+    flow->ip_int   = htonl(0x0a000000 + (uint32_t)(natbench_rand(b) % b->hosts));
+    flow->port_int = (uint16_t)(1024 + natbench_rand(b) % 64512);
+    flow->tcp      = natbench_rand(b) % 100 < (uint64_t)b->tcp_pct;
+    type = flow->tcp ? nat_mapping_tcp : nat_mapping_udp;
+
+    sr_nat_read_begin(&b->nat, b->reader);
+    t0 = natbench_ns();
+    mapping = sr_nat_lookup_internal(&b->nat, flow->ip_int, flow->port_int, type);
+    t1 = natbench_ns();
+    if (mapping) {
+        natbench_record(&b->hit, t1 - t0);
+        b->reopened++;
+    }
+    else {
+        natbench_record(&b->miss, t1 - t0);
+        mapping = sr_nat_insert_mapping(&b->nat, flow->ip_int, flow->port_int, type);
+        natbench_record(&b->insert, natbench_ns() - t1);
+    }
+    if (mapping && flow->tcp) {
+        natbench_segment(b, mapping, TCP_SYN, 1);
+        natbench_segment(b, mapping, TCP_SYN | TCP_ACK, 0);
+        natbench_segment(b, mapping, TCP_ACK, 1);
+    }
+    sr_nat_read_end(&b->nat, b->reader);
+
+    if (mapping == NULL) {
+        b->failed++;
+        return;
+    }
+    u = (double)(natbench_rand(b) >> 11) / 9007199254740992.0;
+    flow->end  = natbench_now + (time_t)(-b->lifetime * log(1.0 - u));
+    flow->next = natbench_now + b->interval;
+    b->nflows++;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: natbench_packet(..)
+ *
+ * A later packet of a live flow, or its FINs if it has reached its end.
+ * Returns 1 if the flow is over.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int natbench_packet(struct natbench *b, struct natbench_flow *flow)
+{
+    struct sr_nat_mapping *mapping;
+    uint64_t t0;
+    int ending = natbench_now >= flow->end;
+
+    if (!ending && natbench_now < flow->next) { return 0; }
+    /* -- a UDP flow just stops sending -- */
+    if (ending && !flow->tcp) { return 1; }
+
+    sr_nat_read_begin(&b->nat, b->reader);
+    t0 = natbench_ns();
+    mapping = sr_nat_lookup_internal(&b->nat, flow->ip_int, flow->port_int,
+                                     flow->tcp ? nat_mapping_tcp : nat_mapping_udp);
+    natbench_record(&b->hit, natbench_ns() - t0);
+    if (mapping == NULL) {
+        b->lost++;
+        ending = 1;
+    }
+    else if (ending) {
+        natbench_segment(b, mapping, TCP_FIN | TCP_ACK, 1);
+        natbench_segment(b, mapping, TCP_FIN | TCP_ACK, 0);
+        natbench_segment(b, mapping, TCP_ACK, 1);
+    }
+    else if (flow->tcp) {
+        natbench_segment(b, mapping, TCP_ACK, 1);
+    }
+    sr_nat_read_end(&b->nat, b->reader);
+
+    flow->next += b->interval;
+    return ending;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: natbench_tick(..)
+ *
+ * One simulated second: the flows that have a packet due send it, the
+ * ones past their end go, then the NAT expires what's idle.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void natbench_tick(struct natbench *b)
+{
+    unsigned long i, live;
+    uint64_t t0;
+
+    for (i = 0; i < b->nflows; ) {
+        if (natbench_packet(b, &b->flows[i])) {
+            b->flows[i] = b->flows[--b->nflows];
+        }
+        else {
+            i++;
+        }
+    }
+
+    live = b->nat.nmappings;
+    if (live > b->peak_live) {
+        b->peak_live  = live;
+        b->peak_bytes = sr_mem_bytes(SR_MEM_NAT);
+    }
+
+    t0 = natbench_ns();
+    sr_nat_expire(&b->nat, natbench_now);
+    natbench_record(&b->expire, natbench_ns() - t0);
+    if (live - b->nat.nmappings > b->expired_max) {
+        b->expired_max = live - b->nat.nmappings;
+    }
+    natbench_now++;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: natbench_locks(..)
+ *
+ * Shard lock hold times, all shards together, from the NAT's own log2
+ * histograms.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void natbench_locks(struct natbench *b)
+{
+    unsigned long hist[SR_NAT_LOCK_HIST], holds = 0, seen, busiest = 0, n;
+    uint64_t ns = 0, max = 0;
+    double pcts[] = { 50, 90, 99, 99.9 };
+    int i, s, p;
+
+    memset(hist, 0, sizeof(hist));
+    for (s = 0; s < SR_NAT_SHARDS; s++) {
+        struct sr_nat_shard *shard = &b->nat.shards[s];
+        for (i = 0, n = 0; i < SR_NAT_LOCK_HIST; i++) {
+            hist[i] += shard->lock_hist[i];
+            n += shard->lock_hist[i];
+        }
+        holds += n;
+        if (n > busiest) { busiest = n; }
+        ns += shard->lock_ns;
+        if (shard->lock_max_ns > max) { max = shard->lock_max_ns; }
+    }
+    if (holds == 0) {
+        printf("lock holds none\n");
+        return;
+    }
+
+    printf("lock holds %10lu  avg %7.0f ", holds, (double)ns / holds);
+    for (p = 0; p < 4; p++) {
+        for (i = 0, seen = 0; i < SR_NAT_LOCK_HIST; i++) {
+            if ((seen += hist[i]) >= (unsigned long)ceil(holds * pcts[p] / 100.0)) { break; }
+        }
+        printf(" p%g <%llu", pcts[p], 2ULL << i);
+    }
+    printf("  max %llu ns\n", (unsigned long long)max);
+    printf("           busiest shard took %.1f%% of them\n", 100.0 * busiest / holds);
+}
+
+int main(int argc, char **argv)
+{
+    struct natbench *b;
+    unsigned long opened = 0, due, ticks = 0;
+    double arrived = 0;
+    uint64_t t0;
+    int c;
+    unsigned int i;
+
+    if ((b = calloc(1, sizeof(struct natbench))) == NULL) { return 1; }
+    b->sessions = 1000000;
+    b->rate     = 10000;
+    b->lifetime = 20;
+    b->interval = 5;
+    b->timeout  = 30;
+    b->hosts    = 4096;
+    b->naddrs   = 16;
+    b->rng      = 88172645463325252ULL;
+
+    while ((c = getopt(argc, argv, "hn:r:l:i:u:t:H:a:B:S:s:")) != EOF)
+    {
+        switch (c)
+        {
+            case 'h': usage(argv[0]); exit(0);
+            case 'n': b->sessions = strtoul(optarg, NULL, 10); break;
+            case 'r': b->rate = atof(optarg); break;
+            case 'l': b->lifetime = atof(optarg); break;
+            case 'i': b->interval = atoi(optarg); break;
+            case 'u': b->timeout = atoi(optarg); break;
+            case 't': b->tcp_pct = atoi(optarg); break;
+            case 'H': b->hosts = (unsigned int)atoi(optarg); break;
+            case 'a': b->naddrs = (unsigned int)atoi(optarg); break;
+            case 'B': b->port_block = (unsigned int)atoi(optarg); break;
+            case 'S': b->expected = (unsigned int)atoi(optarg); break;
+            case 's': b->rng = strtoull(optarg, NULL, 10) | 1; break;
+            default: usage(argv[0]); exit(1);
+        }
+    }
+    if (b->rate <= 0 || b->interval <= 0 || b->hosts == 0 ||
+        b->naddrs == 0 || b->naddrs > SR_NAT_POOL_MAX) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    /* -- a flow's mapping outlives it by the timeout, and lifetimes vary,
+          so leave the tables room over the steady state's average -- */
+    if (b->expected == 0) {
+        b->expected = (unsigned int)(2 * b->rate * (b->lifetime + b->timeout));
+    }
+    natbench_now = time(NULL);
+    if (sr_nat_init(&b->nat, b->expected, natbench_clock) != 0) {
+        fprintf(stderr, "Error: NAT init failed\n");
+        return 1;
+    }
+    b->nat.qtimeout   = b->timeout;
+    b->nat.tr_it      = b->timeout;
+    b->nat.udp_it     = b->timeout;
+    b->nat.est_it     = b->timeout + b->interval;
+    b->nat.port_block = b->port_block;
+    for (i = 0; i < b->naddrs; i++) {
+        sr_nat_add_address(&b->nat, htonl(0x64400001 + i));
+    }
+    b->reader = sr_nat_reader(&b->nat);
+    b->base_bytes = sr_mem_bytes(SR_MEM_NAT);
+
+    printf("natbench: %lu sessions at %.0f/s, lifetime %.0f s, a packet every %d s,"
+           " timeout %d s, %d%% TCP, %u hosts, %u addresses\n",
+           b->sessions, b->rate, b->lifetime, b->interval, b->timeout,
+           b->tcp_pct, b->hosts, b->naddrs);
+
+    t0 = natbench_ns();
+    while (opened < b->sessions) {
+        arrived += b->rate;
+        due = (unsigned long)arrived - opened;
+        if (due > b->sessions - opened) { due = b->sessions - opened; }
+        for (; due > 0; due--, opened++) { natbench_open(b); }
+        natbench_tick(b);
+        ticks++;
+    }
+    while ((b->nflows > 0 || b->nat.nmappings > 0) && ticks < NATBENCH_DRAIN_MAX) {
+        natbench_tick(b);
+        ticks++;
+    }
+
+    printf("ran %lu simulated seconds in %.2f s, %u mappings left\n", ticks,
+           (natbench_ns() - t0) / 1e9, b->nat.nmappings);
+    printf("%lu opened on a live mapping, %lu refused, %lu lost to expiry\n",
+           b->reopened, b->failed, b->lost);
+    natbench_print("lookup hit", &b->hit);
+    natbench_print("lookup miss", &b->miss);
+    natbench_print("insert", &b->insert);
+    natbench_print("expiry", &b->expire);
+    printf("           per tick, at most %lu mappings expired in one\n", b->expired_max);
+    natbench_locks(b);
+    if (b->peak_live) {
+        printf("memory     %lu live at the peak, %.1f MB, %.0f bytes each"
+               " (%.0f over the %.1f MB of fixed tables)\n", b->peak_live,
+               b->peak_bytes / 1e6, (double)b->peak_bytes / b->peak_live,
+               (double)(b->peak_bytes - b->base_bytes) / b->peak_live,
+               b->base_bytes / 1e6);
+    }
+
+    free(b->flows);
+    free(b);
+    return 0;
+}
@@ -0,0 +1,570 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_afpacket.c
+ *
+ * Description:
+ *
+ * AF_PACKET I/O backend.  Lets the router forward directly between Linux
+ * interfaces (e.g. veth pairs into network namespaces) instead of going
+ * through the VNS TCP tunnel.  Each interface gets its own packet socket
+ * with a TPACKET_V3 receive ring and a transmit ring, both mmap'd, so
+ * frames move between the kernel and the router without a copy or a
+ * syscall per packet.
+ *
+ * The backend argument is a comma separated list of interfaces, each
+ * optionally with the IP the router should answer to on it:
+ *
+ *     -i afpacket:veth1=10.0.1.1,veth2=192.168.2.1
+ *
+ * Give the router its addresses here rather than configuring them in the
+ * kernel, or the host stack will answer ARP and ICMP on its behalf.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifdef _LINUX_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_mem.h"
+#include "sr_protocol.h"
+#include "sr_io.h"
+
+#define SR_AFP_MAX_IFACES  16
+#define SR_AFP_BLOCK_SIZE  (1 << 18)  /* 256KB */
+#define SR_AFP_BLOCK_NR    32
+#define SR_AFP_FRAME_SIZE  2048
+#define SR_AFP_RETIRE_TOV  1          /* ms before a partial rx block is handed up */
+#define SR_AFP_POLL_MS     1000
+
+/* data offset in a tx frame, see tpacket_fill_skb() in the kernel */
+#define SR_AFP_TX_DATA     (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+/* ----------------------------------------------------------------------------
+ * struct sr_afp_iface
+ *
+ * One packet socket and its rings.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_afp_iface
+{
+    char     name[sr_IFACE_NAMELEN];
+    uint32_t ip;             /* configured address, network byte order */
+    int      fd;
+    int      ifindex;        /* kernel's */
+    int      sr_index;       /* router's, see sr_get_interface_idx(..) */
+
+    uint8_t* map;            /* rx ring followed by tx ring */
+    size_t   map_len;
+
+    /* -- rx -- */
+    uint8_t* rx_ring;
+    unsigned int rx_block;   /* block we are reading */
+    unsigned int rx_pkt;     /* packets of it already handed out */
+    uint8_t* rx_next;        /* next tpacket3_hdr, 0 if block not started */
+
+    /* -- tx -- */
+    uint8_t* tx_ring;
+    unsigned int tx_frame;   /* next slot to fill */
+    unsigned int tx_frame_nr;
+    int      tx_kick;        /* frames queued since the last sendto */
+    pthread_mutex_t tx_lock; /* router and ARP thread both transmit */
+};
+
+struct sr_afp
+{
+    struct sr_afp_iface ifs[SR_AFP_MAX_IFACES];
+    struct pollfd pfds[SR_AFP_MAX_IFACES];
+    int      num_ifs;
+    int      rr;             /* interface to start the next burst at */
+    pthread_t rx_thread;     /* the one whose sends wait for the flush */
+    struct sr_afp_iface* by_index[SR_IF_MAX]; /* by router interface index */
+};
+
+static struct tpacket_block_desc* sr_afp_block(struct sr_afp_iface* ifc, unsigned int i)
+{
+    return (struct tpacket_block_desc*)(ifc->rx_ring + (size_t)i * SR_AFP_BLOCK_SIZE);
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afp_release_iface(..)
+ * Scope: Local
+ *
+ * Unmap an interface's rings and close its socket, whichever of them it
+ * got as far as.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_afp_release_iface(struct sr_afp_iface* ifc)
+{
+    if (ifc->map)
+    { munmap(ifc->map, ifc->map_len); }
+    if (ifc->fd >= 0)
+    { close(ifc->fd); }
+    ifc->map = 0;
+    ifc->fd  = -1;
+} /* -- sr_afp_release_iface -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afp_setup_iface(..)
+ * Scope: Local
+ *
+ * Open a TPACKET_V3 socket on one interface and map its rings.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_afp_setup_iface(struct sr_afp_iface* ifc)
+{
+    struct tpacket_req3 req;
+    struct sockaddr_ll ll;
+    int ver = TPACKET_V3, one = 1;
+    size_t rx_len, tx_len;
+
+    if ((ifc->ifindex = if_nametoindex(ifc->name)) == 0)
+    {
+        fprintf(stderr, "Error: no interface %s\n", ifc->name);
+        return -1;
+    }
+
+    if ((ifc->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0)
+    {
+        perror("socket(..):sr_afpacket.c::sr_afp_setup_iface(..)");
+        return -1;
+    }
+
+    if (setsockopt(ifc->fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0)
+    {
+        perror("setsockopt(PACKET_VERSION)");
+        sr_afp_release_iface(ifc);
+        return -1;
+    }
+
+#ifdef PACKET_IGNORE_OUTGOING
+    /* we don't want to see our own transmissions, older kernels filter below */
+    setsockopt(ifc->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+    (void)one;
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = SR_AFP_BLOCK_SIZE;
+    req.tp_block_nr   = SR_AFP_BLOCK_NR;
+    req.tp_frame_size = SR_AFP_FRAME_SIZE;
+    req.tp_frame_nr   = (SR_AFP_BLOCK_SIZE / SR_AFP_FRAME_SIZE) * SR_AFP_BLOCK_NR;
+    req.tp_retire_blk_tov = SR_AFP_RETIRE_TOV;
+    req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+    if (setsockopt(ifc->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+    {
+        perror("setsockopt(PACKET_RX_RING)");
+        sr_afp_release_iface(ifc);
+        return -1;
+    }
+    rx_len = (size_t)req.tp_block_size * req.tp_block_nr;
+
+    /* the tx ring is frame based, block timers and features must be off */
+    req.tp_retire_blk_tov = 0;
+    req.tp_feature_req_word = 0;
+    if (setsockopt(ifc->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+    {
+        perror("setsockopt(PACKET_TX_RING)");
+        sr_afp_release_iface(ifc);
+        return -1;
+    }
+    tx_len = (size_t)req.tp_block_size * req.tp_block_nr;
+    ifc->tx_frame_nr = req.tp_frame_nr;
+
+    ifc->map_len = rx_len + tx_len;
+    ifc->map = mmap(0, ifc->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    ifc->fd, 0);
+    if (ifc->map == MAP_FAILED)
+    {
+        perror("mmap(..):sr_afpacket.c::sr_afp_setup_iface(..)");
+        ifc->map = 0;
+        sr_afp_release_iface(ifc);
+        return -1;
+    }
+    ifc->rx_ring = ifc->map;
+    ifc->tx_ring = ifc->map + rx_len;
+
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family   = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_ALL);
+    ll.sll_ifindex  = ifc->ifindex;
+    if (bind(ifc->fd, (struct sockaddr*)&ll, sizeof(ll)) < 0)
+    {
+        perror("bind(..):sr_afpacket.c::sr_afp_setup_iface(..)");
+        sr_afp_release_iface(ifc);
+        return -1;
+    }
+
+    pthread_mutex_init(&ifc->tx_lock, 0);
+    return 0;
+} /* -- sr_afp_setup_iface -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afp_open(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_afp_open(struct sr_instance* sr, const char* arg)
+{
+    struct sr_afp* afp;
+    char spec[1024];
+    char *tok, *save = 0, *eq;
+    struct in_addr addr;
+
+    if ((afp = (struct sr_afp*)sr_mem_calloc(SR_MEM_IO, sizeof(struct sr_afp))) == 0)
+    {
+        fprintf(stderr, "Error: out of memory (sr_afp_open)\n");
+        return -1;
+    }
+    sr->io_priv = afp;
+
+    strncpy(spec, arg, sizeof(spec) - 1);
+    spec[sizeof(spec) - 1] = 0;
+
+    for (tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(0, ",", &save))
+    {
+        struct sr_afp_iface* ifc;
+
+        if (afp->num_ifs == SR_AFP_MAX_IFACES)
+        {
+            fprintf(stderr, "Error: too many interfaces (sr_afp_open)\n");
+            return -1;
+        }
+        ifc = &afp->ifs[afp->num_ifs];
+        ifc->fd = -1;
+
+        if ((eq = strchr(tok, '=')) != 0)
+        {
+            *eq = 0;
+            if (inet_aton(eq + 1, &addr) == 0)
+            {
+                fprintf(stderr, "Error: bad address %s\n", eq + 1);
+                return -1;
+            }
+            ifc->ip = addr.s_addr;
+        }
+        strncpy(ifc->name, tok, sr_IFACE_NAMELEN - 1);
+
+        if (sr_afp_setup_iface(ifc) != 0)
+        { return -1; }
+
+        afp->pfds[afp->num_ifs].fd = ifc->fd;
+        afp->pfds[afp->num_ifs].events = POLLIN | POLLERR;
+        afp->num_ifs++;
+    }
+
+    if (afp->num_ifs == 0)
+    {
+        fprintf(stderr, "Error: no interfaces given (sr_afp_open)\n");
+        return -1;
+    }
+
+    return 0;
+} /* -- sr_afp_open -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afp_discover(..)
+ * Scope: Local
+ *
+ * Build the router's interface list from the kernel's view of the
+ * interfaces, the AF_PACKET equivalent of VNSHWINFO.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_afp_discover(struct sr_instance* sr)
+{
+    struct sr_afp* afp = (struct sr_afp*)sr->io_priv;
+    struct sr_if* iface;
+    struct ifreq ifr;
+    int i;
+
+    for (i = 0; i < afp->num_ifs; i++)
+    {
+        struct sr_afp_iface* ifc = &afp->ifs[i];
+
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, ifc->name, IFNAMSIZ - 1);
+        if (ioctl(ifc->fd, SIOCGIFHWADDR, &ifr) < 0)
+        {
+            perror("ioctl(SIOCGIFHWADDR)");
+            return -1;
+        }
+        if ((iface = sr_add_interface(sr, ifc->name)) == 0)
+        { return -1; }
+        ifc->sr_index = iface->index;
+        afp->by_index[iface->index] = ifc;
+        sr_set_ether_addr(sr, (unsigned char*)ifr.ifr_hwaddr.sa_data);
+
+        /* fall back to whatever address the kernel has on it */
+        if (ifc->ip == 0)
+        {
+            int s = socket(AF_INET, SOCK_DGRAM, 0);
+            memset(&ifr, 0, sizeof(ifr));
+            strncpy(ifr.ifr_name, ifc->name, IFNAMSIZ - 1);
+            if (s >= 0 && ioctl(s, SIOCGIFADDR, &ifr) == 0)
+            { ifc->ip = ((struct sockaddr_in*)&ifr.ifr_addr)->sin_addr.s_addr; }
+            if (s >= 0)
+            { close(s); }
+        }
+        sr_set_ether_ip(sr, ifc->ip);
+    }
+
+    printf("Router interfaces:\n");
+    sr_print_if_list(sr);
+
+    if (sr_verify_routing_table(sr) != 0)
+    {
+        fprintf(stderr,"Routing table not consistent with hardware\n");
+        return -1;
+    }
+    printf(" <-- Ready to process packets --> \n");
+
+    return 0;
+} /* -- sr_afp_discover -- */
+
+/* give every fully consumed block back to the kernel */
+static void sr_afp_release(struct sr_afp_iface* ifc)
+{
+    struct tpacket_block_desc* bd = sr_afp_block(ifc, ifc->rx_block);
+
+    if (ifc->rx_next == 0 || ifc->rx_pkt < bd->hdr.bh1.num_pkts)
+    { return; }
+
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ifc->rx_block = (ifc->rx_block + 1) % SR_AFP_BLOCK_NR;
+    ifc->rx_next = 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afp_rx_iface(..)
+ * Scope: Local
+ *
+ * Hand out up to 'max' frames from the current block of one interface.
+ * The block goes back to the kernel in rx_done once all of its frames
+ * have been handed out.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_afp_rx_iface(struct sr_afp_iface* ifc, struct sr_io_frame* frames,
+                           int max)
+{
+    struct tpacket_block_desc* bd = sr_afp_block(ifc, ifc->rx_block);
+    struct tpacket3_hdr* h;
+    struct sockaddr_ll* ll;
+    int n = 0;
+
+    if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+         TP_STATUS_USER) == 0)
+    { return 0; }
+
+    if (ifc->rx_next == 0)
+    {
+        ifc->rx_next = (uint8_t*)bd + bd->hdr.bh1.offset_to_first_pkt;
+        ifc->rx_pkt = 0;
+    }
+
+    while (n < max && ifc->rx_pkt < bd->hdr.bh1.num_pkts)
+    {
+        h  = (struct tpacket3_hdr*)ifc->rx_next;
+        ll = (struct sockaddr_ll*)((uint8_t*)h +
+                                   TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+        if (ll->sll_pkttype != PACKET_OUTGOING)
+        {
+            frames[n].buf   = (uint8_t*)h + h->tp_mac;
+            frames[n].len   = h->tp_snaplen;
+            frames[n].ifindex = ifc->sr_index;
+            frames[n].priv  = ifc;
+            n++;
+        }
+
+        ifc->rx_pkt++;
+        ifc->rx_next += h->tp_next_offset;
+    }
+
+    /* nothing in it for us (e.g. only our own frames), recycle right away */
+    if (n == 0)
+    { sr_afp_release(ifc); }
+
+    return n;
+} /* -- sr_afp_rx_iface -- */
+
+static int sr_afp_rx_burst(struct sr_instance* sr, struct sr_io_frame* frames,
+                           int max)
+{
+    struct sr_afp* afp = (struct sr_afp*)sr->io_priv;
+    int i, n = 0;
+
+    afp->rx_thread = pthread_self();
+
+    /* round robin so one busy interface can't starve the others */
+    for (i = 0; i < afp->num_ifs && n < max; i++)
+    {
+        struct sr_afp_iface* ifc = &afp->ifs[(afp->rr + i) % afp->num_ifs];
+        n += sr_afp_rx_iface(ifc, frames + n, max - n);
+    }
+    afp->rr = (afp->rr + 1) % afp->num_ifs;
+
+    if (n > 0)
+    { return n; }
+
+    if (poll(afp->pfds, afp->num_ifs, SR_AFP_POLL_MS) < 0 && errno != EINTR)
+    {
+        perror("poll(..):sr_afpacket.c::sr_afp_rx_burst(..)");
+        return -1;
+    }
+    return 0;
+} /* -- sr_afp_rx_burst -- */
+
+static void sr_afp_rx_done(struct sr_instance* sr, struct sr_io_frame* frames,
+                           int n)
+{
+    struct sr_afp* afp = (struct sr_afp*)sr->io_priv;
+    int i;
+
+    for (i = 0; i < afp->num_ifs; i++)
+    { sr_afp_release(&afp->ifs[i]); }
+} /* -- sr_afp_rx_done -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afp_tx_burst(..)
+ * Scope: Local
+ *
+ * Copy frames into the tx rings.  Sent while the router works through a
+ * burst they wait for sr_afp_flush(..), so the burst costs one sendto
+ * per interface; anything the ARP thread sends is kicked straight away.
+ *
+ *---------------------------------------------------------------------------*/
+
+static struct sr_afp_iface* sr_afp_find(struct sr_afp* afp, int index)
+{
+    if (index < 0 || index >= SR_IF_MAX)
+    { return 0; }
+    return afp->by_index[index];
+}
+
+static void sr_afp_kick(struct sr_afp_iface* ifc)
+{
+    if (ifc->tx_kick == 0)
+    { return; }
+    if (sendto(ifc->fd, 0, 0, MSG_DONTWAIT, 0, 0) < 0 &&
+        errno != EAGAIN && errno != ENOBUFS)
+    { perror("sendto(..):sr_afpacket.c::sr_afp_kick(..)"); }
+    __atomic_store_n(&ifc->tx_kick, 0, __ATOMIC_RELAXED);
+}
+
+static int sr_afp_tx_burst(struct sr_instance* sr, struct sr_io_frame* frames,
+                           int n)
+{
+    struct sr_afp* afp = (struct sr_afp*)sr->io_priv;
+    struct sr_afp_iface* ifc;
+    struct tpacket3_hdr* h;
+    int i, sent = 0;
+    int defer = pthread_equal(pthread_self(), afp->rx_thread);
+
+    for (i = 0; i < n; i++)
+    {
+        if ((ifc = sr_afp_find(afp, frames[i].ifindex)) == 0 ||
+            frames[i].len > SR_AFP_FRAME_SIZE - SR_AFP_TX_DATA)
+        { continue; }
+
+        pthread_mutex_lock(&ifc->tx_lock);
+        h = (struct tpacket3_hdr*)(ifc->tx_ring +
+                                   (size_t)ifc->tx_frame * SR_AFP_FRAME_SIZE);
+
+        /* ring full: push out what's queued and drop this one */
+        if (__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE)
+        {
+            sr_afp_kick(ifc);
+            pthread_mutex_unlock(&ifc->tx_lock);
+            continue;
+        }
+
+        memcpy((uint8_t*)h + SR_AFP_TX_DATA, frames[i].buf, frames[i].len);
+        h->tp_len = frames[i].len;
+        h->tp_snaplen = frames[i].len;
+        h->tp_next_offset = 0;
+        __atomic_store_n(&h->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+        ifc->tx_frame = (ifc->tx_frame + 1) % ifc->tx_frame_nr;
+        __atomic_store_n(&ifc->tx_kick, ifc->tx_kick + 1, __ATOMIC_RELAXED);
+        if (!defer)
+        { sr_afp_kick(ifc); }
+        pthread_mutex_unlock(&ifc->tx_lock);
+        sent++;
+    }
+
+    return sent;
+} /* -- sr_afp_tx_burst -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afp_flush(..)
+ * Scope: Local
+ *
+ * End of a burst: kick the interfaces it queued frames on.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_afp_flush(struct sr_instance* sr)
+{
+    struct sr_afp* afp = (struct sr_afp*)sr->io_priv;
+    struct sr_afp_iface* ifc;
+    int i;
+
+    for (i = 0; i < afp->num_ifs; i++)
+    {
+        ifc = &afp->ifs[i];
+        if (__atomic_load_n(&ifc->tx_kick, __ATOMIC_RELAXED) == 0)
+        { continue; }
+        pthread_mutex_lock(&ifc->tx_lock);
+        sr_afp_kick(ifc);
+        pthread_mutex_unlock(&ifc->tx_lock);
+    }
+} /* -- sr_afp_flush -- */
+
+static void sr_afp_close(struct sr_instance* sr)
+{
+    struct sr_afp* afp = (struct sr_afp*)sr->io_priv;
+    int i;
+
+    if (afp == 0)
+    { return; }
+
+    for (i = 0; i < afp->num_ifs; i++)
+    { sr_afp_release_iface(&afp->ifs[i]); }
+    sr_mem_free(afp);
+    sr->io_priv = 0;
+} /* -- sr_afp_close -- */
+
+const struct sr_io_ops sr_io_afpacket =
+{
+    "afpacket",
+    sr_afp_open,
+    sr_afp_discover,
+    sr_afp_rx_burst,
+    sr_afp_rx_done,
+    sr_afp_tx_burst,
+    sr_afp_flush,
+    sr_afp_close
+};
+
+#endif /* _LINUX_ */
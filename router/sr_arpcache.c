@@ -10,6 +10,8 @@
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_pbuf.h"
+#include "sr_mem.h"
 
 /* 
   This function gets called every second. For each request sent out, we keep
@@ -40,21 +42,35 @@ void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req) {
 			
 			/* iterate through all packets on queue */
 			while(packets) {
-				uint8_t *reply_packet = 0;
-				sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packets->buf+sizeof(sr_ethernet_hdr_t));
-				reply_packet = sr_generate_icmp((sr_ethernet_hdr_t *)packets->buf, ip_hdr, sr_get_interface(sr, packets->iface), 3, 1); /* create ICMP type 3, code 1 (host unreachable) */
+				struct sr_pbuf *reply_packet = 0;
+				struct sr_if *in_iface = sr_get_interface_idx(sr, packets->info.ifindex);
+				/* the error goes back out the way the packet came in, to its sender's MAC */
+				if(in_iface == 0) {
+					packets = packets->next;
+					continue;
+				}
+				reply_packet = sr_generate_icmp(&(packets->info), in_iface, 3, 1); /* create ICMP type 3, code 1 (host unreachable) */
 				/* if ICMP packet fails to generate */
 				if(reply_packet == 0) {
 					fprintf(stderr, "Error: failed to generate ICMP packet\n");
+					packets = packets->next;
+					continue;
+				}
+				/* one about a packet the NAT translated, coming in or going out,
+				   quotes and answers the host on the sender's side of it */
+				if((packets->info.flags & SR_PKTINFO_NAT) &&
+				   sr_nat_reply(sr, reply_packet, in_iface->index == sr_nat_ifindex(sr)) != 0) {
+					packets = packets->next;
+					sr_pbuf_free(reply_packet);
+					continue;
 				}
-				
 				
 				/* send ICMP packet to ip of packet in queue */
-				if(sr_send_packet(sr, reply_packet, sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t), packets->iface) == -1) {
+				if(sr_send_packet(sr, sr_pbuf_data(reply_packet), reply_packet->len, in_iface->index) == -1) {
 					fprintf(stderr, "Error: sending packet failed (handle_arpreq)");
 				}
 				packets = packets->next;
-				free(reply_packet);
+				sr_pbuf_free(reply_packet);
 			}
             sr_arpreq_destroy(&(sr->cache), req);
 		} else {
@@ -63,15 +79,15 @@ void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req) {
 			struct sr_if *iface = 0;
 			
 			/* if interface is not found */
-			if((iface = sr_get_interface(sr, req->packets->iface)) == 0) {
+			if((iface = sr_get_interface_idx(sr, req->packets->ifindex)) == 0) {
 				fprintf(stderr, "Error: interface does not exist (handle_arpreq)");
 				return;
 			}
 			
-			uint8_t *arp_pkt = sr_new_arpreq_packet(NULL, iface->addr, req->ip, iface->ip); /* create ARP request packet to re-send */
+			struct sr_pbuf *arp_pkt = sr_new_arpreq_packet(NULL, iface->addr, req->ip, iface->ip); /* create ARP request packet to re-send */
 
 			/* send ARP request packet */
-			if (sr_send_packet(sr, arp_pkt, sizeof(arp_pkt), (const char*)iface)==-1) {
+			if (arp_pkt == 0 || sr_send_packet(sr, sr_pbuf_data(arp_pkt), arp_pkt->len, iface->index)==-1) {
 				fprintf(stderr, "Error: sending packet failed.");
 			}
 
@@ -79,7 +95,7 @@ void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req) {
 			req->times_sent++;
 			req->sent = now;
 			
-			free(arp_pkt);
+			sr_pbuf_free(arp_pkt);
 		}
 	}
 }
@@ -87,17 +103,20 @@ void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req) {
 /*
   This function creates a new ARP request packet with the given parameters.
 */
-uint8_t *sr_new_arpreq_packet(const unsigned char *dest_MAC, 
+struct sr_pbuf *sr_new_arpreq_packet(const unsigned char *dest_MAC, 
 	const unsigned char *src_MAC, 
 	uint32_t dest_ip, 
 	uint32_t src_ip) 
 {
 	sr_arp_hdr_t *arp_hdr = 0; /* ARP header */
 	sr_ethernet_hdr_t *ether_hdr = 0; /* Ether header */
+	struct sr_pbuf *pbuf = 0; /* buffer holding the packet */
 	uint8_t *arp_packet = 0; /* ARP request packet */
 	uint8_t broadcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff}; /* broadcast address ff:ff:ff:ff:ff:ff */
-	if ((arp_packet = malloc(sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t))) == NULL) {
-		fprintf(stderr,"Error: out of memory (sr_new_arpreq_packet)\n");
+	if ((pbuf = sr_pbuf_alloc()) == NULL ||
+		(arp_packet = sr_pbuf_append(pbuf, sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t))) == NULL) {
+		fprintf(stderr,"Error: out of packet buffers (sr_new_arpreq_packet)\n");
+		sr_pbuf_free(pbuf);
         return 0;
     }
 	arp_hdr = (sr_arp_hdr_t*)(arp_packet + sizeof(sr_ethernet_hdr_t));
@@ -116,16 +135,17 @@ uint8_t *sr_new_arpreq_packet(const unsigned char *dest_MAC,
 	memcpy(ether_hdr->ether_shost, src_MAC, ETHER_ADDR_LEN); /* source host */
 	ether_hdr->ether_type = htons(ethertype_arp); /* format of protocol address */
 	
-	return arp_packet;
+	return pbuf;
 }
 /* You should not need to touch the rest of this code. */
 
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
-   You must free the returned structure if it is not NULL. */
-struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
+   Returns 1 and fills in *copy if it is, 0 otherwise. */
+int sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip,
+                       struct sr_arpentry *copy) {
     pthread_mutex_lock(&(cache->lock));
     
-    struct sr_arpentry *entry = NULL, *copy = NULL;
+    struct sr_arpentry *entry = NULL;
     
     int i;
     for (i = 0; i < SR_ARPCACHE_SZ; i++) {
@@ -137,26 +157,26 @@ struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
     /* Must return a copy b/c another thread could jump in and modify
        table after we return. */
     if (entry) {
-        copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
         memcpy(copy, entry, sizeof(struct sr_arpentry));
     }
         
     pthread_mutex_unlock(&(cache->lock));
     
-    return copy;
+    return entry != NULL;
 }
 
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
    that corresponds to this ARP request. You should free the passed *packet.
+   A packet sitting in a pool buffer is kept by reference rather than copied;
+   either way its parse is kept with it.
    
    A pointer to the ARP request is returned; it should not be freed. The caller
    can remove the ARP request from the queue by calling sr_arpreq_destroy. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                                        uint32_t ip,
-                                       uint8_t *packet,           /* borrowed */
-                                       unsigned int packet_len,
-                                       char *iface)
+                                       const struct sr_pktinfo *pkt, /* borrowed */
+                                       int ifindex)
 {
     pthread_mutex_lock(&(cache->lock));
     
@@ -169,21 +189,57 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
     
     /* If the IP wasn't found, add it */
     if (!req) {
-        req = (struct sr_arpreq *) calloc(1, sizeof(struct sr_arpreq));
+        if ((req = (struct sr_arpreq *) sr_slab_alloc(&(cache->req_slab))) == NULL) {
+            fprintf(stderr, "Error: too many outstanding ARP requests (sr_arpcache_queuereq)\n");
+            pthread_mutex_unlock(&(cache->lock));
+            return NULL;
+        }
         req->ip = ip;
         req->next = cache->requests;
         cache->requests = req;
     }
     
     /* Add the packet to the list of packets for this request */
-    if (packet && packet_len && iface) {
-        struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
+    if (pkt && pkt->len && ifindex >= 0) {
+        struct sr_pbuf *pbuf = sr_pbuf_of(pkt->buf);
+        uint8_t *buf = pkt->buf;
+        struct sr_packet *new_pkt = (struct sr_packet *)sr_slab_alloc(&(cache->pkt_slab));
+        
+        /* the buffer a queued packet holds on to counts against us too */
+        if (new_pkt != NULL && sr_mem_charge(SR_MEM_ARP, SR_PBUF_SIZE) != 0) {
+            sr_slab_free(&(cache->pkt_slab), new_pkt);
+            new_pkt = NULL;
+        }
+        
+        if (new_pkt != NULL && pbuf) {
+            sr_pbuf_ref(pbuf);
+        }
+        else if (new_pkt != NULL &&
+                 ((pbuf = sr_pbuf_alloc()) == NULL ||
+                  (buf = sr_pbuf_append(pbuf, pkt->len)) == NULL)) {
+            sr_pbuf_free(pbuf);
+            sr_mem_uncharge(SR_MEM_ARP, SR_PBUF_SIZE);
+            sr_slab_free(&(cache->pkt_slab), new_pkt);
+            new_pkt = NULL;
+        }
+        else if (new_pkt != NULL) {
+            memcpy(buf, pkt->buf, pkt->len);
+        }
         
-        new_pkt->buf = (uint8_t *)malloc(packet_len);
-        memcpy(new_pkt->buf, packet, packet_len);
-        new_pkt->len = packet_len;
-		new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
+        /* Drop the packet; a request with nothing queued is no use */
+        if (new_pkt == NULL) {
+            fprintf(stderr, "Error: ARP queue full (sr_arpcache_queuereq)\n");
+            if (req->packets == NULL) {
+                sr_arpreq_destroy(cache, req);
+                req = NULL;
+            }
+            pthread_mutex_unlock(&(cache->lock));
+            return req;
+        }
+        
+        new_pkt->info = *pkt;
+        new_pkt->info.buf = buf;
+        new_pkt->ifindex = ifindex;
         new_pkt->next = req->packets;
         req->packets = new_pkt;
     }
@@ -265,14 +321,12 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
         
         for (pkt = entry->packets; pkt; pkt = nxt) {
             nxt = pkt->next;
-            if (pkt->buf)
-                free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
-            free(pkt);
+            sr_pbuf_free(sr_pbuf_of(pkt->info.buf));
+            sr_mem_uncharge(SR_MEM_ARP, SR_PBUF_SIZE);
+            sr_slab_free(&(cache->pkt_slab), pkt);
         }
         
-        free(entry);
+        sr_slab_free(&(cache->req_slab), entry);
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -302,6 +356,13 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
     memset(cache->entries, 0, sizeof(cache->entries));
     cache->requests = NULL;
     
+    /* Request and queue memory is set aside up front */
+    if (sr_slab_init(&(cache->req_slab), "arpreq", SR_MEM_ARP,
+                     sizeof(struct sr_arpreq), SR_ARPREQ_MAX, SR_SLAB_PREALLOC) != 0 ||
+        sr_slab_init(&(cache->pkt_slab), "arpq_packet", SR_MEM_ARP,
+                     sizeof(struct sr_packet), SR_ARPQ_MAX, SR_SLAB_PREALLOC) != 0)
+        return -1;
+    
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
     pthread_mutexattr_settype(&(cache->attr), PTHREAD_MUTEX_RECURSIVE);
@@ -70,14 +70,20 @@
 #include <time.h>
 #include <pthread.h>
 #include "sr_if.h"
+#include "sr_slab.h"
+#include "sr_pktinfo.h"
 
 #define SR_ARPCACHE_SZ    100  
 #define SR_ARPCACHE_TO    15.0
+#define SR_ARPREQ_MAX     256   /* outstanding requests */
+#define SR_ARPQ_MAX       1024  /* packets queued on all requests together */
+
+struct sr_pbuf;
 
 struct sr_packet {
-    uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
-    unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
+    struct sr_pktinfo info;     /* The raw Ethernet frame, still with its
+                                   sender's source MAC, and its ingress parse */
+    int ifindex;                /* The outgoing interface */
     struct sr_packet *next;
 };
 
@@ -102,13 +108,16 @@ struct sr_arpreq {
 struct sr_arpcache {
     struct sr_arpentry entries[SR_ARPCACHE_SZ];
     struct sr_arpreq *requests;
+    struct sr_slab req_slab;    /* struct sr_arpreq */
+    struct sr_slab pkt_slab;    /* struct sr_packet */
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
 
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order. 
-   You must free the returned structure if it is not NULL. */
-struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
+   Returns 1 and fills in *copy if it is, 0 otherwise. */
+int sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip,
+                       struct sr_arpentry *copy);
 
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
@@ -116,12 +125,13 @@ struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
    freed by the caller.
 
    A pointer to the ARP request is returned; it should be freed. The caller
-   can remove the ARP request from the queue by calling sr_arpreq_destroy. */
+   can remove the ARP request from the queue by calling sr_arpreq_destroy.
+   NULL is returned if SR_ARPREQ_MAX requests are already outstanding; a
+   packet that would exceed SR_ARPQ_MAX queued packets is dropped. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
-                         uint8_t *packet,               /* borrowed */
-                         unsigned int packet_len,
-                         char *iface);
+                         const struct sr_pktinfo *pkt,  /* borrowed */
+                         int ifindex);
 
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
@@ -140,7 +150,7 @@ void sr_arpcache_dump(struct sr_arpcache *cache);
 
 void sr_arpcache_sweepreqs(struct sr_instance *sr);
 void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req);
-uint8_t *sr_new_arpreq_packet(const unsigned char *dest_MAC, 
+struct sr_pbuf *sr_new_arpreq_packet(const unsigned char *dest_MAC, 
 	const unsigned char *src_MAC, 
 	uint32_t dest_ip, 
 	uint32_t src_ip);
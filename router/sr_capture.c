@@ -0,0 +1,271 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_capture.c
+ *
+ * Description:
+ *
+ * Asynchronous packet capture, see sr_capture.h.
+ *
+ * The ring is a bounded multi-producer queue in the style of Dmitry
+ * Vyukov's: every slot carries a sequence number telling producers when
+ * it is free and the writer when it is full, so producers only contend
+ * on one compare-and-swap of the enqueue index and never wait on each
+ * other or on the writer.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "sr_dumper.h"
+#include "sr_capture.h"
+
+#define SR_CAPTURE_IDLE_NS   1000000  /* writer nap when the ring is empty */
+#define SR_CAPTURE_FLUSH_MS  100      /* longest a frame sits in the block */
+
+struct sr_capture_slot
+{
+    uint32_t       seq;
+    uint32_t       caplen;
+    uint32_t       len;
+    struct timeval ts;
+    /* caplen bytes of frame follow */
+};
+
+struct sr_capture
+{
+    FILE*          fp;
+    unsigned int   snaplen;
+    size_t         stride;     /* bytes per slot, header included */
+    uint8_t*       slots;
+    uint32_t       mask;
+
+    uint8_t        pad0[64];
+    uint32_t       enq;        /* producers */
+    uint8_t        pad1[64];
+    uint32_t       deq;        /* writer only */
+    uint64_t       captured;
+    uint64_t       dropped;
+    int            stop;
+
+    pthread_t      writer;
+    uint8_t*       block;
+    size_t         fill;
+    struct timespec last_flush;
+};
+
+static struct sr_capture_slot* sr_capture_slot(struct sr_capture* cap,
+                                               uint32_t pos)
+{
+    return (struct sr_capture_slot*)(cap->slots +
+                                     (size_t)(pos & cap->mask) * cap->stride);
+} /* -- sr_capture_slot -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_capture_packet(..)
+ * Scope: Global
+ *
+ * Called on the forwarding path for every frame.  Never blocks.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_capture_packet(struct sr_capture* cap, const uint8_t* buf,
+                       unsigned int len)
+{
+    struct sr_capture_slot* slot;
+    uint32_t pos, seq;
+    int32_t diff;
+
+    pos = __atomic_load_n(&cap->enq, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        slot = sr_capture_slot(cap, pos);
+        seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (int32_t)(seq - pos);
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&cap->enq, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            { break; }
+        }
+        else if (diff < 0)
+        {
+            /* -- writer is behind, drop rather than wait -- */
+            __atomic_fetch_add(&cap->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+        { pos = __atomic_load_n(&cap->enq, __ATOMIC_RELAXED); }
+    }
+
+    gettimeofday(&slot->ts, 0);
+    slot->len    = len;
+    slot->caplen = min(len, cap->snaplen);
+    memcpy(slot + 1, buf, slot->caplen);
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+} /* -- sr_capture_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_capture_flush(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_capture_flush(struct sr_capture* cap)
+{
+    if (cap->fill > 0)
+    {
+        if (fwrite(cap->block, cap->fill, 1, cap->fp) != 1)
+        { perror("fwrite(..):sr_capture.c::sr_capture_flush"); }
+        fflush(cap->fp);
+        cap->fill = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &cap->last_flush);
+} /* -- sr_capture_flush -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_capture_writer(..)
+ * Scope: Local
+ *
+ * Background thread: move finished slots into the block, write the block
+ * out when it is full or has been sitting around for a while.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void* sr_capture_writer(void* arg)
+{
+    struct sr_capture* cap = (struct sr_capture*)arg;
+    struct sr_capture_slot* slot;
+    struct pcap_sf_pkthdr hdr;
+    struct timespec now, nap;
+    long waited;
+
+    nap.tv_sec  = 0;
+    nap.tv_nsec = SR_CAPTURE_IDLE_NS;
+
+    for (;;)
+    {
+        slot = sr_capture_slot(cap, cap->deq);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == cap->deq + 1)
+        {
+            if (cap->fill + sizeof(hdr) + slot->caplen > SR_CAPTURE_BLOCK)
+            { sr_capture_flush(cap); }
+
+            hdr.ts.tv_sec  = slot->ts.tv_sec;
+            hdr.ts.tv_usec = slot->ts.tv_usec;
+            hdr.caplen     = slot->caplen;
+            hdr.len        = slot->len;
+            memcpy(cap->block + cap->fill, &hdr, sizeof(hdr));
+            memcpy(cap->block + cap->fill + sizeof(hdr), slot + 1,
+                   slot->caplen);
+            cap->fill += sizeof(hdr) + slot->caplen;
+
+            /* -- hand the slot back to the producers, one lap later -- */
+            __atomic_store_n(&slot->seq, cap->deq + cap->mask + 1,
+                             __ATOMIC_RELEASE);
+            cap->deq++;
+            __atomic_fetch_add(&cap->captured, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        /* -- ring is empty -- */
+        if (__atomic_load_n(&cap->stop, __ATOMIC_ACQUIRE))
+        { break; }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waited = (now.tv_sec - cap->last_flush.tv_sec) * 1000 +
+                 (now.tv_nsec - cap->last_flush.tv_nsec) / 1000000;
+        if (cap->fill > 0 && waited >= SR_CAPTURE_FLUSH_MS)
+        { sr_capture_flush(cap); }
+
+        nanosleep(&nap, 0);
+    }
+
+    sr_capture_flush(cap);
+    return 0;
+} /* -- sr_capture_writer -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_capture_open(..)
+ * Scope: Global
+ *
+ * Start capturing to 'fp', which already has its pcap file header.
+ *
+ *---------------------------------------------------------------------------*/
+
+struct sr_capture* sr_capture_open(FILE* fp, unsigned int snaplen)
+{
+    struct sr_capture* cap;
+    uint32_t i;
+
+    if ((cap = (struct sr_capture*)calloc(1, sizeof(struct sr_capture))) == 0)
+    { return 0; }
+
+    cap->fp      = fp;
+    cap->snaplen = snaplen;
+    cap->mask    = SR_CAPTURE_SLOTS - 1;
+    cap->stride  = (sizeof(struct sr_capture_slot) + snaplen + 63) & ~(size_t)63;
+    cap->slots   = (uint8_t*)malloc(cap->stride * SR_CAPTURE_SLOTS);
+    cap->block   = (uint8_t*)malloc(SR_CAPTURE_BLOCK);
+
+    if (!cap->slots || !cap->block ||
+        sizeof(struct pcap_sf_pkthdr) + snaplen > SR_CAPTURE_BLOCK)
+    {
+        free(cap->slots);
+        free(cap->block);
+        free(cap);
+        return 0;
+    }
+
+    for (i = 0; i < SR_CAPTURE_SLOTS; i++)
+    { sr_capture_slot(cap, i)->seq = i; }
+    clock_gettime(CLOCK_MONOTONIC, &cap->last_flush);
+
+    if (pthread_create(&cap->writer, 0, sr_capture_writer, cap) != 0)
+    {
+        perror("pthread_create(..):sr_capture.c::sr_capture_open");
+        free(cap->slots);
+        free(cap->block);
+        free(cap);
+        return 0;
+    }
+
+    return cap;
+} /* -- sr_capture_open -- */
+
+void sr_capture_stats(struct sr_capture* cap, uint64_t* captured,
+                      uint64_t* dropped)
+{
+    *captured = __atomic_load_n(&cap->captured, __ATOMIC_RELAXED);
+    *dropped  = __atomic_load_n(&cap->dropped, __ATOMIC_RELAXED);
+} /* -- sr_capture_stats -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_capture_close(..)
+ * Scope: Global
+ *
+ * Drain what is queued, stop the writer and report.  The file itself is
+ * left to the caller.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_capture_close(struct sr_capture* cap)
+{
+    uint64_t captured, dropped;
+
+    __atomic_store_n(&cap->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(cap->writer, 0);
+
+    sr_capture_stats(cap, &captured, &dropped);
+    fprintf(stderr, "capture: %llu frames written, %llu dropped\n",
+            (unsigned long long)captured, (unsigned long long)dropped);
+
+    free(cap->slots);
+    free(cap->block);
+    free(cap);
+} /* -- sr_capture_close -- */
@@ -0,0 +1,39 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_capture.h
+ *
+ * Description:
+ *
+ * Asynchronous packet capture for -l.  Forwarding threads copy frames
+ * (up to the snap length) into a lock-free ring and return straight away;
+ * a background writer drains the ring into large blocks and writes them
+ * to the pcap file.  When the disk falls behind and the ring fills up,
+ * frames are counted as dropped instead of stalling the router.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_CAPTURE_H
+#define SR_CAPTURE_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <stdio.h>
+
+#define SR_CAPTURE_SLOTS  4096        /* ring entries, power of 2 */
+#define SR_CAPTURE_BLOCK  (256*1024)  /* bytes handed to fwrite at once */
+
+struct sr_capture;
+
+struct sr_capture* sr_capture_open(FILE* fp, unsigned int snaplen);
+void sr_capture_packet(struct sr_capture* cap, const uint8_t* buf,
+                       unsigned int len);
+void sr_capture_stats(struct sr_capture* cap, uint64_t* captured,
+                      uint64_t* dropped);
+void sr_capture_close(struct sr_capture* cap);
+
+#endif /* -- SR_CAPTURE_H -- */
@@ -0,0 +1,163 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_epoch.c
+ *
+ * Description:
+ *
+ * Epoch based reclamation, see sr_epoch.h.
+ *
+ * The domain's epoch only moves forward, and only once everything retired
+ * so far has been unlinked.  A reader publishes the epoch it entered in; an
+ * object retired in epoch e may be freed once no reader is still in an
+ * epoch at or before e.  Readers and the reclaimer each store
+ * then fence then load (their epoch, the unlink), so at least one of them
+ * sees the other: either the reclaimer sees the reader and waits, or the
+ * reader sees the object already unlinked.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_epoch.h"
+
+int sr_epoch_init(struct sr_epoch* ep, void* arg)
+{
+    assert(ep);
+
+    memset(ep, 0, sizeof(*ep));
+    ep->epoch = 1;
+    ep->arg   = arg;
+    return pthread_mutex_init(&ep->lock, 0);
+} /* -- sr_epoch_init -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_epoch_destroy(..)
+ * Scope: Global
+ *
+ * Free everything still retired.  No reader may be inside a section.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_epoch_destroy(struct sr_epoch* ep)
+{
+    sr_epoch_reclaim(ep);
+    assert(ep->limbo == 0);
+    pthread_mutex_destroy(&ep->lock);
+} /* -- sr_epoch_destroy -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_epoch_register(..)
+ * Scope: Global
+ *
+ * A reader slot for the calling thread, or 0 if all are taken.
+ *
+ *---------------------------------------------------------------------------*/
+
+struct sr_epoch_reader* sr_epoch_register(struct sr_epoch* ep)
+{
+    unsigned int i = __atomic_fetch_add(&ep->nreaders, 1, __ATOMIC_RELAXED);
+
+    if (i >= SR_EPOCH_READERS)
+    {
+        fprintf(stderr, "Error: more than %d epoch readers\n", SR_EPOCH_READERS);
+        return 0;
+    }
+    return &ep->readers[i];
+} /* -- sr_epoch_register -- */
+
+void sr_epoch_enter(struct sr_epoch* ep, struct sr_epoch_reader* reader)
+{
+    __atomic_store_n(&reader->epoch, __atomic_load_n(&ep->epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+} /* -- sr_epoch_enter -- */
+
+void sr_epoch_exit(struct sr_epoch_reader* reader)
+{
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+} /* -- sr_epoch_exit -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_epoch_retire(..)
+ * Scope: Global
+ *
+ * 'node' belongs to an object already unreachable for new readers; call
+ * 'fn' on it once the ones that may still hold it are gone.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_epoch_retire(struct sr_epoch* ep, struct sr_epoch_node* node,
+                     void (*fn)(void* arg, struct sr_epoch_node* node))
+{
+    node->fn = fn;
+
+    /* -- under the lock, so the unlink is ordered before any later
+          advance of the epoch -- */
+    pthread_mutex_lock(&ep->lock);
+    node->epoch = __atomic_load_n(&ep->epoch, __ATOMIC_RELAXED);
+    node->next = ep->limbo;
+    ep->limbo  = node;
+    pthread_mutex_unlock(&ep->lock);
+} /* -- sr_epoch_retire -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_epoch_reclaim(..)
+ * Scope: Global
+ *
+ * Advance the epoch and free what no reader can still hold.  Whatever
+ * isn't free yet goes back on the limbo list for the next call.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_epoch_reclaim(struct sr_epoch* ep)
+{
+    struct sr_epoch_node *node, *next, *keep = 0;
+    uint64_t oldest = UINT64_MAX, e;
+    unsigned int i, n;
+
+    /* -- everything taken here was unlinked before the epoch moved on,
+          so readers entering in the new epoch can't find it -- */
+    pthread_mutex_lock(&ep->lock);
+    node = ep->limbo;
+    ep->limbo = 0;
+    if (node)
+    { __atomic_add_fetch(&ep->epoch, 1, __ATOMIC_RELEASE); }
+    pthread_mutex_unlock(&ep->lock);
+    if (!node)
+    { return; }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    n = __atomic_load_n(&ep->nreaders, __ATOMIC_RELAXED);
+    if (n > SR_EPOCH_READERS)
+    { n = SR_EPOCH_READERS; }
+    for (i = 0; i < n; i++)
+    {
+        e = __atomic_load_n(&ep->readers[i].epoch, __ATOMIC_ACQUIRE);
+        if (e && e < oldest)
+        { oldest = e; }
+    }
+
+    for (; node; node = next)
+    {
+        next = node->next;
+        if (node->epoch < oldest)
+        { node->fn(ep->arg, node); }
+        else
+        {
+            node->next = keep;
+            keep = node;
+        }
+    }
+
+    if (keep)
+    {
+        pthread_mutex_lock(&ep->lock);
+        for (node = keep; node->next; node = node->next)
+        { }
+        node->next = ep->limbo;
+        ep->limbo  = keep;
+        pthread_mutex_unlock(&ep->lock);
+    }
+} /* -- sr_epoch_reclaim -- */
@@ -0,0 +1,60 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_epoch.h
+ *
+ * Description:
+ *
+ * Epoch based reclamation for structures read without locks.  Readers
+ * (datapath threads) register once and bracket each packet with
+ * sr_epoch_enter(..)/sr_epoch_exit(..); anything they find in between
+ * stays valid until they exit.  Writers unlink an object under their own
+ * lock and hand it to sr_epoch_retire(..) instead of freeing it; a later
+ * sr_epoch_reclaim(..) frees it once every reader that might have seen
+ * it has left its section.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_EPOCH_H
+#define SR_EPOCH_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define SR_EPOCH_READERS 64  /* threads that may read one domain */
+
+/* -- embedded in each object that may be retired -- */
+struct sr_epoch_node
+{
+    struct sr_epoch_node* next;
+    uint64_t              epoch;   /* when it was retired */
+    void                (*fn)(void* arg, struct sr_epoch_node* node);
+};
+
+struct sr_epoch_reader
+{
+    uint64_t epoch;                /* entered in, 0 outside a section */
+    char     pad[56];
+};
+
+struct sr_epoch
+{
+    uint64_t               epoch;
+    unsigned int           nreaders;
+    struct sr_epoch_reader readers[SR_EPOCH_READERS];
+
+    pthread_mutex_t        lock;   /* guards limbo */
+    struct sr_epoch_node*  limbo;  /* retired, not yet freed */
+    void*                  arg;    /* passed to each node's fn */
+};
+
+int   sr_epoch_init(struct sr_epoch* ep, void* arg);
+void  sr_epoch_destroy(struct sr_epoch* ep);
+
+struct sr_epoch_reader* sr_epoch_register(struct sr_epoch* ep);
+void  sr_epoch_enter(struct sr_epoch* ep, struct sr_epoch_reader* reader);
+void  sr_epoch_exit(struct sr_epoch_reader* reader);
+
+void  sr_epoch_retire(struct sr_epoch* ep, struct sr_epoch_node* node,
+                      void (*fn)(void* arg, struct sr_epoch_node* node));
+void  sr_epoch_reclaim(struct sr_epoch* ep);
+
+#endif /* -- SR_EPOCH_H -- */
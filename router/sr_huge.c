@@ -0,0 +1,239 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_huge.c
+ *
+ * Description:
+ *
+ * Huge page backed regions, see sr_huge.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "sr_huge.h"
+
+enum sr_huge_kind
+{
+    sr_huge_hugetlb,    /* explicit huge pages */
+    sr_huge_thp,        /* aligned, transparent huge pages requested */
+    sr_huge_small       /* ordinary pages */
+};
+
+static const char* sr_huge_kind_name[] = { "hugetlb", "thp", "4k" };
+
+struct sr_huge_region
+{
+    const char*       name;
+    void*             base;
+    size_t            size;    /* bytes asked for */
+    size_t            len;     /* bytes mapped */
+    enum sr_huge_kind kind;
+};
+
+static pthread_mutex_t sr_huge_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sr_huge_region sr_huge_regions[SR_HUGE_MAX];
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_huge_map_thp(..)
+ * Scope: Local
+ *
+ * Map 'len' bytes (a multiple of SR_HUGE_PAGE) on a huge page boundary
+ * and ask for transparent huge pages.  The kernel only backs aligned
+ * 2 MB ranges with huge pages, so map one page extra and trim.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void* sr_huge_map_thp(size_t len)
+{
+    uint8_t *mem, *base;
+    size_t head;
+
+    mem = mmap(0, len + SR_HUGE_PAGE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    { return 0; }
+
+    base = (uint8_t*)(((uintptr_t)mem + SR_HUGE_PAGE - 1) & ~(SR_HUGE_PAGE - 1));
+    head = base - mem;
+    if (head)
+    { munmap(mem, head); }
+    munmap(base + len, SR_HUGE_PAGE - head);
+
+#ifdef MADV_HUGEPAGE
+    if (madvise(base, len, MADV_HUGEPAGE) == 0)
+    { return base; }
+#endif
+    munmap(base, len);
+    return 0;
+} /* -- sr_huge_map_thp -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_huge_alloc(..)
+ * Scope: Global
+ *
+ * A zeroed region of at least 'size' bytes, or 0.  Regions smaller than a
+ * huge page aren't worth one and get ordinary pages.
+ *
+ *---------------------------------------------------------------------------*/
+
+void* sr_huge_alloc(const char* name, size_t size)
+{
+    struct sr_huge_region* r = 0;
+    void* mem = MAP_FAILED;
+    void* thp;
+    size_t len;
+    int i;
+
+    pthread_mutex_lock(&sr_huge_lock);
+    for (i = 0; i < SR_HUGE_MAX && !r; i++)
+    {
+        if (!sr_huge_regions[i].base)
+        { r = &sr_huge_regions[i]; }
+    }
+    if (!r)
+    {
+        pthread_mutex_unlock(&sr_huge_lock);
+        fprintf(stderr, "Error: more than %d regions, can't map %s\n",
+                SR_HUGE_MAX, name);
+        return 0;
+    }
+
+    len = (size + SR_HUGE_PAGE - 1) & ~(SR_HUGE_PAGE - 1);
+
+    if (size >= SR_HUGE_PAGE)
+    {
+#ifdef MAP_HUGETLB
+        mem = mmap(0, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        r->kind = sr_huge_hugetlb;
+#endif
+        if (mem == MAP_FAILED && (thp = sr_huge_map_thp(len)) != 0)
+        {
+            mem = thp;
+            r->kind = sr_huge_thp;
+        }
+    }
+    if (mem == MAP_FAILED)
+    {
+        len = (size + 4095) & ~(size_t)4095;
+        mem = mmap(0, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        r->kind = sr_huge_small;
+    }
+    if (mem == MAP_FAILED)
+    {
+        pthread_mutex_unlock(&sr_huge_lock);
+        fprintf(stderr, "Error: out of memory mapping %s\n", name);
+        return 0;
+    }
+
+    r->name = name;
+    r->base = mem;
+    r->size = size;
+    r->len  = len;
+    pthread_mutex_unlock(&sr_huge_lock);
+    return mem;
+} /* -- sr_huge_alloc -- */
+
+void sr_huge_free(void* mem)
+{
+    int i;
+
+    if (!mem)
+    { return; }
+
+    pthread_mutex_lock(&sr_huge_lock);
+    for (i = 0; i < SR_HUGE_MAX; i++)
+    {
+        if (sr_huge_regions[i].base == mem)
+        {
+            munmap(mem, sr_huge_regions[i].len);
+            memset(&sr_huge_regions[i], 0, sizeof(sr_huge_regions[i]));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sr_huge_lock);
+} /* -- sr_huge_free -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_huge_thp_kb(..)
+ * Scope: Local
+ *
+ * How much of the mapping holding 'base' the kernel has backed with
+ * transparent huge pages, from /proc/self/smaps.  Adjacent regions with
+ * the same protections may share a mapping; the figure is then theirs
+ * together.  -1 if it can't be told.
+ *
+ *---------------------------------------------------------------------------*/
+
+static long sr_huge_thp_kb(void* base)
+{
+    char line[256];
+    unsigned long start, end;
+    long kb = -1;
+    int inside = 0;
+    FILE* fp;
+
+    if ((fp = fopen("/proc/self/smaps", "r")) == 0)
+    { return -1; }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+        {
+            if (inside)
+            { break; }
+            inside = ((uintptr_t)base >= start && (uintptr_t)base < end);
+        }
+        else if (inside && sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+        { break; }
+    }
+    fclose(fp);
+    return kb;
+} /* -- sr_huge_thp_kb -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_huge_report(..)
+ * Scope: Global
+ *
+ * One line per region: its size and the kind of pages behind it.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_huge_report(FILE* fp)
+{
+    struct sr_huge_region* r;
+    long kb;
+    int i;
+
+    fprintf(fp, "%-16s %10s %10s %8s %10s\n", "region", "size", "mapped",
+            "pages", "huge kB");
+
+    pthread_mutex_lock(&sr_huge_lock);
+    for (i = 0; i < SR_HUGE_MAX; i++)
+    {
+        r = &sr_huge_regions[i];
+        if (!r->base)
+        { continue; }
+
+        if (r->kind == sr_huge_hugetlb)
+        { kb = (long)(r->len >> 10); }
+        else if (r->kind == sr_huge_thp)
+        {
+            kb = sr_huge_thp_kb(r->base);
+            if (kb > (long)(r->len >> 10))
+            { kb = (long)(r->len >> 10); }
+        }
+        else
+        { kb = 0; }
+
+        fprintf(fp, "%-16s %10lu %10lu %8s %10ld\n", r->name,
+                (unsigned long)r->size, (unsigned long)r->len,
+                sr_huge_kind_name[r->kind], kb);
+    }
+    pthread_mutex_unlock(&sr_huge_lock);
+} /* -- sr_huge_report -- */
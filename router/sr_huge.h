@@ -0,0 +1,31 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_huge.h
+ *
+ * Description:
+ *
+ * Large, long lived memory regions (the packet buffer arena, preallocated
+ * object caches) placed on 2 MB huge pages where the system allows it, so
+ * lookups spread across them don't pay a TLB miss per 4 KB page.
+ *
+ * sr_huge_alloc(..) first asks for explicit huge pages (MAP_HUGETLB, needs
+ * pages reserved in /proc/sys/vm/nr_hugepages), then for a 2 MB aligned
+ * mapping with a transparent huge page hint, and finally settles for
+ * ordinary pages.  Regions come back zeroed.  sr_huge_report(..) lists
+ * every region with what it actually got.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_HUGE_H
+#define SR_HUGE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define SR_HUGE_PAGE  (2UL << 20)  /* huge page size we align to */
+#define SR_HUGE_MAX   32           /* regions tracked for the report */
+
+void* sr_huge_alloc(const char* name, size_t size);
+void  sr_huge_free(void* mem);
+void  sr_huge_report(FILE* fp);
+
+#endif /* -- SR_HUGE_H -- */
@@ -24,6 +24,7 @@
 
 #include "sr_if.h"
 #include "sr_router.h"
+#include "sr_rt.h"
 
 /*--------------------------------------------------------------------- 
  * Method: sr_get_interface
@@ -54,30 +55,61 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
     return 0;
 } /* -- sr_get_interface -- */
 
+/*--------------------------------------------------------------------- 
+ * Method: sr_get_interface_idx
+ * Scope: Global
+ *
+ * Given an interface index return the interface record or 0 if it doesn't
+ * exist.  This is the lookup to use per packet.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_if* sr_get_interface_idx(struct sr_instance* sr, int index)
+{
+    if(index < 0 || index >= sr->if_count)
+    { return 0; }
+
+    return sr->if_table[index];
+} /* -- sr_get_interface_idx -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_add_interface(..)
  * Scope: Global
  *
- * Add and interface to the router's list
+ * Add and interface to the router's list and give it the next index.
+ * Returns the new interface, 0 if the table is full.
  *
  *---------------------------------------------------------------------*/
 
-void sr_add_interface(struct sr_instance* sr, const char* name)
+struct sr_if* sr_add_interface(struct sr_instance* sr, const char* name)
 {
     struct sr_if* if_walker = 0;
+    struct sr_if* iface = 0;
 
     /* -- REQUIRES -- */
     assert(name);
     assert(sr);
 
+    if(sr->if_count >= SR_IF_MAX)
+    {
+        fprintf(stderr,"Error: more than %d interfaces, ignoring %s\n",
+                SR_IF_MAX, name);
+        return 0;
+    }
+
+    iface = (struct sr_if*)calloc(1, sizeof(struct sr_if));
+    assert(iface);
+    strncpy(iface->name,name,sr_IFACE_NAMELEN);
+    iface->index = sr->if_count;
+    iface->next = 0;
+    sr->if_table[sr->if_count++] = iface;
+
     /* -- empty list special case -- */
     if(sr->if_list == 0)
     {
-        sr->if_list = (struct sr_if*)malloc(sizeof(struct sr_if));
-        assert(sr->if_list);
-        sr->if_list->next = 0;
-        strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
-        return;
+        sr->if_list = iface;
+        sr_rt_bind_interfaces(sr);
+        return iface;
     }
 
     /* -- find the end of the list -- */
@@ -85,11 +117,9 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     while(if_walker->next)
     {if_walker = if_walker->next; }
 
-    if_walker->next = (struct sr_if*)malloc(sizeof(struct sr_if));
-    assert(if_walker->next);
-    if_walker = if_walker->next;
-    strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
-    if_walker->next = 0;
+    if_walker->next = iface;
+    sr_rt_bind_interfaces(sr);
+    return iface;
 } /* -- sr_add_interface -- */ 
 
 /*--------------------------------------------------------------------- 
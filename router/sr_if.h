@@ -26,12 +26,17 @@
 
 #include "sr_protocol.h"
 
+#define SR_IF_MAX 32 /* interfaces per router */
+
 struct sr_instance;
 
 /* ----------------------------------------------------------------------------
  * struct sr_if
  *
- * Node in the interface list for each router
+ * Node in the interface list for each router.  Interfaces are numbered
+ * densely in the order they are added and the index is what the
+ * datapath passes around; the name is only looked up where it comes in
+ * from (or goes out to) the server.
  *
  * -------------------------------------------------------------------------- */
 
@@ -41,11 +46,13 @@ struct sr_if
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  int index;              /* slot in sr->if_table */
   struct sr_if* next;
 };
 
 struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name);
-void sr_add_interface(struct sr_instance*, const char*);
+struct sr_if* sr_get_interface_idx(struct sr_instance* sr, int index);
+struct sr_if* sr_add_interface(struct sr_instance*, const char*);
 void sr_set_ether_addr(struct sr_instance*, const unsigned char*);
 void sr_set_ether_ip(struct sr_instance*, uint32_t ip_nbo);
 void sr_print_if_list(struct sr_instance*);
@@ -0,0 +1,223 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_io.c
+ *
+ * Description:
+ *
+ * Backend independent half of packet I/O: the receive dispatch loop,
+ * sr_send_packet(..) and packet logging.  Everything that actually moves
+ * bytes lives behind struct sr_io_ops.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_protocol.h"
+#include "sr_io.h"
+#include "sr_capture.h"
+#include "sr_pktinfo.h"
+
+static void sr_log_packet(struct sr_instance* , uint8_t* , int );
+
+static const struct sr_io_ops* sr_io_backends[] =
+{
+    &sr_io_vns,
+#ifdef _LINUX_
+    &sr_io_vns_uring,
+    &sr_io_vns_shm,
+    &sr_io_afpacket,
+#endif /* _LINUX_ */
+    0
+};
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_io_lookup(..)
+ * Scope: Global
+ *
+ * Find a backend by name, 0 if there is no such backend.
+ *
+ *---------------------------------------------------------------------------*/
+
+const struct sr_io_ops* sr_io_lookup(const char* name)
+{
+    int i;
+
+    for (i = 0; sr_io_backends[i]; i++)
+    {
+        if (strcmp(sr_io_backends[i]->name, name) == 0)
+        { return sr_io_backends[i]; }
+    }
+    return 0;
+} /* -- sr_io_lookup -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_io_input(..)
+ * Scope: Global
+ *
+ * Hand a single received frame to the router.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_io_input(struct sr_instance* sr, struct sr_io_frame* frame)
+{
+    /* -- log packet -- */
+    sr_log_packet(sr, frame->buf, frame->len);
+
+    /* -- pass to router, student's code should take over here -- */
+    sr_handlepacket(sr, frame->buf, frame->len, frame->ifindex);
+} /* -- sr_io_input -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_io_poll(..)
+ * Scope: Global
+ *
+ * One iteration of the main loop: pull a burst of frames from the backend
+ * and run each through the router.
+ *
+ * RETURN VALUES:
+ *
+ *  1 to keep going, anything else once the session is over
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_io_poll(struct sr_instance* sr)
+{
+    struct sr_io_frame frames[SR_IO_BURST];
+    int n, i;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(sr->io);
+
+    if ((n = sr->io->rx_burst(sr, frames, SR_IO_BURST)) < 0)
+    { return n; }
+
+    /* -- one timestamp for the whole burst -- */
+    if (n > 0)
+    { sr->rx_ns = sr_pktinfo_clock(); }
+
+    for (i = 0; i < n; i++)
+    { sr_io_input(sr, &frames[i]); }
+
+    if (n > 0 && sr->io->rx_done)
+    { sr->io->rx_done(sr, frames, n); }
+
+    /* -- what the burst sent goes out together -- */
+    if (n > 0 && sr->io->flush)
+    { sr->io->flush(sr); }
+
+    return 1;
+} /* -- sr_io_poll -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_ether_addrs_match_interface(..)
+ * Scope: Local
+ *
+ * Make sure ethernet addresses are sane so we don't muck uo the system.
+ *
+ *----------------------------------------------------------------------------*/
+
+static int
+sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
+                                uint8_t* buf, /* borrowed */
+                                struct sr_if* iface /* borrowed */ )
+{
+    struct sr_ethernet_hdr* ether_hdr = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(buf);
+    assert(iface);
+
+    ether_hdr = (struct sr_ethernet_hdr*)buf;
+
+    if ( memcmp( ether_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN) != 0 ){
+        fprintf( stderr, "** Error, source address does not match interface\n");
+        return 0;
+    }
+
+    /* TODO */
+    /* Check destination, hardware address.  If it is private (i.e. destined
+     * to a virtual interface) ensure it is going to the correct topology
+     * Note: This check should really be done server side ...
+     */
+
+    return 1;
+
+} /* -- sr_ether_addrs_match_interface -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packet(..)
+ * Scope: Global
+ *
+ * Send a packet (ethernet header included!) of length 'len' out of
+ * interface number 'ifindex' through the active I/O backend.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packet(struct sr_instance* sr /* borrowed */,
+                         uint8_t* buf /* borrowed */ ,
+                         unsigned int len,
+                         int ifindex)
+{
+    struct sr_io_frame frame;
+    struct sr_if* iface;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(buf);
+    assert(sr->io);
+
+    if ( (iface = sr_get_interface_idx(sr, ifindex)) == 0 ){
+        fprintf( stderr, "** Error, interface %d, does not exist\n", ifindex);
+        return -1;
+    }
+
+    /* don't waste my time ... */
+    if ( len < sizeof(struct sr_ethernet_hdr) ){
+        fprintf(stderr , "** Error: packet is wayy to short \n");
+        return -1;
+    }
+
+    /* -- log packet -- */
+    sr_log_packet(sr,buf,len);
+
+    if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
+        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+        return -1;
+    }
+
+    frame.buf   = buf;
+    frame.len   = len;
+    frame.ifindex = ifindex;
+    frame.priv  = 0;
+
+    if( sr->io->tx_burst(sr, &frame, 1) != 1 ){
+        fprintf(stderr, "Error writing packet\n");
+        return -1;
+    }
+
+    return 0;
+} /* -- sr_send_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_log_packet()
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
+{
+    /* REQUIRES */
+    assert(sr);
+
+    if(!sr->capture)
+    {return; }
+
+    /* -- copied into the capture ring, written out by its own thread -- */
+    sr_capture_packet(sr->capture, buf, len);
+} /* -- sr_log_packet -- */
@@ -0,0 +1,87 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_io.h
+ *
+ * Description:
+ *
+ * Packet I/O backend interface.  The router core only ever talks to the
+ * outside world through a backend: the VNS client (sr_vns_comm.c), which
+ * tunnels frames over the TCP session to the VNS/Mininet server, the same
+ * session driven through io_uring (sr_uring.c) or carried over shared
+ * memory rings (sr_vns_shm.c), or an AF_PACKET ring (sr_afpacket.c) that
+ * forwards directly between Linux interfaces.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_IO_H
+#define SR_IO_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_IO_BURST 32 /* frames handed to the router per rx call */
+
+struct sr_instance;
+
+/* ----------------------------------------------------------------------------
+ * struct sr_io_frame
+ *
+ * One raw Ethernet frame on its way in or out.  Received frames stay
+ * owned by the backend until rx_done is called on them.  Backends that
+ * name interfaces on the wire translate to and from the index there.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_io_frame
+{
+    uint8_t*     buf;    /* start of the Ethernet header */
+    unsigned int len;    /* length of the frame */
+    int          ifindex; /* see sr_get_interface_idx(..) */
+    void*        priv;   /* backend cookie */
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_io_ops
+ *
+ * Operations a backend provides.  All return -1 on error.
+ *
+ *   open      attach to the backend (server "host:port", interface list ...)
+ *   discover  populate sr->if_list; may be left NULL if the backend learns
+ *             about interfaces in-band (VNSHWINFO)
+ *   rx_burst  receive up to max frames, blocking until at least one frame
+ *             or other event arrives; returns the number of frames (may be
+ *             0), -1 once the session is over
+ *   rx_done   give frames returned by rx_burst back to the backend
+ *   tx_burst  transmit n frames; returns the number sent
+ *   flush     push out what tx_burst queued while the router worked
+ *             through a burst; called at the end of each one, may be NULL
+ *   close     detach and free backend state
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_io_ops
+{
+    const char* name;
+    int  (*open)(struct sr_instance* , const char* );
+    int  (*discover)(struct sr_instance* );
+    int  (*rx_burst)(struct sr_instance* , struct sr_io_frame* , int );
+    void (*rx_done)(struct sr_instance* , struct sr_io_frame* , int );
+    int  (*tx_burst)(struct sr_instance* , struct sr_io_frame* , int );
+    void (*flush)(struct sr_instance* );
+    void (*close)(struct sr_instance* );
+};
+
+extern const struct sr_io_ops sr_io_vns;
+extern const struct sr_io_ops sr_io_vns_uring;
+extern const struct sr_io_ops sr_io_vns_shm;
+extern const struct sr_io_ops sr_io_afpacket;
+
+const struct sr_io_ops* sr_io_lookup(const char* name);
+int  sr_io_poll(struct sr_instance* );
+void sr_io_input(struct sr_instance* , struct sr_io_frame* );
+
+#endif /* -- SR_IO_H -- */
@@ -23,6 +23,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 
 #ifdef _LINUX_
@@ -32,6 +35,13 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_nat.h"
+#include "sr_io.h"
+#include "sr_capture.h"
+#include "sr_pbuf.h"
+#include "sr_slab.h"
+#include "sr_huge.h"
+#include "sr_mem.h"
 
 extern char* optarg;
 
@@ -47,12 +57,24 @@ extern char* optarg;
 #define DEFAULT_QUERY_TIMEOUT 60
 #define DEFAULT_EST_IDLE_TIMEOUT 7440
 #define DEFAULT_TR_IDLE_TIMEOUT 300
+#define DEFAULT_UDP_IDLE_TIMEOUT 300
 
 static void usage(char* );
 static void sr_init_instance(struct sr_instance* );
+static int  sr_start_reporter(int stop);
 static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static int  sr_parse_prefix(const char* spec, uint32_t* base, unsigned int* hosts);
+static int  sr_parse_pool(char* spec, uint32_t* pool, unsigned int* npool);
+static void sr_restore_nat(struct sr_nat* nat);
+
+/* -- reported on SIGUSR1 and checkpointed on SIGTERM/SIGINT, once up -- */
+static struct sr_nat* sr_report_nat = 0;
+
+/* -- the NAT checkpoint to restore once the interfaces are known -- */
+static char* sr_ckpt_path = 0;
+static int   sr_ckpt_interval = 0;
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -68,15 +90,33 @@ int main(int argc, char **argv)
     unsigned int port = DEFAULT_PORT;
     unsigned int topo = DEFAULT_TOPO;
     char *logfile = 0;
+    char *io_spec = "vns";
+    char io_arg[300];
+    int vns_session;
+    char *io_sep;
     struct sr_instance sr;
     struct sr_nat nat;
 	int nat_on = 0;
 	int qtimeout = DEFAULT_QUERY_TIMEOUT;
 	int est_it = DEFAULT_EST_IDLE_TIMEOUT;
 	int tr_it = DEFAULT_TR_IDLE_TIMEOUT;
+	int udp_it = DEFAULT_UDP_IDLE_TIMEOUT;
+	unsigned int nat_sessions = SR_NAT_SESSIONS;
+	int port_cooldown = SR_NAT_PORT_COOLDOWN;
+	unsigned int port_block = 0;
+	char *nat_logfile = 0;
+	char *det_prefix = 0;
+	uint32_t det_base = 0;
+	unsigned int det_hosts = 0;
+	char *ckpt_path = 0;
+	int ckpt_interval = SR_NAT_CKPT_INTERVAL;
+	int syn_rate = SR_NAT_SYN_RATE;
+	int syn_max = -1; /* sr_nat_init's, from the sessions expected */
+	uint32_t pool[SR_NAT_POOL_MAX];
+	unsigned int npool = 0, i;
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:n:I:E:R")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:nI:E:R:U:S:C:B:L:D:k:K:P:i:M:y:Y:")) != EOF)
     {
         switch (c)
         {
@@ -108,21 +148,130 @@ int main(int argc, char **argv)
             case 'T':
                 template = optarg;
                 break;
+            case 'i':
+                io_spec = optarg;
+                break;
             case 'n':
-				nat_on = 1;
-			case 'I':
-				qtimeout = atoi((char *) optarg);
-			case 'E':
-				est_it = atoi((char *) optarg);
-			case 'R':
-				tr_it = atoi((char *) optarg);
-				
+                nat_on = 1;
+                break;
+            case 'I':
+                qtimeout = atoi((char *) optarg);
+                break;
+            case 'E':
+                est_it = atoi((char *) optarg);
+                break;
+            case 'R':
+                tr_it = atoi((char *) optarg);
+                break;
+            case 'U':
+                udp_it = atoi((char *) optarg);
+                break;
+            case 'S':
+                nat_sessions = (unsigned int)atoi((char *) optarg);
+                break;
+            case 'C':
+                port_cooldown = atoi((char *) optarg);
+                break;
+            case 'B':
+                port_block = (unsigned int)atoi((char *) optarg);
+                /* -- whole blocks of whole shard slices tile the port range -- */
+                if (port_block % SR_NAT_SHARDS || port_block > SR_NAT_BLOCK_MAX ||
+                    (port_block && SR_PORTS_COUNT % port_block))
+                {
+                    fprintf(stderr, "Error: a port block is a multiple of %d ports,"
+                            " at most %d, dividing %d\n", SR_NAT_SHARDS,
+                            SR_NAT_BLOCK_MAX, SR_PORTS_COUNT);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'L':
+                nat_logfile = optarg;
+                break;
+            case 'D':
+                det_prefix = optarg;
+                if (sr_parse_prefix(optarg, &det_base, &det_hosts) != 0)
+                {
+                    fprintf(stderr, "Error: bad internal prefix %s\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'k':
+                ckpt_path = optarg;
+                break;
+            case 'P':
+                if (sr_parse_pool(optarg, pool, &npool) != 0)
+                {
+                    fprintf(stderr, "Error: bad NAT address pool %s\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'K':
+                ckpt_interval = atoi((char *) optarg);
+                break;
+            case 'y':
+                syn_rate = atoi((char *) optarg);
+                break;
+            case 'Y':
+                syn_max = atoi((char *) optarg);
+                break;
+            case 'M':
+                if (sr_mem_set_limits(optarg) != 0)
+                {
+                    fprintf(stderr, "Error: bad memory limits %s\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
         } /* switch */
     } /* -- while -- */
 
+    /* -- deterministic NAT: the largest block that gives every host one,
+          across all the pool's addresses -- */
+    if (det_prefix && port_block == 0)
+    {
+        for (port_block = SR_NAT_BLOCK_MAX; port_block >= SR_NAT_SHARDS;
+             port_block -= SR_NAT_SHARDS)
+        {
+            if (SR_PORTS_COUNT % port_block == 0 &&
+                SR_PORTS_COUNT / port_block * (npool ? npool : 1) >= det_hosts)
+            { break; }
+        }
+    }
+    if (det_prefix && (port_block < SR_NAT_SHARDS ||
+                       SR_PORTS_COUNT / port_block * (npool ? npool : 1) < det_hosts))
+    {
+        fprintf(stderr, "Error: %s has more hosts than port blocks\n", det_prefix);
+        exit(1);
+    }
+
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
 
+    /* -- before any other thread exists, so they all inherit the mask -- */
+    if (sr_start_reporter(nat_on && ckpt_path) != 0)
+    {
+        fprintf(stderr, "Error: can't start the signal reporter\n");
+        exit(1);
+    }
+
+    /* -- pick the packet I/O backend, "name[:argument]" -- */
+    if ((io_sep = strchr(io_spec, ':')) != 0)
+    { *io_sep++ = 0; }
+    if ((sr.io = sr_io_lookup(io_spec)) == 0)
+    {
+        fprintf(stderr, "Error: unknown I/O backend %s\n", io_spec);
+        usage(argv[0]);
+        exit(1);
+    }
+    vns_session = (strncmp(sr.io->name, "vns", 3) == 0);
+    if (vns_session)
+    { snprintf(io_arg, sizeof(io_arg), "%s:%u", server, port); }
+    else
+    { snprintf(io_arg, sizeof(io_arg), "%s", io_sep ? io_sep : ""); }
+
     /* -- set up routing table from file -- */
     if(template == NULL) {
         sr.template[0] = '\0';
@@ -149,16 +298,31 @@ int main(int argc, char **argv)
                     logfile);
             exit(1);
         }
+        sr.capture = sr_capture_open(sr.logfile, PACKET_DUMP_SIZE);
+        if(!sr.capture)
+        {
+            fprintf(stderr,"Error starting packet capture\n");
+            exit(1);
+        }
     }
 
-    Debug("Client %s connecting to Server %s:%d\n", sr.user, server, port);
-    if(template)
-        Debug("Requesting topology template %s\n", template);
-    else
-        Debug("Requesting topology %d\n", topo);
+    if (vns_session)
+    {
+        Debug("Client %s connecting to Server %s:%d\n", sr.user, server, port);
+        if(template)
+            Debug("Requesting topology template %s\n", template);
+        else
+            Debug("Requesting topology %d\n", topo);
+    }
+
+    /* -- every packet buffer the datapath will use -- */
+    if(sr_pbuf_pool_init(SR_PBUF_COUNT) != 0)
+    {
+        return 1;
+    }
 
     /* connect to server and negotiate session */
-    if(sr_connect_to_server(&sr,port,server) == -1)
+    if(sr.io->open(&sr, io_arg) == -1)
     {
         return 1;
     }
@@ -172,21 +336,76 @@ int main(int argc, char **argv)
       sr_load_rt_wrap(&sr, rtable);
     }
 
+    /* backends that don't announce interfaces in-band list them now */
+    if(sr.io->discover && sr.io->discover(&sr) != 0)
+    {
+        return 1;
+    }
+
     /* call router init (for arp subsystem etc.) */
     sr_init(&sr);
 
 	if (nat_on) {
-		sr_nat_init(&nat)		
-		if(!nat) {
+		if (sr_nat_init(&nat, nat_sessions, NULL) != 0) {
 			fprintf(stderr, "Error:NAT init failed.(sr_main.c)\n");
-			return;
+			return 1;
+		}
+		nat.sr = &sr;
+		nat.qtimeout = qtimeout;
+		nat.est_it = est_it;
+		nat.tr_it = tr_it;
+		nat.udp_it = udp_it;
+		nat.port_cooldown = port_cooldown;
+		nat.port_block = port_block;
+		nat.syn_rate = syn_rate > 0 ? syn_rate : 0;
+		nat.syn_burst = 2 * nat.syn_rate;
+		if (syn_max >= 0) {
+			nat.syn_max = syn_max;
+		}
+		for (i = 0; i < npool; i++) {
+			sr_nat_add_address(&nat, pool[i]);
+		}
+		if (det_prefix) {
+			if (sr_nat_deterministic(&nat, det_base, det_hosts) != 0) {
+				fprintf(stderr, "Error: deterministic NAT setup failed\n");
+				return 1;
+			}
+			printf("NAT: host %s + i maps to external ports %d + %u * (i %% %u),"
+				   " %u of them, on pool address i / %u\n", det_prefix, SR_PORTS_LO,
+				   port_block, SR_PORTS_COUNT / port_block, port_block,
+				   SR_PORTS_COUNT / port_block);
+		}
+		if (nat_logfile) {
+			if ((nat.log = fopen(nat_logfile, "a")) == NULL) {
+				fprintf(stderr, "Error opening NAT log %s\n", nat_logfile);
+				return 1;
+			}
+			setvbuf(nat.log, NULL, _IOLBF, 0);
+		}
+		/* restored, and checkpointed from then on, once the interfaces
+		   (and so the NAT's address) are known: now if the backend listed
+		   them in discover, else when it announces them */
+		sr_ckpt_path = ckpt_path;
+		sr_ckpt_interval = ckpt_interval;
+		__atomic_store_n(&sr_report_nat, &nat, __ATOMIC_RELEASE);
+		sr.nat_reader = sr_nat_reader(&nat);
+		sr.nat = &nat;
+		if (sr.if_list) {
+			sr_restore_nat(&nat);
 		}
-		nat->qtimeout = qtimeout;
-		nat->est_it = est_it;
-		nat->tr_it = tr_it;
 	}
+
+    /* -- which of the big regions got huge pages -- */
+    sr_huge_report(stdout);
+
     /* -- whizbang main loop ;-) */
-    while( sr_read_from_server(&sr) == 1);
+    while( sr_io_poll(&sr) == 1);
+
+    /* -- the backend went away; keep the NAT's sessions for next time -- */
+    if (nat_on && nat.ckpt_path && sr_nat_save(&nat, nat.ckpt_path) != 0)
+    { fprintf(stderr, "Error: NAT checkpoint to %s failed\n", nat.ckpt_path); }
+    else if (nat_on && ckpt_path && nat.ckpt_path == 0)
+    { fprintf(stderr, "Error: no interfaces came up, NAT checkpoint %s unused\n", ckpt_path); }
 
     sr_destroy_instance(&sr);
 
@@ -206,8 +425,21 @@ static void usage(char* argv0)
     printf("           [-t topo id] [-r routing table] \n");
     printf("           [-l log file] [-n toggle NAT] [-I query timeout]\n");
     printf("           [-E TCP established idle timeout] [-R TCP transitory idle timeout]\n");
+    printf("           [-U UDP idle timeout]\n");
+    printf("           [-S expected NAT sessions, sizes the NAT tables]\n");
+    printf("           [-C seconds before a released NAT port is reused]\n");
+    printf("           [-B ports per host block, 0 (default) to allocate per session]\n");
+    printf("           [-L NAT log file, a line per mapping or per block]\n");
+    printf("           [-D internal prefix/len, deterministic NAT with a block per host]\n");
+    printf("           [-k NAT checkpoint file, restored at startup] [-K seconds between checkpoints]\n");
+    printf("           [-P NAT external addresses a.b.c.d,..., the external interface's by default]\n");
+    printf("           [-y TCP connections a source may open per second, 0 for no limit]\n");
+    printf("           [-Y half-open TCP connections kept before the oldest go, 0 for no cap]\n");
+    printf("           [-i I/O backend, vns (default), vns-uring, vns-shm or afpacket:if[=ip],if[=ip],...]\n");
+    printf("           [-M memory limits, e.g. arp=1m,nat=256m,rt=64k,io=16m]\n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
+    printf("   a server starting with / is the path of a Unix socket\n");
 } /* -- usage -- */
 
 /*-----------------------------------------------------------------------------
@@ -247,11 +479,25 @@ static void sr_destroy_instance(struct sr_instance* sr)
     /* REQUIRES */
     assert(sr);
 
+    if(sr->capture)
+    {
+        sr_capture_close(sr->capture);
+    }
+
     if(sr->logfile)
     {
         sr_dump_close(sr->logfile);
     }
 
+    if(sr->io)
+    {
+        sr->io->close(sr);
+    }
+
+    sr_pbuf_pool_destroy();
+    sr_slab_report(stderr);
+    sr_mem_report(stderr);
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -273,11 +519,71 @@ static void sr_init_instance(struct sr_instance* sr)
     sr->user[0] = 0;
     sr->host[0] = 0;
     sr->topo_id = 0;
+    sr->vns_caps = 0;
     sr->if_list = 0;
+    sr->if_count = 0;
     sr->routing_table = 0;
     sr->logfile = 0;
+    sr->capture = 0;
+    sr->io = 0;
+    sr->io_priv = 0;
+    sr->nat = 0;
+    sr->nat_reader = 0;
 } /* -- sr_init_instance -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_prefix(..)
+ * Scope: local
+ *
+ * "a.b.c.d/len" to its first address (host byte order) and the number of
+ * addresses it covers.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_parse_prefix(const char* spec, uint32_t* base, unsigned int* hosts)
+{
+    char addr[INET_ADDRSTRLEN];
+    const char* slash = strchr(spec, '/');
+    struct in_addr in;
+    int len;
+
+    if (slash == 0 || slash - spec >= (int)sizeof(addr))
+    { return -1; }
+    memcpy(addr, spec, slash - spec);
+    addr[slash - spec] = 0;
+    len = atoi(slash + 1);
+    if (inet_pton(AF_INET, addr, &in) != 1 || len < 16 || len > 32)
+    { return -1; }
+
+    *hosts = 1U << (32 - len);
+    *base  = ntohl(in.s_addr) & ~(*hosts - 1);
+    return 0;
+} /* -- sr_parse_prefix -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_pool(..)
+ * Scope: local
+ *
+ * "a.b.c.d,a.b.c.d,..." to at most SR_NAT_POOL_MAX addresses (network
+ * byte order).
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_parse_pool(char* spec, uint32_t* pool, unsigned int* npool)
+{
+    char* tok;
+    struct in_addr in;
+
+    *npool = 0;
+    for (tok = strtok(spec, ","); tok; tok = strtok(0, ","))
+    {
+        if (*npool == SR_NAT_POOL_MAX || inet_pton(AF_INET, tok, &in) != 1)
+        { return -1; }
+        pool[(*npool)++] = in.s_addr;
+    }
+    return *npool ? 0 : -1;
+} /* -- sr_parse_pool -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_verify_routing_table()
  * Scope: Global
@@ -326,9 +632,44 @@ int sr_verify_routing_table(struct sr_instance* sr)
         rt_walker = rt_walker->next;
     } /* -- while -- */
 
+    /* -- the interfaces are in, before any packet: if the NAT is already
+          up (backends that announce interfaces in-band), its sessions can
+          come back now -- */
+    if (ret == 0 && sr->nat)
+    { sr_restore_nat(sr->nat); }
+
     return ret;
 } /* -- sr_verify_routing_table -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_restore_nat(..)
+ * Scope: Local
+ *
+ * Restore the -k checkpoint, if any, and start checkpointing to it.  This
+ * waits for the interfaces because, with no -P pool, the NAT's address is
+ * the external interface's; sessions saved on any other address are
+ * dropped.  Exits if the checkpoint is there but can't be used.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_restore_nat(struct sr_nat* nat)
+{
+    int restored;
+
+    if (sr_ckpt_path == 0 || nat->ckpt_path)
+    { return; }
+
+    if ((restored = sr_nat_restore(nat, sr_ckpt_path)) >= 0)
+    { printf("NAT: restored %d mappings from %s\n", restored, sr_ckpt_path); }
+    else if (errno != ENOENT)
+    {
+        fprintf(stderr, "Error: can't restore NAT checkpoint %s\n", sr_ckpt_path);
+        exit(1);
+    }
+    nat->ckpt_interval = sr_ckpt_interval;
+    __atomic_store_n(&nat->ckpt_path, sr_ckpt_path, __ATOMIC_RELEASE);
+} /* -- sr_restore_nat -- */
+
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
     if(sr_load_rt(sr, rtable) != 0) {
         fprintf(stderr,"Error setting up routing table from file %s\n",
@@ -342,3 +683,60 @@ static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
     sr_print_routing_table(sr);
     printf("---------------------------------------------\n");
 }
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_reporter(..)
+ * Scope: Local
+ *
+ * Prints memory usage, and the NAT's use of its addresses, every time the
+ * router gets SIGUSR1.  With 'stop' it also takes SIGTERM and SIGINT,
+ * checkpointing the NAT before exiting.
+ *
+ *----------------------------------------------------------------------------*/
+
+static void* sr_reporter(void* arg)
+{
+    sigset_t* set = (sigset_t*)arg;
+    unsigned int in_use;
+    unsigned long failed;
+    struct sr_nat* nat;
+    int sig;
+
+    while (sigwait(set, &sig) == 0)
+    {
+        nat = __atomic_load_n(&sr_report_nat, __ATOMIC_ACQUIRE);
+        if (sig != SIGUSR1)
+        {
+            if (nat && nat->ckpt_path && sr_nat_save(nat, nat->ckpt_path) != 0)
+            { fprintf(stderr, "Error: NAT checkpoint to %s failed\n", nat->ckpt_path); }
+            exit(0);
+        }
+        sr_mem_report(stderr);
+        sr_slab_report(stderr);
+        sr_pbuf_stats(&in_use, &failed);
+        fprintf(stderr, "pbuf: %u in use, %lu failed allocations\n",
+                in_use, failed);
+        if (nat)
+        { sr_nat_report(nat, stderr); }
+    }
+    return 0;
+} /* -- sr_reporter -- */
+
+static int sr_start_reporter(int stop)
+{
+    static sigset_t set;
+    pthread_t thread;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (stop)
+    {
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+    }
+    if (pthread_sigmask(SIG_BLOCK, &set, 0) != 0 ||
+        pthread_create(&thread, 0, sr_reporter, &set) != 0)
+    { return -1; }
+    pthread_detach(thread);
+    return 0;
+} /* -- sr_start_reporter -- */
@@ -0,0 +1,211 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_mem.c
+ *
+ * Description:
+ *
+ * Memory accounting by subsystem, see sr_mem.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_mem.h"
+
+/* -- sr_mem_alloc(..) keeps the size and subsystem in front of the
+      block, in as much room as malloc(..) aligns to -- */
+#define SR_MEM_HDR 16
+
+struct sr_mem_acct
+{
+    const char*   name;
+    size_t        bytes;     /* live */
+    size_t        peak;
+    size_t        limit;     /* 0 for none */
+    unsigned long objects;   /* live allocations */
+    unsigned long refused;   /* charges over the limit */
+};
+
+static struct sr_mem_acct sr_mem_acct[SR_MEM_NSYS] =
+{
+    { "arp" }, { "nat" }, { "rt" }, { "io" }
+};
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_mem_charge(..)
+ * Scope: Global
+ *
+ * Account for one allocation of 'bytes' in subsystem 'sys'.  Returns 0,
+ * or -1 (and charges nothing) if it would exceed the ceiling.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_mem_charge(int sys, size_t bytes)
+{
+    struct sr_mem_acct* a;
+    size_t now, peak;
+
+    assert(sys >= 0 && sys < SR_MEM_NSYS);
+    a = &sr_mem_acct[sys];
+
+    now = __atomic_add_fetch(&a->bytes, bytes, __ATOMIC_RELAXED);
+    if (a->limit && now > a->limit)
+    {
+        __atomic_sub_fetch(&a->bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&a->refused, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    __atomic_add_fetch(&a->objects, 1, __ATOMIC_RELAXED);
+
+    peak = __atomic_load_n(&a->peak, __ATOMIC_RELAXED);
+    while (now > peak &&
+           !__atomic_compare_exchange_n(&a->peak, &peak, now, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    { }
+    return 0;
+} /* -- sr_mem_charge -- */
+
+void sr_mem_uncharge(int sys, size_t bytes)
+{
+    assert(sys >= 0 && sys < SR_MEM_NSYS);
+
+    __atomic_sub_fetch(&sr_mem_acct[sys].bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&sr_mem_acct[sys].objects, 1, __ATOMIC_RELAXED);
+} /* -- sr_mem_uncharge -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_mem_alloc(..)
+ * Scope: Global
+ *
+ * malloc(..) charged to 'sys'; 0 if refused or out of memory.  Give it
+ * back with sr_mem_free(..).
+ *
+ *---------------------------------------------------------------------------*/
+
+void* sr_mem_alloc(int sys, size_t size)
+{
+    char* mem;
+
+    if (sr_mem_charge(sys, size) != 0)
+    { return 0; }
+    if ((mem = (char*)malloc(SR_MEM_HDR + size)) == 0)
+    {
+        sr_mem_uncharge(sys, size);
+        return 0;
+    }
+    *(size_t*)mem = size;
+    *(int*)(mem + sizeof(size_t)) = sys;
+    return mem + SR_MEM_HDR;
+} /* -- sr_mem_alloc -- */
+
+void* sr_mem_calloc(int sys, size_t size)
+{
+    void* mem;
+
+    if ((mem = sr_mem_alloc(sys, size)) != 0)
+    { memset(mem, 0, size); }
+    return mem;
+} /* -- sr_mem_calloc -- */
+
+void sr_mem_free(void* mem)
+{
+    char* hdr;
+
+    if (!mem)
+    { return; }
+    hdr = (char*)mem - SR_MEM_HDR;
+    sr_mem_uncharge(*(int*)(hdr + sizeof(size_t)), *(size_t*)hdr);
+    free(hdr);
+} /* -- sr_mem_free -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_mem_set_limits(..)
+ * Scope: Global
+ *
+ * Set ceilings from "sys=size[,sys=size...]", sizes in bytes with an
+ * optional k, m or g suffix, e.g. "arp=1m,nat=256m".  0 lifts a ceiling.
+ * Returns -1 if the spec doesn't parse.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_mem_set_limits(const char* spec)
+{
+    char name[16];
+    char* end;
+    unsigned long size;
+    size_t len;
+    int i;
+
+    while (*spec)
+    {
+        len = strcspn(spec, "=");
+        if (spec[len] != '=' || len == 0 || len >= sizeof(name))
+        { return -1; }
+        memcpy(name, spec, len);
+        name[len] = 0;
+        spec += len + 1;
+
+        size = strtoul(spec, &end, 10);
+        if (end == spec)
+        { return -1; }
+        switch (*end)
+        {
+            case 'g': case 'G': size <<= 10;
+            case 'm': case 'M': size <<= 10;
+            case 'k': case 'K': size <<= 10; end++;
+        }
+        if (*end != ',' && *end != 0)
+        { return -1; }
+        spec = (*end == ',') ? end + 1 : end;
+
+        for (i = 0; i < SR_MEM_NSYS; i++)
+        {
+            if (strcmp(sr_mem_acct[i].name, name) == 0)
+            { break; }
+        }
+        if (i == SR_MEM_NSYS)
+        { return -1; }
+        sr_mem_acct[i].limit = (size_t)size;
+    }
+    return 0;
+} /* -- sr_mem_set_limits -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_mem_bytes(..)
+ * Scope: Global
+ *
+ * Bytes charged to 'sys' right now.
+ *
+ *---------------------------------------------------------------------------*/
+
+size_t sr_mem_bytes(int sys)
+{
+    return __atomic_load_n(&sr_mem_acct[sys].bytes, __ATOMIC_RELAXED);
+} /* -- sr_mem_bytes -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_mem_report(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_mem_report(FILE* fp)
+{
+    struct sr_mem_acct* a;
+    int i;
+
+    fprintf(fp, "%-8s %12s %10s %12s %12s %10s\n", "memory", "bytes",
+            "allocs", "peak", "limit", "refused");
+    for (i = 0; i < SR_MEM_NSYS; i++)
+    {
+        a = &sr_mem_acct[i];
+        fprintf(fp, "%-8s %12lu %10lu %12lu %12lu %10lu\n", a->name,
+                (unsigned long)__atomic_load_n(&a->bytes, __ATOMIC_RELAXED),
+                __atomic_load_n(&a->objects, __ATOMIC_RELAXED),
+                (unsigned long)__atomic_load_n(&a->peak, __ATOMIC_RELAXED),
+                (unsigned long)a->limit,
+                __atomic_load_n(&a->refused, __ATOMIC_RELAXED));
+    }
+} /* -- sr_mem_report -- */
@@ -0,0 +1,54 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_mem.h
+ *
+ * Description:
+ *
+ * Memory accounting by subsystem.  Everything the ARP cache, the NAT,
+ * the routing table and the I/O backends allocate is charged to their
+ * subsystem, either through sr_mem_alloc(..) or, for object caches,
+ * through the sr_slab the object comes from.  Each subsystem keeps live
+ * byte and allocation counts and a high water mark, and may be given a
+ * ceiling (sr_mem_set_limits(..), the router's -M option).
+ *
+ * A charge that would take a subsystem over its ceiling is refused and
+ * counted; what that means is up to the subsystem:
+ *
+ *   arp  a new request, or a packet to queue on one, is dropped
+ *   nat  no new mapping or connection is created, the packet is dropped
+ *   rt   the routing entry is not added
+ *   io   a backend fails to open, or the session ends if a command can't
+ *        be buffered (the rest of the stream can't be framed without it)
+ *
+ * sr_mem_report(..) prints the counters; the router prints them on
+ * SIGUSR1.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_MEM_H
+#define SR_MEM_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+enum sr_mem_sys
+{
+    SR_MEM_ARP,
+    SR_MEM_NAT,
+    SR_MEM_RT,
+    SR_MEM_IO,
+    SR_MEM_NSYS
+};
+
+int   sr_mem_charge(int sys, size_t bytes);
+void  sr_mem_uncharge(int sys, size_t bytes);
+
+void* sr_mem_alloc(int sys, size_t size);
+void* sr_mem_calloc(int sys, size_t size);
+void  sr_mem_free(void* mem);
+
+size_t sr_mem_bytes(int sys);
+
+int   sr_mem_set_limits(const char* spec);
+void  sr_mem_report(FILE* fp);
+
+#endif /* -- SR_MEM_H -- */
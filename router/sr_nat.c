@@ -1,14 +1,661 @@
 
 #include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 #include <assert.h>
 #include "sr_nat.h"
 #include <unistd.h>
 
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_mem.h"
+#include "sr_huge.h"
+#include "sr_pktinfo.h"
+#include "sr_utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
 
+/* Shard and bucket of a mapping. The internal key hashes like a flow from
+   (ip_int, aux_int), its low bits picking the shard. The external port's
+   own low bits name its shard, and its hash the bucket there. In block
+   mode a host's mappings all go to one shard, the one its address hashes
+   to, and an external port to the shard of the block it's in. The
+   external index is keyed by address and port, so every address in the
+   pool has the whole port range. */
+static uint32_t sr_nat_hash_int(uint32_t ip_int, uint16_t aux_int,
+  sr_nat_mapping_type type) {
+  return sr_pktinfo_hash(ip_int, 0, type, aux_int, 0);
+}
+
+static uint32_t sr_nat_hash_host(uint32_t ip_int) {
+  return sr_pktinfo_hash(ip_int, 0, 0, 0, 0);
+}
+
+static int sr_nat_shard_int(struct sr_nat *nat, uint32_t ip_int, uint32_t h) {
+  if (nat->det_hosts) {
+    /* the shard of the block, by its index in its address */
+    return ((ntohl(ip_int) - nat->det_base) % (SR_PORTS_COUNT / nat->port_block)) &
+      (SR_NAT_SHARDS - 1);
+  }
+  if (nat->port_block) {
+    h = sr_nat_hash_host(ip_int);
+  }
+  return h & (SR_NAT_SHARDS - 1);
+}
+
+static int sr_nat_shard_ext(struct sr_nat *nat, uint16_t aux_ext) {
+  if (nat->port_block) {
+    return ((aux_ext - SR_PORTS_LO) / (int)nat->port_block) & (SR_NAT_SHARDS - 1);
+  }
+  return aux_ext & (SR_NAT_SHARDS - 1);
+}
+
+static uint32_t sr_nat_bucket_ext(struct sr_nat *nat, uint32_t ip_ext,
+  uint16_t aux_ext, sr_nat_mapping_type type) {
+  return sr_pktinfo_hash(ip_ext, 0, type, 0, aux_ext) & nat->hash_mask;
+}
+
+/* Deterministic mode: the external index slot of a port of the pool's
+   address 'index'. */
+static struct sr_nat_mapping **sr_nat_det_slot(struct sr_nat *nat,
+  unsigned int index, sr_nat_mapping_type type, uint16_t aux_ext) {
+  return &nat->det_slots[(index * SR_NAT_NTYPES + type) * SR_PORTS_COUNT +
+                         aux_ext - SR_PORTS_LO];
+}
+
+/* A connection's bucket in its mapping's shard, from the whole 5-tuple. */
+static uint32_t sr_nat_bucket_conn(struct sr_nat *nat, uint32_t ip_int,
+  uint16_t port_int, uint32_t ip_rem, uint16_t port_rem) {
+  return sr_pktinfo_hash(ip_int, ip_rem, ip_protocol_tcp, port_int, port_rem) &
+    nat->hash_mask;
+}
+
+/* Timeout queue primitives.  A queue is a circular list through its head;
+   an entry that's on no queue links to itself. */
+#define SR_NAT_ENTRY(link, type, member) \
+  ((type *)((char *)(link) - offsetof(type, member)))
+
+static void sr_nat_qinit(struct sr_nat_qlink *link) {
+  link->prev = link->next = link;
+}
+
+static void sr_nat_qdel(struct sr_nat_qlink *link) {
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  sr_nat_qinit(link);
+}
+
+/* Move 'link' to the tail of 'queue'. */
+static void sr_nat_qtail(struct sr_nat_qlink *queue, struct sr_nat_qlink *link,
+  time_t now) {
+  sr_nat_qdel(link);
+  link->prev = queue->prev;
+  link->next = queue;
+  link->queued = now;
+  queue->prev->next = link;
+  queue->prev = link;
+}
+
+/* The NAT's idea of the time, see sr_nat.h. */
+static time_t sr_nat_now(struct sr_nat *nat) {
+  return nat->clock(NULL);
+}
+
+/* Shard locking. Built with SR_NAT_LOCK_STATS, each hold is also timed
+   into the shard's histogram. */
+static void sr_nat_lock(struct sr_nat_shard *shard) {
+  pthread_mutex_lock(&(shard->lock));
+#ifdef SR_NAT_LOCK_STATS
+  clock_gettime(CLOCK_MONOTONIC, &shard->locked_at);
+#endif
+}
+
+static void sr_nat_unlock(struct sr_nat_shard *shard) {
+#ifdef SR_NAT_LOCK_STATS
+  struct timespec ts;
+  uint64_t ns;
+  int b = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ns = (uint64_t)(ts.tv_sec - shard->locked_at.tv_sec) * 1000000000 +
+    ts.tv_nsec - shard->locked_at.tv_nsec;
+  while (b < SR_NAT_LOCK_HIST - 1 && (ns >> (b + 1)) != 0) {
+    b++;
+  }
+  shard->lock_hist[b]++;
+  shard->lock_ns += ns;
+  if (ns > shard->lock_max_ns) {
+    shard->lock_max_ns = ns;
+  }
+#endif
+  pthread_mutex_unlock(&(shard->lock));
+}
+
+/* Put a mapping on the queue for its timeout class. One with connections
+   lives as long as they do and sits on no queue. Caller holds the lock. */
+static void sr_nat_enqueue(struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping, time_t now) {
+  if (mapping->type == nat_mapping_icmp) {
+    sr_nat_qtail(&shard->queues[nat_queue_query], &mapping->lru, now);
+  } else if (mapping->type == nat_mapping_udp) {
+    sr_nat_qtail(&shard->queues[nat_queue_udp], &mapping->lru, now);
+  } else if (mapping->nconns == 0) {
+    sr_nat_qtail(&shard->queues[nat_queue_unused], &mapping->lru, now);
+  }
+}
+
+/* Note activity on a mapping. Readers don't requeue; the timeout thread
+   does that when it finds the mapping at a queue head still in use. */
+static void sr_nat_touch(struct sr_nat_mapping *mapping, time_t now) {
+  if (__atomic_load_n(&mapping->last_updated, __ATOMIC_RELAXED) != now) {
+    __atomic_store_n(&mapping->last_updated, now, __ATOMIC_RELAXED);
+  }
+}
+
+/* Epoch callbacks: nothing can reach these any more. */
+static void sr_nat_free_conn(void *arg, struct sr_epoch_node *node) {
+  struct sr_nat *nat = (struct sr_nat *)arg;
+  sr_slab_free(&(nat->conn_slab),
+               SR_NAT_ENTRY(node, struct sr_nat_connection, retire));
+}
+
+static void sr_nat_free_mapping(void *arg, struct sr_epoch_node *node) {
+  struct sr_nat *nat = (struct sr_nat *)arg;
+  sr_slab_free(&(nat->mapping_slab),
+               SR_NAT_ENTRY(node, struct sr_nat_mapping, retire));
+}
+
+/* The external address 'ip', made on first use. NULL if the NAT's memory
+   ceiling won't allow it. */
+static struct sr_nat_addr *sr_nat_addr(struct sr_nat *nat, uint32_t ip) {
+  struct sr_nat_addr *addr;
+
+  /* addresses are only ever added, at the front, so the list can be
+     searched without the lock; it's only needed to add one */
+  for (addr = __atomic_load_n(&nat->addrs, __ATOMIC_ACQUIRE); addr;
+       addr = addr->next) {
+    if (addr->ip == ip) {
+      break;
+    }
+  }
+  if (addr == NULL) {
+    pthread_mutex_lock(&(nat->lock));
+    for (addr = nat->addrs; addr; addr = addr->next) {
+      if (addr->ip == ip) {
+        break;
+      }
+    }
+    if (addr == NULL) {
+      if ((addr = sr_mem_calloc(SR_MEM_NAT, sizeof(struct sr_nat_addr))) == NULL) {
+        pthread_mutex_unlock(&(nat->lock));
+        return NULL;
+      }
+      addr->ip = ip;
+      addr->index = SR_NAT_POOL_MAX; /* until it's in the pool */
+      addr->next = nat->addrs;
+      __atomic_store_n(&nat->addrs, addr, __ATOMIC_RELEASE);
+      nat->naddrs++;
+    }
+    pthread_mutex_unlock(&(nat->lock));
+  }
+  return addr;
+}
+
+/* The pool's address 'ip', or NULL. The pool only grows, at its end. */
+static struct sr_nat_addr *sr_nat_pool_find(struct sr_nat *nat, uint32_t ip) {
+  unsigned int i, npool = __atomic_load_n(&nat->npool, __ATOMIC_ACQUIRE);
+
+  for (i = 0; i < npool; i++) {
+    if (nat->pool[i]->ip == ip) {
+      return nat->pool[i];
+    }
+  }
+  return NULL;
+}
+
+int sr_nat_add_address(struct sr_nat *nat, uint32_t ip) {
+  struct sr_nat_addr *addr;
+  int ret = 0;
+
+  pthread_mutex_lock(&(nat->lock));
+  if (sr_nat_pool_find(nat, ip) == NULL) {
+    if (nat->npool == SR_NAT_POOL_MAX || (addr = sr_nat_addr(nat, ip)) == NULL) {
+      ret = -1;
+    } else {
+      addr->index = nat->npool;
+      nat->pool[nat->npool] = addr;
+      __atomic_store_n(&nat->npool, nat->npool + 1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&(nat->lock));
+  return ret;
+}
+
+int sr_nat_owns(struct sr_nat *nat, uint32_t ip) {
+  return sr_nat_pool_find(nat, ip) != NULL;
+}
+
+/* How many addresses the pool has, putting the external interface's in it
+   if none were added. 0 while that isn't known yet. */
+static unsigned int sr_nat_pool(struct sr_nat *nat) {
+  unsigned int npool = __atomic_load_n(&nat->npool, __ATOMIC_ACQUIRE);
+  struct sr_if *ext_iface;
+
+  if (npool == 0 && nat->sr &&
+      (ext_iface = sr_get_interface(nat->sr, nat->out_if_name)) != NULL &&
+      sr_nat_add_address(nat, ext_iface->ip) == 0) {
+    npool = __atomic_load_n(&nat->npool, __ATOMIC_ACQUIRE);
+  }
+  return npool;
+}
+
+/* The least loaded of the pool's addresses, by ports in use (or held in
+   blocks). Ties go to the one the host hashes nearest, so new hosts
+   spread even when the pool is idle. */
+static struct sr_nat_addr *sr_nat_pick(struct sr_nat *nat, uint32_t ip_int,
+  unsigned int npool) {
+  unsigned int i, load, least = UINT_MAX;
+  unsigned int start = sr_nat_hash_host(ip_int) % npool;
+  struct sr_nat_addr *addr, *best = NULL;
+
+  for (i = 0; i < npool; i++) {
+    addr = nat->pool[(start + i) % npool];
+    load = nat->port_block ?
+      __atomic_load_n(&addr->hosts, __ATOMIC_RELAXED) * nat->port_block :
+      __atomic_load_n(&addr->in_use, __ATOMIC_RELAXED);
+    if (load < least) {
+      least = load;
+      best = addr;
+    }
+  }
+  return best;
+}
+
+/* Per mapping mode: the address a new mapping of host 'ip_int' goes on,
+   the one the host is paired with. A new host is paired with 'want', or
+   the least loaded address if that's NULL; a host paired elsewhere gets
+   NULL. With a pool of one there's nothing to pair. Each address handed
+   out is given back with sr_nat_unpair(..). */
+static struct sr_nat_addr *sr_nat_pair(struct sr_nat *nat, uint32_t ip_int,
+  struct sr_nat_addr *want) {
+  unsigned int npool = sr_nat_pool(nat);
+  uint32_t hh = sr_nat_hash_host(ip_int);
+  struct sr_nat_pairs *pairs = &nat->pairs[hh & (SR_NAT_SHARDS - 1)];
+  struct sr_nat_pair **head = &pairs->buckets[(hh >> SR_NAT_SHARD_BITS) &
+                                              (SR_NAT_PAIR_BUCKETS - 1)];
+  struct sr_nat_pair *pair;
+  struct sr_nat_addr *addr = NULL;
+
+  if (npool <= 1) {
+    return (npool && (want == NULL || want == nat->pool[0])) ? nat->pool[0] : NULL;
+  }
+
+  pthread_mutex_lock(&(pairs->lock));
+  for (pair = *head; pair; pair = pair->next_hash) {
+    if (pair->ip_int == ip_int) {
+      break;
+    }
+  }
+  if (pair) {
+    if (want == NULL || pair->addr == want) {
+      pair->nmappings++;
+      addr = pair->addr;
+    }
+  } else if ((pair = sr_slab_alloc(&(nat->pair_slab))) != NULL) {
+    pair->ip_int = ip_int;
+    pair->addr = want ? want : sr_nat_pick(nat, ip_int, npool);
+    pair->nmappings = 1;
+    pair->next_hash = *head;
+    *head = pair;
+    __atomic_add_fetch(&pair->addr->hosts, 1, __ATOMIC_RELAXED);
+    addr = pair->addr;
+  }
+  pthread_mutex_unlock(&(pairs->lock));
+  return addr;
+}
+
+static void sr_nat_unpair(struct sr_nat *nat, uint32_t ip_int) {
+  uint32_t hh = sr_nat_hash_host(ip_int);
+  struct sr_nat_pairs *pairs = &nat->pairs[hh & (SR_NAT_SHARDS - 1)];
+  struct sr_nat_pair **pp = &pairs->buckets[(hh >> SR_NAT_SHARD_BITS) &
+                                            (SR_NAT_PAIR_BUCKETS - 1)];
+  struct sr_nat_pair *pair;
+
+  if (__atomic_load_n(&nat->npool, __ATOMIC_ACQUIRE) <= 1) {
+    return;
+  }
+  pthread_mutex_lock(&(pairs->lock));
+  while (*pp && (*pp)->ip_int != ip_int) {
+    pp = &(*pp)->next_hash;
+  }
+  /* a mapping made while the pool had one address has no pair */
+  if ((pair = *pp) != NULL && --pair->nmappings == 0) {
+    *pp = pair->next_hash;
+    __atomic_sub_fetch(&pair->addr->hosts, 1, __ATOMIC_RELAXED);
+    sr_slab_free(&(nat->pair_slab), pair);
+  }
+  pthread_mutex_unlock(&(pairs->lock));
+}
+
+/* A port space for the NAT, seeded from what it's for. */
+static struct sr_ports *sr_nat_space(struct sr_nat *nat, uint16_t first,
+  uint16_t stride, uint32_t seed) {
+  struct sr_ports *ports = sr_mem_alloc(SR_MEM_NAT, sizeof(struct sr_ports));
+  if (ports == NULL) {
+    return NULL;
+  }
+  if (sr_ports_init(ports, first, stride, nat->port_cooldown,
+                    seed ^ (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 8)) != 0) {
+    sr_mem_free(ports);
+    return NULL;
+  }
+  return ports;
+}
+
+/* Shard 'shard_idx's port space for 'type' on an external address, made
+   on first use. NULL if the NAT's memory ceiling won't allow it. Caller
+   holds the shard lock. */
+static struct sr_ports *sr_nat_ports(struct sr_nat *nat, struct sr_nat_addr *addr,
+  sr_nat_mapping_type type, int shard_idx) {
+  if (addr->ports[shard_idx][type] == NULL) {
+    addr->ports[shard_idx][type] =
+      sr_nat_space(nat, SR_PORTS_LO + shard_idx, SR_NAT_SHARDS,
+                   addr->ip ^ ((uint32_t)type << 24) ^ ((uint32_t)shard_idx << 16));
+  }
+  return addr->ports[shard_idx][type];
+}
 
-int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
+/* Log a mapping, or in block mode a host's block, coming or going. */
+static void sr_nat_log_mapping(struct sr_nat *nat, const char *event,
+  struct sr_nat_mapping *mapping, time_t now) {
+  static const char *types[SR_NAT_NTYPES] = { "icmp", "tcp", "udp" };
+  char ip_int[INET_ADDRSTRLEN], ip_ext[INET_ADDRSTRLEN];
+
+  if (nat->log) {
+    inet_ntop(AF_INET, &mapping->ip_int, ip_int, sizeof(ip_int));
+    inet_ntop(AF_INET, &mapping->ip_ext, ip_ext, sizeof(ip_ext));
+    fprintf(nat->log, "%ld %s %s %s:%u %s:%u\n", (long)now, event,
+            types[mapping->type], ip_int, mapping->aux_int, ip_ext,
+            mapping->aux_ext);
+  }
+}
+
+static void sr_nat_log_block(struct sr_nat *nat, const char *event,
+  struct sr_nat_host *host, time_t now) {
+  char ip_int[INET_ADDRSTRLEN], ip_ext[INET_ADDRSTRLEN];
+
+  if (nat->log) {
+    inet_ntop(AF_INET, &host->ip_int, ip_int, sizeof(ip_int));
+    inet_ntop(AF_INET, &host->addr->ip, ip_ext, sizeof(ip_ext));
+    fprintf(nat->log, "%ld %s %s %s:%u-%u\n", (long)now, event, ip_int,
+            ip_ext, host->first, host->first + nat->port_block - 1);
+  }
+}
+
+/* Block mode: the host 'ip_int' of shard 'shard_idx', given a block when
+   it has none: on 'addr', or the least loaded address if that's NULL, the
+   block starting at 'want', or any if 'want' is -1. NULL if no such block
+   is free, or the host holds another. Caller holds the shard lock. */
+static struct sr_nat_host *sr_nat_host(struct sr_nat *nat,
+  struct sr_nat_shard *shard, int shard_idx, struct sr_nat_addr *addr,
+  uint32_t ip_int, int want, time_t now) {
+  struct sr_nat_host **head = &shard->hosts[(sr_nat_hash_host(ip_int) >>
+                                             SR_NAT_SHARD_BITS) &
+                                            (SR_NAT_HOST_BUCKETS - 1)];
+  struct sr_nat_host *host;
+  unsigned int npool, off, nblocks = SR_PORTS_COUNT / nat->port_block;
+  int first;
+
+  for (host = *head; host; host = host->next_hash) {
+    if (host->ip_int == ip_int) {
+      return ((want < 0 || host->first == want) &&
+              (addr == NULL || host->addr == addr)) ? host : NULL;
+    }
+  }
+
+  if ((npool = sr_nat_pool(nat)) == 0) {
+    return NULL;
+  }
+  if (nat->det_hosts) {
+    /* the block is the host's by its address, nothing to hand out: the
+       first addresses' blocks go to the first hosts, and so on */
+    off = ntohl(ip_int) - nat->det_base;
+    if (off >= nat->det_hosts || off / nblocks >= npool ||
+        (addr && addr != nat->pool[off / nblocks])) {
+      return NULL;
+    }
+    addr = nat->pool[off / nblocks];
+    first = SR_PORTS_LO + (off % nblocks) * nat->port_block;
+  } else {
+    if (addr == NULL) {
+      addr = sr_nat_pick(nat, ip_int, npool);
+    }
+    if (addr->blocks[shard_idx] == NULL) {
+      addr->blocks[shard_idx] =
+        sr_nat_space(nat, SR_PORTS_LO + shard_idx * nat->port_block,
+                     SR_NAT_SHARDS * nat->port_block,
+                     addr->ip ^ ((uint32_t)SR_NAT_NTYPES << 24) ^
+                     ((uint32_t)shard_idx << 16));
+      if (addr->blocks[shard_idx] == NULL) {
+        return NULL;
+      }
+    }
+  }
+  if (nat->det_hosts) {
+    if (want >= 0 && want != first) {
+      return NULL;
+    }
+  } else if (want >= 0) {
+    if (sr_ports_take(addr->blocks[shard_idx], (uint16_t)want) != 0) {
+      return NULL;
+    }
+    first = want;
+  } else if ((first = sr_ports_alloc(addr->blocks[shard_idx], now)) < 0) {
+    __atomic_add_fetch(&addr->failed, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  if ((host = sr_slab_alloc(&(nat->host_slab))) == NULL) {
+    if (!nat->det_hosts) {
+      sr_ports_release(addr->blocks[shard_idx], (uint16_t)first, now);
+    }
+    return NULL;
+  }
+  memset(host, 0, sizeof(*host));
+  host->ip_int = ip_int;
+  host->addr = addr;
+  host->first = (uint16_t)first;
+  host->next_hash = *head;
+  *head = host;
+  __atomic_add_fetch(&addr->hosts, 1, __ATOMIC_RELAXED);
+  if (!nat->det_hosts) {
+    sr_nat_log_block(nat, "BLOCK", host, now);
+  }
+  return host;
+}
+
+/* A free port of 'type' in a host's block, or -1 once they're all taken.
+   The search starts after the last one handed out, so a port just given
+   back isn't reused at once. Caller holds the shard lock. */
+static int sr_nat_host_alloc(struct sr_nat *nat, struct sr_nat_host *host,
+  sr_nat_mapping_type type) {
+  unsigned int n, off;
+  uint64_t *used = host->used[type];
+
+  for (n = 0; n < nat->port_block; n++) {
+    off = (host->next[type] + n) % nat->port_block;
+    if (!(used[off / 64] & (1ULL << (off % 64)))) {
+      used[off / 64] |= 1ULL << (off % 64);
+      host->next[type] = (uint16_t)((off + 1) % nat->port_block);
+      host->nmappings++;
+      return host->first + off;
+    }
+  }
+  return -1;
+}
+
+/* Claim a particular port of 'type' in a host's block. Returns 0, or -1
+   if it's taken or not in the block. Caller holds the shard lock. */
+static int sr_nat_host_take(struct sr_nat *nat, struct sr_nat_host *host,
+  sr_nat_mapping_type type, uint16_t port) {
+  unsigned int off = port - host->first;
+
+  if (port < host->first || off >= nat->port_block ||
+      (host->used[type][off / 64] & (1ULL << (off % 64)))) {
+    return -1;
+  }
+  host->used[type][off / 64] |= 1ULL << (off % 64);
+  host->nmappings++;
+  return 0;
+}
+
+/* Give back an external port: to its shard's space, or to its host's
+   block, which goes back with the host's last port. Caller holds the
+   shard lock. */
+static void sr_nat_release_port(struct sr_nat *nat, struct sr_nat_shard *shard,
+  int shard_idx, struct sr_nat_addr *addr, struct sr_nat_host *host,
+  sr_nat_mapping_type type, uint16_t port, time_t now) {
+  struct sr_nat_host **pp;
+  unsigned int off;
+
+  if (host == NULL) {
+    sr_ports_release(addr->ports[shard_idx][type], port, now);
+    return;
+  }
+
+  off = port - host->first;
+  assert(host->used[type][off / 64] & (1ULL << (off % 64)));
+  host->used[type][off / 64] &= ~(1ULL << (off % 64));
+  if (--host->nmappings > 0) {
+    return;
+  }
+
+  pp = &shard->hosts[(sr_nat_hash_host(host->ip_int) >> SR_NAT_SHARD_BITS) &
+                     (SR_NAT_HOST_BUCKETS - 1)];
+  while (*pp != host) {
+    pp = &(*pp)->next_hash;
+  }
+  *pp = host->next_hash;
+  __atomic_sub_fetch(&addr->hosts, 1, __ATOMIC_RELAXED);
+  if (!nat->det_hosts) {
+    sr_nat_log_block(nat, "UNBLOCK", host, now);
+    sr_ports_release(addr->blocks[shard_idx], host->first, now);
+  }
+  sr_slab_free(&(nat->host_slab), host);
+}
+
+/* Link a new mapping into its shard's list and both indexes, publishing it
+   to readers last. Caller holds the shard lock. */
+static void sr_nat_link(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping, uint32_t h) {
+  struct sr_nat_mapping **head;
+
+  mapping->prev = NULL;
+  mapping->next = shard->mappings; /* add to front of table */
+  if (shard->mappings) {
+    shard->mappings->prev = mapping;
+  }
+  shard->mappings = mapping;
+
+  head = &shard->by_int[(h >> SR_NAT_SHARD_BITS) & nat->hash_mask];
+  mapping->next_int = *head;
+  __atomic_store_n(head, mapping, __ATOMIC_RELEASE);
+
+  if (nat->det_slots) {
+    __atomic_store_n(sr_nat_det_slot(nat, mapping->addr->index, mapping->type,
+                                     mapping->aux_ext),
+                     mapping, __ATOMIC_RELEASE);
+  } else {
+    head = &shard->by_ext[sr_nat_bucket_ext(nat, mapping->ip_ext, mapping->aux_ext,
+                                            mapping->type)];
+    mapping->next_ext = *head;
+    __atomic_store_n(head, mapping, __ATOMIC_RELEASE);
+  }
+
+  __atomic_add_fetch(&nat->nmappings, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&mapping->addr->in_use, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&mapping->addr->allocs, 1, __ATOMIC_RELAXED);
+}
+
+/* Take a mapping out of its shard's list and both indexes and release its
+   port; it's freed once no reader can hold it. Readers already on it can
+   still follow its chain links, which are left alone. It has no
+   connections left. Caller holds the shard lock. */
+static void sr_nat_unlink(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping, time_t now) {
+  struct sr_nat_mapping **pp;
+  uint32_t h = sr_nat_hash_int(mapping->ip_int, mapping->aux_int, mapping->type);
+
+  if (mapping->prev) {
+    mapping->prev->next = mapping->next;
+  } else {
+    shard->mappings = mapping->next;
+  }
+  if (mapping->next) {
+    mapping->next->prev = mapping->prev;
+  }
+
+  pp = &shard->by_int[(h >> SR_NAT_SHARD_BITS) & nat->hash_mask];
+  while (*pp != mapping) {
+    pp = &(*pp)->next_int;
+  }
+  __atomic_store_n(pp, mapping->next_int, __ATOMIC_RELEASE);
+
+  if (nat->det_slots) {
+    __atomic_store_n(sr_nat_det_slot(nat, mapping->addr->index, mapping->type,
+                                     mapping->aux_ext),
+                     NULL, __ATOMIC_RELEASE);
+  } else {
+    pp = &shard->by_ext[sr_nat_bucket_ext(nat, mapping->ip_ext, mapping->aux_ext,
+                                          mapping->type)];
+    while (*pp != mapping) {
+      pp = &(*pp)->next_ext;
+    }
+    __atomic_store_n(pp, mapping->next_ext, __ATOMIC_RELEASE);
+  }
+
+  sr_nat_qdel(&mapping->lru);
+  if (mapping->host == NULL) {
+    sr_nat_log_mapping(nat, "UNMAP", mapping, now);
+  }
+  sr_nat_release_port(nat, shard, mapping->shard, mapping->addr, mapping->host,
+                      mapping->type, mapping->aux_ext, now);
+  if (mapping->host == NULL) {
+    sr_nat_unpair(nat, mapping->ip_int);
+  }
+  __atomic_sub_fetch(&nat->nmappings, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&mapping->addr->in_use, 1, __ATOMIC_RELAXED);
+  sr_epoch_retire(&nat->epoch, &mapping->retire, sr_nat_free_mapping);
+}
+
+/* Take a connection out of the index and off its queue; it's freed once no
+   reader can hold it. Its mapping goes with its last connection. Caller
+   holds the shard lock. */
+static void sr_nat_unlink_conn(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_connection *conn, time_t now) {
+  struct sr_nat_connection **pp;
+  struct sr_nat_mapping *mapping = conn->mapping;
+
+  pp = &shard->by_conn[sr_nat_bucket_conn(nat, conn->ip_int, conn->port_int,
+                                          conn->ip_rem, conn->port_rem)];
+  while (*pp != conn) {
+    pp = &(*pp)->next_hash;
+  }
+  __atomic_store_n(pp, conn->next_hash, __ATOMIC_RELEASE);
+
+  sr_nat_qdel(&conn->lru);
+  if (SR_NAT_HALF_OPEN(conn->state)) {
+    shard->half_open--;
+  }
+  sr_epoch_retire(&nat->epoch, &conn->retire, sr_nat_free_conn);
+  if (--mapping->nconns == 0) {
+    sr_nat_unlink(nat, shard, mapping, now);
+  }
+}
+
+int sr_nat_init(struct sr_nat *nat, unsigned int sessions,
+  time_t (*clock)(time_t *)) { /* Initializes the nat */
 
   assert(nat);
 
@@ -17,183 +664,1256 @@ int sr_nat_init(struct sr_nat *nat) { /* Initializes the nat */
   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
   int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
 
-  /* Initialize timeout thread */
-
-  pthread_attr_init(&(nat->thread_attr));
-  pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
-  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, nat);
-
-  /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
-
-  nat->mappings = NULL;
+  nat->nmappings = 0;
   nat->qtimeout = 0;
   nat->est_it = 0;
   nat->tr_it = 0;
-  nat->ports_used = uint16_t[NUM_PORTS];
+  nat->udp_it = 0;
+  nat->port_cooldown = SR_NAT_PORT_COOLDOWN;
+  nat->port_block = 0;
+  nat->det_base = 0;
+  nat->det_hosts = 0;
+  nat->det_naddrs = 0;
+  nat->det_slots = NULL;
+  nat->ckpt_path = NULL;
+  nat->ckpt_interval = 0;
+  nat->clock = clock ? clock : time;
+  nat->ckpt_last = nat->clock(NULL);
+  pthread_mutex_init(&(nat->ckpt_lock), NULL);
+  nat->log = NULL;
+  nat->syn_rate = SR_NAT_SYN_RATE;
+  nat->syn_burst = 2 * SR_NAT_SYN_RATE;
+  nat->syn_limited = 0;
+  nat->syn_evicted = 0;
+  nat->addrs = NULL;
+  nat->naddrs = 0;
+  nat->npool = 0;
+  memset(nat->pool, 0, sizeof(nat->pool));
+  if (sr_epoch_init(&(nat->epoch), nat) != 0) {
+    return -1;
+  }
+
+  /* one bucket per expected mapping in each index, rounded up to a power
+     of two and split between the shards, so chains stay about one long */
+  if (sessions == 0) {
+    sessions = SR_NAT_SESSIONS;
+  }
+  uint32_t buckets = 1;
+  while (buckets * SR_NAT_SHARDS < sessions) {
+    buckets <<= 1;
+  }
+  nat->hash_mask = buckets - 1;
+
+  size_t index_bytes = 3 * SR_NAT_SHARDS * buckets * sizeof(struct sr_nat_mapping *);
+  struct sr_nat_mapping **index = NULL;
+  if (sr_mem_charge(SR_MEM_NAT, index_bytes) == 0) {
+    index = sr_huge_alloc("nat_index", index_bytes);
+    if (index == NULL) {
+      sr_mem_uncharge(SR_MEM_NAT, index_bytes);
+    }
+  }
+  if (index == NULL) {
+    return -1;
+  }
+
+  int shard_idx, queue;
+  for (shard_idx = 0; shard_idx < SR_NAT_SHARDS; shard_idx++) {
+    struct sr_nat_shard *shard = &nat->shards[shard_idx];
+    pthread_mutex_init(&(shard->lock), NULL);
+    pthread_mutex_init(&(nat->syn_locks[shard_idx]), NULL);
+    shard->half_open = 0;
+    memset(shard->lock_hist, 0, sizeof(shard->lock_hist));
+    shard->lock_ns = 0;
+    shard->lock_max_ns = 0;
+    shard->by_int = index + (3 * shard_idx) * buckets;
+    shard->by_ext = index + (3 * shard_idx + 1) * buckets;
+    shard->by_conn = (struct sr_nat_connection **)(index + (3 * shard_idx + 2) * buckets);
+    shard->mappings = NULL;
+    memset(shard->hosts, 0, sizeof(shard->hosts));
+    for (queue = 0; queue < nat_nqueues; queue++) {
+      sr_nat_qinit(&shard->queues[queue]);
+    }
+    pthread_mutex_init(&(nat->pairs[shard_idx].lock), NULL);
+    memset(nat->pairs[shard_idx].buckets, 0, sizeof(nat->pairs[shard_idx].buckets));
+  }
+
+  if (sr_slab_init(&(nat->mapping_slab), "nat_mapping", SR_MEM_NAT,
+                   sizeof(struct sr_nat_mapping), sessions, SR_SLAB_PREALLOC) != 0 ||
+      sr_slab_init(&(nat->conn_slab), "nat_connection", SR_MEM_NAT,
+                   sizeof(struct sr_nat_connection),
+                   sessions > SR_NAT_CONN_MAX ? sessions : SR_NAT_CONN_MAX, 0) != 0 ||
+      sr_slab_init(&(nat->host_slab), "nat_host", SR_MEM_NAT,
+                   sizeof(struct sr_nat_host), sessions, 0) != 0 ||
+      sr_slab_init(&(nat->pair_slab), "nat_pair", SR_MEM_NAT,
+                   sizeof(struct sr_nat_pair), sessions, 0) != 0) {
+    success = -1;
+  }
+  /* half the connections there's room for may be half-open */
+  nat->syn_max = (sessions > SR_NAT_CONN_MAX ? sessions : SR_NAT_CONN_MAX) / 2;
+  nat->syn_buckets = sr_mem_calloc(SR_MEM_NAT, SR_NAT_SYN_BUCKETS *
+                                   sizeof(struct sr_nat_syn_bucket));
+  if (nat->syn_buckets == NULL) {
+    success = -1;
+  }
+  nat->sr = NULL;
+  strncpy(nat->out_if_name, "eth2", sr_IFACE_NAMELEN);
+  nat->out_ifindex = -1;
   /* Initialize any variables here */
 
+  /* Initialize timeout thread, last: it reads all of the above */
+  nat->stop = 0;
+  pthread_attr_init(&(nat->thread_attr));
+  pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
+  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
+  if (success == 0 &&
+      pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, nat) != 0) {
+    success = -1;
+  }
+
   return success;
 }
 
 
+/* Deterministic mode. The external index is a flat array, one slot per
+   address, type and port, so the way in is an array read. With no pool
+   added, the external interface's address is the one. */
+int sr_nat_deterministic(struct sr_nat *nat, uint32_t base, unsigned int hosts) {
+  unsigned int naddrs = nat->npool ? nat->npool : 1;
+  size_t slot_bytes = naddrs * SR_NAT_NTYPES * SR_PORTS_COUNT *
+    sizeof(struct sr_nat_mapping *);
+
+  assert(nat->port_block && nat->nmappings == 0);
+  if (hosts == 0 || hosts > naddrs * (SR_PORTS_COUNT / nat->port_block)) {
+    return -1;
+  }
+  if (sr_mem_charge(SR_MEM_NAT, slot_bytes) != 0) {
+    return -1;
+  }
+  if ((nat->det_slots = sr_huge_alloc("nat_det_slots", slot_bytes)) == NULL) {
+    sr_mem_uncharge(SR_MEM_NAT, slot_bytes);
+    return -1;
+  }
+  nat->det_base = base;
+  nat->det_hosts = hosts;
+  nat->det_naddrs = naddrs;
+  return 0;
+}
+
 int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
 
+  /* the timeout thread goes first, it walks everything freed below */
+  __atomic_store_n(&nat->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(nat->thread, NULL);
+  pthread_attr_destroy(&(nat->thread_attr));
+
   pthread_mutex_lock(&(nat->lock));
 
   /* free nat memory here */
-  struct sr_nat_mapping *mappings, *nxt;
-  struct sr_nat_connection *conn, *nxt_conn;
-  for(mappings = nat->mappings; mappings; mappings = nxt) {
-	  nxt = mappings->next;
-	  /*mappings->next = NULL;*/
-	  for(conn = mappings->conns; conn; conn=nxt_conn) {
-		  nxt_conn = conn->next;
-		  free(conn);
-	  }
-	  free(mappings);
-  }
- 
-  pthread_kill(nat->thread, SIGKILL);
+  time_t now = sr_nat_now(nat);
+  int shard_idx, type;
+  uint32_t bucket;
+  for (shard_idx = 0; shard_idx < SR_NAT_SHARDS; shard_idx++) {
+    struct sr_nat_shard *shard = &nat->shards[shard_idx];
+    sr_nat_lock(shard);
+    for (bucket = 0; bucket <= nat->hash_mask; bucket++) {
+      while (shard->by_conn[bucket]) {
+        sr_nat_unlink_conn(nat, shard, shard->by_conn[bucket], now);
+      }
+    }
+    while (shard->mappings) {
+      sr_nat_unlink(nat, shard, shard->mappings, now);
+    }
+    sr_nat_unlock(shard);
+    pthread_mutex_destroy(&(shard->lock));
+    pthread_mutex_destroy(&(nat->pairs[shard_idx].lock));
+    pthread_mutex_destroy(&(nat->syn_locks[shard_idx]));
+  }
+  sr_epoch_destroy(&(nat->epoch));
+  sr_mem_free(nat->syn_buckets);
+
+  while (nat->addrs) {
+    struct sr_nat_addr *addr = nat->addrs;
+    nat->addrs = addr->next;
+    for (shard_idx = 0; shard_idx < SR_NAT_SHARDS; shard_idx++) {
+      for (type = 0; type < SR_NAT_NTYPES; type++) {
+        if (addr->ports[shard_idx][type]) {
+          sr_ports_destroy(addr->ports[shard_idx][type]);
+          sr_mem_free(addr->ports[shard_idx][type]);
+        }
+      }
+      if (addr->blocks[shard_idx]) {
+        sr_ports_destroy(addr->blocks[shard_idx]);
+        sr_mem_free(addr->blocks[shard_idx]);
+      }
+    }
+    sr_mem_free(addr);
+  }
+  sr_slab_destroy(&(nat->mapping_slab));
+  sr_slab_destroy(&(nat->conn_slab));
+  sr_slab_destroy(&(nat->host_slab));
+  sr_slab_destroy(&(nat->pair_slab));
+  if (nat->det_slots) {
+    sr_huge_free(nat->det_slots);
+    sr_mem_uncharge(SR_MEM_NAT, nat->det_naddrs * SR_NAT_NTYPES * SR_PORTS_COUNT *
+                    sizeof(struct sr_nat_mapping *));
+  }
+  sr_huge_free(nat->shards[0].by_int);
+  sr_mem_uncharge(SR_MEM_NAT, 3 * SR_NAT_SHARDS * (nat->hash_mask + 1) *
+                  sizeof(struct sr_nat_mapping *));
+
   return pthread_mutex_destroy(&(nat->lock)) &&
     pthread_mutexattr_destroy(&(nat->attr));
 
 }
 
+/* Expire what has been idle past 'timeout' from the head of a mapping
+   queue. A head queued that long ago but touched since goes back to the
+   tail, so each entry is looked at about once per timeout however busy it
+   is. Caller holds the shard lock. */
+static void sr_nat_expire_mappings(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_qlink *queue, int timeout, time_t curtime) {
+  struct sr_nat_qlink *head;
+  struct sr_nat_mapping *mapping;
+
+  while ((head = queue->next) != queue &&
+         difftime(curtime, head->queued) > timeout) {
+    mapping = SR_NAT_ENTRY(head, struct sr_nat_mapping, lru);
+    if (difftime(curtime, __atomic_load_n(&mapping->last_updated,
+                                          __ATOMIC_RELAXED)) > timeout) {
+      sr_nat_unlink(nat, shard, mapping, curtime);
+    } else {
+      sr_nat_qtail(queue, head, curtime);
+    }
+  }
+}
+
+/* Idle timeout of a TCP connection in 'state'. */
+static int sr_nat_tcp_timeout(struct sr_nat *nat, int state) {
+  switch (state) {
+  case nat_tcp_established: return nat->est_it;
+  case nat_tcp_last_ack:    return SR_NAT_TCP_LAST_ACK;
+  case nat_tcp_time_wait:   return SR_NAT_TCP_TIME_WAIT;
+  case nat_tcp_close:       return SR_NAT_TCP_CLOSE;
+  default:                  return nat->tr_it;
+  }
+}
+
+/* The same for a connection queue. */
+static void sr_nat_expire_conns(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_qlink *queue, int timeout, time_t curtime) {
+  struct sr_nat_qlink *head;
+  struct sr_nat_connection *conn;
+
+  while ((head = queue->next) != queue &&
+         difftime(curtime, head->queued) > timeout) {
+    conn = SR_NAT_ENTRY(head, struct sr_nat_connection, lru);
+    if (difftime(curtime, __atomic_load_n(&conn->last_active,
+                                          __ATOMIC_RELAXED)) > timeout) {
+      sr_nat_unlink_conn(nat, shard, conn, curtime);
+    } else {
+      sr_nat_qtail(queue, head, curtime);
+    }
+  }
+}
+
+void sr_nat_expire(struct sr_nat *nat, time_t curtime) {
+  /* one shard at a time so lookups and inserts elsewhere carry on */
+  int shard_idx, state;
+  for (shard_idx = 0; shard_idx < SR_NAT_SHARDS; shard_idx++) {
+    struct sr_nat_shard *shard = &nat->shards[shard_idx];
+    sr_nat_lock(shard);
+    sr_nat_expire_mappings(nat, shard, &shard->queues[nat_queue_query],
+                           nat->qtimeout, curtime);
+    sr_nat_expire_mappings(nat, shard, &shard->queues[nat_queue_udp],
+                           nat->udp_it, curtime);
+    sr_nat_expire_mappings(nat, shard, &shard->queues[nat_queue_unused],
+                           nat->tr_it, curtime);
+    for (state = 0; state < nat_tcp_nstates; state++) {
+      sr_nat_expire_conns(nat, shard, &shard->queues[nat_queue_tcp + state],
+                          sr_nat_tcp_timeout(nat, state), curtime);
+    }
+    sr_nat_unlock(shard);
+  }
+  sr_epoch_reclaim(&(nat->epoch));
+}
+
 void *sr_nat_timeout(void *nat_ptr) {  /* Periodic Timout handling */
   struct sr_nat *nat = (struct sr_nat *)nat_ptr;
   while (1) {
     sleep(1.0);
-    pthread_mutex_lock(&(nat->lock));
+    if (__atomic_load_n(&nat->stop, __ATOMIC_ACQUIRE)) {
+      break;
+    }
 
-    time_t curtime = time(NULL);
+    /* a simulated clock's owner expires as it advances it */
+    if (nat->clock != time) {
+      continue;
+    }
 
     /* handle periodic tasks here */
-	struct sr_nat_mapping *mappings, *nxt_map, *prev;
-	
-	/* give one second for most recent insert before checking for timeout */
-	if (difftime(curtime, nat->mappings->last_updated) <= 1.0) {
-		break;
-	}
-	/* iterate through mappings table and free mappings which have not been
-	 * updated within the timeout specified. */
-	for (mappings = nat->mappings; mappings; mappings=nxt_map) {
-		nxt_map = mappings->next;
-		if (mappings->type == nat_mapping_icmp) {
-			if (difftime(curtime,  mappings->last_updated) > nat->qtimeout) {
-				if (prev != NULL) {
-					prev->next = nxt_map;		
-				} 
-				mappings->next = NULL;
-				/* free(mappings->conns);*/
-				nat->ports_used[mappings->aux_ext] = 0;
-				free(mappings);
-			}
-		} else if (mappings->type == nat_mapping_tcp) {
-			struct sr_nat_connection *conn, *nxt_conn, *prev;
-			/* iterate through the connections and remove those that timed out */
-			for (conn = mappings->conns; conn; conn=nxt_conn) {
-				nxt_conn = conn->next;
-				time_t diff = difftime(curtime, conn->last_active);
-				if (conn->status == nat_conn_established) {
-					if (diff > nat->est_it) {
-						if (prev != NULL) {
-							prev->next = nxt_conn;							
-						}
-						conn->next = NULL;
-						free(conn);
-					} 
-				} else if (conn->status == nat_conn_transitory) {
-					if (diff > nat->tr_it) {
-						if (prev != NULL) {
-							prev->next = nxt_conn;							
-						}
-						conn->next = NULL;
-						free(conn);
-					}
-				}
-			}
-			/* If mapping has no active connections left, remove mapping */
-			if (mappings->conns == NULL) {
-				if (prev != NULL) {
-					prev->next = nxt_map;		
-				}
-				mappings->next = NULL;
-				nat->ports_used[mappings->aux_ext] = 0;
-				free(mappings);
-			}
-		}		
-		
-		mappings = nxt_map;
-	}
-    pthread_mutex_unlock(&(nat->lock));
+    time_t curtime = sr_nat_now(nat);
+    sr_nat_expire(nat, curtime);
+
+    if (nat->ckpt_path && nat->ckpt_interval > 0 &&
+        difftime(curtime, nat->ckpt_last) >= nat->ckpt_interval) {
+      if (sr_nat_save(nat, nat->ckpt_path) != 0) {
+        fprintf(stderr, "Error: NAT checkpoint to %s failed\n", nat->ckpt_path);
+      }
+      nat->ckpt_last = curtime;
+    }
   }
   return NULL;
 }
 
-/* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type ) {
+struct sr_epoch_reader *sr_nat_reader(struct sr_nat *nat) {
+  return sr_epoch_register(&(nat->epoch));
+}
 
-  pthread_mutex_lock(&(nat->lock));
+void sr_nat_read_begin(struct sr_nat *nat, struct sr_epoch_reader *reader) {
+  sr_epoch_enter(&(nat->epoch), reader);
+}
 
-  /* handle lookup here, malloc and assign to copy */
-  struct sr_nat_mapping *copy = NULL;
+void sr_nat_read_end(struct sr_nat *nat, struct sr_epoch_reader *reader) {
+  sr_epoch_exit(reader);
+}
 
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+/* Make a mapping on the external port already claimed for it, or give the
+   port (and the host's pairing) back if there's no room. Caller holds the
+   shard lock. */
+static struct sr_nat_mapping *sr_nat_add_mapping(struct sr_nat *nat,
+  struct sr_nat_shard *shard, int shard_idx, uint32_t h, uint32_t ip_int,
+  uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_addr *addr,
+  struct sr_nat_host *host, uint16_t port, time_t now) {
+  struct sr_nat_mapping *mapping = sr_slab_alloc(&(nat->mapping_slab));
+
+  if (mapping == NULL) {
+    sr_nat_release_port(nat, shard, shard_idx, addr, host, type, port, now);
+    if (host == NULL) {
+      sr_nat_unpair(nat, ip_int);
+    }
+    return NULL;
+  }
+  mapping->ip_int = ip_int;
+  mapping->aux_int = aux_int;
+  mapping->type = type;
+  mapping->last_updated = now;
+  mapping->nconns = 0;
+  mapping->ip_ext = addr->ip;
+  mapping->aux_ext = port;
+  mapping->addr = addr;
+  mapping->host = host;
+  mapping->shard = shard_idx;
+  sr_nat_qinit(&mapping->lru);
+
+  sr_nat_link(nat, shard, mapping, h);
+  sr_nat_enqueue(shard, mapping, now);
+  if (host == NULL) {
+    sr_nat_log_mapping(nat, "MAP", mapping, now);
+  }
+  return mapping;
+}
+
+/* Get the mapping associated with given external (ip, port) pair. */
+struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type ) {
+
+  if (nat->det_slots) {
+    struct sr_nat_addr *addr = sr_nat_pool_find(nat, ip_ext);
+    struct sr_nat_mapping *mapping = NULL;
+    if (addr && addr->index < nat->det_naddrs && aux_ext >= SR_PORTS_LO &&
+        (mapping = __atomic_load_n(sr_nat_det_slot(nat, addr->index, type, aux_ext),
+                                   __ATOMIC_ACQUIRE)) != NULL) {
+      sr_nat_touch(mapping, sr_nat_now(nat));
+    }
+    return mapping;
+  }
+
+  struct sr_nat_shard *shard = &nat->shards[sr_nat_shard_ext(nat, aux_ext)];
+  struct sr_nat_mapping *mapping =
+    __atomic_load_n(&shard->by_ext[sr_nat_bucket_ext(nat, ip_ext, aux_ext, type)],
+                    __ATOMIC_ACQUIRE);
+  for (; mapping; mapping = __atomic_load_n(&mapping->next_ext, __ATOMIC_ACQUIRE)) {
+    if (mapping->aux_ext == aux_ext && mapping->ip_ext == ip_ext &&
+        mapping->type == type) {
+      sr_nat_touch(mapping, sr_nat_now(nat));
+      break;
+    }
+  }
+  return mapping;
 }
 
-/* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
+/* Get the mapping associated with given internal (ip, port) pair. */
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
 
-  pthread_mutex_lock(&(nat->lock));
+  uint32_t h = sr_nat_hash_int(ip_int, aux_int, type);
+  struct sr_nat_shard *shard = &nat->shards[sr_nat_shard_int(nat, ip_int, h)];
+  struct sr_nat_mapping *mapping =
+    __atomic_load_n(&shard->by_int[(h >> SR_NAT_SHARD_BITS) & nat->hash_mask],
+                    __ATOMIC_ACQUIRE);
+  for (; mapping; mapping = __atomic_load_n(&mapping->next_int, __ATOMIC_ACQUIRE)) {
+    if (mapping->ip_int == ip_int && mapping->aux_int == aux_int &&
+        mapping->type == type) {
+      sr_nat_touch(mapping, sr_nat_now(nat));
+      break;
+    }
+  }
+  return mapping;
+}
+
+/* Insert a new mapping into the nat's mapping table, or find the one
+   another thread just inserted for the same pair. */
+struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
 
-  /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *copy = NULL;
+  uint32_t h = sr_nat_hash_int(ip_int, aux_int, type);
+  int shard_idx = sr_nat_shard_int(nat, ip_int, h);
+  struct sr_nat_shard *shard = &nat->shards[shard_idx];
+  struct sr_nat_mapping *mapping;
+  time_t now = sr_nat_now(nat);
 
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+  sr_nat_lock(shard);
+
+  mapping = shard->by_int[(h >> SR_NAT_SHARD_BITS) & nat->hash_mask];
+  for (; mapping; mapping = mapping->next_int) {
+    if (mapping->ip_int == ip_int && mapping->aux_int == aux_int &&
+        mapping->type == type) {
+      sr_nat_touch(mapping, now);
+      sr_nat_unlock(shard);
+      return mapping;
+    }
+  }
+
+  /* get the host's external address, and a random free port on it from
+     this shard's share, or the next free one in the host's block */
+  struct sr_nat_addr *addr = NULL;
+  struct sr_nat_host *host = NULL;
+  struct sr_ports *ports;
+  int port = -1;
+  if (nat->port_block) {
+    if ((host = sr_nat_host(nat, shard, shard_idx, NULL, ip_int, -1, now)) != NULL) {
+      addr = host->addr;
+      port = sr_nat_host_alloc(nat, host, type);
+    }
+  } else if ((addr = sr_nat_pair(nat, ip_int, NULL)) != NULL) {
+    if ((ports = sr_nat_ports(nat, addr, type, shard_idx)) != NULL) {
+      port = sr_ports_alloc(ports, now);
+    }
+    if (port < 0) {
+      sr_nat_unpair(nat, ip_int);
+    }
+  }
+  if (port < 0) {
+    if (addr) {
+      __atomic_add_fetch(&addr->failed, 1, __ATOMIC_RELAXED);
+    }
+    sr_nat_unlock(shard);
+    return NULL;
+  }
+
+  /* handle insert here, create a mapping, and then return it */
+  mapping = sr_nat_add_mapping(nat, shard, shard_idx, h, ip_int, aux_int, type,
+                               addr, host, (uint16_t)port, now);
+  sr_nat_unlock(shard);
+  return mapping;
 }
 
-/* Insert a new mapping into the nat's mapping table.
-   Actually returns a copy to the new mapping, for thread safety.
- */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
+/* The mapping for an outbound packet, made if there's none yet. */
+struct sr_nat_mapping *sr_nat_map_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
 
-  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_mapping *mapping = sr_nat_lookup_internal(nat, ip_int, aux_int, type);
+  if (mapping == NULL) {
+    mapping = sr_nat_insert_mapping(nat, ip_int, aux_int, type);
+  }
+  return mapping;
+}
 
-  /* handle insert here, create a mapping, and then return a copy of it */
-  struct sr_nat_mapping *mapping = malloc(sizeof(struct sr_nat_mapping));
-  mapping->ip_int = ip_int;
-  mapping->aux_int = aux_int;
-  mapping->type = type;
-  mapping->last_updated = time(NULL);
-  mapping->conns = NULL;
-  
-  /* find free port to assign mapping to 1024-2047 */
-  uint16_t nxt_prt = 0;
-  for(nxt_prt; nxt_prt < NUM_PORTS; nxt_prt++) {
-	  if (nat->ports_used[nxt_prt] == 0) {
-		  break;
-	  }
-  } 
-  mapping->aux_ext = 1024+nxt_prt;
-  nat->ports_used[nxt_prt] == 1;
-  
-  /* get ext_ip */
-  struct sr_if *ext_iface = sr_get_interface(nat->sr, nat->out_if_name);  
-  mapping->ip_ext = ext_iface->ip;
-  
-  mapping->next = nat->mappings; /* add to front of table */
-  pthread_mutex_unlock(&(nat->lock));
-  
-  struct sr_nat_mapping *copy = malloc(sizeof(struct sr_nat_mapping));
-  memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
-  return copy;
+/* Where a segment with 'tcp_flags' takes a connection; 'opener' if it
+   came from the side that opened it. Sequence numbers aren't followed, so
+   any ACK after both FINs counts as the last one. Caller holds the lock. */
+static int sr_nat_tcp_next(struct sr_nat_connection *conn, uint8_t tcp_flags,
+  int outbound) {
+  int opener = !outbound == !!(conn->flags & SR_NAT_CONN_INBOUND);
+
+  if (tcp_flags & TCP_RST) {
+    return nat_tcp_close;
+  }
+  if (tcp_flags & TCP_SYN) {
+    if (tcp_flags & TCP_ACK) {
+      return (conn->state == nat_tcp_syn_sent && !opener) ?
+        nat_tcp_syn_recv : conn->state;
+    }
+    /* a new connection reusing the tuple of a closed one */
+    if (conn->state == nat_tcp_time_wait || conn->state == nat_tcp_close) {
+      conn->flags = outbound ? 0 : SR_NAT_CONN_INBOUND;
+      return nat_tcp_syn_sent;
+    }
+    return conn->state;
+  }
+  if (tcp_flags & TCP_FIN) {
+    if (conn->state >= nat_tcp_last_ack) {
+      return conn->state;
+    }
+    conn->flags |= outbound ? SR_NAT_CONN_FIN_OUT : SR_NAT_CONN_FIN_IN;
+    return ((conn->flags & SR_NAT_CONN_FIN_OUT) &&
+            (conn->flags & SR_NAT_CONN_FIN_IN)) ?
+      nat_tcp_last_ack : nat_tcp_fin_wait;
+  }
+  if (tcp_flags & TCP_ACK) {
+    if (conn->state == nat_tcp_syn_recv && opener) {
+      return nat_tcp_established;
+    }
+    if (conn->state == nat_tcp_last_ack) {
+      return nat_tcp_time_wait;
+    }
+  }
+  return conn->state;
+}
+
+/* Start tracking a connection through 'mapping' in 'state'. NULL if
+   there's no room. Caller holds the shard lock. */
+static struct sr_nat_connection *sr_nat_add_conn(struct sr_nat *nat,
+  struct sr_nat_shard *shard, struct sr_nat_mapping *mapping, uint32_t ip_rem,
+  uint16_t port_rem, int state, uint8_t flags, time_t now) {
+  struct sr_nat_connection **head =
+    &shard->by_conn[sr_nat_bucket_conn(nat, mapping->ip_int, mapping->aux_int,
+                                       ip_rem, port_rem)];
+  struct sr_nat_connection *conn = sr_slab_alloc(&(nat->conn_slab));
+
+  if (conn == NULL) {
+    return NULL;
+  }
+  conn->ip_int = mapping->ip_int;
+  conn->port_int = mapping->aux_int;
+  conn->ip_rem = ip_rem;
+  conn->port_rem = port_rem;
+  conn->state = state;
+  conn->flags = flags;
+  conn->last_active = now;
+  conn->mapping = mapping;
+  sr_nat_qinit(&conn->lru);
+
+  conn->next_hash = *head;
+  __atomic_store_n(head, conn, __ATOMIC_RELEASE);
+  if (mapping->nconns++ == 0) {
+    sr_nat_qdel(&mapping->lru);
+  }
+  sr_nat_qtail(&shard->queues[nat_queue_tcp + state], &conn->lru, now);
+  if (SR_NAT_HALF_OPEN(state)) {
+    shard->half_open++;
+  }
+  return conn;
+}
+
+/* Make room for one more half-open connection in a shard holding its
+   share of syn_max by letting the oldest go, whichever of the two
+   half-open queues it heads. Caller holds the shard lock. */
+static void sr_nat_evict_half_open(struct sr_nat *nat,
+  struct sr_nat_shard *shard, time_t now) {
+  struct sr_nat_qlink *sent = &shard->queues[nat_queue_tcp + nat_tcp_syn_sent];
+  struct sr_nat_qlink *recv = &shard->queues[nat_queue_tcp + nat_tcp_syn_recv];
+  struct sr_nat_qlink *oldest;
+  unsigned int cap = (nat->syn_max + SR_NAT_SHARDS - 1) / SR_NAT_SHARDS;
+
+  while (nat->syn_max && shard->half_open >= cap) {
+    if (sent->next == sent) {
+      oldest = recv->next;
+    } else if (recv->next == recv || sent->next->queued <= recv->next->queued) {
+      oldest = sent->next;
+    } else {
+      oldest = recv->next;
+    }
+    sr_nat_unlink_conn(nat, shard,
+                       SR_NAT_ENTRY(oldest, struct sr_nat_connection, lru), now);
+    __atomic_add_fetch(&nat->syn_evicted, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* Charge a SYN to its source's allowance. 0 if it may pass, -1 if the
+   source is over its rate. */
+static int sr_nat_syn_admit(struct sr_nat *nat, uint32_t ip_src, time_t now) {
+  uint32_t i = sr_nat_hash_host(ip_src) & (SR_NAT_SYN_BUCKETS - 1);
+  struct sr_nat_syn_bucket *bucket = &nat->syn_buckets[i];
+  int admit = 0;
+
+  if (nat->syn_rate == 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&(nat->syn_locks[i & (SR_NAT_SHARDS - 1)]));
+  if (now > bucket->last) {
+    if (now - bucket->last >= (time_t)(nat->syn_burst / nat->syn_rate + 1)) {
+      bucket->tokens = nat->syn_burst;
+    } else {
+      bucket->tokens += (unsigned int)(now - bucket->last) * nat->syn_rate;
+      if (bucket->tokens > nat->syn_burst) {
+        bucket->tokens = nat->syn_burst;
+      }
+    }
+    bucket->last = now;
+  }
+  if (bucket->tokens > 0) {
+    bucket->tokens--;
+  } else {
+    admit = -1;
+  }
+  pthread_mutex_unlock(&(nat->syn_locks[i & (SR_NAT_SHARDS - 1)]));
+
+  if (admit != 0) {
+    __atomic_add_fetch(&nat->syn_limited, 1, __ATOMIC_RELAXED);
+  }
+  return admit;
+}
+
+/* Account a TCP segment between a TCP mapping and a remote host. Segments
+   of an established connection that don't change its state only note
+   the time, without the lock. */
+struct sr_nat_connection *sr_nat_track_tcp(struct sr_nat *nat,
+  struct sr_nat_mapping *mapping, uint32_t ip_rem, uint16_t port_rem,
+  uint8_t tcp_flags, int outbound) {
+
+  struct sr_nat_shard *shard = &nat->shards[mapping->shard];
+  struct sr_nat_connection **head =
+    &shard->by_conn[sr_nat_bucket_conn(nat, mapping->ip_int, mapping->aux_int,
+                                       ip_rem, port_rem)];
+  struct sr_nat_connection *conn;
+  time_t now = sr_nat_now(nat);
+  int state;
+
+  assert(mapping->type == nat_mapping_tcp);
+
+  for (conn = __atomic_load_n(head, __ATOMIC_ACQUIRE); conn;
+       conn = __atomic_load_n(&conn->next_hash, __ATOMIC_ACQUIRE)) {
+    if (conn->mapping == mapping && conn->ip_rem == ip_rem &&
+        conn->port_rem == port_rem) {
+      break;
+    }
+  }
+  if (conn && !(tcp_flags & (TCP_SYN | TCP_FIN | TCP_RST)) &&
+      __atomic_load_n(&conn->state, __ATOMIC_RELAXED) == nat_tcp_established) {
+    if (__atomic_load_n(&conn->last_active, __ATOMIC_RELAXED) != now) {
+      __atomic_store_n(&conn->last_active, now, __ATOMIC_RELAXED);
+    }
+    return conn;
+  }
+
+  sr_nat_lock(shard);
+
+  /* look again, the connection may have come or gone meanwhile */
+  for (conn = *head; conn; conn = conn->next_hash) {
+    if (conn->mapping == mapping && conn->ip_rem == ip_rem &&
+        conn->port_rem == port_rem) {
+      break;
+    }
+  }
+
+  if (conn == NULL) {
+    /* only a SYN opens a connection; an outbound segment of one we never
+       saw open (we restarted, say) is picked up as established */
+    if (outbound) {
+      state = (tcp_flags & TCP_SYN) ? nat_tcp_syn_sent : nat_tcp_established;
+    } else if ((tcp_flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN) {
+      state = nat_tcp_syn_sent;
+    } else {
+      sr_nat_unlock(shard);
+      return NULL;
+    }
+    if (SR_NAT_HALF_OPEN(state)) {
+      sr_nat_evict_half_open(nat, shard, now);
+    }
+    /* the mapping may have expired since the caller found it, or gone
+       with the connection just evicted */
+    if (mapping->lru.next == &mapping->lru && mapping->nconns == 0) {
+      sr_nat_unlock(shard);
+      return NULL;
+    }
+    conn = sr_nat_add_conn(nat, shard, mapping, ip_rem, port_rem, state,
+                           outbound ? 0 : SR_NAT_CONN_INBOUND, now);
+  } else {
+    conn->last_active = now;
+    state = sr_nat_tcp_next(conn, tcp_flags, outbound);
+    if (SR_NAT_HALF_OPEN(state) != SR_NAT_HALF_OPEN(conn->state)) {
+      if (SR_NAT_HALF_OPEN(state)) {
+        /* reopened; the oldest to go can't be this one, it's closed */
+        sr_nat_evict_half_open(nat, shard, now);
+        shard->half_open++;
+      } else {
+        shard->half_open--;
+      }
+    }
+    if (state != conn->state) {
+      __atomic_store_n(&conn->state, state, __ATOMIC_RELAXED);
+      sr_nat_qtail(&shard->queues[nat_queue_tcp + state], &conn->lru, now);
+    }
+  }
+
+  sr_nat_unlock(shard);
+  return conn;
+}
+
+void sr_nat_report(struct sr_nat *nat, FILE *fp) {
+  char ip[INET_ADDRSTRLEN];
+  struct sr_nat_addr *addr;
+  unsigned int i, npool = __atomic_load_n(&nat->npool, __ATOMIC_ACQUIRE);
+
+  fprintf(fp, "%-15s %8s %8s %12s %10s\n", "nat address", "in use", "hosts",
+          "mappings", "failed");
+  for (i = 0; i < npool; i++) {
+    addr = nat->pool[i];
+    inet_ntop(AF_INET, &addr->ip, ip, sizeof(ip));
+    fprintf(fp, "%-15s %8u %8u %12lu %10lu\n", ip,
+            __atomic_load_n(&addr->in_use, __ATOMIC_RELAXED),
+            __atomic_load_n(&addr->hosts, __ATOMIC_RELAXED),
+            __atomic_load_n(&addr->allocs, __ATOMIC_RELAXED),
+            __atomic_load_n(&addr->failed, __ATOMIC_RELAXED));
+  }
+
+  unsigned int half_open = 0;
+  for (i = 0; i < SR_NAT_SHARDS; i++) {
+    half_open += __atomic_load_n(&nat->shards[i].half_open, __ATOMIC_RELAXED);
+  }
+  fprintf(fp, "tcp half-open %u (max %u), %lu evicted early, %lu SYNs over rate\n",
+          half_open, nat->syn_max,
+          __atomic_load_n(&nat->syn_evicted, __ATOMIC_RELAXED),
+          __atomic_load_n(&nat->syn_limited, __ATOMIC_RELAXED));
+}
+
+/* Checkpoint file: a header, then per shard a record for each mapping
+   followed by one for each of its TCP connections. Fields are in host
+   byte order; a checkpoint is only read back on the machine that wrote
+   it. */
+#define SR_NAT_CKPT_MAGIC "srnatck1"
+
+struct sr_nat_ckpt_hdr {
+  char magic[8];
+  uint32_t port_block; /* the mode it was written in */
+  uint32_t det_base;
+  uint32_t det_hosts;
+  uint32_t nrecs;
+  int64_t saved;
+};
+
+#define SR_NAT_CKPT_MAPPING 1
+#define SR_NAT_CKPT_CONN    2
+
+struct sr_nat_ckpt_rec {
+  uint8_t kind;
+  uint8_t type; /* mapping type, or connection state */
+  uint8_t flags; /* connection flags */
+  uint8_t pad;
+  uint16_t aux_int; /* connection: port_int */
+  uint16_t aux_ext; /* connection: port_rem */
+  uint32_t ip_int;
+  uint32_t ip_ext; /* connection: ip_rem */
+  int64_t time; /* last_updated, or last_active */
+};
+
+/* Records for one shard's sessions, into a buffer grown as needed.
+   Returns how many, or -1 if the buffer can't grow. Caller holds the
+   shard lock. */
+static int sr_nat_ckpt_shard(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_ckpt_rec **recs, size_t *cap) {
+  struct sr_nat_mapping *mapping;
+  struct sr_nat_connection *conn;
+  struct sr_nat_ckpt_rec *rec;
+  size_t n = 0;
+  uint32_t bucket;
+
+  for (mapping = shard->mappings; mapping; mapping = mapping->next) {
+    n += 1 + mapping->nconns;
+  }
+  /* each shard's records overwrite the last one's, nothing to keep */
+  if (n > *cap) {
+    sr_mem_free(*recs);
+    *cap = 0;
+    if ((*recs = sr_mem_alloc(SR_MEM_NAT, n * sizeof(*rec))) == NULL) {
+      return -1;
+    }
+    *cap = n;
+  }
+
+  rec = *recs;
+  for (mapping = shard->mappings; mapping; mapping = mapping->next, rec++) {
+    memset(rec, 0, sizeof(*rec));
+    rec->kind = SR_NAT_CKPT_MAPPING;
+    rec->type = mapping->type;
+    rec->aux_int = mapping->aux_int;
+    rec->aux_ext = mapping->aux_ext;
+    rec->ip_int = mapping->ip_int;
+    rec->ip_ext = mapping->ip_ext;
+    rec->time = mapping->last_updated;
+  }
+  for (bucket = 0; bucket <= nat->hash_mask; bucket++) {
+    for (conn = shard->by_conn[bucket]; conn; conn = conn->next_hash, rec++) {
+      memset(rec, 0, sizeof(*rec));
+      rec->kind = SR_NAT_CKPT_CONN;
+      rec->type = conn->state;
+      rec->flags = conn->flags;
+      rec->aux_int = conn->port_int;
+      rec->aux_ext = conn->port_rem;
+      rec->ip_int = conn->ip_int;
+      rec->ip_ext = conn->ip_rem;
+      rec->time = conn->last_active;
+    }
+  }
+  return (int)n;
+}
+
+/* Write a checkpoint. Each shard is copied out under its lock and
+   written after; the file is built beside 'path' and renamed over it. */
+int sr_nat_save(struct sr_nat *nat, const char *path) {
+  char tmp[PATH_MAX];
+  struct sr_nat_ckpt_hdr hdr;
+  struct sr_nat_ckpt_rec *recs = NULL;
+  size_t cap = 0;
+  int shard_idx, n, ret = 0;
+  FILE *fp;
+
+  pthread_mutex_lock(&(nat->ckpt_lock));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((fp = fopen(tmp, "w")) == NULL) {
+    pthread_mutex_unlock(&(nat->ckpt_lock));
+    return -1;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SR_NAT_CKPT_MAGIC, sizeof(hdr.magic));
+  hdr.port_block = nat->port_block;
+  hdr.det_base = nat->det_base;
+  hdr.det_hosts = nat->det_hosts;
+  hdr.saved = sr_nat_now(nat);
+  if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+    ret = -1;
+  }
+
+  for (shard_idx = 0; shard_idx < SR_NAT_SHARDS && ret == 0; shard_idx++) {
+    struct sr_nat_shard *shard = &nat->shards[shard_idx];
+    sr_nat_lock(shard);
+    n = sr_nat_ckpt_shard(nat, shard, &recs, &cap);
+    sr_nat_unlock(shard);
+    if (n < 0 || fwrite(recs, sizeof(*recs), n, fp) != (size_t)n) {
+      ret = -1;
+    }
+    hdr.nrecs += n;
+  }
+  sr_mem_free(recs);
+
+  /* the count goes in last, so a torn file never reads as complete */
+  if (ret == 0 && (fseek(fp, 0, SEEK_SET) != 0 ||
+                   fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+                   fflush(fp) != 0 || fsync(fileno(fp)) != 0)) {
+    ret = -1;
+  }
+  if (fclose(fp) != 0) {
+    ret = -1;
+  }
+  if (ret == 0 && rename(tmp, path) != 0) {
+    ret = -1;
+  }
+  if (ret != 0) {
+    unlink(tmp);
+  }
+  pthread_mutex_unlock(&(nat->ckpt_lock));
+  return ret;
+}
+
+/* Bring back one mapping, claiming its external port in whatever the
+   mode allocates from. Caller holds every shard lock. */
+static int sr_nat_restore_mapping(struct sr_nat *nat,
+  const struct sr_nat_ckpt_rec *rec, time_t now) {
+  sr_nat_mapping_type type = (sr_nat_mapping_type)rec->type;
+  uint32_t h = sr_nat_hash_int(rec->ip_int, rec->aux_int, type);
+  int shard_idx = sr_nat_shard_int(nat, rec->ip_int, h);
+  struct sr_nat_shard *shard = &nat->shards[shard_idx];
+  struct sr_nat_mapping *mapping;
+  struct sr_nat_addr *addr;
+  struct sr_nat_host *host = NULL;
+  struct sr_ports *ports;
+
+  /* sessions on an address no longer in the pool are gone */
+  if (type >= SR_NAT_NTYPES || rec->aux_ext < SR_PORTS_LO ||
+      sr_nat_shard_ext(nat, rec->aux_ext) != shard_idx ||
+      (addr = sr_nat_pool_find(nat, rec->ip_ext)) == NULL) {
+    return -1;
+  }
+  if (nat->port_block) {
+    int first = SR_PORTS_LO + (rec->aux_ext - SR_PORTS_LO) /
+      nat->port_block * nat->port_block;
+    if ((host = sr_nat_host(nat, shard, shard_idx, addr, rec->ip_int,
+                            first, now)) == NULL) {
+      return -1;
+    }
+    if (sr_nat_host_take(nat, host, type, rec->aux_ext) != 0) {
+      return -1;
+    }
+  } else if (sr_nat_pair(nat, rec->ip_int, addr) != addr) {
+    return -1;
+  } else if ((ports = sr_nat_ports(nat, addr, type, shard_idx)) == NULL ||
+             sr_ports_take(ports, rec->aux_ext) != 0) {
+    sr_nat_unpair(nat, rec->ip_int);
+    return -1;
+  }
+
+  mapping = sr_nat_add_mapping(nat, shard, shard_idx, h, rec->ip_int,
+                               rec->aux_int, type, addr, host, rec->aux_ext, now);
+  if (mapping == NULL) {
+    return -1;
+  }
+  mapping->last_updated = (time_t)rec->time;
+  return 0;
+}
+
+/* And one connection, through the mapping restored before it. */
+static int sr_nat_restore_conn(struct sr_nat *nat,
+  const struct sr_nat_ckpt_rec *rec, time_t now) {
+  uint32_t h = sr_nat_hash_int(rec->ip_int, rec->aux_int, nat_mapping_tcp);
+  struct sr_nat_shard *shard = &nat->shards[sr_nat_shard_int(nat, rec->ip_int, h)];
+  struct sr_nat_mapping *mapping;
+  struct sr_nat_connection *conn;
+
+  if (rec->type >= nat_tcp_nstates) {
+    return -1;
+  }
+  mapping = shard->by_int[(h >> SR_NAT_SHARD_BITS) & nat->hash_mask];
+  for (; mapping; mapping = mapping->next_int) {
+    if (mapping->ip_int == rec->ip_int && mapping->aux_int == rec->aux_int &&
+        mapping->type == nat_mapping_tcp) {
+      break;
+    }
+  }
+  if (mapping == NULL ||
+      (conn = sr_nat_add_conn(nat, shard, mapping, rec->ip_ext, rec->aux_ext,
+                              rec->type, rec->flags, now)) == NULL) {
+    return -1;
+  }
+  conn->last_active = (time_t)rec->time;
+  return 0;
+}
+
+/* Load a checkpoint in one read, then link every session in with each
+   shard's lock taken once for the lot rather than per session. */
+int sr_nat_restore(struct sr_nat *nat, const char *path) {
+  struct sr_nat_ckpt_hdr hdr;
+  struct sr_nat_ckpt_rec *recs;
+  time_t now = sr_nat_now(nat);
+  uint32_t i;
+  int shard_idx, restored = 0;
+  FILE *fp;
+
+  /* the pool as it is now, the external interface's address if no
+     other was given */
+  if (sr_nat_pool(nat) == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if ((fp = fopen(path, "r")) == NULL) {
+    return -1;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      memcmp(hdr.magic, SR_NAT_CKPT_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.port_block != nat->port_block || hdr.det_base != nat->det_base ||
+      hdr.det_hosts != nat->det_hosts) {
+    fclose(fp);
+    errno = EINVAL;
+    return -1;
+  }
+  if ((recs = sr_mem_alloc(SR_MEM_NAT, (size_t)hdr.nrecs * sizeof(*recs) + 1)) == NULL) {
+    fclose(fp);
+    errno = ENOMEM;
+    return -1;
+  }
+  if (fread(recs, sizeof(*recs), hdr.nrecs, fp) != hdr.nrecs) {
+    sr_mem_free(recs);
+    fclose(fp);
+    errno = EINVAL;
+    return -1;
+  }
+  fclose(fp);
+
+  for (shard_idx = 0; shard_idx < SR_NAT_SHARDS; shard_idx++) {
+    sr_nat_lock(&nat->shards[shard_idx]);
+  }
+  for (i = 0; i < hdr.nrecs; i++) {
+    if (recs[i].kind == SR_NAT_CKPT_MAPPING) {
+      restored += sr_nat_restore_mapping(nat, &recs[i], now) == 0;
+    } else if (recs[i].kind == SR_NAT_CKPT_CONN) {
+      sr_nat_restore_conn(nat, &recs[i], now);
+    }
+  }
+  for (shard_idx = 0; shard_idx < SR_NAT_SHARDS; shard_idx++) {
+    sr_nat_unlock(&nat->shards[shard_idx]);
+  }
+  sr_mem_free(recs);
+  return restored;
+}
+
+/* Whether an inbound packet for 'ip_dst' that matched no mapping is for a
+   pool address the router doesn't otherwise have, which nothing past
+   the NAT would take either. */
+static int sr_nat_stray(struct sr_nat *nat, uint32_t ip_dst) {
+  struct sr_if *ext_iface;
+
+  return sr_nat_owns(nat, ip_dst) &&
+    ((ext_iface = sr_get_interface(nat->sr, nat->out_if_name)) == NULL ||
+     ext_iface->ip != ip_dst);
+}
+
+/* 16 and 32 bit fields in packet headers, which needn't be aligned. */
+static uint16_t sr_nat_get16(const uint8_t *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void sr_nat_put16(uint8_t *p, uint16_t v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t sr_nat_get32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void sr_nat_put32(uint8_t *p, uint32_t v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+/* ICMP errors about a packet quote its IP header and at least the 8 bytes
+   after it, which hold the ports or the echo id. */
+#define SR_NAT_ICMP_ERROR(type) ((type) == 3 || (type) == 11 || (type) == 12)
+
+/* Translate an ICMP error by the packet it quotes, which went the other
+   way: an error coming in quotes one that went out, from the mapping's
+   external side, and one going out quotes one that came in, to its
+   internal side. The error's own address and the quoted address and
+   port are rewritten. Their checksums follow: the outer IP header's, the
+   quoted IP header's and, when the quote reaches it, the quoted
+   transport checksum, then the ICMP checksum over all of those. */
+static int sr_nat_translate_error(struct sr_nat *nat,
+  struct sr_epoch_reader *reader, struct sr_pktinfo *pkt, int outbound) {
+
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(pkt->buf + pkt->l3_off);
+  uint8_t *icmp = pkt->buf + pkt->l4_off;
+  unsigned int icmp_len = pkt->l3_len - pkt->l3_hlen;
+  unsigned int in_hlen, in_l4_len;
+  uint8_t *in_ip, *in_l4, *in_ip_field, *in_aux_field;
+  uint8_t *in_sum_field = NULL, *outer_field;
+  uint16_t sum, in_sum, aux_old, aux_new, icmp_sum;
+  uint32_t ip_old, ip_new, outer_old;
+  sr_nat_mapping_type type;
+  struct sr_nat_mapping *mapping;
+  int pseudo = 1;
+
+  /* the ICMP header and its 4 more bytes, then the quoted IP header, not
+     a later fragment, and the 8 bytes after it */
+  if (icmp_len < 8 + sizeof(sr_ip_hdr_t)) {
+    return outbound ? -1 : 1;
+  }
+  in_ip = icmp + 8;
+  in_hlen = (in_ip[0] & 0x0f) * 4;
+  if (in_hlen < sizeof(sr_ip_hdr_t) || icmp_len < 8 + in_hlen + 8 ||
+      (ntohs(sr_nat_get16(in_ip + offsetof(sr_ip_hdr_t, ip_off))) & IP_OFFMASK)) {
+    return outbound ? -1 : 1;
+  }
+  in_l4 = in_ip + in_hlen;
+  in_l4_len = icmp_len - 8 - in_hlen;
+
+  switch (in_ip[offsetof(sr_ip_hdr_t, ip_p)]) {
+  case ip_protocol_tcp:
+    type = nat_mapping_tcp;
+    in_aux_field = in_l4 + (outbound ? offsetof(sr_tcp_hdr_t, tcp_dport) :
+                                       offsetof(sr_tcp_hdr_t, tcp_sport));
+    if (in_l4_len >= offsetof(sr_tcp_hdr_t, tcp_sum) + 2) {
+      in_sum_field = in_l4 + offsetof(sr_tcp_hdr_t, tcp_sum);
+    }
+    break;
+  case ip_protocol_udp:
+    type = nat_mapping_udp;
+    in_aux_field = in_l4 + (outbound ? offsetof(sr_udp_hdr_t, udp_dport) :
+                                       offsetof(sr_udp_hdr_t, udp_sport));
+    if (((sr_udp_hdr_t *)in_l4)->udp_sum != 0) {
+      in_sum_field = in_l4 + offsetof(sr_udp_hdr_t, udp_sum);
+    }
+    break;
+  case ip_protocol_icmp:
+    /* the echo request that went out, or the reply that came in */
+    if (((sr_icmp_hdr_t *)in_l4)->icmp_type != (outbound ? 0 : 8)) {
+      return outbound ? -1 : 1;
+    }
+    type = nat_mapping_icmp;
+    in_aux_field = in_l4 + sizeof(sr_icmp_hdr_t);
+    in_sum_field = in_l4 + offsetof(sr_icmp_hdr_t, icmp_sum);
+    pseudo = 0;
+    break;
+  default:
+    return outbound ? -1 : 1;
+  }
+  in_ip_field = in_ip + (outbound ? offsetof(sr_ip_hdr_t, ip_dst) :
+                                    offsetof(sr_ip_hdr_t, ip_src));
+  outer_field = (uint8_t *)ip_hdr + (outbound ? offsetof(sr_ip_hdr_t, ip_src) :
+                                                offsetof(sr_ip_hdr_t, ip_dst));
+  ip_old = sr_nat_get32(in_ip_field);
+  aux_old = sr_nat_get16(in_aux_field);
+  outer_old = sr_nat_get32(outer_field);
+
+  /* an error finds its session but makes none */
+  sr_nat_read_begin(nat, reader);
+  if (outbound) {
+    mapping = sr_nat_lookup_internal(nat, ip_old, ntohs(aux_old), type);
+  } else {
+    mapping = sr_nat_lookup_external(nat, ip_old, ntohs(aux_old), type);
+    if (mapping && outer_old != ip_old) {
+      mapping = NULL;
+    }
+  }
+  if (mapping == NULL) {
+    sr_nat_read_end(nat, reader);
+    return (outbound || sr_nat_stray(nat, outer_old)) ? -1 : 1;
+  }
+  ip_new = outbound ? mapping->ip_ext : mapping->ip_int;
+  aux_new = htons(outbound ? mapping->aux_ext : mapping->aux_int);
+  sr_nat_read_end(nat, reader);
+
+  icmp_sum = sr_nat_get16(icmp + offsetof(sr_icmp_hdr_t, icmp_sum));
+  if (in_sum_field) {
+    sum = in_sum = sr_nat_get16(in_sum_field);
+    if (pseudo) {
+      sum = cksum_adjust32(sum, ip_old, ip_new);
+    }
+    sum = cksum_adjust(sum, aux_old, aux_new);
+    if (sum == 0 && type == nat_mapping_udp) {
+      sum = 0xffff;
+    }
+    sr_nat_put16(in_sum_field, sum);
+    icmp_sum = cksum_adjust(icmp_sum, in_sum, sum);
+  }
+  in_sum = sr_nat_get16(in_ip + offsetof(sr_ip_hdr_t, ip_sum));
+  sum = cksum_adjust32(in_sum, ip_old, ip_new);
+  sr_nat_put16(in_ip + offsetof(sr_ip_hdr_t, ip_sum), sum);
+  icmp_sum = cksum_adjust(icmp_sum, in_sum, sum);
+  icmp_sum = cksum_adjust32(icmp_sum, ip_old, ip_new);
+  icmp_sum = cksum_adjust(icmp_sum, aux_old, aux_new);
+  sr_nat_put16(icmp + offsetof(sr_icmp_hdr_t, icmp_sum), icmp_sum);
+  sr_nat_put32(in_ip_field, ip_new);
+  sr_nat_put16(in_aux_field, aux_new);
+
+  /* the error itself is from, or to, where the quoted packet was */
+  ip_hdr->ip_sum = cksum_adjust32(ip_hdr->ip_sum, outer_old, ip_new);
+  sr_nat_put32(outer_field, ip_new);
+  return 0;
+}
+
+/* Translate a packet crossing the NAT, in place. Only the changed words
+   go into the checksums: the address into the IP header's and, through
+   the pseudo header, the TCP or UDP one; the port or ICMP id into the
+   transport checksum. */
+int sr_nat_translate(struct sr_nat *nat, struct sr_epoch_reader *reader,
+  struct sr_pktinfo *pkt, int outbound) {
+
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(pkt->buf + pkt->l3_off);
+  uint8_t *l4 = pkt->buf + pkt->l4_off;
+  uint8_t *ip_field, *aux_field, *sum_field = NULL;
+  uint8_t tcp_flags = 0;
+  uint16_t port_rem = 0, aux_old, aux_new, sum;
+  uint32_t ip_old, ip_new;
+  sr_nat_mapping_type type;
+  struct sr_nat_mapping *mapping;
+  int pseudo = 1;
+
+  /* later fragments carry no port to go by */
+  if (!(pkt->flags & SR_PKTINFO_L4)) {
+    return outbound ? -1 : 1;
+  }
+
+  switch (pkt->l4_proto) {
+  case ip_protocol_tcp:
+    type = nat_mapping_tcp;
+    aux_field = l4 + (outbound ? offsetof(sr_tcp_hdr_t, tcp_sport) :
+                                 offsetof(sr_tcp_hdr_t, tcp_dport));
+    port_rem = ntohs(sr_nat_get16(l4 + (outbound ? offsetof(sr_tcp_hdr_t, tcp_dport) :
+                                                   offsetof(sr_tcp_hdr_t, tcp_sport))));
+    sum_field = l4 + offsetof(sr_tcp_hdr_t, tcp_sum);
+    tcp_flags = ((sr_tcp_hdr_t *)l4)->tcp_flags;
+    break;
+  case ip_protocol_udp:
+    type = nat_mapping_udp;
+    aux_field = l4 + (outbound ? offsetof(sr_udp_hdr_t, udp_sport) :
+                                 offsetof(sr_udp_hdr_t, udp_dport));
+    /* a zero checksum means none was computed */
+    if (((sr_udp_hdr_t *)l4)->udp_sum != 0) {
+      sum_field = l4 + offsetof(sr_udp_hdr_t, udp_sum);
+    }
+    break;
+  case ip_protocol_icmp:
+    if (SR_NAT_ICMP_ERROR(((sr_icmp_hdr_t *)l4)->icmp_type)) {
+      return sr_nat_translate_error(nat, reader, pkt, outbound);
+    }
+    /* echo requests out, their replies back in; the id is in the
+       word after the checksum */
+    if (((sr_icmp_hdr_t *)l4)->icmp_type != (outbound ? 8 : 0) ||
+        ((sr_icmp_hdr_t *)l4)->icmp_code != 0) {
+      return outbound ? -1 : 1;
+    }
+    type = nat_mapping_icmp;
+    aux_field = l4 + sizeof(sr_icmp_hdr_t);
+    sum_field = l4 + offsetof(sr_icmp_hdr_t, icmp_sum);
+    pseudo = 0;
+    break;
+  default:
+    return (outbound || sr_nat_stray(nat, ip_hdr->ip_dst)) ? -1 : 1;
+  }
+  ip_field = (uint8_t *)ip_hdr + (outbound ? offsetof(sr_ip_hdr_t, ip_src) :
+                                             offsetof(sr_ip_hdr_t, ip_dst));
+  ip_old = sr_nat_get32(ip_field);
+  aux_old = sr_nat_get16(aux_field);
+
+  /* a source opening connections faster than its rate gets no mapping
+     for them, nor a connection through one it has */
+  int opener = type == nat_mapping_tcp &&
+    (tcp_flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN;
+  if (opener && outbound && sr_nat_syn_admit(nat, ip_old, sr_nat_now(nat)) != 0) {
+    return -1;
+  }
+
+  sr_nat_read_begin(nat, reader);
+  if (outbound) {
+    mapping = sr_nat_map_internal(nat, ip_old, ntohs(aux_old), type);
+  } else {
+    mapping = sr_nat_lookup_external(nat, ip_old, ntohs(aux_old), type);
+  }
+  if (mapping == NULL) {
+    sr_nat_read_end(nat, reader);
+    return (outbound || sr_nat_stray(nat, ip_old)) ? -1 : 1;
+  }
+  if (opener && !outbound &&
+      sr_nat_syn_admit(nat, ip_hdr->ip_src, sr_nat_now(nat)) != 0) {
+    sr_nat_read_end(nat, reader);
+    return -1;
+  }
+  if (type == nat_mapping_tcp &&
+      sr_nat_track_tcp(nat, mapping, outbound ? ip_hdr->ip_dst : ip_hdr->ip_src,
+                       port_rem, tcp_flags, outbound) == NULL) {
+    sr_nat_read_end(nat, reader);
+    return -1;
+  }
+  ip_new = outbound ? mapping->ip_ext : mapping->ip_int;
+  aux_new = htons(outbound ? mapping->aux_ext : mapping->aux_int);
+  sr_nat_read_end(nat, reader);
+
+  ip_hdr->ip_sum = cksum_adjust32(ip_hdr->ip_sum, ip_old, ip_new);
+  sr_nat_put32(ip_field, ip_new);
+  if (sum_field) {
+    sum = sr_nat_get16(sum_field);
+    if (pseudo) {
+      sum = cksum_adjust32(sum, ip_old, ip_new);
+    }
+    sum = cksum_adjust(sum, aux_old, aux_new);
+    if (sum == 0 && type == nat_mapping_udp) {
+      sum = 0xffff;
+    }
+    sr_nat_put16(sum_field, sum);
+  }
+  sr_nat_put16(aux_field, aux_new);
+  return 0;
 }
@@ -3,36 +3,142 @@
 #define SR_NAT_TABLE_H
 
 #include <inttypes.h>
+#include <stdio.h>
 #include <time.h>
 #include <pthread.h>
+#include "sr_protocol.h"
+#include "sr_slab.h"
+#include "sr_ports.h"
+#include "sr_epoch.h"
 
-#define NUM_PORTS 1024
+struct sr_pktinfo;
+
+#define SR_NAT_CONN_MAX 16384 /* tracked TCP connections, at least */
+#define SR_NAT_SESSIONS 1024  /* expected mappings unless told otherwise */
+#define SR_NAT_PORT_COOLDOWN 30 /* seconds before a released port is reused */
+#define SR_NAT_SHARD_BITS 4
+#define SR_NAT_SHARDS (1 << SR_NAT_SHARD_BITS)
+#define SR_NAT_LOCK_HIST 32 /* lock hold histogram buckets, powers of two ns */
+#define SR_NAT_BLOCK_MAX 1024 /* largest port block, see port_block */
+#define SR_NAT_HOST_BUCKETS 64 /* per shard, for the hosts holding blocks */
+#define SR_NAT_POOL_MAX 64 /* external addresses */
+#define SR_NAT_PAIR_BUCKETS 256 /* per shard, for hosts paired with an address */
+#define SR_NAT_CKPT_INTERVAL 60 /* seconds between checkpoints */
+#define SR_NAT_SYN_RATE 100 /* connections a source may open per second */
+#define SR_NAT_SYN_BUCKETS 4096 /* sources rate limited at once, about */
 
 typedef enum {
   nat_mapping_icmp,
-  nat_mapping_tcp
-  /* nat_mapping_udp, */
+  nat_mapping_tcp,
+  nat_mapping_udp
 } sr_nat_mapping_type;
 
+#define SR_NAT_NTYPES (nat_mapping_udp + 1)
+
+/* Timeout queues.  Each holds the sessions of one timeout class in the
+   order they were queued, so expiry only ever looks at the heads. */
+struct sr_nat_qlink {
+  struct sr_nat_qlink *prev, *next;
+  time_t queued;
+};
+
+/* TCP connection states. Each has its own idle timeout, so a connection
+   that has closed is let go of quickly instead of after est_it. */
 typedef enum {
-  nat_conn_established,
-  nat_conn_transitory
-} sr_nat_conn_status_type;
+  nat_tcp_syn_sent,     /* SYN seen from the side that opened */
+  nat_tcp_syn_recv,     /* and the SYN+ACK back, tr_it */
+  nat_tcp_established,  /* est_it */
+  nat_tcp_fin_wait,     /* FIN seen from one side, tr_it */
+  nat_tcp_last_ack,     /* FIN seen from both, SR_NAT_TCP_LAST_ACK */
+  nat_tcp_time_wait,    /* and the last ACK, SR_NAT_TCP_TIME_WAIT */
+  nat_tcp_close,        /* reset, SR_NAT_TCP_CLOSE */
+  nat_tcp_nstates
+} sr_nat_tcp_state;
+
+/* What a SYN flood leaves behind: connections that saw a SYN but not the
+   end of the handshake. */
+#define SR_NAT_HALF_OPEN(state) ((state) <= nat_tcp_syn_recv)
+
+#define SR_NAT_TCP_LAST_ACK  30
+#define SR_NAT_TCP_TIME_WAIT 60
+#define SR_NAT_TCP_CLOSE     10
 
 typedef enum {
-  nat_conn_syn_client,
-  nat_conn_syn_server,
-  nat_conn_syn_both
-} sr_nat_conn_handshake;
+  nat_queue_query,    /* ICMP mappings, qtimeout */
+  nat_queue_udp,      /* UDP mappings, udp_it */
+  nat_queue_unused,   /* TCP mappings without connections, tr_it */
+  nat_queue_tcp,      /* connections, one queue per sr_nat_tcp_state */
+  nat_nqueues = nat_queue_tcp + nat_tcp_nstates
+} sr_nat_queue_type;
+
+/* sr_nat_connection flags */
+#define SR_NAT_CONN_INBOUND 0x01 /* opened from outside */
+#define SR_NAT_CONN_FIN_OUT 0x02 /* FIN seen from the internal host */
+#define SR_NAT_CONN_FIN_IN  0x04 /* FIN seen from the remote host */
 
+/* A TCP connection through a mapping, keyed by its full 5-tuple: the
+   mapping's internal address and port, and the remote address and port. */
 struct sr_nat_connection {
-  /* add TCP connection state data members here */
-  sr_nat_conn_status_type status;
-  sr_nat_conn_handshake handshake;
-  uint32_t host_ip;
-  uint16_t host_port;
+  uint32_t ip_int;
+  uint32_t ip_rem;
+  uint16_t port_int;
+  uint16_t port_rem;
+  uint8_t state; /* sr_nat_tcp_state */
+  uint8_t flags;
   time_t last_active;
-  struct sr_nat_connection *next;
+  struct sr_nat_qlink lru; /* on the queue for its state */
+  struct sr_nat_mapping *mapping;
+  struct sr_nat_connection *next_hash; /* connection index chain */
+  struct sr_epoch_node retire;
+};
+
+/* An external address and its port spaces, one per shard and mapping
+   type, made the first time they're needed. Shard s hands out the ports
+   that are s modulo SR_NAT_SHARDS. In block mode the address is instead
+   split into blocks of port_block ports, and shard s hands out the blocks
+   whose index is s modulo SR_NAT_SHARDS, by their first port. The
+   counters are updated from every shard, atomically. */
+struct sr_nat_addr {
+  uint32_t ip;
+  unsigned int index; /* in the order addresses were made, pool first */
+  struct sr_ports *ports[SR_NAT_SHARDS][SR_NAT_NTYPES];
+  struct sr_ports *blocks[SR_NAT_SHARDS];
+  unsigned int in_use; /* mappings on it */
+  unsigned int hosts; /* internal hosts paired with it */
+  unsigned long allocs; /* mappings made on it, ever */
+  unsigned long failed; /* times a paired host found no port free on it */
+  struct sr_nat_addr *next;
+};
+
+/* With more than one address in the pool, an internal host and the one
+   all its mappings use, so a remote peer sees it at one address
+   ("paired" pooling). It's chosen for the host's first mapping and let go
+   of with its last. In block mode the host's block pairs it instead. */
+struct sr_nat_pair {
+  uint32_t ip_int;
+  struct sr_nat_addr *addr;
+  unsigned int nmappings;
+  struct sr_nat_pair *next_hash;
+};
+
+/* Pairs live in a table of their own, split by host between locks that
+   are only ever taken last. */
+struct sr_nat_pairs {
+  pthread_mutex_t lock;
+  struct sr_nat_pair *buckets[SR_NAT_PAIR_BUCKETS];
+};
+
+/* In block mode, an internal host and the block of external ports its
+   mappings of every type take theirs from. It lives in its shard, and
+   gives the block back with its last mapping. */
+struct sr_nat_host {
+  uint32_t ip_int;
+  struct sr_nat_addr *addr;
+  uint16_t first; /* first port of the block */
+  uint16_t next[SR_NAT_NTYPES]; /* offset to look for a free port from */
+  unsigned int nmappings;
+  uint64_t used[SR_NAT_NTYPES][SR_NAT_BLOCK_MAX / 64]; /* ports taken */
+  struct sr_nat_host *next_hash;
 };
 
 struct sr_nat_mapping {
@@ -41,45 +147,204 @@ struct sr_nat_mapping {
   uint32_t ip_ext; /* external ip addr */
   uint16_t aux_int; /* internal port or icmp id */
   uint16_t aux_ext; /* external port or icmp id */
-  time_t last_updated; /* use to timeout mappings */
-  struct sr_nat_connection *conns; /* list of connections. null for ICMP */
+  time_t last_updated; /* use to timeout mappings, set by lookups */
+  unsigned int nconns; /* connections through it. 0 for ICMP and UDP */
+  struct sr_nat_qlink lru; /* on a timeout queue unless it has connections */
+  struct sr_epoch_node retire;
+  struct sr_nat_addr *addr; /* holds aux_ext */
+  struct sr_nat_host *host; /* whose block holds it, in block mode */
+  unsigned int shard; /* index of the shard it lives in */
   struct sr_nat_mapping *next;
+  struct sr_nat_mapping *prev;
+  struct sr_nat_mapping *next_int; /* internal index chain */
+  struct sr_nat_mapping *next_ext; /* external index chain */
+};
+
+/* A mapping lives in the shard its internal key hashes to, and its
+   external port is one that shard owns, so both lookups for it land on
+   the same shard. Writers take the shard's lock; readers walk the index
+   chains without it. */
+struct sr_nat_shard {
+  pthread_mutex_t lock;
+  /* two indexes over the shard's mappings: by (type, ip_int, aux_int) and
+     by (type, ip_ext, aux_ext), and one over their connections by 5-tuple, each
+     hash_mask + 1 buckets */
+  struct sr_nat_mapping **by_int;
+  struct sr_nat_mapping **by_ext;
+  struct sr_nat_connection **by_conn;
+  struct sr_nat_mapping *mappings;
+  struct sr_nat_qlink queues[nat_nqueues];
+  struct sr_nat_host *hosts[SR_NAT_HOST_BUCKETS];
+  unsigned int half_open; /* connections in a SR_NAT_HALF_OPEN state */
+  /* how long the lock was held, each hold counted in bucket b when it
+     lasted 2^b to 2^(b+1) ns; kept only when sr_nat.c is built with
+     SR_NAT_LOCK_STATS, as for natbench */
+  struct timespec locked_at;
+  unsigned long lock_hist[SR_NAT_LOCK_HIST];
+  uint64_t lock_ns;
+  uint64_t lock_max_ns;
+};
+
+/* A source's allowance of new connections, refilled at syn_rate a second
+   up to syn_burst. Sources whose addresses hash alike share one. */
+struct sr_nat_syn_bucket {
+  unsigned int tokens;
+  time_t last; /* refilled up to */
 };
 
 struct sr_nat {
   /* add any fields here */
-  struct sr_nat_mapping *mappings;
+  struct sr_nat_shard shards[SR_NAT_SHARDS];
+  uint32_t hash_mask;
+  unsigned int nmappings;
+  struct sr_epoch epoch; /* retired mappings and connections */
+  struct sr_slab mapping_slab; /* one mapping per external port at most */
+  struct sr_slab conn_slab;
+  struct sr_slab host_slab;
+  struct sr_slab pair_slab;
+  struct sr_nat_pairs pairs[SR_NAT_SHARDS];
   int qtimeout; /* ICMP query timeout interval */
   int est_it; /* TCP Established Idle Timeout */
   int tr_it; /* TCP Transitory Idle Timeout */
-  
-  uint16_t[] ports_used;
+  int udp_it; /* UDP Idle Timeout */
+  int port_cooldown; /* seconds before a released port is handed out again */
+  unsigned int port_block; /* ports per host block, 0 to allocate per mapping */
+  /* deterministic mode: internal host det_base + i holds block i, counting
+     on through the pool's addresses in turn, and an external port finds
+     its mapping in det_slots, one per address, type and port */
+  uint32_t det_base; /* host byte order */
+  unsigned int det_hosts; /* 0 unless deterministic */
+  unsigned int det_naddrs; /* addresses det_slots covers */
+  struct sr_nat_mapping **det_slots;
+  const char *ckpt_path; /* checkpoint file, if any */
+  int ckpt_interval; /* seconds between checkpoints, 0 for none */
+  time_t ckpt_last;
+  pthread_mutex_t ckpt_lock; /* one checkpoint at a time */
+  FILE *log; /* where mappings, or blocks, are logged as they come and go */
+  /* SYN flood defenses: the SYNs each source may send, and the half-open
+     connections kept, split evenly between the shards, before the oldest
+     makes way. 0 turns either off. */
+  unsigned int syn_rate;
+  unsigned int syn_burst;
+  unsigned int syn_max;
+  struct sr_nat_syn_bucket *syn_buckets;
+  pthread_mutex_t syn_locks[SR_NAT_SHARDS]; /* by bucket index */
+  unsigned long syn_limited; /* SYNs dropped over a source's rate */
+  unsigned long syn_evicted; /* half-open connections let go early */
+
+  struct sr_nat_addr *addrs; /* external addresses in use, added under lock */
+  unsigned int naddrs;
+  /* the addresses new mappings are made on; the external interface's
+     alone unless others were added before traffic flowed */
+  struct sr_nat_addr *pool[SR_NAT_POOL_MAX];
+  unsigned int npool;
+  /* where the NAT gets the time, fixed by sr_nat_init(..): time(2),
+     unless a benchmark simulates it, in which case expiry is left to
+     whoever drives that clock, with sr_nat_expire(..) */
+  time_t (*clock)(time_t *);
+  struct sr_instance *sr;
+  char out_if_name[sr_IFACE_NAMELEN]; /* external interface */
+  int out_ifindex; /* and its index, -1 until the interfaces are known */
   /* threading */
   pthread_mutex_t lock;
   pthread_mutexattr_t attr;
   pthread_attr_t thread_attr;
   pthread_t thread;
+  int stop; /* tells the timeout thread to return */
 };
 
 
-int   sr_nat_init(struct sr_nat *nat);     /* Initializes the nat */
+/* Initializes the nat, sizing its tables for 'sessions' mappings, on
+   'clock' (time(2) if NULL). The timeout thread starts last, once all
+   of it is in place, and only if the rest succeeded. */
+int   sr_nat_init(struct sr_nat *nat, unsigned int sessions,
+                  time_t (*clock)(time_t *));
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
 void *sr_nat_timeout(void *nat_ptr);  /* Periodic Timout */
 
-/* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
+/* Expire, in every shard, what has been idle too long at 'now', then free
+   what no reader can still hold. The timeout thread does this once a
+   second. */
+void  sr_nat_expire(struct sr_nat *nat, time_t now);
+
+/* Switch to deterministic mode, with port_block set: the 'hosts' internal
+   addresses from 'base' (host byte order) each get the block of external
+   ports their offset from 'base' numbers, and no others are translated.
+   Call before any mapping is made. */
+int   sr_nat_deterministic(struct sr_nat *nat, uint32_t base, unsigned int hosts);
+
+/* Add 'ip' (network byte order) to the pool of external addresses, before
+   traffic flows and before sr_nat_deterministic(..). Returns 0, or -1 if
+   the pool is full. */
+int   sr_nat_add_address(struct sr_nat *nat, uint32_t ip);
+
+/* Whether 'ip' is one of the pool's addresses, which the router answers
+   ARP for on the external interface. */
+int   sr_nat_owns(struct sr_nat *nat, uint32_t ip);
+
+/* Print each address's ports in use, paired hosts and counters, and how
+   often the SYN flood defenses stepped in. */
+void  sr_nat_report(struct sr_nat *nat, FILE *fp);
+
+/* Write every mapping and TCP connection to 'path', replacing it only once
+   the new checkpoint is complete. Returns 0 or -1. */
+int   sr_nat_save(struct sr_nat *nat, const char *path);
+
+/* Load a checkpoint written by sr_nat_save(..) by a NAT in the same mode,
+   claiming each session's external port again. Call once the external
+   interface is known and before traffic flows; sessions on an address
+   that isn't in the pool any more are dropped. Returns the number of
+   sessions restored, or -1 if the file can't be read or doesn't fit. */
+int   sr_nat_restore(struct sr_nat *nat, const char *path);
+
+/* Each thread that looks mappings up registers once for a reader, and
+   brackets every packet with sr_nat_read_begin(..)/sr_nat_read_end(..).
+   The mappings the calls below return stay valid until the end of the
+   caller's section; they must not be kept past it. */
+struct sr_epoch_reader *sr_nat_reader(struct sr_nat *nat);
+void  sr_nat_read_begin(struct sr_nat *nat, struct sr_epoch_reader *reader);
+void  sr_nat_read_end(struct sr_nat *nat, struct sr_epoch_reader *reader);
+
+/* Get the mapping associated with given external (ip, port) pair. */
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type );
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type );
 
-/* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
+/* Get the mapping associated with given internal (ip, port) pair. */
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
 
-/* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
+/* Insert a new mapping into the nat's mapping table, or find the one
+   another thread just inserted for the same pair. */
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
 
+/* The mapping for an outbound packet from (ip_int, aux_int), made if
+   there's none yet. Finding an existing one takes no lock, so a flow
+   only pays for the shard lock on its first packet. NULL if no mapping
+   can be made. */
+struct sr_nat_mapping *sr_nat_map_internal(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
+
+/* Account a TCP segment with 'tcp_flags' between a TCP mapping and the
+   remote (ip_rem, port_rem), 'outbound' if it came from the internal
+   host. Returns its connection, or NULL if the segment should be dropped:
+   it opens nothing and belongs to no connection, or there's no room. */
+struct sr_nat_connection *sr_nat_track_tcp(struct sr_nat *nat,
+  struct sr_nat_mapping *mapping, uint32_t ip_rem, uint16_t port_rem,
+  uint8_t tcp_flags, int outbound);
+
+
+/* Translate a packet crossing the NAT, in place: the source of one sent
+   out the external interface ('outbound'), the destination of one
+   received on it. Addresses, ports and ICMP ids are rewritten and the
+   checksums covering them adjusted, without touching the payload. An
+   ICMP error (unreachable, time exceeded, parameter problem) is matched
+   by the header it quotes, which is translated too.
+   Returns 0 once translated, 1 if an inbound packet belongs to no
+   mapping (it may be for the router itself), or -1 if the packet must be
+   dropped. 'reader' is the calling thread's, see sr_nat_reader(..). */
+int sr_nat_translate(struct sr_nat *nat, struct sr_epoch_reader *reader,
+  struct sr_pktinfo *pkt, int outbound);
+
 
 #endif
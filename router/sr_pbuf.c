@@ -0,0 +1,283 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pbuf.c
+ *
+ * Description:
+ *
+ * Packet buffer pool, see sr_pbuf.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "sr_pbuf.h"
+#include "sr_huge.h"
+
+struct sr_pbuf_cache
+{
+    unsigned int    n;
+    struct sr_pbuf* bufs[SR_PBUF_CACHE];
+};
+
+static struct
+{
+    uint8_t*        base;      /* the arena, 'count' buffers */
+    unsigned int    count;
+    pthread_mutex_t lock;
+    struct sr_pbuf* free;      /* shared free list */
+    unsigned int    nfree;
+    unsigned long   failed;    /* allocations the pool could not serve */
+    pthread_key_t   key;       /* flushes a thread's cache when it exits */
+} sr_pbuf_pool;
+
+static __thread struct sr_pbuf_cache sr_pbuf_tcache;
+static __thread int sr_pbuf_tcache_registered;
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pbuf_cache_drain(..)
+ * Scope: Local
+ *
+ * Give all but 'keep' of a thread's cached buffers back to the pool.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_pbuf_cache_drain(struct sr_pbuf_cache* c, unsigned int keep)
+{
+    pthread_mutex_lock(&sr_pbuf_pool.lock);
+    while (c->n > keep)
+    {
+        struct sr_pbuf* p = c->bufs[--c->n];
+        p->next = sr_pbuf_pool.free;
+        sr_pbuf_pool.free = p;
+        sr_pbuf_pool.nfree++;
+    }
+    pthread_mutex_unlock(&sr_pbuf_pool.lock);
+} /* -- sr_pbuf_cache_drain -- */
+
+static void sr_pbuf_thread_exit(void* arg)
+{
+    sr_pbuf_cache_drain((struct sr_pbuf_cache*)arg, 0);
+} /* -- sr_pbuf_thread_exit -- */
+
+static struct sr_pbuf_cache* sr_pbuf_cache(void)
+{
+    if (!sr_pbuf_tcache_registered)
+    {
+        pthread_setspecific(sr_pbuf_pool.key, &sr_pbuf_tcache);
+        sr_pbuf_tcache_registered = 1;
+    }
+    return &sr_pbuf_tcache;
+} /* -- sr_pbuf_cache -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pbuf_pool_init(..)
+ * Scope: Global
+ *
+ * Carve 'count' buffers out of one arena, on huge pages if we can get
+ * them.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_pbuf_pool_init(unsigned int count)
+{
+    struct sr_pbuf* p;
+    unsigned int i;
+
+    assert(sizeof(struct sr_pbuf) == SR_PBUF_SIZE);
+
+    sr_pbuf_pool.base = sr_huge_alloc("pbuf", (size_t)count * SR_PBUF_SIZE);
+    if (!sr_pbuf_pool.base)
+    {
+        fprintf(stderr,"Error: out of memory (sr_pbuf_pool_init)\n");
+        sr_pbuf_pool.base = 0;
+        return -1;
+    }
+    sr_pbuf_pool.count = count;
+    sr_pbuf_pool.free  = 0;
+    sr_pbuf_pool.nfree = count;
+    pthread_mutex_init(&sr_pbuf_pool.lock, 0);
+    pthread_key_create(&sr_pbuf_pool.key, sr_pbuf_thread_exit);
+
+    /* -- lowest addresses first out -- */
+    for (i = count; i > 0; i--)
+    {
+        p = (struct sr_pbuf*)(sr_pbuf_pool.base + (size_t)(i - 1) * SR_PBUF_SIZE);
+        p->refcnt = 0;
+        p->next = sr_pbuf_pool.free;
+        sr_pbuf_pool.free = p;
+    }
+    return 0;
+} /* -- sr_pbuf_pool_init -- */
+
+void sr_pbuf_pool_destroy(void)
+{
+    unsigned int in_use;
+    unsigned long failed;
+
+    if (!sr_pbuf_pool.base)
+    { return; }
+
+    sr_pbuf_cache_drain(&sr_pbuf_tcache, 0);
+    sr_pbuf_stats(&in_use, &failed);
+    if (failed)
+    { fprintf(stderr, "pbuf: pool ran dry %lu times\n", failed); }
+
+    /* -- other threads may still hold buffers, leave the arena alone -- */
+} /* -- sr_pbuf_pool_destroy -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pbuf_alloc(..)
+ * Scope: Global
+ *
+ * A buffer with one reference, no data and the default headroom, or 0
+ * when the pool is exhausted.
+ *
+ *---------------------------------------------------------------------------*/
+
+struct sr_pbuf* sr_pbuf_alloc(void)
+{
+    struct sr_pbuf_cache* c = sr_pbuf_cache();
+    struct sr_pbuf* p;
+
+    if (c->n == 0)
+    {
+        /* -- refill half the cache in one go -- */
+        pthread_mutex_lock(&sr_pbuf_pool.lock);
+        while (c->n < SR_PBUF_CACHE / 2 && sr_pbuf_pool.free)
+        {
+            c->bufs[c->n++] = sr_pbuf_pool.free;
+            sr_pbuf_pool.free = sr_pbuf_pool.free->next;
+            sr_pbuf_pool.nfree--;
+        }
+        if (c->n == 0)
+        { sr_pbuf_pool.failed++; }
+        pthread_mutex_unlock(&sr_pbuf_pool.lock);
+
+        if (c->n == 0)
+        { return 0; }
+    }
+
+    p = c->bufs[--c->n];
+    p->next   = 0;
+    p->refcnt = 1;
+    p->off    = SR_PBUF_HEADROOM;
+    p->len    = 0;
+    p->ifindex = -1;
+    return p;
+} /* -- sr_pbuf_alloc -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pbuf_of(..)
+ * Scope: Global
+ *
+ * The buffer 'ptr' points into, 0 if it is not pool memory (a backend
+ * ring, the stack ...).
+ *
+ *---------------------------------------------------------------------------*/
+
+struct sr_pbuf* sr_pbuf_of(const uint8_t* ptr)
+{
+    size_t off;
+
+    if (ptr < sr_pbuf_pool.base)
+    { return 0; }
+    off = (size_t)(ptr - sr_pbuf_pool.base);
+    if (off >= (size_t)sr_pbuf_pool.count * SR_PBUF_SIZE)
+    { return 0; }
+    return (struct sr_pbuf*)(sr_pbuf_pool.base + off - off % SR_PBUF_SIZE);
+} /* -- sr_pbuf_of -- */
+
+void sr_pbuf_ref(struct sr_pbuf* p)
+{
+    __atomic_add_fetch(&p->refcnt, 1, __ATOMIC_RELAXED);
+} /* -- sr_pbuf_ref -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pbuf_free(..)
+ * Scope: Global
+ *
+ * Drop a reference; the last one puts the buffer in this thread's cache.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_pbuf_free(struct sr_pbuf* p)
+{
+    struct sr_pbuf_cache* c;
+
+    if (!p)
+    { return; }
+    if (__atomic_sub_fetch(&p->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+    { return; }
+
+    c = sr_pbuf_cache();
+    if (c->n == SR_PBUF_CACHE)
+    { sr_pbuf_cache_drain(c, SR_PBUF_CACHE / 2); }
+    c->bufs[c->n++] = p;
+} /* -- sr_pbuf_free -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pbuf_prepend(..)
+ * Scope: Global
+ *
+ * Grow the data by 'len' bytes at the front, 0 if the headroom is too
+ * small.  Returns the new start of the data.
+ *
+ *---------------------------------------------------------------------------*/
+
+uint8_t* sr_pbuf_prepend(struct sr_pbuf* p, unsigned int len)
+{
+    if (len > p->off)
+    { return 0; }
+    p->off -= len;
+    p->len += len;
+    return sr_pbuf_data(p);
+} /* -- sr_pbuf_prepend -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pbuf_append(..)
+ * Scope: Global
+ *
+ * Grow the data by 'len' bytes at the end, 0 if the tailroom is too
+ * small.  Returns a pointer to the new bytes.
+ *
+ *---------------------------------------------------------------------------*/
+
+uint8_t* sr_pbuf_append(struct sr_pbuf* p, unsigned int len)
+{
+    uint8_t* tail = sr_pbuf_data(p) + p->len;
+
+    if (len > sr_pbuf_tailroom(p))
+    { return 0; }
+    p->len += len;
+    return tail;
+} /* -- sr_pbuf_append -- */
+
+unsigned int sr_pbuf_headroom(const struct sr_pbuf* p)
+{
+    return p->off;
+} /* -- sr_pbuf_headroom -- */
+
+unsigned int sr_pbuf_tailroom(const struct sr_pbuf* p)
+{
+    return SR_PBUF_ROOM - p->off - p->len;
+} /* -- sr_pbuf_tailroom -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pbuf_stats(..)
+ * Scope: Global
+ *
+ * Buffers not on the shared free list (in flight or sitting in a thread
+ * cache) and the number of failed allocations.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_pbuf_stats(unsigned int* in_use, unsigned long* failed)
+{
+    pthread_mutex_lock(&sr_pbuf_pool.lock);
+    *in_use = sr_pbuf_pool.count - sr_pbuf_pool.nfree;
+    *failed = sr_pbuf_pool.failed;
+    pthread_mutex_unlock(&sr_pbuf_pool.lock);
+} /* -- sr_pbuf_stats -- */
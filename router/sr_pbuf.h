@@ -0,0 +1,71 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pbuf.h
+ *
+ * Description:
+ *
+ * Packet buffer pool.  Every frame the router receives, builds or queues
+ * lives in a fixed size, cache aligned buffer taken from one contiguous
+ * arena, so the forwarding path never goes to malloc(..).  A buffer
+ * carries a reference count, so the ARP queue can hold on to a received
+ * frame without copying it, and leaves headroom in front of the data so
+ * a transport header (c_packet_header for VNS) can be prepended in place.
+ *
+ * Each thread keeps a small cache of free buffers and only takes the
+ * pool lock to refill or drain it in batches.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PBUF_H
+#define SR_PBUF_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_PBUF_SIZE      2048   /* bytes per buffer, header included */
+#define SR_PBUF_HEADROOM  64     /* default room kept in front of the data */
+#define SR_PBUF_COUNT     4096   /* buffers in the pool */
+#define SR_PBUF_CACHE     64     /* free buffers a thread keeps to itself */
+
+/* ----------------------------------------------------------------------------
+ * struct sr_pbuf
+ *
+ * The header fills exactly one cache line; the rest of the buffer is
+ * room[], of which [off, off + len) holds the packet.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_pbuf
+{
+    struct sr_pbuf* next;             /* free list link */
+    uint32_t        refcnt;
+    uint16_t        off;              /* start of the data in room[] */
+    uint16_t        len;              /* bytes of data */
+    int32_t         ifindex;          /* receiving interface */
+    uint8_t         pad[64 - sizeof(void*) - 12];
+    uint8_t         room[SR_PBUF_SIZE - 64];
+};
+
+#define SR_PBUF_ROOM     (SR_PBUF_SIZE - 64)
+#define sr_pbuf_data(p)  ((p)->room + (p)->off)
+
+int  sr_pbuf_pool_init(unsigned int count);
+void sr_pbuf_pool_destroy(void);
+
+struct sr_pbuf* sr_pbuf_alloc(void);
+struct sr_pbuf* sr_pbuf_of(const uint8_t* ptr);
+void sr_pbuf_ref(struct sr_pbuf* p);
+void sr_pbuf_free(struct sr_pbuf* p);
+
+uint8_t* sr_pbuf_prepend(struct sr_pbuf* p, unsigned int len);
+uint8_t* sr_pbuf_append(struct sr_pbuf* p, unsigned int len);
+unsigned int sr_pbuf_headroom(const struct sr_pbuf* p);
+unsigned int sr_pbuf_tailroom(const struct sr_pbuf* p);
+
+void sr_pbuf_stats(unsigned int* in_use, unsigned long* failed);
+
+#endif /* -- SR_PBUF_H -- */
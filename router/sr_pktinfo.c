@@ -0,0 +1,218 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pktinfo.c
+ *
+ * Description:
+ *
+ * Ingress parse of a received frame, see sr_pktinfo.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "sr_pktinfo.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+
+#define SR_PKTINFO_MTU 1500 /* largest frame we accept, as before */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pktinfo_mix(..)
+ * Scope: Local
+ *
+ * One round of murmur3.
+ *
+ *---------------------------------------------------------------------------*/
+
+static uint32_t sr_pktinfo_mix(uint32_t h, uint32_t k)
+{
+    k *= 0xcc9e2d51;
+    k  = (k << 15) | (k >> 17);
+    k *= 0x1b873593;
+    h ^= k;
+    h  = (h << 13) | (h >> 19);
+    return h * 5 + 0xe6546b64;
+} /* -- sr_pktinfo_mix -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pktinfo_hash(..)
+ * Scope: Global
+ *
+ * Hash of a flow; addresses and ports as they appear in the packet.
+ *
+ *---------------------------------------------------------------------------*/
+
+uint32_t sr_pktinfo_hash(uint32_t src, uint32_t dst, uint8_t proto,
+                         uint16_t sport, uint16_t dport)
+{
+    uint32_t h = proto;
+
+    h = sr_pktinfo_mix(h, src);
+    h = sr_pktinfo_mix(h, dst);
+    h = sr_pktinfo_mix(h, ((uint32_t)sport << 16) | dport);
+
+    /* -- murmur3 finalizer -- */
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+} /* -- sr_pktinfo_hash -- */
+
+uint64_t sr_pktinfo_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+} /* -- sr_pktinfo_clock -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pktinfo_parse_arp(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_pktinfo_parse_arp(struct sr_pktinfo* info)
+{
+    sr_arp_hdr_t* arp_hdr;
+
+    if (info->len < info->l3_off + sizeof(sr_arp_hdr_t)) {
+        fprintf(stderr, "Error: invalid ARP header length\n");
+        return -1;
+    }
+    arp_hdr = (sr_arp_hdr_t*)(info->buf + info->l3_off);
+
+    /* check if ARP hardware type is ethernet */
+    if (arp_hdr->ar_hrd != htons(arp_hrd_ethernet)) {
+        fprintf(stderr, "Error: unknown ARP hardware format\n");
+        return -1;
+    }
+
+    /* check if arp protocol type is ip */
+    if (arp_hdr->ar_pro != htons(ethertype_ip)) {
+        fprintf(stderr, "Error: unknown ARP protocol format\n");
+        return -1;
+    }
+
+    info->l3_hlen = sizeof(sr_arp_hdr_t);
+    info->l3_len  = sizeof(sr_arp_hdr_t);
+    info->flow_hash = sr_pktinfo_hash(arp_hdr->ar_sip, arp_hdr->ar_tip, 0, 0, 0);
+    return 0;
+} /* -- sr_pktinfo_parse_arp -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pktinfo_parse_ip(..)
+ * Scope: Local
+ *
+ * Check version, header length (options included), total length and
+ * header checksum, then locate the transport header if this is the
+ * first (or only) fragment and the header fits.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_pktinfo_parse_ip(struct sr_pktinfo* info)
+{
+    sr_ip_hdr_t* ip_hdr;
+    unsigned int hlen, tlen, l4_min = 0;
+    uint16_t sport = 0, dport = 0;
+
+    if (info->len < info->l3_off + sizeof(sr_ip_hdr_t)) {
+        fprintf(stderr, "Error: invalid IP header length\n");
+        return -1;
+    }
+    ip_hdr = (sr_ip_hdr_t*)(info->buf + info->l3_off);
+    hlen = ip_hdr->ip_hl * 4;
+    tlen = ntohs(ip_hdr->ip_len);
+
+    if (ip_hdr->ip_v != 4 || hlen < sizeof(sr_ip_hdr_t) ||
+        tlen < hlen || info->l3_off + tlen > info->len) {
+        fprintf(stderr, "Error: invalid IP header length\n");
+        return -1;
+    }
+
+    /* perform ip header checksum */
+    if (cksum(ip_hdr, hlen) != 0xffff) {
+        fprintf(stderr, "Error: IP checksum failed\n");
+        return -1;
+    }
+
+    info->l3_hlen  = hlen;
+    info->l3_len   = tlen;
+    info->l4_proto = ip_hdr->ip_p;
+    info->l4_off   = info->l3_off + hlen;
+
+    if (ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK))
+    { info->flags |= SR_PKTINFO_FRAG; }
+
+    switch (ip_hdr->ip_p) {
+    case ip_protocol_icmp: l4_min = 8;                    break;
+    case ip_protocol_tcp:  l4_min = sizeof(sr_tcp_hdr_t); break;
+    case ip_protocol_udp:  l4_min = sizeof(sr_udp_hdr_t); break;
+    }
+
+    /* -- later fragments carry no transport header -- */
+    if (l4_min && !(ntohs(ip_hdr->ip_off) & IP_OFFMASK) &&
+        tlen - hlen >= l4_min) {
+        info->flags |= SR_PKTINFO_L4;
+        if (ip_hdr->ip_p != ip_protocol_icmp) {
+            /* -- TCP and UDP both lead with the two ports -- */
+            sport = ((sr_udp_hdr_t*)(info->buf + info->l4_off))->udp_sport;
+            dport = ((sr_udp_hdr_t*)(info->buf + info->l4_off))->udp_dport;
+        }
+    }
+
+    info->flow_hash = sr_pktinfo_hash(ip_hdr->ip_src, ip_hdr->ip_dst,
+                                      ip_hdr->ip_p, sport, dport);
+    return 0;
+} /* -- sr_pktinfo_parse_ip -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_pktinfo_parse(..)
+ * Scope: Global
+ *
+ * Fill in 'info' for the frame at 'buf'.  Returns 0 if the frame is
+ * well formed and of a type the router handles, -1 (after saying why)
+ * if it should be dropped.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_pktinfo_parse(struct sr_pktinfo* info, uint8_t* buf,
+                     unsigned int len, int ifindex, uint64_t rx_ns)
+{
+    assert(info);
+    assert(buf);
+
+    memset(info, 0, sizeof(*info));
+    info->buf     = buf;
+    info->len     = len;
+    info->ifindex = ifindex;
+    info->rx_ns   = rx_ns;
+
+    /* check if header has the correct size */
+    if (len < sizeof(sr_ethernet_hdr_t)) {
+        fprintf(stderr, "Error: invalid packet length (ether_hdr)\n");
+        return -1;
+    }
+
+    if (len > SR_PKTINFO_MTU) {
+        fprintf(stderr, "Error: packet length longer than MTU(ether_hdr)\n");
+        return -1;
+    }
+
+    info->ethertype = ethertype(buf);
+    info->l3_off    = sizeof(sr_ethernet_hdr_t);
+
+    switch (info->ethertype) {
+    case ethertype_arp:
+        return sr_pktinfo_parse_arp(info);
+    case ethertype_ip:
+        return sr_pktinfo_parse_ip(info);
+    default:
+        fprintf(stderr, "Unknown ether_type: %d\n", info->ethertype);
+        return -1;
+    }
+} /* -- sr_pktinfo_parse -- */
@@ -0,0 +1,61 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pktinfo.h
+ *
+ * Description:
+ *
+ * Parsed packet descriptor.  sr_handlepacket(..) validates a received
+ * frame once, with sr_pktinfo_parse(..), and every later stage (ARP, IP,
+ * ICMP generation, the ARP queue) works from the offsets and lengths
+ * recorded here instead of re-deriving them from the headers.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PKTINFO_H
+#define SR_PKTINFO_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+/* -- flags -- */
+#define SR_PKTINFO_L4    0x01   /* l4_off points at a complete TCP/UDP/ICMP header */
+#define SR_PKTINFO_FRAG  0x02   /* IP fragment (MF set or non-zero offset) */
+#define SR_PKTINFO_NAT   0x04   /* translated by the NAT since the parse */
+
+/* ----------------------------------------------------------------------------
+ * struct sr_pktinfo
+ *
+ * Offsets are from buf, which is the start of the Ethernet header.  For
+ * ARP the "network header" is the ARP header.  All lengths have been
+ * checked against the frame, so a stage can use them without looking at
+ * len again.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_pktinfo
+{
+    uint8_t*  buf;          /* the frame, l2 header at offset 0 */
+    uint16_t  len;          /* bytes in the frame */
+    uint16_t  ethertype;    /* host byte order */
+    uint16_t  l3_off;       /* network header */
+    uint16_t  l3_hlen;      /* IP header length, options included */
+    uint16_t  l3_len;       /* IP total length (header and payload) */
+    uint16_t  l4_off;       /* transport header, if SR_PKTINFO_L4 */
+    uint8_t   l4_proto;     /* ip_p */
+    uint8_t   flags;        /* SR_PKTINFO_* */
+    int16_t   ifindex;      /* receiving interface */
+    uint32_t  flow_hash;    /* addresses, protocol and ports */
+    uint64_t  rx_ns;        /* receive time, see sr_pktinfo_clock(..) */
+};
+
+int      sr_pktinfo_parse(struct sr_pktinfo* info, uint8_t* buf,
+                          unsigned int len, int ifindex, uint64_t rx_ns);
+uint32_t sr_pktinfo_hash(uint32_t src, uint32_t dst, uint8_t proto,
+                         uint16_t sport, uint16_t dport);
+uint64_t sr_pktinfo_clock(void);
+
+#endif /* -- SR_PKTINFO_H -- */
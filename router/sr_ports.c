@@ -0,0 +1,198 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ports.c
+ *
+ * Description:
+ *
+ * NAT port spaces, see sr_ports.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_ports.h"
+#include "sr_mem.h"
+
+/* -- slot[] values for ports not in free[] -- */
+#define SR_PORTS_BUSY    0xffff
+#define SR_PORTS_COOLING 0xfffe
+
+#define SR_PORTS_INDEX(ports, port) (((port) - (ports)->first) / (ports)->stride)
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_ports_init(..)
+ * Scope: Global
+ *
+ * All ports from 'first' up to SR_PORTS_HI, 'stride' apart, free.
+ * Released ports are held back 'cooldown' seconds;
+ * 'seed' varies the allocation order between spaces.  Returns 0, or -1
+ * if the NAT's memory ceiling won't allow the space.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_ports_init(struct sr_ports* ports, uint16_t first, uint16_t stride,
+                  unsigned int cooldown, uint32_t seed)
+{
+    uint8_t* mem;
+    unsigned int i, count;
+
+    assert(ports);
+    assert(first >= SR_PORTS_LO && stride > 0);
+
+    /* -- free, slot and cool, then cool_until -- */
+    count = (SR_PORTS_HI - first) / stride + 1;
+    mem = sr_mem_alloc(SR_MEM_NAT, count * (3 * sizeof(uint16_t) +
+                                            sizeof(uint32_t)));
+    if (!mem)
+    { return -1; }
+
+    memset(ports, 0, sizeof(*ports));
+    ports->first      = first;
+    ports->stride     = stride;
+    ports->count      = count;
+    ports->cool_until = (uint32_t*)mem;
+    ports->free       = (uint16_t*)(ports->cool_until + count);
+    ports->slot       = ports->free + count;
+    ports->cool       = ports->slot + count;
+    ports->cooldown   = cooldown;
+    ports->rng        = seed ? seed : 0x9e3779b9;
+
+    for (i = 0; i < count; i++)
+    {
+        ports->free[i] = (uint16_t)(first + i * stride);
+        ports->slot[i] = (uint16_t)i;
+    }
+    ports->nfree = count;
+    return 0;
+} /* -- sr_ports_init -- */
+
+void sr_ports_destroy(struct sr_ports* ports)
+{
+    sr_mem_free(ports->cool_until);
+    memset(ports, 0, sizeof(*ports));
+} /* -- sr_ports_destroy -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_ports_unfree(..)
+ * Scope: Local
+ *
+ * Take free[i] out of the free array by moving the last free port into
+ * its place.
+ *
+ *---------------------------------------------------------------------------*/
+
+static uint16_t sr_ports_unfree(struct sr_ports* ports, unsigned int i)
+{
+    uint16_t port = ports->free[i];
+    uint16_t last = ports->free[--ports->nfree];
+
+    ports->free[i] = last;
+    ports->slot[SR_PORTS_INDEX(ports, last)] = (uint16_t)i;
+    ports->slot[SR_PORTS_INDEX(ports, port)] = SR_PORTS_BUSY;
+    ports->in_use++;
+    return port;
+} /* -- sr_ports_unfree -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_ports_thaw(..)
+ * Scope: Local
+ *
+ * Return ports whose cooldown has run out to the free array.  The ring
+ * is in release order, so this stops at the first one still cooling.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_ports_thaw(struct sr_ports* ports, time_t now)
+{
+    uint16_t port;
+
+    while (ports->ncool &&
+           (int32_t)(ports->cool_until[ports->cool_head] - (uint32_t)now) <= 0)
+    {
+        port = ports->cool[ports->cool_head];
+        ports->cool_head = (ports->cool_head + 1) % ports->count;
+        ports->ncool--;
+
+        ports->slot[SR_PORTS_INDEX(ports, port)] = (uint16_t)ports->nfree;
+        ports->free[ports->nfree++] = port;
+    }
+} /* -- sr_ports_thaw -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_ports_alloc(..)
+ * Scope: Global
+ *
+ * A free port picked at random, or -1 if none is free.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_ports_alloc(struct sr_ports* ports, time_t now)
+{
+    uint32_t x;
+
+    sr_ports_thaw(ports, now);
+    if (ports->nfree == 0)
+    { return -1; }
+
+    x = ports->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    ports->rng = x;
+
+    return sr_ports_unfree(ports, x % ports->nfree);
+} /* -- sr_ports_alloc -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_ports_take(..)
+ * Scope: Global
+ *
+ * Claim a particular port.  Returns 0, or -1 if it's in use, cooling
+ * down or not in this space.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_ports_take(struct sr_ports* ports, uint16_t port)
+{
+    uint16_t slot;
+
+    if (port < ports->first || (port - ports->first) % ports->stride)
+    { return -1; }
+    slot = ports->slot[SR_PORTS_INDEX(ports, port)];
+    if (slot == SR_PORTS_BUSY || slot == SR_PORTS_COOLING)
+    { return -1; }
+
+    sr_ports_unfree(ports, slot);
+    return 0;
+} /* -- sr_ports_take -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_ports_release(..)
+ * Scope: Global
+ *
+ * Give back a port handed out by sr_ports_alloc(..) or sr_ports_take(..).
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_ports_release(struct sr_ports* ports, uint16_t port, time_t now)
+{
+    unsigned int tail;
+
+    assert(port >= ports->first && (port - ports->first) % ports->stride == 0);
+    assert(ports->slot[SR_PORTS_INDEX(ports, port)] == SR_PORTS_BUSY);
+
+    ports->in_use--;
+    if (ports->cooldown == 0)
+    {
+        ports->slot[SR_PORTS_INDEX(ports, port)] = (uint16_t)ports->nfree;
+        ports->free[ports->nfree++] = port;
+        return;
+    }
+
+    tail = (ports->cool_head + ports->ncool) % ports->count;
+    ports->cool[tail] = port;
+    ports->cool_until[tail] = (uint32_t)now + ports->cooldown;
+    ports->ncool++;
+    ports->slot[SR_PORTS_INDEX(ports, port)] = SR_PORTS_COOLING;
+} /* -- sr_ports_release -- */
@@ -0,0 +1,60 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ports.h
+ *
+ * Description:
+ *
+ * External port (or ICMP id) allocation for the NAT.  A port space covers
+ * SR_PORTS_LO..SR_PORTS_HI for one protocol on one external address, or an
+ * evenly strided slice of that range (first, first + stride, ...) when
+ * the space is split between NAT shards.
+ *
+ * Free ports sit unordered in an array with each port's position kept
+ * beside it, so handing out a random free port, taking a particular one
+ * and giving one back are all O(1).  A released port first waits out a
+ * cooldown in a FIFO before it can be handed out again, so a new mapping
+ * doesn't inherit packets still in flight for the old one.
+ *
+ * A space does no locking of its own; the lock of the NAT shard that owns
+ * it covers it.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PORTS_H
+#define SR_PORTS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define SR_PORTS_LO    1024
+#define SR_PORTS_HI    65535
+#define SR_PORTS_COUNT (SR_PORTS_HI - SR_PORTS_LO + 1)
+
+struct sr_ports
+{
+    uint16_t     first;      /* lowest port */
+    uint16_t     stride;     /* between ports */
+    unsigned int count;      /* ports in the space */
+
+    uint16_t*    free;       /* free ports, any order */
+    uint16_t*    slot;       /* per port, its index in free[] or a state below */
+    unsigned int nfree;
+
+    uint16_t*    cool;       /* released ports, oldest first (a ring) */
+    uint32_t*    cool_until; /* when each may be handed out again */
+    unsigned int cool_head;
+    unsigned int ncool;
+    unsigned int cooldown;   /* seconds */
+
+    unsigned int in_use;
+    uint32_t     rng;        /* xorshift state */
+};
+
+int  sr_ports_init(struct sr_ports* ports, uint16_t first, uint16_t stride,
+                   unsigned int cooldown, uint32_t seed);
+void sr_ports_destroy(struct sr_ports* ports);
+
+int  sr_ports_alloc(struct sr_ports* ports, time_t now);
+int  sr_ports_take(struct sr_ports* ports, uint16_t port);
+void sr_ports_release(struct sr_ports* ports, uint16_t port, time_t now);
+
+#endif /* -- SR_PORTS_H -- */
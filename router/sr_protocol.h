@@ -104,6 +104,39 @@ typedef struct sr_icmp_t3_hdr sr_icmp_t3_hdr_t;
 
 
 
+/* Structure of a TCP header, naked of options
+ */
+struct sr_tcp_hdr {
+  uint16_t tcp_sport;
+  uint16_t tcp_dport;
+  uint32_t tcp_seq;
+  uint32_t tcp_ack;
+  uint8_t  tcp_off;        /* data offset in the high nibble */
+  uint8_t  tcp_flags;
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_URG 0x20
+  uint16_t tcp_win;
+  uint16_t tcp_sum;
+  uint16_t tcp_urp;
+} __attribute__ ((packed)) ;
+typedef struct sr_tcp_hdr sr_tcp_hdr_t;
+
+
+/* Structure of a UDP header
+ */
+struct sr_udp_hdr {
+  uint16_t udp_sport;
+  uint16_t udp_dport;
+  uint16_t udp_len;
+  uint16_t udp_sum;
+} __attribute__ ((packed)) ;
+typedef struct sr_udp_hdr sr_udp_hdr_t;
+
+
 /*
  * Structure of an internet header, naked of options.
  */
@@ -152,6 +185,8 @@ typedef struct sr_ethernet_hdr sr_ethernet_hdr_t;
 
 enum sr_ip_protocol {
   ip_protocol_icmp = 0x0001,
+  ip_protocol_tcp = 0x0006,
+  ip_protocol_udp = 0x0011,
 };
 
 enum sr_ethertype {
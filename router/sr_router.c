@@ -22,6 +22,9 @@
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_utils.h"
+#include "sr_pbuf.h"
+#include "sr_pktinfo.h"
+#include "sr_nat.h"
 
 /*---------------------------------------------------------------------
  * Method: sr_init(void)
@@ -51,95 +54,129 @@ void sr_init(struct sr_instance* sr)
 
 } /* -- sr_init -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_nat_ifindex(..)
+ * Scope:  Global
+ *
+ * The NAT's external interface, looked up by name the first time a
+ * packet needs it (VNS announces interfaces only once the session is up).
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_nat_ifindex(struct sr_instance* sr)
+{
+	struct sr_if* ext_iface = 0;
+	
+	if (sr->nat->out_ifindex < 0 &&
+		(ext_iface = sr_get_interface(sr, sr->nat->out_if_name)) != 0) {
+		sr->nat->out_ifindex = ext_iface->index;
+	}
+	return sr->nat->out_ifindex;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_nat_reply(..)
+ * Scope:  Global
+ *
+ * An ICMP error the router made about a packet that crossed the NAT
+ * quotes it as translated. For one that came in (outbound set, the
+ * error goes back out), the quote has the internal host's address and
+ * port: put it back the way the remote host sent it. For one that went
+ * out, the error is addressed to the NAT's external address: send it
+ * on to the internal host, quoting what that host sent. Returns 0, or
+ * -1 if the error must not be sent.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_nat_reply(struct sr_instance* sr, struct sr_pbuf* reply, int outbound)
+{
+	/* the ARP sweep makes errors too, so each thread has its own reader */
+	static __thread struct sr_epoch_reader* reader = 0;
+	struct sr_pktinfo info;
+	
+	if ((reader == 0 && (reader = sr_nat_reader(sr->nat)) == 0) ||
+		sr_pktinfo_parse(&info, sr_pbuf_data(reply), reply->len, -1, 0) != 0) {
+		return -1;
+	}
+	return sr_nat_translate(sr->nat, reader, &info, outbound) == 0 ? 0 : -1;
+}
+
 void sr_handlearp(struct sr_instance* sr,
-        uint8_t * packet/* lent */,
-        unsigned int len,
-        char* interface/* lent */)
+        const struct sr_pktinfo* pkt/* lent */,
+        struct sr_if* iface/* lent */)
 {
 	sr_arp_hdr_t *arp_hdr, *arp_reply_hdr = 0;
 	sr_ethernet_hdr_t *ether_hdr, *queuing_ether = 0;
-	uint8_t *reply_packet = 0;
-	struct sr_if *iface = 0;
+	struct sr_pbuf *reply_packet = 0;
 	struct sr_arpreq *arpreq = 0;
+	struct sr_arpentry arp_entry;
 	struct sr_packet *queuing_packet = 0;
+	struct sr_if *out_iface = 0;
 	
-	/* check if header has the correct size */
-	if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)) {
-		fprintf(stderr, "Error: invalid ARP header length\n");
-		return;
-	}
-	
-	arp_hdr = (sr_arp_hdr_t*)(packet + sizeof(sr_ethernet_hdr_t));
-	
-	/* check if ARP hardware type is ethernet */
-	if (arp_hdr->ar_hrd != htons(arp_hrd_ethernet)) {
-		fprintf(stderr, "Error: unknown ARP hardware format\n");
-		return;
-	}
-	
-	/* check if arp protocol type is ip */
-	if (arp_hdr->ar_pro != htons(ethertype_ip)) {
-		fprintf(stderr, "Error: unknown ARP protocol format\n");
-		return;
-	}
-	
-	/* grab the receiving interface */
-	if ((iface = sr_get_interface(sr, interface)) == 0) {
-		fprintf(stderr, "Error: interface does not exist (sr_handlearp)\n");
-		return;
-	}
+	/* length, hardware and protocol format were checked at ingress */
+	arp_hdr = (sr_arp_hdr_t*)(pkt->buf + pkt->l3_off);
 	
 	/* handle received ARP request */
 	if (arp_hdr->ar_op == htons(arp_op_request)) {
 		
+		/* a request for another host on the segment; the NAT's other
+		   external addresses are ours to answer for too */
+		if (arp_hdr->ar_tip != iface->ip &&
+			!(sr->nat && iface->index == sr_nat_ifindex(sr) &&
+			  sr_nat_owns(sr->nat, arp_hdr->ar_tip))) {
+			return;
+		}
+		
 		/* create new reply packet */
-		if ((reply_packet = malloc(sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t))) == NULL) {
-			fprintf(stderr,"Error: out of memory (sr_handlearp)\n");
+		if ((reply_packet = sr_pbuf_alloc()) == NULL ||
+			sr_pbuf_append(reply_packet, sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)) == NULL) {
+			fprintf(stderr,"Error: out of packet buffers (sr_handlearp)\n");
+			sr_pbuf_free(reply_packet);
 			return;
 		}
 				
 		/* construct ARP header */
-		arp_reply_hdr = (sr_arp_hdr_t*)(reply_packet + sizeof(sr_ethernet_hdr_t));
+		arp_reply_hdr = (sr_arp_hdr_t*)(sr_pbuf_data(reply_packet) + sizeof(sr_ethernet_hdr_t));
 		arp_reply_hdr->ar_hrd = htons(arp_hrd_ethernet);            /* format of hardware address   */
 		arp_reply_hdr->ar_pro = htons(ethertype_ip);		        /* format of protocol address   */
-		arp_reply_hdr->ar_hln = htons(ETHER_ADDR_LEN);	            /* length of hardware address   */
-		arp_reply_hdr->ar_pln = htons(4);             				/* length of protocol address   */
+		arp_reply_hdr->ar_hln = ETHER_ADDR_LEN;	                    /* length of hardware address   */
+		arp_reply_hdr->ar_pln = 4;                     				/* length of protocol address   */
 		arp_reply_hdr->ar_op = htons(arp_op_reply);             	/* ARP opcode (command)         */
 		memcpy(arp_reply_hdr->ar_sha, iface->addr, sizeof(iface->addr));   				/* sender hardware address      */
-		arp_reply_hdr->ar_sip = htonl(iface->ip);   				/* sender IP address            */
+		arp_reply_hdr->ar_sip = arp_hdr->ar_tip;    				/* sender IP address            */
 		memcpy(arp_reply_hdr->ar_tha, arp_hdr->ar_sha, ETHER_ADDR_LEN);   					/* target hardware address      */
 		arp_reply_hdr->ar_tip = arp_hdr->ar_sip;        				/* target IP address            */
 		
 		/* construct ethernet header */
-		ether_hdr = (sr_ethernet_hdr_t*)reply_packet;
+		ether_hdr = (sr_ethernet_hdr_t*)sr_pbuf_data(reply_packet);
 		memcpy(ether_hdr->ether_dhost, arp_hdr->ar_sha, ETHER_ADDR_LEN);
 		memcpy(ether_hdr->ether_shost, iface->addr, sizeof(iface->addr));
 		ether_hdr->ether_type = htons(ethertype_arp);
 		
 		/* send the packet */
-		if (sr_send_packet(sr, reply_packet, sizeof(reply_packet), (const char*)interface) == -1) {
+		if (sr_send_packet(sr, sr_pbuf_data(reply_packet), reply_packet->len, iface->index) == -1) {
 			fprintf(stderr, "Error: sending packet failed (sr_handlearp)\n");
 		}
-		free(reply_packet);
+		sr_pbuf_free(reply_packet);
 	}
 	
 	/* handle received ARP reply */
 	else if (arp_hdr->ar_op == htons(arp_op_reply)) {
 	
-		/* check if the target ip matches ours */
-		if (arp_hdr->ar_tha != iface->addr) {
+		/* check if the target MAC matches ours */
+		if (memcmp(arp_hdr->ar_tha, iface->addr, ETHER_ADDR_LEN) != 0) {
 			fprintf(stderr, "Error: ARP reply does not match our MAC (sr_handlearp)\n");
 			return;
 		}
 	
 		/* check if the target ip matches ours */
-		if (arp_hdr->ar_tip != htonl(iface->ip)) {
+		if (arp_hdr->ar_tip != iface->ip) {
 			fprintf(stderr, "Error: ARP reply does not match our ip (sr_handlearp)\n");
 			return;
 		}
 		
 		/* check if the ip is already in our cache */
-		if (sr_arpcache_lookup(&(sr->cache), arp_hdr->ar_sip) != NULL) {
+		if (sr_arpcache_lookup(&(sr->cache), arp_hdr->ar_sip, &arp_entry)) {
 			fprintf(stderr, "Error: ARP reply ip already in cache (sr_handlearp)\n");
 			return;
 		}
@@ -152,12 +189,15 @@ void sr_handlearp(struct sr_instance* sr,
 			/* loop through all queuing packets */
 			while(queuing_packet != NULL) {
 			
-				/* fill in the MAC field */
-				queuing_ether = (sr_ethernet_hdr_t *)(queuing_packet->buf);
+				/* fill in the MAC fields */
+				queuing_ether = (sr_ethernet_hdr_t *)(queuing_packet->info.buf);
+				if ((out_iface = sr_get_interface_idx(sr, queuing_packet->ifindex)) != 0) {
+					memcpy(queuing_ether->ether_shost, out_iface->addr, ETHER_ADDR_LEN);
+				}
 				memcpy(queuing_ether->ether_dhost, arp_hdr->ar_sha, ETHER_ADDR_LEN);
 				
 				/* send the queuing packet */
-				if (sr_send_packet(sr, queuing_packet->buf, queuing_packet->len, (const char*)queuing_packet->iface) == -1) {
+				if (sr_send_packet(sr, queuing_packet->info.buf, queuing_packet->info.len, queuing_packet->ifindex) == -1) {
 					fprintf(stderr, "Error: sending queuing packet failed (sr_handlearp)\n");
 				}
 				
@@ -171,61 +211,73 @@ void sr_handlearp(struct sr_instance* sr,
 }
 
 
-uint8_t* sr_generate_icmp(sr_ethernet_hdr_t *received_ether_hdr, 
-						  sr_ip_hdr_t *received_ip_hdr, 
+struct sr_pbuf* sr_generate_icmp(const struct sr_pktinfo *received, 
 						  struct sr_if *iface, 
 						  uint8_t type, uint8_t code)
 {
+	sr_ethernet_hdr_t *received_ether_hdr = (sr_ethernet_hdr_t *)received->buf;
+	sr_ip_hdr_t *received_ip_hdr = (sr_ip_hdr_t *)(received->buf + received->l3_off);
+	struct sr_pbuf *pbuf = 0;
 	uint8_t *reply_packet = 0;
 	sr_icmp_hdr_t *icmp_hdr = 0;
 	sr_ip_hdr_t *ip_hdr = 0;
 	sr_ethernet_hdr_t *ether_hdr = 0;
-	size_t icmp_size = 0;
+	size_t icmp_size = 0, quote_size = 0;
 	
 	/* type 0 echo reply */
 	if (type == 0) {
 	
+		/* the reply echoes back the request's id, sequence number and data */
+		icmp_size = received->l3_len - received->l3_hlen;
+		
 		/* create new reply packet */
-		if ((reply_packet = malloc(sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_hdr_t))) == NULL) {
-			fprintf(stderr,"Error: out of memory (sr_generate_icmp)\n");
+		if ((pbuf = sr_pbuf_alloc()) == NULL ||
+			(reply_packet = sr_pbuf_append(pbuf, sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + icmp_size)) == NULL) {
+			fprintf(stderr,"Error: out of packet buffers (sr_generate_icmp)\n");
+			sr_pbuf_free(pbuf);
 			return 0;
 		}
 		
 		/* construct ICMP header */
 		icmp_hdr = (sr_icmp_hdr_t *)(reply_packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
-		icmp_hdr->icmp_type = htons(type);
-		icmp_hdr->icmp_code = htons(code);
-		icmp_hdr->icmp_sum = htons(0);
-		icmp_hdr->icmp_sum = cksum(icmp_hdr, sizeof(sr_icmp_hdr_t));
-		
-		/* grab the size of ICMP header */
-		icmp_size = sizeof(sr_icmp_hdr_t);
+		memcpy(icmp_hdr, received->buf + received->l4_off, icmp_size);
+		icmp_hdr->icmp_type = type;
+		icmp_hdr->icmp_code = code;
+		icmp_hdr->icmp_sum = 0;
+		icmp_hdr->icmp_sum = cksum(icmp_hdr, icmp_size);
 	}
 	/* Destination net unreachable (type 3, code 0) OR Time exceeded (type 11, code 0),
 	   since the two types use the exact same struct, except the next_mtu field which is unused for type 11 */
 	else if (type == 3 || type == 11) {
 		sr_icmp_t3_hdr_t* icmp_hdr;
+		
+		/* quote the offending header, options included, and 8 bytes of its payload */
+		quote_size = received->l3_hlen + 8;
+		if (quote_size > received->l3_len) {
+			quote_size = received->l3_len;
+		}
+		icmp_size = sizeof(sr_icmp_t3_hdr_t) - ICMP_DATA_SIZE + quote_size;
+		
 		/* create new reply packet */
-		if ((reply_packet = malloc(sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t))) == NULL) {
-			fprintf(stderr,"Error: out of memory (sr_generate_icmp)\n");
+		if ((pbuf = sr_pbuf_alloc()) == NULL ||
+			(reply_packet = sr_pbuf_append(pbuf, sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + icmp_size)) == NULL) {
+			fprintf(stderr,"Error: out of packet buffers (sr_generate_icmp)\n");
+			sr_pbuf_free(pbuf);
 			return 0;
 		}
 		
 		/* construct ICMP header */
 		icmp_hdr = (sr_icmp_t3_hdr_t *)(reply_packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
-		icmp_hdr->icmp_type = htons(type);
-		icmp_hdr->icmp_code = htons(code);
+		icmp_hdr->icmp_type = type;
+		icmp_hdr->icmp_code = code;
 		icmp_hdr->unused = htons(0);
 		icmp_hdr->next_mtu = htons(0);		
 		if (type == 3) {	/* only set next_mtu if ICMP type is 3*/
 			icmp_hdr->next_mtu = htons(1500);
 		}
-		memcpy(icmp_hdr->data, received_ip_hdr, ICMP_DATA_SIZE);
+		memcpy((uint8_t *)icmp_hdr + icmp_size - quote_size, received_ip_hdr, quote_size);
 		icmp_hdr->icmp_sum = htons(0);
-		icmp_hdr->icmp_sum = cksum(icmp_hdr, sizeof(sr_icmp_t3_hdr_t));
-		
-		/* grab the size of ICMP header */
-		icmp_size = sizeof(sr_icmp_t3_hdr_t);
+		icmp_hdr->icmp_sum = cksum(icmp_hdr, icmp_size);
 	}
 	/* An ICMP type that we can't handle */
 	else {
@@ -235,15 +287,15 @@ uint8_t* sr_generate_icmp(sr_ethernet_hdr_t *received_ether_hdr,
 	
 	/* construct IP header */
 	ip_hdr = (sr_ip_hdr_t *)(reply_packet + sizeof(sr_ethernet_hdr_t));
-	ip_hdr->ip_hl = htons(5);									/* header length */
-	ip_hdr->ip_v = htons(4);									/* version */
-	ip_hdr->ip_tos = htons(0);									/* type of service */
+	ip_hdr->ip_hl = 5;											/* header length */
+	ip_hdr->ip_v = 4;											/* version */
+	ip_hdr->ip_tos = 0;											/* type of service */
 	ip_hdr->ip_len = htons(20 + icmp_size);						/* total length */
 	ip_hdr->ip_id = htons(0);									/* identification */
 	ip_hdr->ip_off = htons(IP_DF);								/* fragment offset field */
-	ip_hdr->ip_ttl = htons(INIT_TTL);							/* time to live */
-	ip_hdr->ip_p = htons(ip_protocol_icmp);						/* protocol */
-	ip_hdr->ip_src = htonl(iface->ip);							/* source ip address */
+	ip_hdr->ip_ttl = INIT_TTL;									/* time to live */
+	ip_hdr->ip_p = ip_protocol_icmp;							/* protocol */
+	ip_hdr->ip_src = iface->ip;									/* source ip address */
 	ip_hdr->ip_dst = received_ip_hdr->ip_src;					/* dest ip address */
 	ip_hdr->ip_sum = htons(0);
 	ip_hdr->ip_sum = cksum(ip_hdr, sizeof(sr_ip_hdr_t));		/* checksum */
@@ -253,191 +305,209 @@ uint8_t* sr_generate_icmp(sr_ethernet_hdr_t *received_ether_hdr,
 	memcpy(ether_hdr->ether_dhost, received_ether_hdr->ether_shost, ETHER_ADDR_LEN);
 	memcpy(ether_hdr->ether_shost, iface->addr, sizeof(iface->addr));
 	ether_hdr->ether_type = htons(ethertype_ip);
-			
-	return reply_packet;
+	
+	return pbuf;
 }
 
 
 void sr_handleip(struct sr_instance* sr,
-        uint8_t * packet/* lent */,
-        unsigned int len,
-        char* interface/* lent */)
+        struct sr_pktinfo* pkt/* lent */,
+        struct sr_if* iface/* lent */)
 {
 	sr_ip_hdr_t *ip_hdr = 0;
-	struct sr_if *iface = 0;
+	struct sr_if *out_iface = 0, *if_walker = 0;
 	sr_icmp_hdr_t *icmp_hdr = 0;
-	uint8_t *reply_packet = 0;
-	struct sr_rt *rt = 0;
-	uint32_t nexthop_ip, longest_mask = 0;
-	struct sr_arpentry *arp_entry = 0;
+	struct sr_pbuf *reply_packet = 0;
+	sr_ip_hdr_t *reply_ip_hdr = 0;
+	struct sr_rt *rt = 0, *best_rt = 0;
+	uint32_t nexthop_ip = 0;
+	uint16_t ttl_word = 0;
+	struct sr_arpentry arp_entry;
 	struct sr_arpreq *arp_req = 0;
 	sr_ethernet_hdr_t *ether_hdr = 0;
-	int matched = 0;
+	int nat_in = 0;
 	
-	/* check if header has the correct size */
-	if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) {
-		fprintf(stderr, "Error: invalid IP header length\n");
-		return;
-	}
+	/* lengths and header checksum were checked at ingress */
+	ip_hdr = (sr_ip_hdr_t*)(pkt->buf + pkt->l3_off);
 	
-	ip_hdr = (sr_ip_hdr_t*)(packet + sizeof(sr_ethernet_hdr_t));
-	
-	/* perform ip header checksum */
-	if (cksum(ip_hdr, ip_hdr->ip_hl) != 0xffff) {
-		fprintf(stderr, "Error: IP checksum failed\n");
-		return;
+	/* traffic arriving from outside the NAT is translated back to its
+	   internal host first; what matches no mapping may still be for us */
+	if (sr->nat && iface->index == sr_nat_ifindex(sr)) {
+		if ((nat_in = sr_nat_translate(sr->nat, sr->nat_reader, pkt, 0)) == -1) {
+			return;
+		}
+		if ((nat_in = (nat_in == 0))) {
+			pkt->flags |= SR_PKTINFO_NAT;
+		}
 	}
 	
-	/* grab the receiving interface */
-	if ((iface = sr_get_interface(sr, interface)) == 0) {
-		fprintf(stderr, "Error: interface does not exist (sr_handleip)\n");
-		return;
+	/* check whether the packet is destined to any of our ips */
+	for (if_walker = sr->if_list; if_walker != NULL; if_walker = if_walker->next) {
+		if (ip_hdr->ip_dst == if_walker->ip) {
+			break;
+		}
 	}
 	
 	/* if the packet is destined to our ip */
-	if (ip_hdr->ip_dst == htonl(iface->ip)) {
+	if (if_walker != NULL) {
 	
 		/* if it is an ICMP */
-		if (ip_hdr->ip_p == htons(ip_protocol_icmp)) {
+		if (ip_hdr->ip_p == ip_protocol_icmp) {
 			
 			/* check if header has the correct size */
-			if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_hdr_t)) {
+			if (!(pkt->flags & SR_PKTINFO_L4)) {
 				fprintf(stderr, "Error: invalid ICMP header length\n");
 				return;
 			}
 			
-			icmp_hdr = (sr_icmp_hdr_t*)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+			icmp_hdr = (sr_icmp_hdr_t*)(pkt->buf + pkt->l4_off);
 			
 			/* if it is an ICMP echo request, send an ICMP echo reply */
-			if (icmp_hdr->icmp_type == htons(8) && icmp_hdr->icmp_code == htons(0)) {
+			if (icmp_hdr->icmp_type == 8 && icmp_hdr->icmp_code == 0) {
 				
 				/* perform ICMP header checksum */
-				if (cksum(icmp_hdr, sizeof(icmp_hdr)) != 0xffff) {
+				if (cksum(icmp_hdr, pkt->l3_len - pkt->l3_hlen) != 0xffff) {
 					fprintf(stderr, "Error: ICMP checksum failed\n");
 					return;
 				}
 				
 				/* generate an echo reply packet */
-				if ((reply_packet = sr_generate_icmp((sr_ethernet_hdr_t *)packet, ip_hdr, iface, 0, 0)) == 0) {
+				if ((reply_packet = sr_generate_icmp(pkt, iface, 0, 0)) == 0) {
 					fprintf(stderr, "Error: failed to generate ICMP echo reply packet\n");
 					return;
 				}
 				
+				/* answer from the address that was pinged */
+				reply_ip_hdr = (sr_ip_hdr_t *)(sr_pbuf_data(reply_packet) + sizeof(sr_ethernet_hdr_t));
+				reply_ip_hdr->ip_src = ip_hdr->ip_dst;
+				reply_ip_hdr->ip_sum = 0;
+				reply_ip_hdr->ip_sum = cksum(reply_ip_hdr, sizeof(sr_ip_hdr_t));
+				
 				/* send an ICMP echo reply */
-				if (sr_send_packet(sr, reply_packet, sizeof(reply_packet), (const char*)interface) == -1) {
+				if (sr_send_packet(sr, sr_pbuf_data(reply_packet), reply_packet->len, iface->index) == -1) {
 					fprintf(stderr, "Error: sending packet failed (sr_handleip)\n");
 				}
 				
-				free(reply_packet);				
+				sr_pbuf_free(reply_packet);				
 			}
 		}
 		/* if it contains a TCP or UDP payload */
 		else {
 		
-			/* generate Destination net unreachable (type 3, code 0) reply packet */
-			if ((reply_packet = sr_generate_icmp((sr_ethernet_hdr_t *)packet, ip_hdr, iface, 3, 3)) == 0) {
+			/* generate Port unreachable (type 3, code 3) reply packet */
+			if ((reply_packet = sr_generate_icmp(pkt, iface, 3, 3)) == 0) {
 				fprintf(stderr, "Error: failed to generate ICMP packet\n");
 				return;
 			}
 			
 			/* send an ICMP */
-			if (sr_send_packet(sr, reply_packet, sizeof(reply_packet), (const char*)interface) == -1) {
+			if (sr_send_packet(sr, sr_pbuf_data(reply_packet), reply_packet->len, iface->index) == -1) {
 				fprintf(stderr, "Error: sending packet failed (sr_handleip)\n");
 			}
 			
-			free(reply_packet);		
+			sr_pbuf_free(reply_packet);		
 		}
 	}
 	/* packet not for us, forward it */
 	else {
 		
 		/* if TTL reaches 0 */
-		if (ip_hdr->ip_ttl <= htons(1)) {
+		if (ip_hdr->ip_ttl <= 1) {
 		
 			/* generate Time exceeded (type 11, code 0) reply packet */
-			if ((reply_packet = sr_generate_icmp((sr_ethernet_hdr_t *)packet, ip_hdr, iface, 11, 0)) == 0) {
+			if ((reply_packet = sr_generate_icmp(pkt, iface, 11, 0)) == 0) {
 				fprintf(stderr, "Error: failed to generate ICMP packet\n");
 				return;
 			}
+			if (nat_in && sr_nat_reply(sr, reply_packet, 1) != 0) {
+				sr_pbuf_free(reply_packet);
+				return;
+			}
 			
 			/* send an ICMP */
-			if (sr_send_packet(sr, reply_packet, sizeof(reply_packet), (const char*)interface) == -1) {
+			if (sr_send_packet(sr, sr_pbuf_data(reply_packet), reply_packet->len, iface->index) == -1) {
 				fprintf(stderr, "Error: sending packet failed (sr_handleip)\n");
 			}
 			
-			free(reply_packet);
+			sr_pbuf_free(reply_packet);
 		}
 		/* if packet has enough TTL */
 		else {
 			
-			/* decrement the TTL by 1 */
+			/* decrement the TTL by 1, and fold the change into the checksum */
+			ttl_word = htons(ip_hdr->ip_ttl << 8 | ip_hdr->ip_p);
 			ip_hdr->ip_ttl --;
-			
-			/* recompute the packet checksum */
-			ip_hdr->ip_sum = htons(0);
-			ip_hdr->ip_sum = cksum(ip_hdr, sizeof(sr_ip_hdr_t));
+			ip_hdr->ip_sum = cksum_adjust(ip_hdr->ip_sum, ttl_word,
+										  htons(ip_hdr->ip_ttl << 8 | ip_hdr->ip_p));
 			
 			/* Find entry in the routing table with the longest prefix match */
-			rt = sr->routing_table;
-			while (rt != NULL) {
+			for (rt = sr->routing_table; rt != NULL; rt = rt->next) {
 				
-				/* update the gateway ip and the longest mask so far */
-				if ((rt->dest.s_addr & rt->mask.s_addr) == (ntohl(ip_hdr->ip_dst) & rt->mask.s_addr) &&
-					rt->mask.s_addr > longest_mask) {
-					nexthop_ip = rt->gw.s_addr;
-					longest_mask = rt->mask.s_addr;
-					matched = 1;
+				/* update the best route so far */
+				if ((rt->dest.s_addr & rt->mask.s_addr) == (ip_hdr->ip_dst & rt->mask.s_addr) &&
+					(best_rt == NULL || ntohl(rt->mask.s_addr) > ntohl(best_rt->mask.s_addr))) {
+					best_rt = rt;
 				}
-				
-				rt = rt->next;
 			}
 			
 			/* if a matching routing table entry was NOT found */
-			if (matched == 0) {
+			if (best_rt == NULL || (out_iface = sr_get_interface_idx(sr, best_rt->ifindex)) == 0) {
 				
 				/* generate Destination net unreachable (type 3, code 0) reply packet */
-				if ((reply_packet = sr_generate_icmp((sr_ethernet_hdr_t *)packet, ip_hdr, iface, 3, 0)) == 0) {
+				if ((reply_packet = sr_generate_icmp(pkt, iface, 3, 0)) == 0) {
 					fprintf(stderr, "Error: failed to generate ICMP packet\n");
 					return;
 				}
+				if (nat_in && sr_nat_reply(sr, reply_packet, 1) != 0) {
+					sr_pbuf_free(reply_packet);
+					return;
+				}
 				
 				/* send an ICMP */
-				if (sr_send_packet(sr, reply_packet, sizeof(reply_packet), (const char*)interface) == -1) {
+				if (sr_send_packet(sr, sr_pbuf_data(reply_packet), reply_packet->len, iface->index) == -1) {
 					fprintf(stderr, "Error: sending packet failed (sr_handleip)\n");
 				}
 				
-				free(reply_packet);
+				sr_pbuf_free(reply_packet);
 			}
 			/* if a matching routing table entry was found */
 			else {
+				/* traffic leaving through the NAT takes on its external address */
+				if (sr->nat && out_iface->index == sr_nat_ifindex(sr) &&
+					iface->index != out_iface->index) {
+					if (sr_nat_translate(sr->nat, sr->nat_reader, pkt, 1) != 0) {
+						return;
+					}
+					pkt->flags |= SR_PKTINFO_NAT;
+				}
+				
 				/* if the next hop is 0.0.0.0 */
+				nexthop_ip = best_rt->gw.s_addr;
 				if(nexthop_ip == 0) {
 					nexthop_ip = ip_hdr->ip_dst;
 				}
 				
-				/* set the source MAC of ethernet header */
-				ether_hdr = (sr_ethernet_hdr_t*)packet;
-				memcpy(ether_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN);
-				
 				/* if the next-hop IP CANNOT be found in ARP cache */
-				if ((arp_entry = sr_arpcache_lookup(&(sr->cache), htonl(nexthop_ip))) == NULL) {
+				if (!sr_arpcache_lookup(&(sr->cache), nexthop_ip, &arp_entry)) {
 					
-					/* send an ARP request */
-					arp_req = sr_arpcache_queuereq(&(sr->cache), nexthop_ip, packet, len, iface);
-					handle_arpreq(sr, arp_req);
+					/* send an ARP request; the frame waits with its sender's
+					   MAC, which a host unreachable goes back to */
+					if ((arp_req = sr_arpcache_queuereq(&(sr->cache), nexthop_ip, pkt, out_iface->index)) != NULL) {
+						handle_arpreq(sr, arp_req);
+					}
 				}
 				/* if the next-hop IP can be found in ARP cache */
 				else {
 					
-					/* set the destination MAC of ethernet header */
-					memcpy(ether_hdr->ether_dhost, arp_entry->mac, ETHER_ADDR_LEN);
+					/* set the source and destination MAC of ethernet header */
+					ether_hdr = (sr_ethernet_hdr_t*)pkt->buf;
+					memcpy(ether_hdr->ether_shost, out_iface->addr, ETHER_ADDR_LEN);
+					memcpy(ether_hdr->ether_dhost, arp_entry.mac, ETHER_ADDR_LEN);
 					
 					/* send the packet */
-					if (sr_send_packet(sr, packet, sizeof(packet), (const char*)interface) == -1) {
-						fprintf(stderr, "Error: sending packet failed (sr_handlearp)\n");
+					if (sr_send_packet(sr, pkt->buf, pkt->len, out_iface->index) == -1) {
+						fprintf(stderr, "Error: sending packet failed (sr_handleip)\n");
 					}
-					
-					free(arp_entry);
 				}
 			}
 		}
@@ -445,60 +515,58 @@ void sr_handleip(struct sr_instance* sr,
 }
 
 /*---------------------------------------------------------------------
- * Method: sr_handlepacket(uint8_t* p,char* interface)
+ * Method: sr_handlepacket(uint8_t* p,int ifindex)
  * Scope:  Global
  *
  * This method is called each time the router receives a packet on the
- * interface.  The packet buffer, the packet length and the receiving
- * interface are passed in as parameters. The packet is complete with
- * ethernet headers.
+ * interface.  The packet buffer, the packet length and the index of the
+ * receiving interface are passed in as parameters. The packet is
+ * complete with ethernet headers.
  *
- * Note: Both the packet buffer and the character's memory are handled
- * by sr_vns_comm.c that means do NOT delete either.  Make a copy of the
- * packet instead if you intend to keep it around beyond the scope of
- * the method call.
+ * Note: The packet buffer is handled by the I/O backend, that means do
+ * NOT delete it.  Make a copy of the packet (or take a reference on its
+ * pool buffer) instead if you intend to keep it around beyond the scope
+ * of the method call.
  *
  *---------------------------------------------------------------------*/
  
 void sr_handlepacket(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
-        char* interface/* lent */)
+        int ifindex)
 {
+  struct sr_if *iface = 0;
+  struct sr_pktinfo pkt;
+
   /* REQUIRES */
   assert(sr);
   assert(packet);
-  assert(interface);
 
   printf("*** -> Received packet of length %d \n",len);
 
   /* fill in code here */
   
-  /* check if header has the correct size */
-  if (len < sizeof(sr_ethernet_hdr_t)) {
-	fprintf(stderr, "Error: invalid packet length (ether_hdr)\n");
+  /* grab the receiving interface */
+  if ((iface = sr_get_interface_idx(sr, ifindex)) == 0) {
+	fprintf(stderr, "Error: interface does not exist (sr_handlepacket)\n");
 	return;
   }
   
-  if (len > 1500) {
-	  fprintf(stderr, "Error: packet length longer than MTU(ether_hdr)");
-	  return;
+  /* the one place headers are validated, everything below trusts pkt */
+  if (sr_pktinfo_parse(&pkt, packet, len, ifindex, sr->rx_ns) != 0) {
+	return;
   }
   
-  switch (ethertype(packet)) {
+  switch (pkt.ethertype) {
   
 	/* -------------       Handling ARP     -------------------- */
 	case ethertype_arp:
-		sr_handlearp(sr, packet, len, interface);
+		sr_handlearp(sr, &pkt, iface);
 		break;
 
 	/* -------------       Handling IP      -------------------- */
 	case ethertype_ip:
-		sr_handleip(sr, packet, len, interface);
-		break;
-
-	default:
-		fprintf(stderr, "Unknown ether_type: %d\n", ethertype(packet));
+		sr_handleip(sr, &pkt, iface);
 		break;
 
   }/* -- switch -- */
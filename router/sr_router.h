@@ -33,6 +33,13 @@
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_io_ops;
+struct sr_io_frame;
+struct sr_capture;
+struct sr_pbuf;
+struct sr_pktinfo;
+struct sr_nat;
+struct sr_epoch_reader;
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -48,40 +55,52 @@ struct sr_instance
     char host[32]; /* host name */ 
     char template[30]; /* template name if any */
     unsigned short topo_id;
+    unsigned short vns_caps; /* VNS_CAP_* offered in VNSOPEN */
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
+    struct sr_if* if_table[SR_IF_MAX]; /* the same, by index */
+    int if_count;
     struct sr_rt* routing_table; /* routing table */
     struct sr_arpcache cache;   /* ARP cache */
+    uint64_t rx_ns;             /* receive time of the current burst */
     pthread_attr_t attr;
     FILE* logfile;
+    struct sr_capture* capture; /* writes logfile off the forwarding path */
+    const struct sr_io_ops* io; /* packet I/O backend */
+    void* io_priv;              /* backend private state */
+    struct sr_nat* nat;         /* 0 unless NAT is on */
+    struct sr_epoch_reader* nat_reader; /* the datapath's, see sr_nat_reader(..) */
 };
 
 /* -- sr_main.c -- */
 int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
-int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
+int sr_vns_dispatch(struct sr_instance* , uint8_t* , int , int ,
+                    struct sr_io_frame* );
+
+/* -- sr_io.c -- */
+int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , int );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
-void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
+void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , int );
 void sr_handlearp(struct sr_instance* sr,
-        uint8_t * packet/* lent */,
-        unsigned int len,
-        char* interface/* lent */);
-uint8_t* sr_generate_icmp(sr_ethernet_hdr_t *received_ether_hdr, 
-						  sr_ip_hdr_t *received_ip_hdr, 
+        const struct sr_pktinfo* pkt/* lent */,
+        struct sr_if* iface/* lent */);
+struct sr_pbuf* sr_generate_icmp(const struct sr_pktinfo *received, 
 						  struct sr_if *iface, 
 						  uint8_t type, uint8_t code);
 void sr_handleip(struct sr_instance* sr,
-        uint8_t * packet/* lent */,
-        unsigned int len,
-        char* interface/* lent */);						  
+        struct sr_pktinfo* pkt/* lent */,
+        struct sr_if* iface/* lent */);
+int sr_nat_ifindex(struct sr_instance* sr);
+int sr_nat_reply(struct sr_instance* sr, struct sr_pbuf* reply, int outbound);						  
 
 /* -- sr_if.c -- */
-void sr_add_interface(struct sr_instance* , const char* );
+struct sr_if* sr_add_interface(struct sr_instance* , const char* );
 void sr_set_ether_ip(struct sr_instance* , uint32_t );
 void sr_set_ether_addr(struct sr_instance* , const unsigned char* );
 void sr_print_if_list(struct sr_instance* );
@@ -21,6 +21,7 @@
 
 #include "sr_rt.h"
 #include "sr_router.h"
+#include "sr_mem.h"
 
 /*---------------------------------------------------------------------
  * Method:
@@ -38,6 +39,7 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
     struct in_addr dest_addr;
     struct in_addr gw_addr;
     struct in_addr mask_addr;
+    struct sr_rt* rt_walker = 0;
     int clear_routing_table = 0;
 
     /* -- REQUIRES -- */
@@ -76,7 +78,10 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
         }
         if( clear_routing_table == 0 ){
             printf("Loading routing table from server, clear local routing table.\n");
-            sr->routing_table = 0;
+            while( (rt_walker = sr->routing_table) != 0 ){
+                sr->routing_table = rt_walker->next;
+                sr_mem_free(rt_walker);
+            }
             clear_routing_table = 1;
         }
         sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
@@ -94,21 +99,32 @@ void sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
 struct in_addr gw, struct in_addr mask,char* if_name)
 {
     struct sr_rt* rt_walker = 0;
+    struct sr_rt* entry = 0;
+    struct sr_if* iface = 0;
 
     /* -- REQUIRES -- */
     assert(if_name);
     assert(sr);
 
+    if( (entry = (struct sr_rt*)sr_mem_alloc(SR_MEM_RT, sizeof(struct sr_rt))) == 0 )
+    {
+        fprintf(stderr,"Error: routing table memory exhausted, not adding entry\n");
+        return;
+    }
+
+    /* -- interfaces added later bind themselves, see sr_add_interface(..) -- */
+    iface = sr_get_interface(sr, if_name);
+
     /* -- empty list special case -- */
     if(sr->routing_table == 0)
     {
-        sr->routing_table = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-        assert(sr->routing_table);
+        sr->routing_table = entry;
         sr->routing_table->next = 0;
         sr->routing_table->dest = dest;
         sr->routing_table->gw   = gw;
         sr->routing_table->mask = mask;
         strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        sr->routing_table->ifindex = (iface ? iface->index : -1);
 
         return;
     }
@@ -119,8 +135,7 @@ struct in_addr gw, struct in_addr mask,char* if_name)
       rt_walker = rt_walker->next; 
     }
 
-    rt_walker->next = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-    assert(rt_walker->next);
+    rt_walker->next = entry;
     rt_walker = rt_walker->next;
 
     rt_walker->next = 0;
@@ -128,9 +143,31 @@ struct in_addr gw, struct in_addr mask,char* if_name)
     rt_walker->gw   = gw;
     rt_walker->mask = mask;
     strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    rt_walker->ifindex = (iface ? iface->index : -1);
 
 } /* -- sr_add_entry -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_rt_bind_interfaces(..)
+ *
+ * Resolve the interface name of every entry to its index.  Called
+ * whenever an interface is added, since the routing table may be loaded
+ * before the interfaces are known (VNSHWINFO arrives in-band).
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_rt_bind_interfaces(struct sr_instance* sr)
+{
+    struct sr_rt* rt_walker = 0;
+    struct sr_if* iface = 0;
+
+    for(rt_walker = sr->routing_table; rt_walker; rt_walker = rt_walker->next)
+    {
+        iface = sr_get_interface(sr, rt_walker->interface);
+        rt_walker->ifindex = iface ? iface->index : -1;
+    }
+} /* -- sr_rt_bind_interfaces -- */
+
 /*---------------------------------------------------------------------
  * Method:
  *
@@ -33,6 +33,7 @@ struct sr_rt
     struct in_addr gw;
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
+    int    ifindex;  /* index of 'interface', -1 until it exists */
     struct sr_rt* next;
 };
 
@@ -40,6 +41,7 @@ struct sr_rt
 int sr_load_rt(struct sr_instance*,const char*);
 void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
+void sr_rt_bind_interfaces(struct sr_instance* sr);
 void sr_print_routing_table(struct sr_instance* sr);
 void sr_print_routing_entry(struct sr_rt* entry);
 
@@ -0,0 +1,310 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_shm.c
+ *
+ * Description:
+ *
+ * Shared memory packet rings, see sr_shm.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifdef _LINUX_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/mman.h>
+
+#include "sr_shm.h"
+
+#define SR_SHM_PAGE 4096
+#define SR_SHM_ROUND(x) (((x) + SR_SHM_PAGE - 1) & ~(size_t)(SR_SHM_PAGE - 1))
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_shm_map(..)
+ * Scope: Local
+ *
+ * Map an area and check that its layout fits inside it.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_shm_map(struct sr_shm* shm, int memfd, size_t size)
+{
+    struct sr_shm_hdr* hdr;
+    size_t desc_len, buf_len;
+    int r;
+
+    memset(shm, 0, sizeof(*shm));
+    if (size < SR_SHM_PAGE)
+    { return -1; }
+
+    shm->base = (uint8_t*)mmap(0, size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, memfd, 0);
+    if (shm->base == MAP_FAILED)
+    {
+        perror("mmap(..):sr_shm.c::sr_shm_map");
+        shm->base = 0;
+        return -1;
+    }
+    shm->size = size;
+    shm->hdr  = hdr = (struct sr_shm_hdr*)shm->base;
+
+    if (hdr->magic != SR_SHM_MAGIC || hdr->version != SR_SHM_VERSION ||
+        hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) != 0 ||
+        hdr->slot_size == 0 || hdr->slot_size > 65536)
+    {
+        fprintf(stderr, "Error: shared memory area has a bad header\n");
+        sr_shm_detach(shm);
+        return -1;
+    }
+
+    desc_len = (size_t)hdr->nslots * sizeof(struct sr_shm_desc);
+    buf_len  = (size_t)hdr->nslots * hdr->slot_size;
+    for (r = 0; r < 2; r++)
+    {
+        if (hdr->desc_off[r] < sizeof(struct sr_shm_hdr) ||
+            hdr->desc_off[r] + desc_len > size ||
+            hdr->buf_off[r] < sizeof(struct sr_shm_hdr) ||
+            hdr->buf_off[r] + buf_len > size)
+        {
+            fprintf(stderr, "Error: shared memory area is too small\n");
+            sr_shm_detach(shm);
+            return -1;
+        }
+        shm->desc[r] = (struct sr_shm_desc*)(shm->base + hdr->desc_off[r]);
+        shm->buf[r]  = shm->base + hdr->buf_off[r];
+        shm->prod[r] = shm->cons[r] =
+            __atomic_load_n(&hdr->ring[r].tail, __ATOMIC_ACQUIRE);
+    }
+    shm->mask      = hdr->nslots - 1;
+    shm->slot_size = hdr->slot_size;
+    return 0;
+} /* -- sr_shm_map -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_shm_create(..)
+ * Scope: Global
+ *
+ * Server side: lay out a new area in a memfd, returned through 'memfd'
+ * for passing to the peer.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_shm_create(struct sr_shm* shm, unsigned int nslots,
+                  unsigned int slot_size, int* memfd)
+{
+    struct sr_shm_hdr hdr;
+    size_t off, desc_len, buf_len;
+    int r, fd;
+
+    if ((fd = memfd_create("sr_shm", MFD_CLOEXEC)) < 0)
+    {
+        perror("memfd_create(..):sr_shm.c::sr_shm_create");
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic     = SR_SHM_MAGIC;
+    hdr.version   = SR_SHM_VERSION;
+    hdr.nslots    = nslots;
+    hdr.slot_size = slot_size;
+
+    desc_len = (size_t)nslots * sizeof(struct sr_shm_desc);
+    buf_len  = (size_t)nslots * slot_size;
+    off = SR_SHM_ROUND(sizeof(hdr));
+    for (r = 0; r < 2; r++)
+    {
+        hdr.desc_off[r] = off;
+        off = SR_SHM_ROUND(off + desc_len);
+    }
+    for (r = 0; r < 2; r++)
+    {
+        hdr.buf_off[r] = off;
+        off = SR_SHM_ROUND(off + buf_len);
+    }
+
+    if (ftruncate(fd, off) < 0 || pwrite(fd, &hdr, sizeof(hdr), 0) !=
+        sizeof(hdr))
+    {
+        perror("ftruncate(..):sr_shm.c::sr_shm_create");
+        close(fd);
+        return -1;
+    }
+
+    if (sr_shm_map(shm, fd, off) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    *memfd = fd;
+    return 0;
+} /* -- sr_shm_create -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_shm_attach(..)
+ * Scope: Global
+ *
+ * Client side: map an area received from the server.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_shm_attach(struct sr_shm* shm, int memfd, size_t size)
+{
+    return sr_shm_map(shm, memfd, size);
+} /* -- sr_shm_attach -- */
+
+void sr_shm_detach(struct sr_shm* shm)
+{
+    if (shm->base)
+    { munmap(shm->base, shm->size); }
+    shm->base = 0;
+} /* -- sr_shm_detach -- */
+
+uint8_t* sr_shm_buf(struct sr_shm* shm, int ring, struct sr_shm_desc* d)
+{
+    return shm->buf[ring] + (size_t)(d - shm->desc[ring]) * shm->slot_size;
+} /* -- sr_shm_buf -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_shm_produce(..)
+ * Scope: Global
+ *
+ * Claim the next free descriptor of 'ring', 0 if the ring is full.  The
+ * descriptor is handed to the consumer by sr_shm_publish(..).
+ *
+ *---------------------------------------------------------------------------*/
+
+struct sr_shm_desc* sr_shm_produce(struct sr_shm* shm, int ring)
+{
+    uint32_t tail = __atomic_load_n(&shm->hdr->ring[ring].tail,
+                                    __ATOMIC_ACQUIRE);
+
+    if (shm->prod[ring] - tail > shm->mask)
+    { return 0; }
+
+    return &shm->desc[ring][shm->prod[ring]++ & shm->mask];
+} /* -- sr_shm_produce -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_shm_publish(..)
+ * Scope: Global
+ *
+ * Make everything produced so far visible and kick the consumer if it is
+ * asleep.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_shm_publish(struct sr_shm* shm, int ring, int peer_efd)
+{
+    struct sr_shm_ring* r = &shm->hdr->ring[ring];
+    uint64_t one = 1;
+
+    if (__atomic_load_n(&r->head, __ATOMIC_RELAXED) == shm->prod[ring])
+    { return; }
+
+    /* -- pairs with the fence in sr_shm_wait(..) -- */
+    __atomic_store_n(&r->head, shm->prod[ring], __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&r->need_wakeup, __ATOMIC_RELAXED))
+    {
+        if (write(peer_efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        { perror("write(..):sr_shm.c::sr_shm_publish"); }
+    }
+} /* -- sr_shm_publish -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_shm_consume(..)
+ * Scope: Global
+ *
+ * Next filled descriptor of 'ring', 0 if there is none.  The slot stays
+ * ours, buffer included, until sr_shm_release(..).
+ *
+ *---------------------------------------------------------------------------*/
+
+struct sr_shm_desc* sr_shm_consume(struct sr_shm* shm, int ring)
+{
+    struct sr_shm_desc* d;
+    uint32_t head = __atomic_load_n(&shm->hdr->ring[ring].head,
+                                    __ATOMIC_ACQUIRE);
+
+    if (head == shm->cons[ring])
+    { return 0; }
+
+    d = &shm->desc[ring][shm->cons[ring]++ & shm->mask];
+
+    /* -- never trust the peer with a length -- */
+    if (d->len > shm->slot_size)
+    { d->len = 0; }
+    d->iface[sizeof(d->iface) - 1] = 0;
+    return d;
+} /* -- sr_shm_consume -- */
+
+void sr_shm_release(struct sr_shm* shm, int ring, unsigned int n)
+{
+    struct sr_shm_ring* r = &shm->hdr->ring[ring];
+
+    __atomic_store_n(&r->tail, __atomic_load_n(&r->tail, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELEASE);
+} /* -- sr_shm_release -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_shm_wait(..)
+ * Scope: Global
+ *
+ * Consumer side: sleep until 'ring' has something for us, 'other_fd' (if
+ * not -1) becomes readable or 'timeout' ms pass.
+ *
+ * RETURN VALUES:
+ *
+ *  bit 0 set if the ring may have frames, bit 1 if other_fd is readable,
+ *  0 on timeout, -1 on error
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_shm_wait(struct sr_shm* shm, int ring, int efd, int other_fd,
+                int timeout)
+{
+    struct sr_shm_ring* r = &shm->hdr->ring[ring];
+    struct pollfd pfd[2];
+    uint64_t cnt;
+    int ret = 0;
+
+    __atomic_store_n(&r->need_wakeup, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != shm->cons[ring])
+    {
+        __atomic_store_n(&r->need_wakeup, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    pfd[0].fd = efd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = other_fd;
+    pfd[1].events = POLLIN;
+
+    if (poll(pfd, other_fd >= 0 ? 2 : 1, timeout) < 0)
+    { ret = (errno == EINTR) ? 0 : -1; }
+    else
+    {
+        if (pfd[0].revents & POLLIN)
+        {
+            if (read(efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+            { ret = -1; }
+            else
+            { ret |= 1; }
+        }
+        if (other_fd >= 0 && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+        { ret |= 2; }
+    }
+
+    __atomic_store_n(&r->need_wakeup, 0, __ATOMIC_RELAXED);
+    return ret;
+} /* -- sr_shm_wait -- */
+
+#endif /* _LINUX_ */
@@ -0,0 +1,111 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_shm.h
+ *
+ * Description:
+ *
+ * Shared memory packet rings between the router and a simulator on the
+ * same host.  The server creates a memfd holding a header, two rings of
+ * descriptors (one per direction) and a buffer area in which every
+ * descriptor owns a fixed slot.  Each ring has a single producer and a
+ * single consumer; indices only ever grow and are published with
+ * release/acquire ordering, so no locks are shared between processes.
+ *
+ * A consumer about to sleep sets need_wakeup and blocks on its eventfd;
+ * the producer only pays for the eventfd write when that flag is set.
+ *
+ * Used by the router (sr_vns_shm.c) and the local VNS stand-in (vnsd.c).
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_SHM_H
+#define SR_SHM_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <stddef.h>
+
+#define SR_SHM_MAGIC      0x53525348   /* "SRSH" */
+#define SR_SHM_VERSION    1
+#define SR_SHM_SLOTS      1024         /* per ring, power of 2 */
+#define SR_SHM_SLOT_SIZE  2048         /* largest frame carried */
+
+#define SR_SHM_TO_ROUTER   0           /* ring the server produces into */
+#define SR_SHM_FROM_ROUTER 1           /* ring the router produces into */
+
+/* ----------------------------------------------------------------------------
+ * struct sr_shm_ring
+ *
+ * Control words of one ring, each on its own cache line so producer and
+ * consumer never write to the same line.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_shm_ring
+{
+    uint32_t head;            /* written by the producer */
+    uint8_t  pad0[60];
+    uint32_t tail;            /* written by the consumer */
+    uint8_t  pad1[60];
+    uint32_t need_wakeup;     /* consumer is (about to be) asleep */
+    uint8_t  pad2[60];
+};
+
+struct sr_shm_desc
+{
+    uint32_t len;             /* frame length */
+    uint32_t flags;           /* unused, 0 */
+    char     iface[16];       /* interface, as in c_packet_header */
+};
+
+struct sr_shm_hdr
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t slot_size;
+    uint32_t desc_off[2];     /* offsets of the descriptor arrays */
+    uint32_t buf_off[2];      /* offsets of the slot areas */
+    uint8_t  pad[32];
+    struct sr_shm_ring ring[2];
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_shm
+ *
+ * One side's view of the area.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_shm
+{
+    uint8_t*            base;
+    size_t              size;
+    struct sr_shm_hdr*  hdr;
+    struct sr_shm_desc* desc[2];
+    uint8_t*            buf[2];
+    uint32_t            mask;
+    uint32_t            slot_size;
+    uint32_t            prod[2];  /* next slot we fill (producer side) */
+    uint32_t            cons[2];  /* next slot we read (consumer side) */
+};
+
+int  sr_shm_create(struct sr_shm* shm, unsigned int nslots,
+                   unsigned int slot_size, int* memfd);
+int  sr_shm_attach(struct sr_shm* shm, int memfd, size_t size);
+void sr_shm_detach(struct sr_shm* shm);
+
+uint8_t* sr_shm_buf(struct sr_shm* shm, int ring, struct sr_shm_desc* d);
+struct sr_shm_desc* sr_shm_produce(struct sr_shm* shm, int ring);
+void sr_shm_publish(struct sr_shm* shm, int ring, int peer_efd);
+struct sr_shm_desc* sr_shm_consume(struct sr_shm* shm, int ring);
+void sr_shm_release(struct sr_shm* shm, int ring, unsigned int n);
+int  sr_shm_wait(struct sr_shm* shm, int ring, int efd, int other_fd,
+                 int timeout);
+
+#endif /* -- SR_SHM_H -- */
@@ -0,0 +1,234 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_slab.c
+ *
+ * Description:
+ *
+ * Object caches, see sr_slab.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_slab.h"
+#include "sr_huge.h"
+#include "sr_mem.h"
+
+/* -- the first line of every slab links it to the next one -- */
+#define SR_SLAB_HDR 64
+
+static pthread_mutex_t sr_slab_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sr_slab* sr_slab_list = 0;
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_slab_carve(..)
+ * Scope: Local
+ *
+ * Put the objects of the slab at 'mem' on the free list.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_slab_carve(struct sr_slab* slab, char* mem)
+{
+    void* obj;
+    unsigned int i;
+
+    slab->nslabs++;
+    for (i = slab->per_slab; i > 0; i--)
+    {
+        obj = mem + SR_SLAB_HDR + (size_t)(i - 1) * slab->size;
+        *(void**)obj = slab->free;
+        slab->free = obj;
+    }
+} /* -- sr_slab_carve -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_slab_grow(..)
+ * Scope: Local
+ *
+ * Add one slab's worth of objects to the free list.  Called with the
+ * cache locked.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_slab_grow(struct sr_slab* slab)
+{
+    char* mem;
+
+    if (posix_memalign((void**)&mem, SR_SLAB_HDR, SR_SLAB_BYTES) != 0)
+    { return -1; }
+
+    *(void**)mem = slab->slabs;
+    slab->slabs = mem;
+    sr_slab_carve(slab, mem);
+    return 0;
+} /* -- sr_slab_grow -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_slab_init(..)
+ * Scope: Global
+ *
+ * Set up a cache of 'size' byte objects charged to subsystem 'sys' (see
+ * sr_mem.h) as they are handed out.  With SR_SLAB_PREALLOC in
+ * 'flags' enough slabs for 'max' objects are allocated right away, as
+ * one region that may land on huge pages (see sr_huge.h).  Returns 0 on
+ * success.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_slab_init(struct sr_slab* slab, const char* name, int sys,
+                 size_t size, unsigned int max, int flags)
+{
+    assert(slab);
+
+    memset(slab, 0, sizeof(*slab));
+    if (size < sizeof(void*))
+    { size = sizeof(void*); }
+    slab->name     = name;
+    slab->sys      = sys;
+    slab->size     = (size + SR_SLAB_ALIGN - 1) & ~(size_t)(SR_SLAB_ALIGN - 1);
+    slab->per_slab = (SR_SLAB_BYTES - SR_SLAB_HDR) / slab->size;
+    slab->max      = max;
+    assert(slab->per_slab > 0);
+    pthread_mutex_init(&slab->lock, 0);
+
+    if ((flags & SR_SLAB_PREALLOC) && max > 0)
+    {
+        unsigned int i, n = (max + slab->per_slab - 1) / slab->per_slab;
+
+        if ((slab->region = sr_huge_alloc(name, (size_t)n * SR_SLAB_BYTES)) == 0)
+        {
+            fprintf(stderr, "Error: out of memory preallocating %s\n", name);
+            pthread_mutex_destroy(&slab->lock);
+            return -1;
+        }
+        /* -- lowest addresses first out -- */
+        for (i = n; i > 0; i--)
+        { sr_slab_carve(slab, (char*)slab->region + (size_t)(i - 1) * SR_SLAB_BYTES); }
+    }
+
+    pthread_mutex_lock(&sr_slab_list_lock);
+    slab->next = sr_slab_list;
+    sr_slab_list = slab;
+    pthread_mutex_unlock(&sr_slab_list_lock);
+    return 0;
+} /* -- sr_slab_init -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_slab_destroy(..)
+ * Scope: Global
+ *
+ * Release every slab; objects still in use become invalid.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_slab_destroy(struct sr_slab* slab)
+{
+    struct sr_slab** walker;
+    void *mem, *next;
+
+    pthread_mutex_lock(&sr_slab_list_lock);
+    for (walker = &sr_slab_list; *walker; walker = &(*walker)->next)
+    {
+        if (*walker == slab)
+        {
+            *walker = slab->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sr_slab_list_lock);
+
+    for (mem = slab->slabs; mem; mem = next)
+    {
+        next = *(void**)mem;
+        free(mem);
+    }
+    sr_huge_free(slab->region);
+    slab->region = 0;
+    slab->slabs  = 0;
+    slab->free   = 0;
+    slab->nslabs = 0;
+    pthread_mutex_destroy(&slab->lock);
+} /* -- sr_slab_destroy -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_slab_alloc(..)
+ * Scope: Global
+ *
+ * A zeroed object, or 0 if the cache is at its cap, its subsystem at its
+ * ceiling, or out of memory.
+ *
+ *---------------------------------------------------------------------------*/
+
+void* sr_slab_alloc(struct sr_slab* slab)
+{
+    void* obj = 0;
+
+    if (sr_mem_charge(slab->sys, slab->size) != 0)
+    {
+        __atomic_add_fetch(&slab->failed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    pthread_mutex_lock(&slab->lock);
+    if ((slab->max == 0 || slab->in_use < slab->max) &&
+        (slab->free || sr_slab_grow(slab) == 0))
+    {
+        obj = slab->free;
+        slab->free = *(void**)obj;
+        slab->allocs++;
+        if (++slab->in_use > slab->peak)
+        { slab->peak = slab->in_use; }
+    }
+    else
+    { slab->failed++; }
+    pthread_mutex_unlock(&slab->lock);
+
+    if (obj)
+    { memset(obj, 0, slab->size); }
+    else
+    { sr_mem_uncharge(slab->sys, slab->size); }
+    return obj;
+} /* -- sr_slab_alloc -- */
+
+void sr_slab_free(struct sr_slab* slab, void* obj)
+{
+    if (!obj)
+    { return; }
+
+    pthread_mutex_lock(&slab->lock);
+    *(void**)obj = slab->free;
+    slab->free = obj;
+    slab->in_use--;
+    pthread_mutex_unlock(&slab->lock);
+
+    sr_mem_uncharge(slab->sys, slab->size);
+} /* -- sr_slab_free -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_slab_report(..)
+ * Scope: Global
+ *
+ * One line of occupancy figures per cache.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_slab_report(FILE* fp)
+{
+    struct sr_slab* slab;
+
+    fprintf(fp, "%-16s %6s %8s %8s %8s %6s %10s %8s\n", "cache", "size",
+            "in use", "peak", "max", "slabs", "allocs", "failed");
+
+    pthread_mutex_lock(&sr_slab_list_lock);
+    for (slab = sr_slab_list; slab; slab = slab->next)
+    {
+        pthread_mutex_lock(&slab->lock);
+        fprintf(fp, "%-16s %6u %8u %8u %8u %6u %10lu %8lu\n", slab->name,
+                (unsigned int)slab->size, slab->in_use, slab->peak, slab->max,
+                slab->nslabs, slab->allocs, slab->failed);
+        pthread_mutex_unlock(&slab->lock);
+    }
+    pthread_mutex_unlock(&sr_slab_list_lock);
+} /* -- sr_slab_report -- */
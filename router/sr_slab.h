@@ -0,0 +1,63 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_slab.h
+ *
+ * Description:
+ *
+ * Typed object caches for the router's control structures (ARP requests
+ * and the packets queued on them, NAT mappings and connections).  Objects
+ * of one type are carved out of page sized slabs and recycled through a
+ * free list, so churn neither fragments the heap nor scatters hot objects
+ * across pages.
+ *
+ * A cache may be capped at a maximum number of live objects and, if
+ * asked, preallocated up to that maximum; a preallocated cache never
+ * calls malloc(..) again and fails exactly when the cap is reached.
+ * Every cache keeps occupancy counters, and all caches can be listed
+ * with sr_slab_report(..).
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_SLAB_H
+#define SR_SLAB_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define SR_SLAB_BYTES  16384  /* size of one slab */
+#define SR_SLAB_ALIGN  16     /* object alignment */
+
+#define SR_SLAB_PREALLOC 1    /* sr_slab_init(..) flag */
+
+struct sr_slab
+{
+    const char*     name;
+    size_t          size;      /* object size, rounded up to SR_SLAB_ALIGN */
+    unsigned int    per_slab;  /* objects carved from each slab */
+    unsigned int    max;       /* cap on live objects, 0 for none */
+    int             sys;       /* charged to, see sr_mem.h */
+
+    void*           free;      /* free objects, linked through their first word */
+    void*           slabs;     /* slabs grown one at a time, linked through their first word */
+    void*           region;    /* the preallocated slabs, see sr_huge_alloc(..) */
+
+    unsigned int    nslabs;
+    unsigned int    in_use;
+    unsigned int    peak;
+    unsigned long   allocs;
+    unsigned long   failed;    /* allocations refused (cap or no memory) */
+
+    pthread_mutex_t lock;
+    struct sr_slab* next;      /* all caches, for sr_slab_report(..) */
+};
+
+int   sr_slab_init(struct sr_slab* slab, const char* name, int sys,
+                   size_t size, unsigned int max, int flags);
+void  sr_slab_destroy(struct sr_slab* slab);
+
+void* sr_slab_alloc(struct sr_slab* slab);
+void  sr_slab_free(struct sr_slab* slab, void* obj);
+
+void  sr_slab_report(FILE* fp);
+
+#endif /* -- SR_SLAB_H -- */
@@ -0,0 +1,871 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_uring.c
+ *
+ * Description:
+ *
+ * io_uring transport for the VNS session, the "vns-uring" I/O backend.
+ *
+ * The handshake still runs over the plain socket (sr_connect_to_server).
+ * After that one multishot recv stays posted on the socket, filling
+ * buffers the kernel picks from a provided buffer ring, and outgoing
+ * VNSPACKETs are written with chains of linked sends.  Commands that fit
+ * in one receive buffer are handed to the router in place; the buffer
+ * goes back to the kernel once every frame pointing into it has been
+ * through rx_done.  Completions are reaped in batches, so a busy burst
+ * costs a single io_uring_enter(2) in each direction instead of a
+ * recv/read/write per packet.
+ *
+ * The kernel is driven through the raw system calls, liburing is not
+ * needed.  Kernels without io_uring, provided buffer rings or multishot
+ * recv (anything before 6.0) fall back to the plain socket transport.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifdef _LINUX_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_mem.h"
+#include "sr_io.h"
+
+#include "vnscommand.h"
+
+#define SR_URING_ENTRIES   256    /* submission queue, cq is 4x          */
+#define SR_URING_NBUFS     256    /* provided receive buffers, power of 2 */
+#define SR_URING_BUFSIZE   16384  /* size of each receive buffer          */
+#define SR_URING_NSEND     256    /* outgoing command slots               */
+#define SR_URING_SLOTSIZE  2048   /* largest outgoing command             */
+#define SR_URING_CHAIN     128    /* longest chain of linked sends        */
+#define SR_URING_BGID      1      /* buffer group of the receive ring     */
+
+#define SR_URING_TAG_RECV  0xffffffffULL
+#define SR_URING_TAG_NOP   0xfffffffeULL
+
+/* ----------------------------------------------------------------------------
+ * struct sr_uring_buf
+ *
+ * A chunk of received stream: either one of the provided buffers or a
+ * malloc'ed buffer holding a command that straddled two of them.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_uring_buf
+{
+    uint8_t* data;
+    int      bid;      /* provided buffer id, -1 for a reassembly buffer */
+    int      refs;     /* frames pointing into data, +1 while being parsed */
+};
+
+struct sr_uring_rcqe
+{
+    int      res;
+    unsigned flags;
+};
+
+struct sr_uring
+{
+    int fd;
+    pthread_mutex_t lock;
+
+    /* -- rings shared with the kernel -- */
+    void*     ring_mem;
+    size_t    ring_len;
+    struct io_uring_sqe* sqes;
+    size_t    sqes_len;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned  sq_mask;
+    unsigned  sq_entries;
+    unsigned  sq_local;     /* our tail, published on submit */
+    unsigned  sq_pending;   /* prepared but not yet submitted */
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned  cq_mask;
+    struct io_uring_cqe* cqes;
+
+    /* -- receive side -- */
+    struct io_uring_buf* br;    /* provided buffer ring */
+    size_t    br_len;
+    uint16_t  br_tail;
+    uint8_t*  bufmem;
+    struct sr_uring_buf bufs[SR_URING_NBUFS];
+    int       recv_armed;
+    int       eof;
+
+    struct sr_uring_rcqe rq[SR_URING_NBUFS + 4]; /* reaped, not yet parsed */
+    int       rq_head, rq_count;
+
+    struct sr_uring_buf* cur;   /* buffer being parsed */
+    int       cur_off, cur_len;
+    struct sr_uring_buf* spill; /* command straddling buffers */
+    int       spill_have, spill_len;
+    uint8_t   lenbuf[4];
+    int       lenhave;
+
+    pthread_t poller;           /* thread in rx_burst */
+    int       rx_waiting;
+
+    /* -- transmit side -- */
+    uint8_t*  slotmem;
+    unsigned  slot_len[SR_URING_NSEND];
+    int       free_slots[SR_URING_NSEND];
+    int       nfree;
+    int       queued[SR_URING_NSEND]; /* filled, waiting for the next chain */
+    int       nqueued;
+    int       inflight;               /* sends of the current chain */
+    int       broken;
+};
+
+static int sr_uring_sys_setup(unsigned entries, struct io_uring_params* p)
+{ return (int)syscall(__NR_io_uring_setup, entries, p); }
+
+static int sr_uring_sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{ return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0); }
+
+static int sr_uring_sys_register(int fd, unsigned opcode, void* arg,
+                                 unsigned nr)
+{ return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr); }
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_get_sqe(..)
+ * Scope: Local
+ *
+ * Next free submission entry, zeroed, or 0 if the queue is full.  Caller
+ * holds the lock.
+ *
+ *---------------------------------------------------------------------------*/
+
+static struct io_uring_sqe* sr_uring_get_sqe(struct sr_uring* ur)
+{
+    struct io_uring_sqe* sqe;
+    unsigned head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+    unsigned idx;
+
+    if (ur->sq_local - head >= ur->sq_entries)
+    { return 0; }
+
+    idx = ur->sq_local & ur->sq_mask;
+    ur->sq_array[idx] = idx;
+    sqe = &ur->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ur->sq_local++;
+    ur->sq_pending++;
+    return sqe;
+} /* -- sr_uring_get_sqe -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_submit(..)
+ * Scope: Local
+ *
+ * Publish and submit everything prepared so far.  Always done under the
+ * lock so a chain of linked sends is never split between two submits.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_uring_submit(struct sr_uring* ur)
+{
+    int ret;
+
+    if (ur->sq_pending == 0)
+    { return 0; }
+
+    __atomic_store_n(ur->sq_tail, ur->sq_local, __ATOMIC_RELEASE);
+    do
+    {
+        ret = sr_uring_sys_enter(ur->fd, ur->sq_pending, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+    {
+        perror("io_uring_enter(..):sr_uring.c::sr_uring_submit");
+        ur->broken = 1;
+        return -1;
+    }
+    ur->sq_pending -= ret;
+    return ret;
+} /* -- sr_uring_submit -- */
+
+static void sr_uring_arm_recv(struct sr_uring* ur, int sockfd)
+{
+    struct io_uring_sqe* sqe;
+
+    if (ur->recv_armed || ur->eof || (sqe = sr_uring_get_sqe(ur)) == 0)
+    { return; }
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = sockfd;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = SR_URING_BGID;
+    sqe->user_data = SR_URING_TAG_RECV;
+    ur->recv_armed = 1;
+} /* -- sr_uring_arm_recv -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_flush_tx(..)
+ * Scope: Local
+ *
+ * Turn the queued slots into a chain of linked sends.  Only one chain is
+ * ever in flight: sends on a stream socket that are not linked may be
+ * reordered when the socket buffer fills up.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_uring_flush_tx(struct sr_uring* ur, int sockfd)
+{
+    struct io_uring_sqe* sqe;
+    int i, n, slot;
+
+    if (ur->inflight || ur->nqueued == 0 || ur->broken)
+    { return; }
+
+    n = ur->nqueued < SR_URING_CHAIN ? ur->nqueued : SR_URING_CHAIN;
+    for (i = 0; i < n; i++)
+    {
+        if ((sqe = sr_uring_get_sqe(ur)) == 0)
+        { break; }
+        slot = ur->queued[i];
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->fd        = sockfd;
+        sqe->addr      = (unsigned long)(ur->slotmem + slot * SR_URING_SLOTSIZE);
+        sqe->len       = ur->slot_len[slot];
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = slot;
+        if (i < n - 1)
+        { sqe->flags = IOSQE_IO_LINK; }
+        ur->inflight++;
+    }
+    if (i > 0 && i < n)
+    { ur->sqes[(ur->sq_local - 1) & ur->sq_mask].flags = 0; }
+
+    ur->nqueued -= i;
+    memmove(ur->queued, ur->queued + i, ur->nqueued * sizeof(int));
+} /* -- sr_uring_flush_tx -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_reap(..)
+ * Scope: Local
+ *
+ * Drain the completion queue.  Receive completions are queued for the
+ * parser, send completions free their slot and start the next chain.
+ * Returns the number of receive completions found.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_uring_reap(struct sr_instance* sr, struct sr_uring* ur)
+{
+    struct io_uring_cqe* cqe;
+    unsigned head = *ur->cq_head;
+    unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    int slot, nrecv = 0;
+
+    for (; head != tail; head++)
+    {
+        cqe = &ur->cqes[head & ur->cq_mask];
+
+        if (cqe->user_data == SR_URING_TAG_RECV)
+        {
+            ur->rq[(ur->rq_head + ur->rq_count) % (SR_URING_NBUFS + 4)].res =
+                cqe->res;
+            ur->rq[(ur->rq_head + ur->rq_count) % (SR_URING_NBUFS + 4)].flags =
+                cqe->flags;
+            ur->rq_count++;
+            nrecv++;
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+            { ur->recv_armed = 0; }
+        }
+        else if (cqe->user_data < SR_URING_NSEND)
+        {
+            slot = (int)cqe->user_data;
+            if (cqe->res != (int)ur->slot_len[slot] && !ur->broken)
+            {
+                fprintf(stderr, "Error: io_uring send failed: %s\n",
+                        cqe->res < 0 ? strerror(-cqe->res) : "short write");
+                ur->broken = 1;
+            }
+            ur->free_slots[ur->nfree++] = slot;
+            ur->inflight--;
+        }
+    }
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+    sr_uring_flush_tx(ur, sr->sockfd);
+    if (ur->rq_count == 0)
+    { sr_uring_arm_recv(ur, sr->sockfd); }
+
+    return nrecv;
+} /* -- sr_uring_reap -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_wait(..)
+ * Scope: Local
+ *
+ * Sleep until at least one completion is posted.  Called with the lock
+ * held, which is dropped for the duration of the wait so other threads
+ * can keep sending.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_uring_wait(struct sr_uring* ur)
+{
+    sr_uring_submit(ur);
+    pthread_mutex_unlock(&ur->lock);
+    if (sr_uring_sys_enter(ur->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR)
+    { perror("io_uring_enter(..):sr_uring.c::sr_uring_wait"); }
+    pthread_mutex_lock(&ur->lock);
+} /* -- sr_uring_wait -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_buf_put(..)
+ * Scope: Local
+ *
+ * Drop a reference; provided buffers go back on the buffer ring,
+ * reassembly buffers are freed.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_uring_buf_put(struct sr_uring* ur, struct sr_uring_buf* b)
+{
+    struct io_uring_buf* e;
+
+    if (--b->refs > 0)
+    { return; }
+
+    if (b->bid < 0)
+    {
+        sr_mem_free(b);
+        return;
+    }
+
+    e = &ur->br[ur->br_tail & (SR_URING_NBUFS - 1)];
+    e->addr = (unsigned long)b->data;
+    e->len  = SR_URING_BUFSIZE;
+    e->bid  = (uint16_t)b->bid;
+    ur->br_tail++;
+    __atomic_store_n(&((struct io_uring_buf_ring*)ur->br)->tail, ur->br_tail,
+                     __ATOMIC_RELEASE);
+} /* -- sr_uring_buf_put -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_command(..)
+ * Scope: Local
+ *
+ * A complete command at 'data' inside 'b'.  Packets are returned through
+ * 'frame' holding a reference on 'b'.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_uring_command(struct sr_instance* sr, struct sr_uring_buf* b,
+                            uint8_t* data, int len, struct sr_io_frame* frame)
+{
+    int ret;
+
+    if ((ret = sr_vns_dispatch(sr, data, len, 0, frame)) == 2)
+    {
+        frame->priv = b;
+        b->refs++;
+    }
+    return ret;
+} /* -- sr_uring_command -- */
+
+static int sr_uring_check_len(int len)
+{
+    if (len > VNS_MAX_COMMAND_LEN || len < 8)
+    {
+        fprintf(stderr,"Error: bad command length %d\n",len);
+        return -1;
+    }
+    return 0;
+} /* -- sr_uring_check_len -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_parse(..)
+ * Scope: Local
+ *
+ * Cut commands out of the received stream until 'max' frames have been
+ * collected or the data runs out.
+ *
+ * RETURN VALUES:
+ *
+ *  number of frames, -1 once the session is over
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_uring_parse(struct sr_instance* sr, struct sr_uring* ur,
+                          struct sr_io_frame* frames, int max)
+{
+    struct sr_uring_rcqe* rc;
+    uint8_t* p;
+    int n = 0, avail, len, take, ret;
+    uint32_t nlen;
+
+    while (n < max)
+    {
+        /* -- move on to the next chunk of the stream -- */
+        if (ur->cur == 0)
+        {
+            if (ur->rq_count == 0)
+            { break; }
+            rc = &ur->rq[ur->rq_head];
+            ur->rq_head = (ur->rq_head + 1) % (SR_URING_NBUFS + 4);
+            ur->rq_count--;
+
+            if (rc->res == -ENOBUFS)
+            { continue; } /* recv is re-armed once buffers come back */
+            if (rc->res <= 0)
+            {
+                if (rc->res < 0)
+                { fprintf(stderr, "Error: io_uring recv: %s\n",
+                          strerror(-rc->res)); }
+                else
+                { fprintf(stderr, "VNS server closed the connection.\n"); }
+                ur->eof = 1;
+                break;
+            }
+            ur->cur = &ur->bufs[rc->flags >> IORING_CQE_BUFFER_SHIFT];
+            ur->cur->refs = 1;
+            ur->cur_off = 0;
+            ur->cur_len = rc->res;
+        }
+
+        p = ur->cur->data + ur->cur_off;
+        avail = ur->cur_len - ur->cur_off;
+
+        if (avail == 0)
+        {
+            sr_uring_buf_put(ur, ur->cur);
+            ur->cur = 0;
+            continue;
+        }
+
+        /* -- finish a command that started in an earlier buffer -- */
+        if (ur->lenhave || ur->spill)
+        {
+            if (ur->lenhave < 4)
+            {
+                take = 4 - ur->lenhave < avail ? 4 - ur->lenhave : avail;
+                memcpy(ur->lenbuf + ur->lenhave, p, take);
+                ur->lenhave += take;
+                ur->cur_off += take;
+                if (ur->lenhave < 4)
+                { continue; }
+                memcpy(&nlen, ur->lenbuf, 4);
+                len = (int)ntohl(nlen);
+                if (sr_uring_check_len(len) != 0)
+                { return -1; }
+                ur->spill = (struct sr_uring_buf*)
+                    sr_mem_alloc(SR_MEM_IO, sizeof(struct sr_uring_buf) + len);
+                if (ur->spill == 0)
+                {
+                    fprintf(stderr,"Error: out of memory (sr_uring_parse)\n");
+                    return -1;
+                }
+                ur->spill->data = (uint8_t*)(ur->spill + 1);
+                ur->spill->bid  = -1;
+                ur->spill->refs = 1;
+                memcpy(ur->spill->data, ur->lenbuf, 4);
+                ur->spill_have = 4;
+                ur->spill_len  = len;
+                continue;
+            }
+
+            take = ur->spill_len - ur->spill_have;
+            if (take > avail)
+            { take = avail; }
+            memcpy(ur->spill->data + ur->spill_have, p, take);
+            ur->spill_have += take;
+            ur->cur_off += take;
+            if (ur->spill_have < ur->spill_len)
+            { continue; }
+
+            ret = sr_uring_command(sr, ur->spill, ur->spill->data,
+                                   ur->spill_len, &frames[n]);
+            sr_uring_buf_put(ur, ur->spill);
+            ur->spill = 0;
+            ur->lenhave = 0;
+            if (ret == 2)
+            { n++; }
+            else if (ret != 1)
+            { return -1; }
+            continue;
+        }
+
+        /* -- the common case: whole commands sitting in this buffer -- */
+        if (avail < 4)
+        {
+            memcpy(ur->lenbuf, p, avail);
+            ur->lenhave = avail;
+            ur->cur_off += avail;
+            continue;
+        }
+
+        memcpy(&nlen, p, 4);
+        len = (int)ntohl(nlen);
+        if (sr_uring_check_len(len) != 0)
+        { return -1; }
+
+        if (len > avail)
+        {
+            memcpy(ur->lenbuf, p, 4);
+            ur->lenhave = 4;
+            ur->cur_off += 4;
+            ur->spill = (struct sr_uring_buf*)
+                sr_mem_alloc(SR_MEM_IO, sizeof(struct sr_uring_buf) + len);
+            if (ur->spill == 0)
+            {
+                fprintf(stderr,"Error: out of memory (sr_uring_parse)\n");
+                return -1;
+            }
+            ur->spill->data = (uint8_t*)(ur->spill + 1);
+            ur->spill->bid  = -1;
+            ur->spill->refs = 1;
+            memcpy(ur->spill->data, p, 4);
+            ur->spill_have = 4;
+            ur->spill_len  = len;
+            continue;
+        }
+
+        ur->cur_off += len;
+        if ((ret = sr_uring_command(sr, ur->cur, p, len, &frames[n])) == 2)
+        { n++; }
+        else if (ret != 1)
+        { return -1; }
+    }
+
+    return n;
+} /* -- sr_uring_parse -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_rx_burst(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_uring_rx_burst(struct sr_instance* sr, struct sr_io_frame* frames,
+                             int max)
+{
+    struct sr_uring* ur = (struct sr_uring*)sr->io_priv;
+    int n;
+
+    pthread_mutex_lock(&ur->lock);
+    ur->poller = pthread_self();
+
+    for (;;)
+    {
+        sr_uring_reap(sr, ur);
+
+        if ((n = sr_uring_parse(sr, ur, frames, max)) < 0)
+        { break; }
+        if (n > 0)
+        { break; }
+        if (ur->eof || ur->broken)
+        {
+            n = -1;
+            break;
+        }
+
+        ur->rx_waiting = 1;
+        sr_uring_wait(ur);
+        ur->rx_waiting = 0;
+    }
+
+    /* -- sends queued by the router during the last burst go out here -- */
+    sr_uring_reap(sr, ur);
+    sr_uring_submit(ur);
+
+    pthread_mutex_unlock(&ur->lock);
+    return n;
+} /* -- sr_uring_rx_burst -- */
+
+static void sr_uring_rx_done(struct sr_instance* sr, struct sr_io_frame* frames,
+                             int n)
+{
+    struct sr_uring* ur = (struct sr_uring*)sr->io_priv;
+    int i;
+
+    pthread_mutex_lock(&ur->lock);
+    for (i = 0; i < n; i++)
+    { sr_uring_buf_put(ur, (struct sr_uring_buf*)frames[i].priv); }
+    pthread_mutex_unlock(&ur->lock);
+} /* -- sr_uring_rx_done -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_tx_burst(..)
+ * Scope: Local
+ *
+ * Wrap each frame in a VNSPACKET header in a send slot.  Frames sent by
+ * the router while it works through a receive burst are held back and
+ * go out as one chain when the next rx_burst begins; sends from any other
+ * thread are submitted right away.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_uring_tx_burst(struct sr_instance* sr, struct sr_io_frame* frames,
+                             int n)
+{
+    struct sr_uring* ur = (struct sr_uring*)sr->io_priv;
+    struct io_uring_sqe* sqe;
+    c_packet_header* sr_pkt;
+    struct sr_if* iface;
+    unsigned int total_len;
+    int i, slot, wake;
+
+    pthread_mutex_lock(&ur->lock);
+
+    for (i = 0; i < n && !ur->broken; i++)
+    {
+        total_len = frames[i].len + sizeof(c_packet_header);
+        if ((iface = sr_get_interface_idx(sr, frames[i].ifindex)) == 0)
+        { break; }
+        if (total_len > SR_URING_SLOTSIZE)
+        {
+            fprintf(stderr, "Error: frame of %u bytes too large to send\n",
+                    frames[i].len);
+            break;
+        }
+
+        while (ur->nfree == 0 && !ur->broken)
+        {
+            sr_uring_reap(sr, ur);
+            sr_uring_submit(ur);
+            if (ur->nfree == 0)
+            { sr_uring_wait(ur); }
+        }
+        if (ur->broken)
+        { break; }
+
+        slot = ur->free_slots[--ur->nfree];
+        sr_pkt = (c_packet_header*)(ur->slotmem + slot * SR_URING_SLOTSIZE);
+        sr_pkt->mLen  = htonl(total_len);
+        sr_pkt->mType = htonl(VNSPACKET);
+        strncpy(sr_pkt->mInterfaceName, iface->name,
+                sizeof(sr_pkt->mInterfaceName));
+        memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
+               frames[i].buf, frames[i].len);
+        ur->slot_len[slot] = total_len;
+        ur->queued[ur->nqueued++] = slot;
+    }
+
+    if (!pthread_equal(pthread_self(), ur->poller))
+    {
+        /* -- we may have reaped receive completions the poller sleeps
+         *    on, post a no-op to wake it up -- */
+        wake = sr_uring_reap(sr, ur) > 0 && ur->rx_waiting;
+        sr_uring_flush_tx(ur, sr->sockfd);
+        if (wake && (sqe = sr_uring_get_sqe(ur)) != 0)
+        {
+            sqe->opcode    = IORING_OP_NOP;
+            sqe->user_data = SR_URING_TAG_NOP;
+        }
+        sr_uring_submit(ur);
+    }
+
+    pthread_mutex_unlock(&ur->lock);
+    return i;
+} /* -- sr_uring_tx_burst -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_free(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_uring_free(struct sr_uring* ur)
+{
+    if (ur->fd >= 0)
+    { close(ur->fd); }
+    if (ur->ring_mem)
+    { munmap(ur->ring_mem, ur->ring_len); }
+    if (ur->sqes)
+    { munmap(ur->sqes, ur->sqes_len); }
+    if (ur->br)
+    { munmap(ur->br, ur->br_len); }
+    sr_mem_free(ur->spill);
+    sr_mem_free(ur->bufmem);
+    sr_mem_free(ur->slotmem);
+    pthread_mutex_destroy(&ur->lock);
+    sr_mem_free(ur);
+} /* -- sr_uring_free -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_setup(..)
+ * Scope: Local
+ *
+ * Create the ring, register the provided buffers and post the multishot
+ * recv.  Returns 0 or the reason the kernel refused.
+ *
+ *---------------------------------------------------------------------------*/
+
+static const char* sr_uring_setup(struct sr_instance* sr, struct sr_uring* ur)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct io_uring_cqe* cqe;
+    unsigned head;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = SR_URING_ENTRIES * 4;
+    if ((ur->fd = sr_uring_sys_setup(SR_URING_ENTRIES, &p)) < 0)
+    { return strerror(errno); }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    { return "kernel too old"; }
+
+    ur->ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (ur->ring_len < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+    { ur->ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe); }
+    ur->ring_mem = mmap(0, ur->ring_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    if (ur->ring_mem == MAP_FAILED)
+    {
+        ur->ring_mem = 0;
+        return strerror(errno);
+    }
+    ur->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = (struct io_uring_sqe*)mmap(0, ur->sqes_len,
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ur->fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED)
+    {
+        ur->sqes = 0;
+        return strerror(errno);
+    }
+
+    ur->sq_head    = (unsigned*)((char*)ur->ring_mem + p.sq_off.head);
+    ur->sq_tail    = (unsigned*)((char*)ur->ring_mem + p.sq_off.tail);
+    ur->sq_array   = (unsigned*)((char*)ur->ring_mem + p.sq_off.array);
+    ur->sq_mask    = *(unsigned*)((char*)ur->ring_mem + p.sq_off.ring_mask);
+    ur->sq_entries = p.sq_entries;
+    ur->sq_local   = *ur->sq_tail;
+    ur->cq_head    = (unsigned*)((char*)ur->ring_mem + p.cq_off.head);
+    ur->cq_tail    = (unsigned*)((char*)ur->ring_mem + p.cq_off.tail);
+    ur->cq_mask    = *(unsigned*)((char*)ur->ring_mem + p.cq_off.ring_mask);
+    ur->cqes       = (struct io_uring_cqe*)((char*)ur->ring_mem + p.cq_off.cqes);
+
+    /* -- provided buffer ring -- */
+    ur->br_len = SR_URING_NBUFS * sizeof(struct io_uring_buf);
+    ur->br = (struct io_uring_buf*)mmap(0, ur->br_len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ur->br == MAP_FAILED)
+    {
+        ur->br = 0;
+        return strerror(errno);
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (unsigned long)ur->br;
+    reg.ring_entries = SR_URING_NBUFS;
+    reg.bgid         = SR_URING_BGID;
+    if (sr_uring_sys_register(ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    { return strerror(errno); }
+
+    if ((ur->bufmem = (uint8_t*)sr_mem_alloc(SR_MEM_IO, SR_URING_NBUFS * SR_URING_BUFSIZE)) == 0 ||
+        (ur->slotmem = (uint8_t*)sr_mem_alloc(SR_MEM_IO, SR_URING_NSEND * SR_URING_SLOTSIZE)) == 0)
+    { return "out of memory"; }
+
+    for (i = 0; i < SR_URING_NBUFS; i++)
+    {
+        ur->bufs[i].data = ur->bufmem + i * SR_URING_BUFSIZE;
+        ur->bufs[i].bid  = i;
+        ur->bufs[i].refs = 1;
+        sr_uring_buf_put(ur, &ur->bufs[i]);
+    }
+    for (i = 0; i < SR_URING_NSEND; i++)
+    { ur->free_slots[ur->nfree++] = i; }
+
+    /* -- an old kernel rejects multishot recv right at submit time -- */
+    sr_uring_arm_recv(ur, sr->sockfd);
+    if (sr_uring_submit(ur) != 1)
+    { return "submit failed"; }
+
+    head = *ur->cq_head;
+    if (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        cqe = &ur->cqes[head & ur->cq_mask];
+        if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+        { return "no multishot recv"; }
+    }
+
+    return 0;
+} /* -- sr_uring_setup -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_open(..)
+ * Scope: Local
+ *
+ * 'arg' is "server:port" as for the plain VNS backend, which does the
+ * connect and handshake.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_uring_open(struct sr_instance* sr, const char* arg)
+{
+    struct sr_uring* ur;
+    const char* why;
+
+    if (sr_io_vns.open(sr, arg) != 0)
+    { return -1; }
+
+    if ((ur = (struct sr_uring*)sr_mem_calloc(SR_MEM_IO, sizeof(struct sr_uring))) == 0)
+    {
+        fprintf(stderr,"Error: out of memory (sr_uring_open)\n");
+        return -1;
+    }
+    ur->fd = -1;
+    pthread_mutex_init(&ur->lock, 0);
+    ur->poller = pthread_self();
+
+    if ((why = sr_uring_setup(sr, ur)) != 0)
+    {
+        fprintf(stderr, "io_uring unavailable (%s), using the plain socket\n",
+                why);
+        sr_uring_free(ur);
+        sr->io = &sr_io_vns;
+        return 0;
+    }
+
+    sr->io_priv = ur;
+    return 0;
+} /* -- sr_uring_open -- */
+
+static void sr_uring_close(struct sr_instance* sr)
+{
+    if (sr->io_priv)
+    {
+        sr_uring_free((struct sr_uring*)sr->io_priv);
+        sr->io_priv = 0;
+    }
+    sr_io_vns.close(sr);
+} /* -- sr_uring_close -- */
+
+const struct sr_io_ops sr_io_vns_uring =
+{
+    "vns-uring",
+    sr_uring_open,
+    0,              /* interfaces arrive in-band with VNSHWINFO */
+    sr_uring_rx_burst,
+    sr_uring_rx_done,
+    sr_uring_tx_burst,
+    0,              /* sends go with the next submit */
+    sr_uring_close
+};
+
+#endif /* _LINUX_ */
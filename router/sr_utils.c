@@ -19,6 +19,23 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+/* The checksum 'sum' once a 16 bit word it covers changes from 'old' to
+   'new' (RFC 1624, eqn. 3). One's complement sums don't care about byte
+   order, so all three are taken as they sit in the packet. */
+uint16_t cksum_adjust(uint16_t sum, uint16_t old, uint16_t new) {
+  uint32_t s = (uint16_t)~sum + (uint16_t)~old + new;
+
+  s = (s & 0xffff) + (s >> 16);
+  s = (s & 0xffff) + (s >> 16);
+  return (uint16_t)~s;
+}
+
+/* The same for a 32 bit field, an address, as two words. */
+uint16_t cksum_adjust32(uint16_t sum, uint32_t old, uint32_t new) {
+  sum = cksum_adjust(sum, (uint16_t)(old >> 16), (uint16_t)(new >> 16));
+  return cksum_adjust(sum, (uint16_t)old, (uint16_t)new);
+}
+
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
@@ -29,6 +29,8 @@
 #define SR_UTILS_H
 
 uint16_t cksum(const void *_data, int len);
+uint16_t cksum_adjust(uint16_t sum, uint16_t old, uint16_t new);
+uint16_t cksum_adjust32(uint16_t sum, uint32_t old, uint32_t new);
 
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
@@ -32,24 +32,27 @@
 #include <errno.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <poll.h>
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_io.h"
+#include "sr_pbuf.h"
+#include "sr_pktinfo.h"
+#include "sr_mem.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
 
-static void sr_log_packet(struct sr_instance* , uint8_t* , int );
-static int  sr_arp_req_not_for_us(struct sr_instance* sr,
-                                  uint8_t * packet /* lent */,
-                                  unsigned int len,
-                                  char* interface  /* lent */);
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd);
+static int sr_vns_read_command(struct sr_instance* sr, int expected_cmd,
+                               struct sr_io_frame* frame);
 
 /*-----------------------------------------------------------------------------
  * Method: sr_session_closed_help(..)
@@ -77,6 +80,7 @@ int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
                          char* server)
 {
     struct hostent *hp;
+    struct sockaddr_un sun;
     c_open command;
     c_open_template ot;
     char* buf;
@@ -89,36 +93,58 @@ int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
     /* purify UMR be gone ! */
     memset((void*)&command,0,sizeof(c_open));
 
-    /* zero out server address struct */
-    memset(&(sr->sr_addr),0,sizeof(struct sockaddr_in));
-
-    sr->sr_addr.sin_family = AF_INET;
-    sr->sr_addr.sin_port = htons(port);
-
-    /* grab hosts address from domain name */
-    if ((hp = gethostbyname(server))==0)
+    /* a server starting with '/' is the path of a Unix socket */
+    if (server[0] == '/')
     {
-        perror("gethostbyname:sr_client.c::sr_connect_to_server(..)");
-        return -1;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, server, sizeof(sun.sun_path) - 1);
+
+        if ((sr->sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        {
+            perror("socket(..):sr_client.c::sr_connect_to_server(..)");
+            return -1;
+        }
+        if (connect(sr->sockfd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+        {
+            perror("connect(..):sr_client.c::sr_connect_to_server(..)");
+            close(sr->sockfd);
+            return -1;
+        }
     }
+    else
+    {
+        /* zero out server address struct */
+        memset(&(sr->sr_addr),0,sizeof(struct sockaddr_in));
 
-    /* set server address */
-    memcpy(&(sr->sr_addr.sin_addr),hp->h_addr,hp->h_length);
+        sr->sr_addr.sin_family = AF_INET;
+        sr->sr_addr.sin_port = htons(port);
 
-    /* create socket */
-    if ((sr->sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-    {
-        perror("socket(..):sr_client.c::sr_connect_to_server(..)");
-        return -1;
-    }
+        /* grab hosts address from domain name */
+        if ((hp = gethostbyname(server))==0)
+        {
+            perror("gethostbyname:sr_client.c::sr_connect_to_server(..)");
+            return -1;
+        }
 
-    /* attempt to connect to the server */
-    if (connect(sr->sockfd, (struct sockaddr *)&(sr->sr_addr),
-                sizeof(sr->sr_addr)) < 0)
-    {
-        perror("connect(..):sr_client.c::sr_connect_to_server(..)");
-        close(sr->sockfd);
-        return -1;
+        /* set server address */
+        memcpy(&(sr->sr_addr.sin_addr),hp->h_addr,hp->h_length);
+
+        /* create socket */
+        if ((sr->sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        {
+            perror("socket(..):sr_client.c::sr_connect_to_server(..)");
+            return -1;
+        }
+
+        /* attempt to connect to the server */
+        if (connect(sr->sockfd, (struct sockaddr *)&(sr->sr_addr),
+                    sizeof(sr->sr_addr)) < 0)
+        {
+            perror("connect(..):sr_client.c::sr_connect_to_server(..)");
+            close(sr->sockfd);
+            return -1;
+        }
     }
 
     /* wait for authentication to be completed (server sends the first message) */
@@ -142,6 +168,7 @@ int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
         command.mLen   = htonl(sizeof(c_open));
         command.mType  = htonl(VNSOPEN);
         command.topoID = htons(sr->topo_id);
+        command.pad    = htons(sr->vns_caps);
         strncpy( command.mVirtualHostID, sr->host,  IDSIZE);
         strncpy( command.mUID, sr->user, IDSIZE);
 
@@ -281,9 +308,9 @@ int sr_handle_auth_request(struct sr_instance* sr, c_auth_request* req) {
         /* build the auth reply packet and then send it */
         len_username = strlen(sr->user);
         len = sizeof(c_auth_reply) + len_username + SHA1_LEN;
-        buf = (char*)malloc(len);
+        buf = (char*)sr_mem_alloc(SR_MEM_IO, len);
         if(!buf) {
-            perror("malloc failed");
+            fprintf(stderr,"Error: out of memory (sr_handle_auth_request)\n");
             return 0;
         }
         ar = (c_auth_reply*)buf;
@@ -301,7 +328,7 @@ int sr_handle_auth_request(struct sr_instance* sr, c_auth_request* req) {
         }
         else
             ret = 1;
-        free(buf);
+        sr_mem_free(buf);
         return ret;
     }
     else {
@@ -333,9 +360,32 @@ int sr_read_from_server(struct sr_instance* sr /* borrowed */)
 
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
 {
-    int command, len;
+    return sr_vns_read_command(sr, expected_cmd, 0);
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_read_command(..)
+ * Scope: Local
+ *
+ * Read and handle one command from the server.  If 'frame' is given a
+ * VNSPACKET is returned through it instead of being handed to the router;
+ * the caller then owns frame->priv and must free it.
+ *
+ * RETURN VALUES:
+ *
+ *  2 a packet was returned in 'frame'
+ *  1 command handled
+ *  0 server closed the session
+ * -1 on error
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_read_command(struct sr_instance* sr, int expected_cmd,
+                               struct sr_io_frame* frame)
+{
+    int len;
     unsigned char *buf = 0;
-    c_packet_ethernet_header* sr_pkt = 0;
+    struct sr_pbuf *pbuf = 0;
     int ret = 0, bytes_read = 0;
 
     /* REQUIRES */
@@ -369,14 +419,25 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
     len = ntohl(len);
 
-    if ( len > 10000 || len < 0 )
+    if ( len > VNS_MAX_COMMAND_LEN || len < 0 )
     {
         fprintf(stderr,"Error: command length to large %d\n",len);
         close(sr->sockfd);
         return -1;
     }
 
-    if((buf = malloc(len)) == 0)
+    /* -- packets go straight into a pool buffer, the VNS header landing in
+          its headroom; only control commands too big for one are malloc'd -- */
+    if((pbuf = sr_pbuf_alloc()) != 0)
+    {
+        pbuf->off = SR_PBUF_HEADROOM - sizeof(c_packet_header);
+        if((buf = sr_pbuf_append(pbuf, len)) == 0)
+        {
+            sr_pbuf_free(pbuf);
+            pbuf = 0;
+        }
+    }
+    if(buf == 0 && (buf = sr_mem_alloc(SR_MEM_IO, len)) == 0)
     {
         fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
         return -1;
@@ -406,6 +467,54 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
         } while (errno == EINTR); /* be mindful of signals */
     }
 
+    if (pbuf == 0)
+    {
+        ret = sr_vns_dispatch(sr, buf, len, expected_cmd, 0);
+        sr_mem_free(buf);
+        return ret;
+    }
+
+    if ((ret = sr_vns_dispatch(sr, buf, len, expected_cmd, frame)) == 2)
+    {
+        /* -- trim the buffer down to the frame -- */
+        pbuf->off += sizeof(c_packet_header);
+        pbuf->len  = frame->len;
+        pbuf->ifindex = frame->ifindex;
+        frame->priv  = pbuf;
+    }
+    else
+    { sr_pbuf_free(pbuf); }
+    return ret;
+}/* -- sr_read_from_server -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_dispatch(..)
+ * Scope: Global
+ *
+ * Handle one complete command of 'len' bytes sitting in 'buf' (length
+ * field included).  Shared by every transport that speaks the VNS
+ * protocol; 'buf' is never freed here.  If 'frame' is given a VNSPACKET
+ * is returned through it, pointing into 'buf', with frame->priv left for
+ * the caller to fill in.
+ *
+ * RETURN VALUES:
+ *
+ *  2 a packet was returned in 'frame'
+ *  1 command handled
+ *  0 server closed the session
+ * -1 on error
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_vns_dispatch(struct sr_instance* sr, uint8_t* buf, int len,
+                    int expected_cmd, struct sr_io_frame* frame)
+{
+    int command;
+    c_packet_ethernet_header* sr_pkt = 0;
+    struct sr_io_frame pkt;
+    struct sr_if* iface = 0;
+    int ret;
+
     /* My entry for most unreadable line of code - guido */
     /* ... you win - mc                                  */
     command = *(((int *)buf)+1) = ntohl(*(((int *)buf)+1));
@@ -426,25 +535,35 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
         case VNSPACKET:
             sr_pkt = (c_packet_ethernet_header *)buf;
 
-            /* -- check if it is an ARP to another router if so drop   -- */
-            if ( sr_arp_req_not_for_us(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base))) )
+            if ( len < sizeof(c_packet_ethernet_header) )
             { break; }
 
-            /* -- log packet -- */
-            sr_log_packet(sr, buf + sizeof(c_packet_header),
-                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
+            /* terminate the interface name in place, the server pads it */
+            sr_pkt->mInterfaceName[sizeof(sr_pkt->mInterfaceName) - 1] = 0;
 
-            /* -- pass to router, student's code should take over here -- */
-            sr_handlepacket(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base)));
+            /* -- the only place a received name is looked up -- */
+            if ( (iface = sr_get_interface(sr, sr_pkt->mInterfaceName)) == 0 )
+            {
+                fprintf(stderr, "** Error, interface %s, does not exist\n",
+                        sr_pkt->mInterfaceName);
+                break;
+            }
+
+            pkt.buf     = buf + sizeof(c_packet_header);
+            pkt.len     = len - sizeof(c_packet_ethernet_header) +
+                          sizeof(struct sr_ethernet_hdr);
+            pkt.ifindex = iface->index;
+            pkt.priv    = 0;
+
+            /* -- hand it back to sr_io_poll(..) -- */
+            if ( frame )
+            {
+                *frame = pkt;
+                return 2;
+            }
 
+            sr->rx_ns = sr_pktinfo_clock();
+            sr_io_input(sr, &pkt);
             break;
 
             /* -------------        VNSCLOSE      -------------------- */
@@ -453,11 +572,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             fprintf(stderr,"VNS server closed session.\n");
             fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
             sr_session_closed_help();
-
-            if(buf)
-            { free(buf); }
             return 0;
-            break;
 
             /* -------------        VNSBANNER      -------------------- */
 
@@ -501,167 +616,155 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
     }/* -- switch -- */
 
-    if(buf)
-    { free(buf); }
     return ret;
-}/* -- sr_read_from_server -- */
+}/* -- sr_vns_dispatch -- */
+
+/*-----------------------------------------------------------------------------
+ * VNS I/O backend
+ *---------------------------------------------------------------------------*/
 
 /*-----------------------------------------------------------------------------
- * Method: sr_ether_addrs_match_interface(..)
+ * Method: sr_vns_open(..)
  * Scope: Local
  *
- * Make sure ethernet addresses are sane so we don't muck uo the system.
+ * 'arg' is "server:port".
  *
- *----------------------------------------------------------------------------*/
+ *---------------------------------------------------------------------------*/
 
-static int
-sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
-                                uint8_t* buf, /* borrowed */
-                                const char* name /* borrowed */ )
+static int sr_vns_open(struct sr_instance* sr, const char* arg)
 {
-    struct sr_ethernet_hdr* ether_hdr = 0;
-    struct sr_if* iface = 0;
+    char server[256];
+    char* colon;
 
-    /* -- REQUIRES -- */
-    assert(sr);
-    assert(buf);
-    assert(name);
-
-    ether_hdr = (struct sr_ethernet_hdr*)buf;
-    iface = sr_get_interface(sr, name);
-
-    if ( iface == 0 ){
-        fprintf( stderr, "** Error, interface %s, does not exist\n", name);
-        return 0;
-    }
-
-    if ( memcmp( ether_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN) != 0 ){
-        fprintf( stderr, "** Error, source address does not match interface\n");
-        return 0;
+    strncpy(server, arg, sizeof(server) - 1);
+    server[sizeof(server) - 1] = 0;
+    if ((colon = strrchr(server, ':')) == 0)
+    {
+        fprintf(stderr, "Error: expected server:port, got %s\n", arg);
+        return -1;
     }
+    *colon = 0;
 
-    /* TODO */
-    /* Check destination, hardware address.  If it is private (i.e. destined
-     * to a virtual interface) ensure it is going to the correct topology
-     * Note: This check should really be done server side ...
-     */
-
-    return 1;
-
-} /* -- sr_ether_addrs_match_interface -- */
+    return sr_connect_to_server(sr, (unsigned short)atoi(colon + 1), server);
+} /* -- sr_vns_open -- */
 
 /*-----------------------------------------------------------------------------
- * Method: sr_send_packet(..)
- * Scope: Global
+ * Method: sr_vns_rx_burst(..)
+ * Scope: Local
  *
- * Send a packet (ethernet header included!) of length 'len' to the server
- * to be injected onto the wire.
+ * Block for one command, then keep reading for as long as the socket has
+ * more data queued.
  *
  *---------------------------------------------------------------------------*/
 
-int sr_send_packet(struct sr_instance* sr /* borrowed */,
-                         uint8_t* buf /* borrowed */ ,
-                         unsigned int len,
-                         const char* iface /* borrowed */)
+static int sr_vns_rx_burst(struct sr_instance* sr, struct sr_io_frame* frames,
+                           int max)
 {
-    c_packet_header *sr_pkt;
-    unsigned int total_len =  len + (sizeof(c_packet_header));
+    struct pollfd pfd;
+    int n = 0, ret;
 
-    /* REQUIRES */
-    assert(sr);
-    assert(buf);
-    assert(iface);
-
-    /* don't waste my time ... */
-    if ( len < sizeof(struct sr_ethernet_hdr) ){
-        fprintf(stderr , "** Error: packet is wayy to short \n");
-        return -1;
-    }
+    pfd.fd = sr->sockfd;
+    pfd.events = POLLIN;
 
-    /* Create packet */
-    sr_pkt = (c_packet_header *)malloc(len +
-            sizeof(c_packet_header));
-    assert(sr_pkt);
-    sr_pkt->mLen  = htonl(total_len);
-    sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
-    memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
-            buf,len);
-
-    /* -- log packet -- */
-    sr_log_packet(sr,buf,len);
-
-    if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
-        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-        free ( sr_pkt );
-        return -1;
-    }
-
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
-        fprintf(stderr, "Error writing packet\n");
-        free(sr_pkt);
-        return -1;
-    }
+    do
+    {
+        if ((ret = sr_vns_read_command(sr, 0, &frames[n])) == 2)
+        { n++; }
+        else if (ret != 1)
+        {
+            /* session is over, drop what we have already read */
+            sr->io->rx_done(sr, frames, n);
+            return -1;
+        }
+    } while (n < max && poll(&pfd, 1, 0) == 1);
 
-    free(sr_pkt);
+    return n;
+} /* -- sr_vns_rx_burst -- */
 
-    return 0;
-} /* -- sr_send_packet -- */
+static void sr_vns_rx_done(struct sr_instance* sr, struct sr_io_frame* frames,
+                           int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+    { sr_pbuf_free((struct sr_pbuf*)frames[i].priv); }
+} /* -- sr_vns_rx_done -- */
 
 /*-----------------------------------------------------------------------------
- * Method: sr_log_packet()
+ * Method: sr_vns_tx_burst(..)
  * Scope: Local
  *
+ * Wrap each frame in a VNSPACKET header and write it to the server.  A
+ * frame in a pool buffer gets the header written into its headroom;
+ * anything else is copied into a fresh buffer first.
+ *
  *---------------------------------------------------------------------------*/
 
-void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
+static int sr_vns_tx_burst(struct sr_instance* sr, struct sr_io_frame* frames,
+                           int n)
 {
-    struct pcap_pkthdr h;
-    int size;
-
-    /* REQUIRES */
-    assert(sr);
-
-    if(!sr->logfile)
-    {return; }
-
-    size = min(PACKET_DUMP_SIZE, len);
+    c_packet_header *sr_pkt;
+    struct sr_pbuf *pbuf, *copy;
+    struct sr_if *iface;
+    unsigned int total_len;
+    int i;
 
-    gettimeofday(&h.ts, 0);
-    h.caplen = size;
-    h.len = (size < PACKET_DUMP_SIZE) ? size : PACKET_DUMP_SIZE;
+    for (i = 0; i < n; i++)
+    {
+        total_len = frames[i].len + sizeof(c_packet_header);
+        copy = 0;
 
-    sr_dump(sr->logfile, &h, buf);
-    fflush(sr->logfile);
-} /* -- sr_log_packet -- */
+        if ((iface = sr_get_interface_idx(sr, frames[i].ifindex)) == 0)
+        { break; }
 
-/*-----------------------------------------------------------------------------
- * Method: sr_arp_req_not_for_us()
- * Scope: Local
- *
- *---------------------------------------------------------------------------*/
+        pbuf = sr_pbuf_of(frames[i].buf);
+        if (pbuf && frames[i].buf - pbuf->room >= sizeof(c_packet_header))
+        { sr_pkt = (c_packet_header *)(frames[i].buf - sizeof(c_packet_header)); }
+        else
+        {
+            if ((copy = sr_pbuf_alloc()) == 0 ||
+                sr_pbuf_append(copy, frames[i].len) == 0)
+            {
+                fprintf(stderr,"Error: out of packet buffers (sr_vns_tx_burst)\n");
+                sr_pbuf_free(copy);
+                break;
+            }
+            memcpy(sr_pbuf_data(copy), frames[i].buf, frames[i].len);
+            sr_pkt = (c_packet_header *)sr_pbuf_prepend(copy,
+                                                        sizeof(c_packet_header));
+        }
 
-int  sr_arp_req_not_for_us(struct sr_instance* sr,
-                           uint8_t * packet /* lent */,
-                           unsigned int len,
-                           char* interface  /* lent */)
-{
-    struct sr_if* iface = sr_get_interface(sr, interface);
-    struct sr_ethernet_hdr* e_hdr = 0;
-    struct sr_arp_hdr*       a_hdr = 0;
+        sr_pkt->mLen  = htonl(total_len);
+        sr_pkt->mType = htonl(VNSPACKET);
+        strncpy(sr_pkt->mInterfaceName,iface->name,16);
 
-    if (len < sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr) )
-    { return 0; }
+        if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
+            sr_pbuf_free(copy);
+            break;
+        }
 
-    assert(iface);
+        sr_pbuf_free(copy);
+    }
 
-    e_hdr = (struct sr_ethernet_hdr*)packet;
-    a_hdr = (struct sr_arp_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
+    return i;
+} /* -- sr_vns_tx_burst -- */
 
-    if ( (e_hdr->ether_type == htons(ethertype_arp)) &&
-            (a_hdr->ar_op      == htons(arp_op_request))   &&
-            (a_hdr->ar_tip     != iface->ip ) )
-    { return 1; }
+static void sr_vns_close(struct sr_instance* sr)
+{
+    if (sr->sockfd >= 0)
+    {
+        close(sr->sockfd);
+        sr->sockfd = -1;
+    }
+} /* -- sr_vns_close -- */
 
-    return 0;
-} /* -- sr_arp_req_not_for_us -- */
+const struct sr_io_ops sr_io_vns =
+{
+    "vns",
+    sr_vns_open,
+    0,              /* interfaces arrive in-band with VNSHWINFO */
+    sr_vns_rx_burst,
+    sr_vns_rx_done,
+    sr_vns_tx_burst,
+    0,              /* each frame is written as it's sent */
+    sr_vns_close
+};
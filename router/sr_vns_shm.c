@@ -0,0 +1,354 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_vns_shm.c
+ *
+ * Description:
+ *
+ * Shared memory transport for a VNS session with a simulator on the same
+ * host, the "vns-shm" I/O backend.
+ *
+ * The session is opened over a Unix socket (-s /path/to/socket) with
+ * VNS_CAP_SHM set in VNSOPEN.  A server that supports it answers with
+ * VNS_SHM_OFFER carrying a memfd with the packet rings (sr_shm.h) and a
+ * pair of eventfds; from then on frames travel through the rings without
+ * passing through the kernel, while control commands (VNSHWINFO,
+ * VNSCLOSE ...) stay on the socket.  Any other server, and any server
+ * reached over TCP, simply keeps talking VNSPACKETs on the socket and
+ * the plain VNS backend takes over.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifdef _LINUX_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_mem.h"
+#include "sr_io.h"
+#include "sr_shm.h"
+
+#include "vnscommand.h"
+
+#define SR_SHM_IDLE_MS  1000 /* longest sleep before looking at the socket */
+#define SR_SHM_TX_TRIES 100  /* 10us naps waiting for room before dropping */
+
+struct sr_vns_shm
+{
+    struct sr_shm   shm;
+    int             memfd;
+    int             efd;        /* we sleep on this one */
+    int             peer_efd;   /* the server sleeps on this one */
+    pthread_mutex_t tx_lock;    /* the router sends from several threads */
+    unsigned long   tx_full;    /* frames dropped on a full ring */
+};
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_shm_read_offer(..)
+ * Scope: Local
+ *
+ * Read the first command after VNSOPEN, picking up any file descriptors
+ * that came with it.  Anything but an offer is handled as usual.
+ *
+ * RETURN VALUES:
+ *
+ *  1 an offer, fds[] filled in
+ *  0 no offer, command handled
+ * -1 on error
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_shm_read_offer(struct sr_instance* sr, int fds[3],
+                                 uint32_t* size)
+{
+    union
+    {
+        struct cmsghdr align;
+        char           buf[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct iovec iov;
+    uint32_t hdr[2];
+    uint8_t* buf;
+    int len, got = 0, ret, nfds = 0, i;
+
+    /* -- the header, and with it any descriptors -- */
+    while (got < (int)sizeof(hdr))
+    {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = (uint8_t*)hdr + got;
+        iov.iov_len  = sizeof(hdr) - got;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        if ((ret = recvmsg(sr->sockfd, &msg, MSG_CMSG_CLOEXEC)) <= 0)
+        {
+            if (ret < 0 && errno == EINTR)
+            { continue; }
+            perror("recvmsg(..):sr_vns_shm.c::sr_vns_shm_read_offer");
+            return -1;
+        }
+        got += ret;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            {
+                for (i = 0; nfds < 3 &&
+                     CMSG_LEN((i + 1) * sizeof(int)) <= cmsg->cmsg_len; i++)
+                { memcpy(&fds[nfds++], CMSG_DATA(cmsg) + i * sizeof(int),
+                         sizeof(int)); }
+            }
+        }
+    }
+
+    len = ntohl(hdr[0]);
+    if (len < 8 || len > VNS_MAX_COMMAND_LEN)
+    {
+        fprintf(stderr,"Error: bad command length %d\n",len);
+        return -1;
+    }
+    if ((buf = sr_mem_alloc(SR_MEM_IO, len)) == 0)
+    {
+        fprintf(stderr,"Error: out of memory (sr_vns_shm_read_offer)\n");
+        return -1;
+    }
+    memcpy(buf, hdr, sizeof(hdr));
+    for (got = sizeof(hdr); got < len; got += ret)
+    {
+        if ((ret = read(sr->sockfd, buf + got, len - got)) <= 0)
+        {
+            if (ret < 0 && errno == EINTR)
+            { ret = 0; continue; }
+            fprintf(stderr,"Error: failed reading command body %d\n",ret);
+            sr_mem_free(buf);
+            return -1;
+        }
+    }
+
+    if (ntohl(hdr[1]) == VNS_SHM_OFFER && len >= (int)sizeof(c_shm_offer) &&
+        nfds == 3)
+    {
+        *size = ntohl(((c_shm_offer*)buf)->size);
+        sr_mem_free(buf);
+        return 1;
+    }
+
+    for (i = 0; i < nfds; i++)
+    { close(fds[i]); }
+
+    ret = sr_vns_dispatch(sr, buf, len, 0, 0);
+    sr_mem_free(buf);
+    return ret == 1 ? 0 : -1;
+} /* -- sr_vns_shm_read_offer -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_shm_open(..)
+ * Scope: Local
+ *
+ * 'arg' is "server:port"; only a Unix socket server can offer a ring.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_shm_open(struct sr_instance* sr, const char* arg)
+{
+    struct sr_vns_shm* vs;
+    int fds[3];
+    uint32_t size;
+    int ret;
+
+    if (arg[0] != '/')
+    {
+        fprintf(stderr, "shared memory needs a Unix socket server, "
+                "using the plain socket\n");
+        sr->io = &sr_io_vns;
+        return sr_io_vns.open(sr, arg);
+    }
+
+    sr->vns_caps |= VNS_CAP_SHM;
+    if (sr_io_vns.open(sr, arg) != 0)
+    { return -1; }
+
+    /* -- a template session has nothing to carry the capability -- */
+    if (strlen(sr->template) > 0 ||
+        (ret = sr_vns_shm_read_offer(sr, fds, &size)) == 0)
+    {
+        fprintf(stderr, "server offers no shared memory, "
+                "using the plain socket\n");
+        sr->io = &sr_io_vns;
+        return 0;
+    }
+    if (ret < 0)
+    { return -1; }
+
+    if ((vs = (struct sr_vns_shm*)sr_mem_calloc(SR_MEM_IO, sizeof(struct sr_vns_shm))) == 0)
+    {
+        fprintf(stderr,"Error: out of memory (sr_vns_shm_open)\n");
+        return -1;
+    }
+    vs->memfd    = fds[0];
+    vs->efd      = fds[1];
+    vs->peer_efd = fds[2];
+    pthread_mutex_init(&vs->tx_lock, 0);
+
+    if (sr_shm_attach(&vs->shm, vs->memfd, size) != 0)
+    {
+        close(vs->memfd);
+        close(vs->efd);
+        close(vs->peer_efd);
+        sr_mem_free(vs);
+        return -1;
+    }
+
+    printf("Using shared memory rings, %u slots of %u bytes\n",
+           vs->shm.mask + 1, vs->shm.slot_size);
+    sr->io_priv = vs;
+    return 0;
+} /* -- sr_vns_shm_open -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_shm_rx_burst(..)
+ * Scope: Local
+ *
+ * Frames are handed to the router in place, the ring slots are given
+ * back in rx_done.  While the ring is empty we sleep on the eventfd and
+ * the socket at the same time so control commands are not missed.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_shm_rx_burst(struct sr_instance* sr,
+                               struct sr_io_frame* frames, int max)
+{
+    struct sr_vns_shm* vs = (struct sr_vns_shm*)sr->io_priv;
+    struct sr_shm_desc* d;
+    struct sr_if* iface;
+    int n = 0, ret;
+
+    for (;;)
+    {
+        while (n < max && (d = sr_shm_consume(&vs->shm, SR_SHM_TO_ROUTER)))
+        {
+            /* -- unknown interface: keep the slot, the router skips it -- */
+            iface = sr_get_interface(sr, d->iface);
+            frames[n].buf     = sr_shm_buf(&vs->shm, SR_SHM_TO_ROUTER, d);
+            frames[n].len     = d->len;
+            frames[n].ifindex = iface ? iface->index : -1;
+            frames[n].priv    = 0;
+            n++;
+        }
+        if (n > 0)
+        { return n; }
+
+        if ((ret = sr_shm_wait(&vs->shm, SR_SHM_TO_ROUTER, vs->efd,
+                               sr->sockfd, SR_SHM_IDLE_MS)) < 0)
+        { return -1; }
+        if ((ret & 2) && sr_read_from_server(sr) != 1)
+        { return -1; }
+    }
+} /* -- sr_vns_shm_rx_burst -- */
+
+static void sr_vns_shm_rx_done(struct sr_instance* sr,
+                               struct sr_io_frame* frames, int n)
+{
+    struct sr_vns_shm* vs = (struct sr_vns_shm*)sr->io_priv;
+
+    sr_shm_release(&vs->shm, SR_SHM_TO_ROUTER, n);
+} /* -- sr_vns_shm_rx_done -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_shm_tx_burst(..)
+ * Scope: Local
+ *
+ * Copy frames into free slots and publish them in one go.  If the ring
+ * stays full for about a millisecond it is treated like a full NIC queue
+ * and the rest of the burst is dropped.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_shm_tx_burst(struct sr_instance* sr,
+                               struct sr_io_frame* frames, int n)
+{
+    struct sr_vns_shm* vs = (struct sr_vns_shm*)sr->io_priv;
+    struct sr_shm_desc* d;
+    struct sr_if* iface;
+    int i, tries;
+
+    pthread_mutex_lock(&vs->tx_lock);
+    for (i = 0; i < n; i++)
+    {
+        if ((iface = sr_get_interface_idx(sr, frames[i].ifindex)) == 0)
+        { break; }
+        if (frames[i].len > vs->shm.slot_size)
+        {
+            fprintf(stderr, "Error: frame of %u bytes too large to send\n",
+                    frames[i].len);
+            break;
+        }
+        for (tries = 0; (d = sr_shm_produce(&vs->shm, SR_SHM_FROM_ROUTER)) == 0
+             && tries < SR_SHM_TX_TRIES; tries++)
+        {
+            sr_shm_publish(&vs->shm, SR_SHM_FROM_ROUTER, vs->peer_efd);
+            usleep(10);
+        }
+        if (d == 0)
+        {
+            vs->tx_full += n - i;
+            break;
+        }
+        memcpy(sr_shm_buf(&vs->shm, SR_SHM_FROM_ROUTER, d), frames[i].buf,
+               frames[i].len);
+        d->len   = frames[i].len;
+        d->flags = 0;
+        strncpy(d->iface, iface->name, sizeof(d->iface));
+    }
+    sr_shm_publish(&vs->shm, SR_SHM_FROM_ROUTER, vs->peer_efd);
+    pthread_mutex_unlock(&vs->tx_lock);
+
+    return i;
+} /* -- sr_vns_shm_tx_burst -- */
+
+static void sr_vns_shm_close(struct sr_instance* sr)
+{
+    struct sr_vns_shm* vs = (struct sr_vns_shm*)sr->io_priv;
+
+    if (vs)
+    {
+        if (vs->tx_full)
+        { fprintf(stderr, "shared memory ring full, dropped %lu frames\n",
+                  vs->tx_full); }
+        sr_shm_detach(&vs->shm);
+        close(vs->memfd);
+        close(vs->efd);
+        close(vs->peer_efd);
+        pthread_mutex_destroy(&vs->tx_lock);
+        sr_mem_free(vs);
+        sr->io_priv = 0;
+    }
+    sr_io_vns.close(sr);
+} /* -- sr_vns_shm_close -- */
+
+const struct sr_io_ops sr_io_vns_shm =
+{
+    "vns-shm",
+    sr_vns_shm_open,
+    0,              /* interfaces arrive in-band with VNSHWINFO */
+    sr_vns_shm_rx_burst,
+    sr_vns_shm_rx_done,
+    sr_vns_shm_tx_burst,
+    0,              /* each frame is published as it's sent */
+    sr_vns_shm_close
+};
+
+#endif /* _LINUX_ */
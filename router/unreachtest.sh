@@ -0,0 +1,36 @@
+#!/bin/sh
+
+#checks that the host unreachable the router sends when a next hop never
+#answers ARP gets back to the sender intact, with and without the NAT.
+#vnsd's -q host ignores ARP; with -e the receiving host echoes what it
+#gets, so the last case is traffic coming in through the NAT.
+#Prints a line per case and exits non-zero if any of them fails.
+
+PORT=${PORT:-8889}
+COUNT=${COUNT:-50}
+OUT=$(mktemp)
+failed=0
+
+run() {
+    name=$1
+    sr_args=$2
+    shift 2
+    ./vnsd -p $PORT -g eth1:eth2 -r 100 -c $COUNT -d 14 "$@" > $OUT &
+    VNSD=$!
+    sleep 0.5
+    ./sr -p $PORT $sr_args > /dev/null
+    wait $VNSD
+    if grep -q "^unreach: *$COUNT host unreachable to the senders, 0 misaddressed" $OUT; then
+        echo "PASS $name"
+    else
+        echo "FAIL $name: $(grep '^unreach:' $OUT || echo 'no host unreachable')"
+        failed=1
+    fi
+}
+
+run "no NAT, next hop silent"           ""   -q eth2
+run "NAT, outbound, next hop silent"    "-n" -q eth2
+run "NAT, inbound, internal host silent" "-n" -e -q eth1
+
+rm -f $OUT
+exit $failed
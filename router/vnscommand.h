@@ -20,6 +20,8 @@
 
 #define IDSIZE 32
 
+#define VNS_MAX_COMMAND_LEN 10000 /* largest command a client will accept */
+
 /*-----------------------------------------------------------------------------
                                  BASE
   ---------------------------------------------------------------------------*/
@@ -40,7 +42,8 @@ typedef struct
     uint32_t mLen;
     uint32_t mType;        /* = VNSOPEN */
     uint16_t topoID;       /* Id of the topology we want to run on */
-    uint16_t pad;          /* unused */
+    uint16_t pad;          /* VNS_CAP_* the client supports, 0 for
+                              servers that predate them */
     char     mVirtualHostID[IDSIZE]; /* Id of the simulated router (e.g.
                                         'VNS-A'); */
     char     mUID[IDSIZE]; /* User id (e.g. "appenz"), for information only */
@@ -167,6 +170,21 @@ typedef struct
     c_src_filter srcFilters[0];
 }__attribute__ ((__packed__)) c_open_template;
 
+/* ******* Local transport extensions ******** */
+#define VNS_SHM_OFFER    1024
+
+#define VNS_CAP_SHM      0x0001 /* c_open.pad: can take a shared memory ring */
+
+/* shared memory ring offer, server -> client over a Unix socket.  The
+ * memfd holding the rings, the client's eventfd and the server's eventfd
+ * travel with it as SCM_RIGHTS.  Layout of the area is in sr_shm.h. */
+typedef struct
+{
+    uint32_t mLen;
+    uint32_t mType;
+    uint32_t size;         /* bytes to map */
+}__attribute__ ((__packed__)) c_shm_offer;
+
 /* authentication request */
 typedef struct
 {
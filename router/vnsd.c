@@ -0,0 +1,1217 @@
+/*-----------------------------------------------------------------------------
+ * File: vnsd.c
+ * Date: Fall 2013
+ *
+ * Description:
+ *
+ * Local stand-in for the VNS/Mininet server.  Speaks enough of the
+ * protocol in vnscommand.h (auth, VNSOPEN / VNS_OPEN_TEMPLATE, VNSHWINFO,
+ * VNSPACKET, VNSCLOSE) to drive an unmodified sr client on a plain Linux
+ * box, and doubles as a load generator:
+ *
+ *   - presents a configurable set of router interfaces, each with one
+ *     simulated host attached (answers the router's ARP requests for it)
+ *   - injects traffic into the router at a target packet rate, either
+ *     synthetic UDP flows between two of the hosts or frames from a pcap
+ *   - matches what the router forwards back out (from the sending host,
+ *     or from the router itself if its NAT is on) and reports forwarded
+ *     throughput, loss and per-packet latency
+ *   - optionally (-e) has the receiving host echo each datagram back, and
+ *     (-q) keeps one host from answering ARP, then checks that the host
+ *     unreachables the router gives up with reach the senders intact
+ *
+ * With -U it listens on a Unix socket instead and, if the router asks
+ * for it (VNS_CAP_SHM), moves packets onto shared memory rings (sr_shm.h)
+ * after the handshake.
+ *
+ * Every injected frame is stamped with a sequence number in the IP
+ * identification field, which the router leaves untouched while
+ * forwarding, so latency can be measured without touching the payload.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "sr_protocol.h"
+#include "sr_dumper.h"
+#include "sr_shm.h"
+#include "sr_utils.h"
+#include "sha1.h"
+#include "vnscommand.h"
+
+#define VNSD_DEFAULT_PORT   8888
+#define VNSD_MAX_IFACES     16
+#define VNSD_MAX_FRAME      1514
+#define VNSD_SALT_LEN       20
+#define VNSD_AUTH_KEY_LEN   64
+#define VNSD_SEQ_SPACE      65536
+#define VNSD_TX_BATCH       64
+#define VNSD_RX_BUFSZ       (256*1024)
+
+/* ----------------------------------------------------------------------------
+ * struct vnsd_iface
+ *
+ * One router interface plus the single host hanging off it.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct vnsd_iface
+{
+    char     name[sr_IFACE_NAMELEN];
+    uint8_t  mac[ETHER_ADDR_LEN];       /* router side */
+    uint32_t ip;                        /* router side, network byte order */
+    uint32_t mask;                      /* network byte order */
+    uint8_t  host_mac[ETHER_ADDR_LEN];
+    uint32_t host_ip;                   /* network byte order */
+    int      quiet;                     /* host doesn't answer ARP */
+    uint32_t sent_to;                   /* where the host's traffic goes, 0 if unknown */
+};
+
+/* a frame queued for injection, already wrapped in a VNSPACKET header */
+struct vnsd_frame
+{
+    uint8_t     *buf;
+    unsigned int len;                   /* including c_packet_header */
+};
+
+struct vnsd
+{
+    int      listenfd;
+    int      fd;
+    pthread_mutex_t wlock;              /* serializes writes to fd / shm */
+    const char *unix_path;              /* listen here instead of TCP */
+    int      no_shm;                    /* never offer shared memory */
+
+    /* -- shared memory rings, once offered -- */
+    int      shm_on;
+    struct sr_shm shm;
+    int      memfd;
+    int      efd;                       /* we sleep on this one */
+    int      router_efd;                /* the router sleeps on this one */
+
+    struct vnsd_iface ifaces[VNSD_MAX_IFACES];
+    int      num_ifaces;
+    const char *keyfile;
+
+    /* -- load generation -- */
+    int      gen_in;                    /* ingress iface index, -1 = off */
+    int      gen_out;                   /* egress iface index */
+    const char *pcapfile;
+    struct vnsd_frame *frames;          /* templates, cycled through */
+    int      num_frames;
+    unsigned int flows;
+    unsigned int frame_size;
+    double   rate;                      /* packets per second */
+    uint64_t count;
+    double   warmup;                    /* seconds before traffic starts */
+    double   drain;                     /* seconds to wait for stragglers */
+    int      echo;                      /* out host sends each datagram back */
+
+    /* -- measurement -- */
+    struct timespec sent_at[VNSD_SEQ_SPACE];
+    uint64_t tx_pkts, tx_bytes;
+    uint64_t rx_pkts, rx_bytes;
+    uint64_t rx_other, rx_arp;
+    uint64_t rx_unreach, rx_unreach_bad; /* host unreachables to a sender */
+    double  *lat;                       /* per-packet latency in usec */
+    uint64_t num_lat;
+    struct timespec t_first_tx, t_last_tx, t_first_rx, t_last_rx;
+    volatile int done;
+};
+
+static void usage(char* argv0)
+{
+    printf("Local VNS server / load generator\n");
+    printf("Format: %s [-h] [-p port] [-i name,router_ip,host_ip[/len]]...\n", argv0);
+    printf("           [-g in_iface:out_iface] [-r pps] [-c count] [-s frame size]\n");
+    printf("           [-f flows] [-P pcap file] [-w warmup] [-d drain] [-k auth_key]\n");
+    printf("           [-U unix socket path] [-S (no shared memory)]\n");
+    printf("           [-e (echo datagrams back)] [-q iface (host ignores ARP)]\n");
+    printf("   defaults port=%d, interfaces eth1..eth3 matching the stock rtable\n",
+            VNSD_DEFAULT_PORT);
+} /* -- usage -- */
+
+static double ts_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (double)(a->tv_sec - b->tv_sec) +
+           (double)(a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static void ts_add(struct timespec *t, double secs)
+{
+    long ns = (long)(secs * 1e9);
+    t->tv_sec  += ns / 1000000000L;
+    t->tv_nsec += ns % 1000000000L;
+    if (t->tv_nsec >= 1000000000L) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_add_iface(..)
+ *
+ * Parse "name,router_ip,host_ip[/prefixlen]" and append it.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_add_iface(struct vnsd *d, const char *spec)
+{
+    char tmp[128], *name, *rip, *hip, *plen;
+    struct vnsd_iface *ifc;
+    struct in_addr a;
+    int len = 24, idx;
+
+    if (d->num_ifaces >= VNSD_MAX_IFACES) {
+        fprintf(stderr, "Error: too many interfaces\n");
+        return -1;
+    }
+    strncpy(tmp, spec, sizeof(tmp) - 1);
+    tmp[sizeof(tmp) - 1] = 0;
+
+    name = strtok(tmp, ",");
+    rip  = strtok(NULL, ",");
+    hip  = strtok(NULL, ",");
+    if (!name || !rip || !hip) {
+        fprintf(stderr, "Error: bad interface spec %s\n", spec);
+        return -1;
+    }
+    if ((plen = strchr(hip, '/')) != NULL) {
+        *plen++ = 0;
+        len = atoi(plen);
+    }
+
+    idx = d->num_ifaces;
+    ifc = &d->ifaces[idx];
+    memset(ifc, 0, sizeof(*ifc));
+    strncpy(ifc->name, name, sr_IFACE_NAMELEN - 1);
+
+    if (inet_aton(rip, &a) == 0) { return -1; }
+    ifc->ip = a.s_addr;
+    if (inet_aton(hip, &a) == 0) { return -1; }
+    ifc->host_ip = a.s_addr;
+    ifc->mask = len ? htonl(0xffffffffu << (32 - len)) : 0;
+
+    /* locally administered MACs, router 02:00:00:00:<if>:01, host ..:02 */
+    ifc->mac[0] = 0x02; ifc->mac[4] = idx; ifc->mac[5] = 0x01;
+    ifc->host_mac[0] = 0x02; ifc->host_mac[4] = idx; ifc->host_mac[5] = 0x02;
+
+    d->num_ifaces++;
+    return 0;
+} /* -- vnsd_add_iface -- */
+
+static int vnsd_find_iface(struct vnsd *d, const char *name)
+{
+    int i;
+    for (i = 0; i < d->num_ifaces; i++) {
+        if (strncmp(d->ifaces[i].name, name, sr_IFACE_NAMELEN) == 0)
+        { return i; }
+    }
+    return -1;
+}
+
+/*-----------------------------------------------------------------------------
+ * Socket helpers
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_write(struct vnsd *d, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t ret;
+
+    pthread_mutex_lock(&d->wlock);
+    while (len > 0) {
+        if ((ret = write(d->fd, p, len)) < 0) {
+            if (errno == EINTR) { continue; }
+            pthread_mutex_unlock(&d->wlock);
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    pthread_mutex_unlock(&d->wlock);
+    return 0;
+}
+
+static int vnsd_read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    ssize_t ret;
+
+    while (len > 0) {
+        if ((ret = read(fd, p, len)) <= 0) {
+            if (ret < 0 && errno == EINTR) { continue; }
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* read a whole command during the handshake; caller frees */
+static uint8_t *vnsd_read_cmd(struct vnsd *d, uint32_t *type)
+{
+    uint32_t len;
+    uint8_t *buf;
+
+    if (vnsd_read_full(d->fd, &len, 4) != 0) { return NULL; }
+    len = ntohl(len);
+    if (len < sizeof(c_base) || len > 65536) { return NULL; }
+    if ((buf = malloc(len)) == NULL) { return NULL; }
+    *((uint32_t*)buf) = htonl(len);
+    if (vnsd_read_full(d->fd, buf + 4, len - 4) != 0) {
+        free(buf);
+        return NULL;
+    }
+    *type = ntohl(((c_base*)buf)->mType);
+    return buf;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_handshake(..)
+ *
+ * Authenticate the client, wait for it to open a topology and hand it the
+ * hardware description.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_send_close(struct vnsd *d, const char *msg)
+{
+    c_close c;
+
+    memset(&c, 0, sizeof(c));
+    c.mLen  = htonl(sizeof(c));
+    c.mType = htonl(VNSCLOSE);
+    strncpy(c.mErrorMessage, msg, sizeof(c.mErrorMessage) - 1);
+    return vnsd_write(d, &c, sizeof(c));
+}
+
+static int vnsd_auth(struct vnsd *d)
+{
+    uint8_t req[sizeof(c_auth_request) + VNSD_SALT_LEN];
+    uint8_t stat[sizeof(c_auth_status) + 64];
+    c_auth_request *ar = (c_auth_request*)req;
+    c_auth_reply *rep;
+    c_auth_status *st = (c_auth_status*)stat;
+    char key[VNSD_AUTH_KEY_LEN + 1];
+    SHA1Context sha1;
+    uint32_t type, ulen;
+    uint8_t *buf;
+    FILE *fp;
+    int i, ok = 1;
+
+    ar->mLen  = htonl(sizeof(req));
+    ar->mType = htonl(VNS_AUTH_REQUEST);
+    for (i = 0; i < VNSD_SALT_LEN; i++)
+    { ar->salt[i] = rand() & 0xff; }
+    if (vnsd_write(d, req, sizeof(req)) != 0) { return -1; }
+
+    if ((buf = vnsd_read_cmd(d, &type)) == NULL || type != VNS_AUTH_REPLY) {
+        fprintf(stderr, "Error: expected auth reply\n");
+        free(buf);
+        return -1;
+    }
+    rep = (c_auth_reply*)buf;
+    ulen = ntohl(rep->usernameLen);
+
+    /* verify against the shared key if we have one, otherwise wave through */
+    if ((fp = fopen(d->keyfile, "r")) != NULL) {
+        if (fgets(key, sizeof(key), fp) == key &&
+            ntohl(rep->mLen) >= sizeof(c_auth_reply) + ulen + 20) {
+            SHA1Reset(&sha1);
+            SHA1Input(&sha1, ar->salt, VNSD_SALT_LEN);
+            SHA1Input(&sha1, (unsigned char*)key, VNSD_AUTH_KEY_LEN);
+            SHA1Result(&sha1);
+            for (i = 0; i < 5; i++)
+            { sha1.Message_Digest[i] = htonl(sha1.Message_Digest[i]); }
+            ok = memcmp(rep->username + ulen, sha1.Message_Digest, 20) == 0;
+        }
+        else
+        { ok = 0; }
+        fclose(fp);
+    }
+    printf("vnsd: auth %s for %.*s\n", ok ? "ok" : "FAILED", (int)ulen, rep->username);
+    free(buf);
+
+    memset(stat, 0, sizeof(stat));
+    st->mLen  = htonl(sizeof(stat));
+    st->mType = htonl(VNS_AUTH_STATUS);
+    st->auth_ok = ok;
+    strcpy(st->msg, ok ? "welcome" : "bad credentials");
+    if (vnsd_write(d, stat, sizeof(stat)) != 0) { return -1; }
+    return ok ? 0 : -1;
+}
+
+static int vnsd_send_rtable(struct vnsd *d, const char *vhost)
+{
+    char text[VNSD_MAX_IFACES * 80];
+    uint8_t *buf;
+    c_rtable *rt;
+    struct in_addr a;
+    int i, off = 0, len, ret;
+
+    text[0] = 0;
+    for (i = 0; i < d->num_ifaces; i++) {
+        struct vnsd_iface *ifc = &d->ifaces[i];
+        a.s_addr = ifc->host_ip;
+        off += sprintf(text + off, "%s ", inet_ntoa(a));
+        off += sprintf(text + off, "%s 255.255.255.255 %s\n", inet_ntoa(a), ifc->name);
+    }
+
+    len = sizeof(c_rtable) + off;
+    if ((buf = calloc(1, len)) == NULL) { return -1; }
+    rt = (c_rtable*)buf;
+    rt->mLen  = htonl(len);
+    rt->mType = htonl(VNS_RTABLE);
+    strncpy(rt->mVirtualHostID, vhost, IDSIZE);
+    memcpy(rt->rtable, text, off);
+    ret = vnsd_write(d, buf, len);
+    free(buf);
+    return ret;
+}
+
+static int vnsd_send_hwinfo(struct vnsd *d)
+{
+    c_hwinfo hw;
+    c_hw_entry *e;
+    uint32_t speed = htonl(1000);
+    int i, n = 0;
+
+    memset(&hw, 0, sizeof(hw));
+    for (i = 0; i < d->num_ifaces; i++) {
+        struct vnsd_iface *ifc = &d->ifaces[i];
+        uint32_t subnet = ifc->ip & ifc->mask;
+
+        e = &hw.mHWInfo[n++];
+        e->mKey = htonl(HWINTERFACE);
+        strncpy(e->value, ifc->name, sizeof(e->value) - 1);
+        e = &hw.mHWInfo[n++];
+        e->mKey = htonl(HWSPEED);
+        memcpy(e->value, &speed, 4);
+        e = &hw.mHWInfo[n++];
+        e->mKey = htonl(HWSUBNET);
+        memcpy(e->value, &subnet, 4);
+        e = &hw.mHWInfo[n++];
+        e->mKey = htonl(HWMASK);
+        memcpy(e->value, &ifc->mask, 4);
+        e = &hw.mHWInfo[n++];
+        e->mKey = htonl(HWETHER);
+        memcpy(e->value, ifc->mac, ETHER_ADDR_LEN);
+        e = &hw.mHWInfo[n++];
+        e->mKey = htonl(HWETHIP);
+        memcpy(e->value, &ifc->ip, 4);
+    }
+
+    hw.mLen  = htonl(2*sizeof(uint32_t) + n*sizeof(c_hw_entry));
+    hw.mType = htonl(VNSHWINFO);
+    return vnsd_write(d, &hw, ntohl(hw.mLen));
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_offer_shm(..)
+ *
+ * Create the packet rings and hand them to the router together with the
+ * eventfd it sleeps on and the one we sleep on.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_offer_shm(struct vnsd *d)
+{
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    c_shm_offer offer;
+    int fds[3];
+    ssize_t ret;
+
+    if (sr_shm_create(&d->shm, SR_SHM_SLOTS, SR_SHM_SLOT_SIZE, &d->memfd) != 0)
+    { return -1; }
+    d->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    d->router_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (d->efd < 0 || d->router_efd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    offer.mLen  = htonl(sizeof(offer));
+    offer.mType = htonl(VNS_SHM_OFFER);
+    offer.size  = htonl(d->shm.size);
+    fds[0] = d->memfd;
+    fds[1] = d->router_efd;
+    fds[2] = d->efd;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &offer;
+    iov.iov_len  = sizeof(offer);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(fds));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    pthread_mutex_lock(&d->wlock);
+    do {
+        ret = sendmsg(d->fd, &msg, 0);
+    } while (ret < 0 && errno == EINTR);
+    pthread_mutex_unlock(&d->wlock);
+    if (ret != sizeof(offer)) {
+        perror("sendmsg");
+        return -1;
+    }
+
+    d->shm_on = 1;
+    printf("vnsd: packets move to shared memory rings (%lu bytes)\n",
+            (unsigned long)d->shm.size);
+    return 0;
+}
+
+/* queue one VNSPACKET on the ring to the router, caller holds wlock and
+ * publishes */
+static void vnsd_shm_put(struct vnsd *d, c_packet_header *pkt)
+{
+    struct sr_shm_desc *desc;
+    unsigned int len = ntohl(pkt->mLen) - sizeof(c_packet_header);
+
+    while ((desc = sr_shm_produce(&d->shm, SR_SHM_TO_ROUTER)) == NULL) {
+        if (d->done) { return; }
+        sr_shm_publish(&d->shm, SR_SHM_TO_ROUTER, d->router_efd);
+        usleep(20);
+    }
+    memcpy(sr_shm_buf(&d->shm, SR_SHM_TO_ROUTER, desc),
+           (uint8_t*)pkt + sizeof(c_packet_header), len);
+    desc->len   = len;
+    desc->flags = 0;
+    memcpy(desc->iface, pkt->mInterfaceName, sizeof(desc->iface));
+}
+
+static int vnsd_handshake(struct vnsd *d)
+{
+    uint32_t type;
+    uint8_t *buf;
+
+    if (vnsd_auth(d) != 0) { return -1; }
+
+    if ((buf = vnsd_read_cmd(d, &type)) == NULL) { return -1; }
+    if (type == VNS_OPEN_TEMPLATE) {
+        c_open_template *ot = (c_open_template*)buf;
+        char vhost[IDSIZE + 1];
+        memcpy(vhost, ot->mVirtualHostID, IDSIZE);
+        vhost[IDSIZE] = 0;
+        printf("vnsd: open template %.30s host %s\n", ot->templateName, vhost);
+        if (vnsd_send_rtable(d, vhost) != 0) { free(buf); return -1; }
+    }
+    else if (type == VNSOPEN) {
+        c_open *o = (c_open*)buf;
+        printf("vnsd: open topo %d host %.32s user %.32s\n",
+                ntohs(o->topoID), o->mVirtualHostID, o->mUID);
+        if ((ntohs(o->pad) & VNS_CAP_SHM) && d->unix_path && !d->no_shm &&
+            vnsd_offer_shm(d) != 0) {
+            free(buf);
+            return -1;
+        }
+    }
+    else {
+        fprintf(stderr, "Error: expected open, got %u\n", type);
+        free(buf);
+        return -1;
+    }
+    free(buf);
+
+    return vnsd_send_hwinfo(d);
+}
+
+/*-----------------------------------------------------------------------------
+ * Frame construction
+ *---------------------------------------------------------------------------*/
+
+static uint8_t *vnsd_wrap(struct vnsd_iface *ifc, const uint8_t *frame,
+                          unsigned int len, unsigned int *total)
+{
+    c_packet_header *hdr;
+    uint8_t *buf;
+
+    *total = sizeof(c_packet_header) + len;
+    if ((buf = calloc(1, *total)) == NULL) { return NULL; }
+    hdr = (c_packet_header*)buf;
+    hdr->mLen  = htonl(*total);
+    hdr->mType = htonl(VNSPACKET);
+    strncpy(hdr->mInterfaceName, ifc->name, sizeof(hdr->mInterfaceName));
+    memcpy(buf + sizeof(c_packet_header), frame, len);
+    return buf;
+}
+
+/* point the frame at the router's ingress interface */
+static void vnsd_retarget(struct vnsd_iface *in, uint8_t *frame)
+{
+    sr_ethernet_hdr_t *eh = (sr_ethernet_hdr_t*)frame;
+    memcpy(eh->ether_dhost, in->mac, ETHER_ADDR_LEN);
+    memcpy(eh->ether_shost, in->host_mac, ETHER_ADDR_LEN);
+}
+
+static int vnsd_build_synthetic(struct vnsd *d)
+{
+    struct vnsd_iface *in = &d->ifaces[d->gen_in];
+    struct vnsd_iface *out = &d->ifaces[d->gen_out];
+    uint8_t frame[VNSD_MAX_FRAME];
+    unsigned int i, len = d->frame_size;
+    sr_ethernet_hdr_t *eh = (sr_ethernet_hdr_t*)frame;
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    uint16_t *udp = (uint16_t*)(frame + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+    unsigned int min = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + 8;
+
+    if (len < min) { len = min; }
+    if (len > VNSD_MAX_FRAME) { len = VNSD_MAX_FRAME; }
+
+    d->frames = calloc(d->flows, sizeof(struct vnsd_frame));
+    if (!d->frames) { return -1; }
+
+    for (i = 0; i < d->flows; i++) {
+        memset(frame, 0, sizeof(frame));
+        vnsd_retarget(in, frame);
+        eh->ether_type = htons(ethertype_ip);
+
+        ip->ip_v   = 4;
+        ip->ip_hl  = 5;
+        ip->ip_len = htons(len - sizeof(sr_ethernet_hdr_t));
+        ip->ip_ttl = 64;
+        ip->ip_p   = 17; /* UDP */
+        ip->ip_src = in->host_ip;
+        ip->ip_dst = out->host_ip;
+
+        udp[0] = htons(1024 + i);   /* source port: one per flow */
+        udp[1] = htons(9);          /* discard */
+        udp[2] = htons(len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
+        udp[3] = 0;                 /* no UDP checksum */
+
+        if ((d->frames[i].buf = vnsd_wrap(in, frame, len, &d->frames[i].len)) == NULL)
+        { return -1; }
+    }
+    in->sent_to = out->host_ip;
+    d->num_frames = d->flows;
+    return 0;
+}
+
+static int vnsd_load_pcap(struct vnsd *d)
+{
+    struct vnsd_iface *in = &d->ifaces[d->gen_in];
+    struct pcap_file_header fh;
+    struct pcap_sf_pkthdr ph;
+    uint8_t frame[65536];
+    int cap = 0, swapped;
+    uint32_t caplen;
+    FILE *fp;
+
+    if ((fp = fopen(d->pcapfile, "r")) == NULL) {
+        perror("fopen(pcap)");
+        return -1;
+    }
+    if (fread(&fh, sizeof(fh), 1, fp) != 1 ||
+        (fh.magic != TCPDUMP_MAGIC && fh.magic != ntohl(TCPDUMP_MAGIC))) {
+        fprintf(stderr, "Error: %s is not a pcap file\n", d->pcapfile);
+        fclose(fp);
+        return -1;
+    }
+    swapped = fh.magic != TCPDUMP_MAGIC;
+
+    while (fread(&ph, sizeof(ph), 1, fp) == 1) {
+        caplen = swapped ? ntohl(ph.caplen) : ph.caplen;
+        if (caplen > sizeof(frame) || fread(frame, caplen, 1, fp) != 1)
+        { break; }
+        /* only IPv4 frames that fit the router's MTU are useful here */
+        if (caplen < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) ||
+            caplen > VNSD_MAX_FRAME || ethertype(frame) != ethertype_ip)
+        { continue; }
+
+        if (d->num_frames == cap) {
+            cap = cap ? cap * 2 : 1024;
+            d->frames = realloc(d->frames, cap * sizeof(struct vnsd_frame));
+            if (!d->frames) { fclose(fp); return -1; }
+        }
+        vnsd_retarget(in, frame);
+        d->frames[d->num_frames].buf = vnsd_wrap(in, frame, caplen,
+                                                 &d->frames[d->num_frames].len);
+        if (!d->frames[d->num_frames].buf) { fclose(fp); return -1; }
+        d->num_frames++;
+    }
+    fclose(fp);
+
+    printf("vnsd: loaded %d frames from %s\n", d->num_frames, d->pcapfile);
+    return d->num_frames > 0 ? 0 : -1;
+}
+
+/* stamp the sequence number into ip_id and redo the IP checksum */
+static void vnsd_stamp(uint8_t *pkt, uint16_t seq)
+{
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t*)(pkt + sizeof(c_packet_header) +
+                                     sizeof(sr_ethernet_hdr_t));
+    ip->ip_id  = htons(seq);
+    ip->ip_sum = 0;
+    ip->ip_sum = cksum(ip, ip->ip_hl * 4);
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_generator(..)
+ *
+ * Injects frames at the requested rate.  When we fall behind schedule all
+ * frames that are due go out in a single writev.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void *vnsd_generator(void *arg)
+{
+    struct vnsd *d = arg;
+    struct iovec iov[VNSD_TX_BATCH];
+    uint8_t *batch[VNSD_TX_BATCH];
+    struct timespec start, now, due;
+    uint64_t sent = 0;
+    int n, i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ts_add(&start, d->warmup);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &start, NULL);
+    d->t_first_tx = start;
+
+    for (i = 0; i < VNSD_TX_BATCH; i++) {
+        if ((batch[i] = malloc(sizeof(c_packet_header) + VNSD_MAX_FRAME)) == NULL)
+        { return NULL; }
+    }
+
+    while (sent < d->count && !d->done) {
+        /* wait until the next frame is due */
+        due = start;
+        ts_add(&due, (double)sent / d->rate);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (ts_diff(&due, &now) > 0) {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        }
+
+        /* gather everything that is due by now */
+        n = 0;
+        do {
+            struct vnsd_frame *f = &d->frames[sent % d->num_frames];
+            memcpy(batch[n], f->buf, f->len);
+            vnsd_stamp(batch[n], (uint16_t)sent);
+            iov[n].iov_base = batch[n];
+            iov[n].iov_len  = f->len;
+            d->sent_at[sent % VNSD_SEQ_SPACE] = now;
+            d->tx_bytes += f->len - sizeof(c_packet_header);
+            n++;
+            sent++;
+            due = start;
+            ts_add(&due, (double)sent / d->rate);
+        } while (n < VNSD_TX_BATCH && sent < d->count && ts_diff(&due, &now) <= 0);
+
+        pthread_mutex_lock(&d->wlock);
+        if (d->shm_on) {
+            for (i = 0; i < n; i++) { vnsd_shm_put(d, (c_packet_header*)batch[i]); }
+            sr_shm_publish(&d->shm, SR_SHM_TO_ROUTER, d->router_efd);
+        }
+        for (i = d->shm_on ? n : 0; i < n; ) {
+            ssize_t ret = writev(d->fd, iov + i, n - i);
+            if (ret < 0) {
+                if (errno == EINTR) { continue; }
+                pthread_mutex_unlock(&d->wlock);
+                d->done = 1;
+                return NULL;
+            }
+            while (i < n && (size_t)ret >= iov[i].iov_len) { ret -= iov[i].iov_len; i++; }
+            if (i < n) {
+                iov[i].iov_base = (uint8_t*)iov[i].iov_base + ret;
+                iov[i].iov_len -= ret;
+            }
+        }
+        pthread_mutex_unlock(&d->wlock);
+        d->tx_pkts += n;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &d->t_last_tx);
+    for (i = 0; i < VNSD_TX_BATCH; i++) { free(batch[i]); }
+    return NULL;
+} /* -- vnsd_generator -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_handle_frame(..)
+ *
+ * A frame the router sent out of one of its interfaces.
+ *
+ *---------------------------------------------------------------------------*/
+
+/* hand the router a frame from one of the hosts */
+static void vnsd_inject(struct vnsd *d, c_packet_header *ph)
+{
+    if (d->shm_on) {
+        pthread_mutex_lock(&d->wlock);
+        vnsd_shm_put(d, ph);
+        sr_shm_publish(&d->shm, SR_SHM_TO_ROUTER, d->router_efd);
+        pthread_mutex_unlock(&d->wlock);
+    }
+    else
+    { vnsd_write(d, ph, ntohl(ph->mLen)); }
+}
+
+/* IP header length of an IP frame that holds all of it, else 0 */
+static unsigned int ip_hdr_len(const uint8_t *frame, unsigned int len)
+{
+    const sr_ip_hdr_t *ip = (const sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    unsigned int hlen;
+
+    if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) ||
+        ethertype((uint8_t*)frame) != ethertype_ip)
+    { return 0; }
+    hlen = ip->ip_hl * 4;
+    if (hlen < sizeof(sr_ip_hdr_t) || ntohs(ip->ip_len) < hlen + 8 ||
+        sizeof(sr_ethernet_hdr_t) + ntohs(ip->ip_len) > len)
+    { return 0; }
+    return hlen;
+}
+
+static void vnsd_answer_arp(struct vnsd *d, int idx, uint8_t *frame, unsigned int len)
+{
+    struct vnsd_iface *ifc = &d->ifaces[idx];
+    uint8_t reply[sizeof(c_packet_header) + sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)];
+    sr_arp_hdr_t *req = (sr_arp_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    c_packet_header *ph = (c_packet_header*)reply;
+    sr_ethernet_hdr_t *eh = (sr_ethernet_hdr_t*)(reply + sizeof(c_packet_header));
+    sr_arp_hdr_t *arp = (sr_arp_hdr_t*)(reply + sizeof(c_packet_header) +
+                                        sizeof(sr_ethernet_hdr_t));
+
+    if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t) || ifc->quiet ||
+        req->ar_op != htons(arp_op_request) || req->ar_tip != ifc->host_ip)
+    { return; }
+
+    memset(reply, 0, sizeof(reply));
+    ph->mLen  = htonl(sizeof(reply));
+    ph->mType = htonl(VNSPACKET);
+    strncpy(ph->mInterfaceName, ifc->name, sizeof(ph->mInterfaceName));
+
+    memcpy(eh->ether_dhost, req->ar_sha, ETHER_ADDR_LEN);
+    memcpy(eh->ether_shost, ifc->host_mac, ETHER_ADDR_LEN);
+    eh->ether_type = htons(ethertype_arp);
+
+    arp->ar_hrd = htons(arp_hrd_ethernet);
+    arp->ar_pro = htons(ethertype_ip);
+    arp->ar_hln = ETHER_ADDR_LEN;
+    arp->ar_pln = 4;
+    arp->ar_op  = htons(arp_op_reply);
+    memcpy(arp->ar_sha, ifc->host_mac, ETHER_ADDR_LEN);
+    arp->ar_sip = ifc->host_ip;
+    memcpy(arp->ar_tha, req->ar_sha, ETHER_ADDR_LEN);
+    arp->ar_tip = req->ar_sip;
+
+    vnsd_inject(d, ph);
+}
+
+/* the host on an interface sends a UDP datagram it got back to its sender */
+static void vnsd_echo(struct vnsd *d, int idx, uint8_t *frame, unsigned int len)
+{
+    struct vnsd_iface *ifc = &d->ifaces[idx];
+    uint8_t reply[sizeof(c_packet_header) + VNSD_MAX_FRAME];
+    c_packet_header *ph = (c_packet_header*)reply;
+    sr_ethernet_hdr_t *eh = (sr_ethernet_hdr_t*)(reply + sizeof(c_packet_header));
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t*)(reply + sizeof(c_packet_header) +
+                                     sizeof(sr_ethernet_hdr_t));
+    uint16_t *udp, port;
+    uint32_t addr;
+
+    if (len > VNSD_MAX_FRAME || ip_hdr_len(frame, len) == 0 ||
+        ((sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t)))->ip_p != ip_protocol_udp)
+    { return; }
+
+    ph->mLen  = htonl(sizeof(c_packet_header) + len);
+    ph->mType = htonl(VNSPACKET);
+    strncpy(ph->mInterfaceName, ifc->name, sizeof(ph->mInterfaceName));
+    memcpy(eh, frame, len);
+    memcpy(eh->ether_dhost, ifc->mac, ETHER_ADDR_LEN);
+    memcpy(eh->ether_shost, ifc->host_mac, ETHER_ADDR_LEN);
+
+    addr = ip->ip_src;
+    ip->ip_src = ip->ip_dst;
+    ip->ip_dst = addr;
+    ip->ip_ttl = 64;
+    ip->ip_sum = 0;
+    ip->ip_sum = cksum(ip, ip->ip_hl * 4);
+    ifc->sent_to = addr;
+    udp = (uint16_t*)((uint8_t*)ip + ip->ip_hl * 4);
+    port = udp[0];
+    udp[0] = udp[1];
+    udp[1] = port;
+
+    vnsd_inject(d, ph);
+}
+
+/*
+ * A host unreachable the router sent the host on an interface: it has to
+ * be addressed to that host, and quote, with good checksums, a packet the
+ * host sent.  Returns 0 if the frame isn't one.
+ */
+static int vnsd_check_unreach(struct vnsd *d, int idx, uint8_t *frame, unsigned int len)
+{
+    struct vnsd_iface *ifc = &d->ifaces[idx];
+    sr_ethernet_hdr_t *eh = (sr_ethernet_hdr_t*)frame;
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    sr_icmp_t3_hdr_t *icmp;
+    sr_ip_hdr_t *quote;
+    unsigned int hlen, icmp_len;
+
+    if ((hlen = ip_hdr_len(frame, len)) == 0 || ip->ip_p != ip_protocol_icmp)
+    { return 0; }
+    icmp = (sr_icmp_t3_hdr_t*)((uint8_t*)ip + hlen);
+    icmp_len = ntohs(ip->ip_len) - hlen;
+    if (icmp_len < sizeof(sr_icmp_t3_hdr_t) - ICMP_DATA_SIZE + sizeof(sr_ip_hdr_t) ||
+        icmp->icmp_type != 3 || icmp->icmp_code != 1)
+    { return 0; }
+    quote = (sr_ip_hdr_t*)icmp->data;
+
+    d->rx_unreach++;
+    if (memcmp(eh->ether_dhost, ifc->host_mac, ETHER_ADDR_LEN) != 0 ||
+        ip->ip_dst != ifc->host_ip || quote->ip_src != ifc->host_ip ||
+        (ifc->sent_to && quote->ip_dst != ifc->sent_to) ||
+        cksum(icmp, icmp_len) != 0xffff || cksum(quote, sizeof(sr_ip_hdr_t)) != 0xffff)
+    { d->rx_unreach_bad++; }
+    return 1;
+}
+
+static void vnsd_handle_frame(struct vnsd *d, const char *iface, uint8_t *frame,
+                              unsigned int len)
+{
+    char name[sizeof(((c_packet_header*)0)->mInterfaceName) + 1];
+    struct timespec now;
+    sr_ip_hdr_t *ip;
+    int idx;
+
+    memcpy(name, iface, sizeof(name) - 1);
+    name[sizeof(name) - 1] = 0;
+    if ((idx = vnsd_find_iface(d, name)) < 0 || len < sizeof(sr_ethernet_hdr_t))
+    { return; }
+
+    if (ethertype(frame) == ethertype_arp) {
+        d->rx_arp++;
+        vnsd_answer_arp(d, idx, frame, len);
+        return;
+    }
+
+    if (vnsd_check_unreach(d, idx, frame, len))
+    { return; }
+
+    ip = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    if (ethertype(frame) != ethertype_ip || idx != d->gen_out ||
+        len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) ||
+        (ip->ip_src != d->ifaces[d->gen_in].host_ip &&
+         ip->ip_src != d->ifaces[d->gen_out].ip && !d->pcapfile)) {
+        d->rx_other++;
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (d->rx_pkts == 0) { d->t_first_rx = now; }
+    d->t_last_rx = now;
+    d->rx_pkts++;
+    d->rx_bytes += len;
+    if (d->lat && d->num_lat < d->count) {
+        d->lat[d->num_lat++] =
+            ts_diff(&now, &d->sent_at[ntohs(ip->ip_id)]) * 1e6;
+    }
+    if (d->echo)
+    { vnsd_echo(d, idx, frame, len); }
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_receiver(..)
+ *
+ * Drains everything the router writes to us.  Reads large chunks and
+ * parses commands out of them so we are never the bottleneck.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void vnsd_shm_receiver(struct vnsd *d)
+{
+    struct sr_shm_desc *desc;
+    unsigned int n;
+    uint8_t junk[256];
+    int ret;
+
+    while (!d->done) {
+        n = 0;
+        while ((desc = sr_shm_consume(&d->shm, SR_SHM_FROM_ROUTER)) != NULL) {
+            vnsd_handle_frame(d, desc->iface,
+                              sr_shm_buf(&d->shm, SR_SHM_FROM_ROUTER, desc),
+                              desc->len);
+            n++;
+        }
+        if (n > 0) {
+            sr_shm_release(&d->shm, SR_SHM_FROM_ROUTER, n);
+            continue;
+        }
+
+        /* nothing on the ring; the socket only matters once it closes */
+        ret = sr_shm_wait(&d->shm, SR_SHM_FROM_ROUTER, d->efd, d->fd, 100);
+        if (ret < 0 || ((ret & 2) && read(d->fd, junk, sizeof(junk)) <= 0))
+        { break; }
+    }
+}
+
+static void *vnsd_receiver(void *arg)
+{
+    struct vnsd *d = arg;
+    uint8_t *buf;
+    size_t have = 0, off;
+    ssize_t ret;
+    uint32_t clen;
+
+    if (d->shm_on) {
+        vnsd_shm_receiver(d);
+        return NULL;
+    }
+
+    if ((buf = malloc(VNSD_RX_BUFSZ)) == NULL) { return NULL; }
+
+    while (!d->done) {
+        if ((ret = read(d->fd, buf + have, VNSD_RX_BUFSZ - have)) <= 0) {
+            if (ret < 0 && errno == EINTR) { continue; }
+            break;
+        }
+        have += ret;
+
+        off = 0;
+        while (have - off >= sizeof(c_base)) {
+            c_base *b = (c_base*)(buf + off);
+            clen = ntohl(b->mLen);
+            if (clen < sizeof(c_base) || clen > VNSD_RX_BUFSZ) {
+                fprintf(stderr, "Error: bad command length %u from router\n", clen);
+                d->done = 1;
+                break;
+            }
+            if (have - off < clen) { break; }
+            if (ntohl(b->mType) == VNSPACKET && clen >= sizeof(c_packet_header))
+            { vnsd_handle_frame(d, ((c_packet_header*)b)->mInterfaceName,
+                                (uint8_t*)b + sizeof(c_packet_header),
+                                clen - sizeof(c_packet_header)); }
+            off += clen;
+        }
+        memmove(buf, buf + off, have - off);
+        have -= off;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+ * Reporting
+ *---------------------------------------------------------------------------*/
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void vnsd_report(struct vnsd *d)
+{
+    double tx_time = ts_diff(&d->t_last_tx, &d->t_first_tx);
+    double rx_time = ts_diff(&d->t_last_rx, &d->t_first_rx);
+    double sum = 0;
+    uint64_t i;
+
+    printf("\n---------------------------------------------\n");
+    printf("offered:   %llu pkts %llu bytes in %.3f s (%.0f pps)\n",
+            (unsigned long long)d->tx_pkts, (unsigned long long)d->tx_bytes,
+            tx_time, tx_time > 0 ? d->tx_pkts / tx_time : 0.0);
+    printf("forwarded: %llu pkts %llu bytes in %.3f s (%.0f pps, %.2f Mbit/s)\n",
+            (unsigned long long)d->rx_pkts, (unsigned long long)d->rx_bytes,
+            rx_time, rx_time > 0 ? d->rx_pkts / rx_time : 0.0,
+            rx_time > 0 ? d->rx_bytes * 8 / rx_time / 1e6 : 0.0);
+    printf("loss:      %llu pkts (%.3f%%)\n",
+            (unsigned long long)(d->tx_pkts - (d->rx_pkts < d->tx_pkts ? d->rx_pkts : d->tx_pkts)),
+            d->tx_pkts ? 100.0 * (double)(d->tx_pkts - d->rx_pkts) / d->tx_pkts : 0.0);
+    printf("other:     %llu arp, %llu unmatched frames from router\n",
+            (unsigned long long)d->rx_arp, (unsigned long long)d->rx_other);
+    if (d->rx_unreach > 0)
+    { printf("unreach:   %llu host unreachable to the senders, %llu misaddressed or bad\n",
+             (unsigned long long)d->rx_unreach, (unsigned long long)d->rx_unreach_bad); }
+
+    if (d->num_lat > 0) {
+        qsort(d->lat, d->num_lat, sizeof(double), cmp_double);
+        for (i = 0; i < d->num_lat; i++) { sum += d->lat[i]; }
+        printf("latency:   min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f usec\n",
+                d->lat[0], sum / d->num_lat,
+                d->lat[d->num_lat / 2],
+                d->lat[(uint64_t)(d->num_lat * 0.99)],
+                d->lat[d->num_lat - 1]);
+    }
+    printf("---------------------------------------------\n");
+}
+
+/*-----------------------------------------------------------------------------
+ *---------------------------------------------------------------------------*/
+
+int main(int argc, char **argv)
+{
+    struct vnsd *d;
+    struct sockaddr_in addr;
+    struct sockaddr_un sun;
+    pthread_t gen, rcv;
+    unsigned int port = VNSD_DEFAULT_PORT;
+    char *gen_spec = NULL, *quiet = NULL, *sep;
+    int c, one = 1;
+
+    if ((d = calloc(1, sizeof(struct vnsd))) == NULL) { return 1; }
+    d->keyfile = "auth_key";
+    d->gen_in = d->gen_out = -1;
+    d->flows = 1;
+    d->frame_size = 64;
+    d->rate = 10000;
+    d->count = 100000;
+    d->warmup = 1.0;
+    d->drain = 1.0;
+    pthread_mutex_init(&d->wlock, NULL);
+    srand(time(NULL));
+
+    while ((c = getopt(argc, argv, "hp:i:g:r:c:s:f:P:w:d:k:U:Seq:")) != EOF)
+    {
+        switch (c)
+        {
+            case 'h': usage(argv[0]); exit(0);
+            case 'p': port = atoi(optarg); break;
+            case 'i': if (vnsd_add_iface(d, optarg) != 0) { exit(1); } break;
+            case 'g': gen_spec = optarg; break;
+            case 'r': d->rate = atof(optarg); break;
+            case 'c': d->count = strtoull(optarg, NULL, 10); break;
+            case 's': d->frame_size = atoi(optarg); break;
+            case 'f': d->flows = atoi(optarg); break;
+            case 'P': d->pcapfile = optarg; break;
+            case 'w': d->warmup = atof(optarg); break;
+            case 'd': d->drain = atof(optarg); break;
+            case 'k': d->keyfile = optarg; break;
+            case 'U': d->unix_path = optarg; break;
+            case 'S': d->no_shm = 1; break;
+            case 'e': d->echo = 1; break;
+            case 'q': quiet = optarg; break;
+            default: usage(argv[0]); exit(1);
+        }
+    }
+
+    /* defaults match the stock rtable shipped with the router */
+    if (d->num_ifaces == 0) {
+        vnsd_add_iface(d, "eth1,192.168.2.1,192.168.2.2");
+        vnsd_add_iface(d, "eth2,172.64.3.1,172.64.3.10");
+        vnsd_add_iface(d, "eth3,10.0.1.1,10.0.1.100");
+    }
+    if (quiet) {
+        if ((c = vnsd_find_iface(d, quiet)) < 0) {
+            fprintf(stderr, "Error: no interface %s\n", quiet);
+            exit(1);
+        }
+        d->ifaces[c].quiet = 1;
+    }
+
+    if (gen_spec) {
+        if ((sep = strchr(gen_spec, ':')) == NULL) { usage(argv[0]); exit(1); }
+        *sep++ = 0;
+        d->gen_in  = vnsd_find_iface(d, gen_spec);
+        d->gen_out = vnsd_find_iface(d, sep);
+        if (d->gen_in < 0 || d->gen_out < 0 || d->rate <= 0 || d->flows == 0) {
+            fprintf(stderr, "Error: bad generator spec\n");
+            exit(1);
+        }
+        if ((d->pcapfile ? vnsd_load_pcap(d) : vnsd_build_synthetic(d)) != 0)
+        { exit(1); }
+        d->lat = malloc(d->count * sizeof(double));
+    }
+
+    if (d->unix_path) {
+        if ((d->listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            perror("socket");
+            return 1;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, d->unix_path, sizeof(sun.sun_path) - 1);
+        unlink(d->unix_path);
+        if (bind(d->listenfd, (struct sockaddr*)&sun, sizeof(sun)) < 0 ||
+            listen(d->listenfd, 1) < 0) {
+            perror("bind/listen");
+            return 1;
+        }
+        printf("vnsd: listening on %s\n", d->unix_path);
+    }
+    else {
+        if ((d->listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            perror("socket");
+            return 1;
+        }
+        setsockopt(d->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(d->listenfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(d->listenfd, 1) < 0) {
+            perror("bind/listen");
+            return 1;
+        }
+        printf("vnsd: listening on port %u\n", port);
+    }
+
+    if ((d->fd = accept(d->listenfd, NULL, NULL)) < 0) {
+        perror("accept");
+        return 1;
+    }
+    if (!d->unix_path)
+    { setsockopt(d->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); }
+
+    if (vnsd_handshake(d) != 0) {
+        vnsd_send_close(d, "handshake failed");
+        close(d->fd);
+        return 1;
+    }
+
+    pthread_create(&rcv, NULL, vnsd_receiver, d);
+
+    if (d->gen_in < 0) {
+        /* no traffic of our own, just keep the session up */
+        pthread_join(rcv, NULL);
+        return 0;
+    }
+
+    pthread_create(&gen, NULL, vnsd_generator, d);
+    pthread_join(gen, NULL);
+
+    /* give the router a chance to flush what it has queued */
+    usleep((useconds_t)(d->drain * 1e6));
+    d->done = 1;
+    vnsd_report(d);
+
+    vnsd_send_close(d, "load generation finished");
+    shutdown(d->fd, SHUT_RDWR);
+    pthread_join(rcv, NULL);
+    close(d->fd);
+    if (d->unix_path) { unlink(d->unix_path); }
+    return 0;
+}